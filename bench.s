@@ -0,0 +1,122 @@
+# Loop-heavy benchmark the profile guided build (make mu-mips-pgo)
+# is trained on: about 25M instructions of integer, call, memory,
+# bulk copy/fill and FPU work, so the hot paths get the profile the
+# tiny test programs would not give them. Exits with $s7 = checksum.
+	.text
+main:	li $s6, 2000		# outer passes
+	li $s7, 0
+pass:	la $a0, src
+	li $a1, 256
+	jal fill
+	nop
+	jal sum
+	nop
+	addu $s7, $s7, $v0
+	la $a0, src
+	la $a1, dst
+	li $a2, 256
+	jal copy
+	nop
+	jal mix
+	nop
+	addu $s7, $s7, $v0
+	jal fpu
+	nop
+	addu $s7, $s7, $v0
+	addiu $s6, $s6, -1
+	bne $s6, $zero, pass
+	li $v0, 10
+	syscall
+
+# $a1 words of the pass count from $a0 (a bulk fill loop)
+fill:	sll $t1, $a1, 2
+	addu $t1, $a0, $t1
+floop:	sw $s6, 0($a0)
+	addiu $a0, $a0, 4
+	bne $a0, $t1, floop
+	jr $ra
+
+# sum of src: loads, adds and a data dependent branch
+sum:	la $t0, src
+	addiu $t1, $t0, 1024
+	li $v0, 0
+sloop:	lw $t2, 0($t0)
+	andi $t3, $t2, 1
+	beq $t3, $zero, seven
+	addu $v0, $v0, $t2
+	b snext
+seven:	xori $t2, $t2, 7
+	subu $v0, $v0, $t2
+snext:	addiu $t0, $t0, 4
+	bne $t0, $t1, sloop
+	jr $ra
+
+# $a2 words from $a0 to $a1 (a bulk copy loop)
+copy:	lw $t0, 0($a0)
+	sw $t0, 0($a1)
+	addiu $a0, $a0, 4
+	addiu $a2, $a2, -1
+	addiu $a1, $a1, 4
+	bne $a2, $zero, copy
+	jr $ra
+
+# multiply/divide/shift mix over dst, with a leaf call per word
+mix:	move $s0, $ra
+	la $s1, dst
+	addiu $s2, $s1, 1024
+	li $v1, 1
+mloop:	lw $a0, 0($s1)
+	jal hash
+	nop
+	addu $v1, $v1, $v0
+	sw $v1, 0($s1)
+	addiu $s1, $s1, 4
+	slt $t0, $s1, $s2
+	bne $t0, $zero, mloop
+	move $v0, $v1
+	jr $s0
+
+hash:	addiu $t0, $a0, 31
+	mul $t1, $t0, $t0
+	srl $t2, $t1, 3
+	xor $t1, $t1, $t2
+	li $t3, 13
+	divu $t1, $t3
+	mfhi $t4
+	mflo $t5
+	sllv $t5, $t5, $t4
+	addu $v0, $t5, $t4
+	jr $ra
+
+# single and double precision loop: sum of i / (i + 1) for i < 256
+fpu:	li $t0, 0
+	li $t1, 256
+	mtc1 $zero, $f2
+	cvt.s.w $f2, $f2
+	mtc1 $zero, $f8
+	cvt.d.w $f8, $f8
+	li $t2, 1
+	mtc1 $t2, $f6
+	cvt.s.w $f6, $f6
+floop2:	mtc1 $t0, $f0
+	cvt.s.w $f0, $f0
+	add.s $f4, $f0, $f6
+	div.s $f4, $f0, $f4
+	add.s $f2, $f2, $f4
+	mul.s $f10, $f4, $f4
+	cvt.d.s $f12, $f10
+	add.d $f8, $f8, $f12
+	c.lt.s $f4, $f6
+	bc1t fnext
+	sub.s $f2, $f2, $f6
+fnext:	addiu $t0, $t0, 1
+	bne $t0, $t1, floop2
+	cvt.s.d $f14, $f8
+	add.s $f2, $f2, $f14
+	trunc.w.s $f2, $f2
+	mfc1 $v0, $f2
+	jr $ra
+
+	.data
+src:	.space 1024
+dst:	.space 1024
@@ -1,8 +1,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <assert.h>
+#include <inttypes.h>
+#include <time.h>
+#include <math.h>
+#include <fenv.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 #include "mu-mips.h"
 
@@ -15,58 +35,233 @@
 //int R[32];
 char RegNames[32][5]={"zero","at","v0","v1","a0","a1","a2","a3","t0","t1","t2","t3","t4","t5","t6","t7","s0","s1","s2","s3","s4","s5","s6","s7","t8","t9","k0","k1","gp","sp","fp","ra"};
 
-//Opcodes / Funct codes
-// ALU
-#define ADD 	0x20
-#define ADDU	0x21
-#define ADDI	0x08
-#define	ADDIU	0x09
-#define SUB		0x22
-#define SUBU	0x23
-#define MULT	0x18
-#define MULTU	0x19
-#define DIV		0x1a
-#define DIVU	0x1b
-#define AND		0x24
-#define ANDI	0x08
-#define OR		0x25
-#define ORI		0x0d
-#define XOR		0x66
-#define XORI	0x4e
-#define NOR		0x27
-#define SLT		0x2a
-#define SLTI	0x0a
-#define SLL		0x00
-#define SRL		0x02
-#define SRA		0x03
-
-// Load/Store
-#define LW		0x23
-#define LB		0x20
-#define LH		0x21
-#define SW		0x2b
-#define SB		0x28
-#define SH		0x29
-#define MFHI	0x10
-#define MFLO	0x12
-#define MTHI	0x11
-#define MTLO	0x13
-#define LUI		0x0F
-
-
-// Control Flow
-
-#define BEQ		0x04
-#define BNE		0x05
-#define BLEZ	0x06
-//#define BLTZ	0x
-//#define BGEZ	0x do these even exist??
-#define BGTZ	0x07
-#define J		0x02
-#define JR		0x08
-#define JAL		0x03
-#define JALR	0x08
+/***************************************************************/
+/* Instruction set
+   One row per instruction; the decoder maps, the executor, the
+   disassembler and the -T self-check are all expanded from it.
+
+   X(name, mnemonic, encoding, code, operands, class, size, semantics)
+
+   encoding says which field holds code: the major opcode, the
+   SPECIAL/SPECIAL2 funct, the REGIMM rt, the COP0 rs, or the funct
+   of a COP0 word with the CO bit set. size is the width of the
+   memory access whose alignment is checked before the semantics
+   run (0 = none; the unaligned LWL/LWR/SWL/SWR use 1). Semantics
+   are written with the operand macros defined above execute().
+***************************************************************/
+#define MIPS_ISA(X) \
+	X(SLL,     "sll",     ENC_SPECIAL,  0x00, DIS_RD_RT_SA,     CLS_ALU,    0, RD = RT << SA;) \
+	X(SRL,     "srl",     ENC_SPECIAL,  0x02, DIS_RD_RT_SA,     CLS_ALU,    0, RD = RT >> SA;) \
+	X(SRA,     "sra",     ENC_SPECIAL,  0x03, DIS_RD_RT_SA,     CLS_ALU,    0, RD = S32(RT) >> SA;) \
+	X(SLLV,    "sllv",    ENC_SPECIAL,  0x04, DIS_RD_RT_RS,     CLS_ALU,    0, RD = RT << (RS & 31);) \
+	X(SRLV,    "srlv",    ENC_SPECIAL,  0x06, DIS_RD_RT_RS,     CLS_ALU,    0, RD = RT >> (RS & 31);) \
+	X(SRAV,    "srav",    ENC_SPECIAL,  0x07, DIS_RD_RT_RS,     CLS_ALU,    0, RD = S32(RT) >> (RS & 31);) \
+	X(JR,      "jr",      ENC_SPECIAL,  0x08, DIS_RS,           CLS_BRANCH, 0, NPC = RS;) \
+	X(JALR,    "jalr",    ENC_SPECIAL,  0x09, DIS_RD_RS,        CLS_BRANCH, 0, uint32_t target = RS; RD = CPC + 8; NPC = target;) \
+	X(MOVZ,    "movz",    ENC_SPECIAL,  0x0a, DIS_RD_RS_RT,     CLS_ALU,    0, if (RT == 0) RD = RS;) \
+	X(MOVN,    "movn",    ENC_SPECIAL,  0x0b, DIS_RD_RS_RT,     CLS_ALU,    0, if (RT != 0) RD = RS;) \
+	X(SYSCALL, "syscall", ENC_SPECIAL,  0x0c, DIS_NONE,         CLS_SYSTEM, 0, TRAP(EXC_SYS);) \
+	X(BREAK,   "break",   ENC_SPECIAL,  0x0d, DIS_NONE,         CLS_SYSTEM, 0, TRAP(EXC_BP);) \
+	X(SYNC,    "sync",    ENC_SPECIAL,  0x0f, DIS_NONE,         CLS_SYSTEM, 0, __atomic_thread_fence(__ATOMIC_SEQ_CST);) \
+	X(MFHI,    "mfhi",    ENC_SPECIAL,  0x10, DIS_RD,           CLS_MULDIV, 0, RD = HI;) \
+	X(MTHI,    "mthi",    ENC_SPECIAL,  0x11, DIS_RS,           CLS_MULDIV, 0, HI = RS;) \
+	X(MFLO,    "mflo",    ENC_SPECIAL,  0x12, DIS_RD,           CLS_MULDIV, 0, RD = LO;) \
+	X(MTLO,    "mtlo",    ENC_SPECIAL,  0x13, DIS_RS,           CLS_MULDIV, 0, LO = RS;) \
+	X(MULT,    "mult",    ENC_SPECIAL,  0x18, DIS_RS_RT,        CLS_MULDIV, 0, SET_HILO((int64_t)S32(RS) * S32(RT));) \
+	X(MULTU,   "multu",   ENC_SPECIAL,  0x19, DIS_RS_RT,        CLS_MULDIV, 0, SET_HILO((uint64_t)RS * RT);) \
+	X(DIV,     "div",     ENC_SPECIAL,  0x1a, DIS_RS_RT,        CLS_MULDIV, 0, \
+		if (RT == 0xFFFFFFFF) { LO = -RS; HI = 0; } else if (RT != 0) { LO = S32(RS) / S32(RT); HI = S32(RS) % S32(RT); }) \
+	X(DIVU,    "divu",    ENC_SPECIAL,  0x1b, DIS_RS_RT,        CLS_MULDIV, 0, if (RT != 0) { LO = RS / RT; HI = RS % RT; }) \
+	X(ADD,     "add",     ENC_SPECIAL,  0x20, DIS_RD_RS_RT,     CLS_ALU,    0, uint32_t r = RS + RT; TRAP_IF(ADD_OVERFLOWS(RS, RT, r), EXC_OV); RD = r;) \
+	X(ADDU,    "addu",    ENC_SPECIAL,  0x21, DIS_RD_RS_RT,     CLS_ALU,    0, RD = RS + RT;) \
+	X(SUB,     "sub",     ENC_SPECIAL,  0x22, DIS_RD_RS_RT,     CLS_ALU,    0, uint32_t r = RS - RT; TRAP_IF(SUB_OVERFLOWS(RS, RT, r), EXC_OV); RD = r;) \
+	X(SUBU,    "subu",    ENC_SPECIAL,  0x23, DIS_RD_RS_RT,     CLS_ALU,    0, RD = RS - RT;) \
+	X(AND,     "and",     ENC_SPECIAL,  0x24, DIS_RD_RS_RT,     CLS_ALU,    0, RD = RS & RT;) \
+	X(OR,      "or",      ENC_SPECIAL,  0x25, DIS_RD_RS_RT,     CLS_ALU,    0, RD = RS | RT;) \
+	X(XOR,     "xor",     ENC_SPECIAL,  0x26, DIS_RD_RS_RT,     CLS_ALU,    0, RD = RS ^ RT;) \
+	X(NOR,     "nor",     ENC_SPECIAL,  0x27, DIS_RD_RS_RT,     CLS_ALU,    0, RD = ~(RS | RT);) \
+	X(SLT,     "slt",     ENC_SPECIAL,  0x2a, DIS_RD_RS_RT,     CLS_ALU,    0, RD = S32(RS) < S32(RT);) \
+	X(SLTU,    "sltu",    ENC_SPECIAL,  0x2b, DIS_RD_RS_RT,     CLS_ALU,    0, RD = RS < RT;) \
+	X(TGE,     "tge",     ENC_SPECIAL,  0x30, DIS_RS_RT,        CLS_SYSTEM, 0, TRAP_IF(S32(RS) >= S32(RT), EXC_TR);) \
+	X(TGEU,    "tgeu",    ENC_SPECIAL,  0x31, DIS_RS_RT,        CLS_SYSTEM, 0, TRAP_IF(RS >= RT, EXC_TR);) \
+	X(TLT,     "tlt",     ENC_SPECIAL,  0x32, DIS_RS_RT,        CLS_SYSTEM, 0, TRAP_IF(S32(RS) < S32(RT), EXC_TR);) \
+	X(TLTU,    "tltu",    ENC_SPECIAL,  0x33, DIS_RS_RT,        CLS_SYSTEM, 0, TRAP_IF(RS < RT, EXC_TR);) \
+	X(TEQ,     "teq",     ENC_SPECIAL,  0x34, DIS_RS_RT,        CLS_SYSTEM, 0, TRAP_IF(RS == RT, EXC_TR);) \
+	X(TNE,     "tne",     ENC_SPECIAL,  0x36, DIS_RS_RT,        CLS_SYSTEM, 0, TRAP_IF(RS != RT, EXC_TR);) \
+	X(BLTZ,    "bltz",    ENC_REGIMM,   0x00, DIS_RS_BRANCH,    CLS_BRANCH, 0, BRANCH(S32(RS) < 0);) \
+	X(BGEZ,    "bgez",    ENC_REGIMM,   0x01, DIS_RS_BRANCH,    CLS_BRANCH, 0, BRANCH(S32(RS) >= 0);) \
+	X(BLTZL,   "bltzl",   ENC_REGIMM,   0x02, DIS_RS_BRANCH,    CLS_BRANCH, 0, BRANCH_LIKELY(S32(RS) < 0);) \
+	X(BGEZL,   "bgezl",   ENC_REGIMM,   0x03, DIS_RS_BRANCH,    CLS_BRANCH, 0, BRANCH_LIKELY(S32(RS) >= 0);) \
+	X(TGEI,    "tgei",    ENC_REGIMM,   0x08, DIS_RS_SIMM,      CLS_SYSTEM, 0, TRAP_IF(S32(RS) >= S32(IMM), EXC_TR);) \
+	X(TGEIU,   "tgeiu",   ENC_REGIMM,   0x09, DIS_RS_SIMM,      CLS_SYSTEM, 0, TRAP_IF(RS >= IMM, EXC_TR);) \
+	X(TLTI,    "tlti",    ENC_REGIMM,   0x0a, DIS_RS_SIMM,      CLS_SYSTEM, 0, TRAP_IF(S32(RS) < S32(IMM), EXC_TR);) \
+	X(TLTIU,   "tltiu",   ENC_REGIMM,   0x0b, DIS_RS_SIMM,      CLS_SYSTEM, 0, TRAP_IF(RS < IMM, EXC_TR);) \
+	X(TEQI,    "teqi",    ENC_REGIMM,   0x0c, DIS_RS_SIMM,      CLS_SYSTEM, 0, TRAP_IF(RS == IMM, EXC_TR);) \
+	X(TNEI,    "tnei",    ENC_REGIMM,   0x0e, DIS_RS_SIMM,      CLS_SYSTEM, 0, TRAP_IF(RS != IMM, EXC_TR);) \
+	X(BLTZAL,  "bltzal",  ENC_REGIMM,   0x10, DIS_RS_BRANCH,    CLS_BRANCH, 0, int taken = S32(RS) < 0; LINK(31); BRANCH(taken);) \
+	X(BGEZAL,  "bgezal",  ENC_REGIMM,   0x11, DIS_RS_BRANCH,    CLS_BRANCH, 0, int taken = S32(RS) >= 0; LINK(31); BRANCH(taken);) \
+	X(BLTZALL, "bltzall", ENC_REGIMM,   0x12, DIS_RS_BRANCH,    CLS_BRANCH, 0, int taken = S32(RS) < 0; LINK(31); BRANCH_LIKELY(taken);) \
+	X(BGEZALL, "bgezall", ENC_REGIMM,   0x13, DIS_RS_BRANCH,    CLS_BRANCH, 0, int taken = S32(RS) >= 0; LINK(31); BRANCH_LIKELY(taken);) \
+	X(J,       "j",       ENC_OPCODE,   0x02, DIS_JUMP,         CLS_BRANCH, 0, NPC = IMM;) \
+	X(JAL,     "jal",     ENC_OPCODE,   0x03, DIS_JUMP,         CLS_BRANCH, 0, LINK(31); NPC = IMM;) \
+	X(BEQ,     "beq",     ENC_OPCODE,   0x04, DIS_RS_RT_BRANCH, CLS_BRANCH, 0, BRANCH(RS == RT);) \
+	X(BNE,     "bne",     ENC_OPCODE,   0x05, DIS_RS_RT_BRANCH, CLS_BRANCH, 0, BRANCH(RS != RT);) \
+	X(BLEZ,    "blez",    ENC_OPCODE,   0x06, DIS_RS_BRANCH,    CLS_BRANCH, 0, BRANCH(S32(RS) <= 0);) \
+	X(BGTZ,    "bgtz",    ENC_OPCODE,   0x07, DIS_RS_BRANCH,    CLS_BRANCH, 0, BRANCH(S32(RS) > 0);) \
+	X(ADDI,    "addi",    ENC_OPCODE,   0x08, DIS_RT_RS_SIMM,   CLS_ALU,    0, uint32_t r = RS + IMM; TRAP_IF(ADD_OVERFLOWS(RS, IMM, r), EXC_OV); RT = r;) \
+	X(ADDIU,   "addiu",   ENC_OPCODE,   0x09, DIS_RT_RS_SIMM,   CLS_ALU,    0, RT = RS + IMM;) \
+	X(SLTI,    "slti",    ENC_OPCODE,   0x0a, DIS_RT_RS_SIMM,   CLS_ALU,    0, RT = S32(RS) < S32(IMM);) \
+	X(SLTIU,   "sltiu",   ENC_OPCODE,   0x0b, DIS_RT_RS_SIMM,   CLS_ALU,    0, RT = RS < IMM;) \
+	X(ANDI,    "andi",    ENC_OPCODE,   0x0c, DIS_RT_RS_UIMM,   CLS_ALU,    0, RT = RS & IMM;) \
+	X(ORI,     "ori",     ENC_OPCODE,   0x0d, DIS_RT_RS_UIMM,   CLS_ALU,    0, RT = RS | IMM;) \
+	X(XORI,    "xori",    ENC_OPCODE,   0x0e, DIS_RT_RS_UIMM,   CLS_ALU,    0, RT = RS ^ IMM;) \
+	X(LUI,     "lui",     ENC_OPCODE,   0x0f, DIS_RT_UIMM,      CLS_ALU,    0, RT = IMM << 16;) \
+	X(BEQL,    "beql",    ENC_OPCODE,   0x14, DIS_RS_RT_BRANCH, CLS_BRANCH, 0, BRANCH_LIKELY(RS == RT);) \
+	X(BNEL,    "bnel",    ENC_OPCODE,   0x15, DIS_RS_RT_BRANCH, CLS_BRANCH, 0, BRANCH_LIKELY(RS != RT);) \
+	X(BLEZL,   "blezl",   ENC_OPCODE,   0x16, DIS_RS_BRANCH,    CLS_BRANCH, 0, BRANCH_LIKELY(S32(RS) <= 0);) \
+	X(BGTZL,   "bgtzl",   ENC_OPCODE,   0x17, DIS_RS_BRANCH,    CLS_BRANCH, 0, BRANCH_LIKELY(S32(RS) > 0);) \
+	X(LB,      "lb",      ENC_OPCODE,   0x20, DIS_RT_MEM,       CLS_LOAD,   1, RT = (int8_t)LOAD8(EA);) \
+	X(LH,      "lh",      ENC_OPCODE,   0x21, DIS_RT_MEM,       CLS_LOAD,   2, RT = (int16_t)LOAD16(EA);) \
+	X(LWL,     "lwl",     ENC_OPCODE,   0x22, DIS_RT_MEM,       CLS_LOAD,   1, \
+		uint32_t a = EA, sh = (3 - LANE(a)) * 8; RT = (RT & ((1u << sh) - 1)) | (LOAD32(a & ~3u) << sh);) \
+	X(LW,      "lw",      ENC_OPCODE,   0x23, DIS_RT_MEM,       CLS_LOAD,   4, RT = LOAD32(EA);) \
+	X(LBU,     "lbu",     ENC_OPCODE,   0x24, DIS_RT_MEM,       CLS_LOAD,   1, RT = LOAD8(EA);) \
+	X(LHU,     "lhu",     ENC_OPCODE,   0x25, DIS_RT_MEM,       CLS_LOAD,   2, RT = LOAD16(EA);) \
+	X(LWR,     "lwr",     ENC_OPCODE,   0x26, DIS_RT_MEM,       CLS_LOAD,   1, \
+		uint32_t a = EA, sh = LANE(a) * 8; RT = (RT & ~(0xFFFFFFFFu >> sh)) | (LOAD32(a & ~3u) >> sh);) \
+	X(SB,      "sb",      ENC_OPCODE,   0x28, DIS_RT_MEM,       CLS_STORE,  1, STORE8(EA, RT);) \
+	X(SH,      "sh",      ENC_OPCODE,   0x29, DIS_RT_MEM,       CLS_STORE,  2, STORE16(EA, RT);) \
+	X(SWL,     "swl",     ENC_OPCODE,   0x2a, DIS_RT_MEM,       CLS_STORE,  1, \
+		uint32_t a = EA, sh = (3 - LANE(a)) * 8, m = 0xFFFFFFFFu >> sh; STORE32(a & ~3u, (LOAD32(a & ~3u) & ~m) | (RT >> sh));) \
+	X(SW,      "sw",      ENC_OPCODE,   0x2b, DIS_RT_MEM,       CLS_STORE,  4, STORE32(EA, RT);) \
+	X(SWR,     "swr",     ENC_OPCODE,   0x2e, DIS_RT_MEM,       CLS_STORE,  1, \
+		uint32_t a = EA, sh = LANE(a) * 8, m = 0xFFFFFFFFu << sh; STORE32(a & ~3u, (LOAD32(a & ~3u) & ~m) | (RT << sh));) \
+	X(CACHE,   "cache",   ENC_OPCODE,   0x2f, DIS_OP_MEM,       CLS_SYSTEM, 0, ;) \
+	X(LL,      "ll",      ENC_OPCODE,   0x30, DIS_RT_MEM,       CLS_LOAD,   4, RT = load_linked(MEMREF(EA, ACC_LOAD, 4));) \
+	X(PREF,    "pref",    ENC_OPCODE,   0x33, DIS_OP_MEM,       CLS_ALU,    0, ;) \
+	X(SC,      "sc",      ENC_OPCODE,   0x38, DIS_RT_MEM,       CLS_STORE,  4, RT = store_conditional(MEMREF(EA, ACC_STORE, 4), RT);) \
+	X(MADD,    "madd",    ENC_SPECIAL2, 0x00, DIS_RS_RT,        CLS_MULDIV, 0, SET_HILO(HILO + (int64_t)S32(RS) * S32(RT));) \
+	X(MADDU,   "maddu",   ENC_SPECIAL2, 0x01, DIS_RS_RT,        CLS_MULDIV, 0, SET_HILO(HILO + (uint64_t)RS * RT);) \
+	X(MUL,     "mul",     ENC_SPECIAL2, 0x02, DIS_RD_RS_RT,     CLS_MULDIV, 0, RD = (uint32_t)((int64_t)S32(RS) * S32(RT));) \
+	X(MSUB,    "msub",    ENC_SPECIAL2, 0x04, DIS_RS_RT,        CLS_MULDIV, 0, SET_HILO(HILO - (int64_t)S32(RS) * S32(RT));) \
+	X(MSUBU,   "msubu",   ENC_SPECIAL2, 0x05, DIS_RS_RT,        CLS_MULDIV, 0, SET_HILO(HILO - (uint64_t)RS * RT);) \
+	X(CLZ,     "clz",     ENC_SPECIAL2, 0x20, DIS_RD_RS,        CLS_ALU,    0, RD = RS ? __builtin_clz(RS) : 32;) \
+	X(CLO,     "clo",     ENC_SPECIAL2, 0x21, DIS_RD_RS,        CLS_ALU,    0, RD = ~RS ? __builtin_clz(~RS) : 32;) \
+	X(MFC0,    "mfc0",    ENC_COP0,     0x00, DIS_RT_C0,        CLS_SYSTEM, 0, cop0(d);) \
+	X(MTC0,    "mtc0",    ENC_COP0,     0x04, DIS_RT_C0,        CLS_SYSTEM, 0, cop0(d);) \
+	X(TLBR,    "tlbr",    ENC_COP0CO,   0x01, DIS_NONE,         CLS_SYSTEM, 0, cop0(d);) \
+	X(TLBWI,   "tlbwi",   ENC_COP0CO,   0x02, DIS_NONE,         CLS_SYSTEM, 0, cop0(d);) \
+	X(TLBWR,   "tlbwr",   ENC_COP0CO,   0x06, DIS_NONE,         CLS_SYSTEM, 0, cop0(d);) \
+	X(TLBP,    "tlbp",    ENC_COP0CO,   0x08, DIS_NONE,         CLS_SYSTEM, 0, cop0(d);) \
+	X(ERET,    "eret",    ENC_COP0CO,   0x18, DIS_NONE,         CLS_SYSTEM, 0, cop0(d);) \
+	X(MOVF,    "movf",    ENC_MOVCI,    0x00, DIS_RD_RS_CC,     CLS_FPU,    0, if (!GET_FCC(CC_BR)) RD = RS;) \
+	X(MOVT,    "movt",    ENC_MOVCI,    0x01, DIS_RD_RS_CC,     CLS_FPU,    0, if (GET_FCC(CC_BR)) RD = RS;) \
+	X(MFC1,    "mfc1",    ENC_COP1,     0x00, DIS_RT_FS,        CLS_FPU,    0, RT = FPR(FS);) \
+	X(CFC1,    "cfc1",    ENC_COP1,     0x02, DIS_RT_FCR,       CLS_FPU,    0, RT = fpu_read_control(FS);) \
+	X(MTC1,    "mtc1",    ENC_COP1,     0x04, DIS_RT_FS,        CLS_FPU,    0, FPR(FS) = RT;) \
+	X(CTC1,    "ctc1",    ENC_COP1,     0x06, DIS_RT_FCR,       CLS_FPU,    0, fpu_write_control(FS, RT);) \
+	X(BC1F,    "bc1f",    ENC_COP1_BC,  0x00, DIS_CC_BRANCH,    CLS_FPU_BRANCH, 0, BRANCH(!GET_FCC(CC_BR));) \
+	X(BC1T,    "bc1t",    ENC_COP1_BC,  0x01, DIS_CC_BRANCH,    CLS_FPU_BRANCH, 0, BRANCH(GET_FCC(CC_BR));) \
+	X(BC1FL,   "bc1fl",   ENC_COP1_BC,  0x02, DIS_CC_BRANCH,    CLS_FPU_BRANCH, 0, BRANCH_LIKELY(!GET_FCC(CC_BR));) \
+	X(BC1TL,   "bc1tl",   ENC_COP1_BC,  0x03, DIS_CC_BRANCH,    CLS_FPU_BRANCH, 0, BRANCH_LIKELY(GET_FCC(CC_BR));) \
+	FPU_ARITH(X, S, "s", ENC_COP1_S, float, GET_S, SET_S, MOVE_S, HIWORD_S) \
+	FPU_ARITH(X, D, "d", ENC_COP1_D, double, GET_D, SET_D, MOVE_D, HIWORD_D) \
+	X(CVT_D_S, "cvt.d.s", ENC_COP1_S,   0x21, DIS_FD_FS,        CLS_FPU,    0, FP_RESULT(SET_D, FD, (double)GET_S(FS));) \
+	X(CVT_S_D, "cvt.s.d", ENC_COP1_D,   0x20, DIS_FD_FS,        CLS_FPU,    0, FP_RESULT(SET_S, FD, (float)GET_D(FS));) \
+	X(CVT_S_W, "cvt.s.w", ENC_COP1_W,   0x20, DIS_FD_FS,        CLS_FPU,    0, FP_RESULT(SET_S, FD, (float)S32(FPR(FS)));) \
+	X(CVT_D_W, "cvt.d.w", ENC_COP1_W,   0x21, DIS_FD_FS,        CLS_FPU,    0, FP_RESULT(SET_D, FD, (double)S32(FPR(FS)));) \
+	X(LWC1,    "lwc1",    ENC_OPCODE,   0x31, DIS_FT_MEM,       CLS_FPU_LOAD,  4, FPR(FT) = LOAD32(EA);) \
+	X(LDC1,    "ldc1",    ENC_OPCODE,   0x35, DIS_FT_MEM,       CLS_FPU_LOAD,  8, \
+		uint32_t a = EA; FPR(FT & ~1) = LOAD32(a + DW_LO); FPR(FT | 1) = LOAD32(a + DW_HI);) \
+	X(SWC1,    "swc1",    ENC_OPCODE,   0x39, DIS_FT_MEM,       CLS_FPU_STORE, 4, STORE32(EA, FPR(FT));) \
+	X(SDC1,    "sdc1",    ENC_OPCODE,   0x3d, DIS_FT_MEM,       CLS_FPU_STORE, 8, \
+		uint32_t a = EA; STORE32(a + DW_LO, FPR(FT & ~1)); STORE32(a + DW_HI, FPR(FT | 1));)
+
+/* the rows .s and .d share; FMT/fmt name the format */
+#define FPU_ARITH(X, FMT, fmt, enc, T, GET, SET, MOVE, HIWORD) \
+	X(ADD_##FMT,     "add." fmt,     enc, 0x00, DIS_FD_FS_FT, CLS_FPU, 0, FP_RESULT(SET, FD, GET(FS) + GET(FT));) \
+	X(SUB_##FMT,     "sub." fmt,     enc, 0x01, DIS_FD_FS_FT, CLS_FPU, 0, FP_RESULT(SET, FD, GET(FS) - GET(FT));) \
+	X(MUL_##FMT,     "mul." fmt,     enc, 0x02, DIS_FD_FS_FT, CLS_FPU, 0, FP_RESULT(SET, FD, GET(FS) * GET(FT));) \
+	X(DIV_##FMT,     "div." fmt,     enc, 0x03, DIS_FD_FS_FT, CLS_FPU, 0, FP_RESULT(SET, FD, GET(FS) / GET(FT));) \
+	X(SQRT_##FMT,    "sqrt." fmt,    enc, 0x04, DIS_FD_FS,    CLS_FPU, 0, FP_RESULT(SET, FD, (T)sqrt(GET(FS)));) \
+	X(ABS_##FMT,     "abs." fmt,     enc, 0x05, DIS_FD_FS,    CLS_FPU, 0, MOVE(FD, FS); FPR(HIWORD(FD)) &= 0x7FFFFFFF;) \
+	X(MOV_##FMT,     "mov." fmt,     enc, 0x06, DIS_FD_FS,    CLS_FPU, 0, MOVE(FD, FS);) \
+	X(NEG_##FMT,     "neg." fmt,     enc, 0x07, DIS_FD_FS,    CLS_FPU, 0, MOVE(FD, FS); FPR(HIWORD(FD)) ^= 0x80000000;) \
+	X(ROUND_W_##FMT, "round.w." fmt, enc, 0x0c, DIS_FD_FS,    CLS_FPU, 0, FP_RESULT(SET_W, FD, fpu_to_word(GET(FS), FCSR_RM_NEAREST));) \
+	X(TRUNC_W_##FMT, "trunc.w." fmt, enc, 0x0d, DIS_FD_FS,    CLS_FPU, 0, FP_RESULT(SET_W, FD, fpu_to_word(GET(FS), FCSR_RM_ZERO));) \
+	X(CEIL_W_##FMT,  "ceil.w." fmt,  enc, 0x0e, DIS_FD_FS,    CLS_FPU, 0, FP_RESULT(SET_W, FD, fpu_to_word(GET(FS), FCSR_RM_UP));) \
+	X(FLOOR_W_##FMT, "floor.w." fmt, enc, 0x0f, DIS_FD_FS,    CLS_FPU, 0, FP_RESULT(SET_W, FD, fpu_to_word(GET(FS), FCSR_RM_DOWN));) \
+	X(MOVZ_##FMT,    "movz." fmt,    enc, 0x12, DIS_FD_FS_RT, CLS_FPU, 0, if (RT == 0) MOVE(FD, FS);) \
+	X(MOVN_##FMT,    "movn." fmt,    enc, 0x13, DIS_FD_FS_RT, CLS_FPU, 0, if (RT != 0) MOVE(FD, FS);) \
+	X(CVT_W_##FMT,   "cvt.w." fmt,   enc, 0x24, DIS_FD_FS,    CLS_FPU, 0, FP_RESULT(SET_W, FD, fpu_to_word(GET(FS), CURRENT_STATE.FCSR & FCSR_RM_MASK));) \
+	FPU_COMPARE(X, FMT, fmt, enc, GET, F,    "f",    0x0) \
+	FPU_COMPARE(X, FMT, fmt, enc, GET, UN,   "un",   0x1) \
+	FPU_COMPARE(X, FMT, fmt, enc, GET, EQ,   "eq",   0x2) \
+	FPU_COMPARE(X, FMT, fmt, enc, GET, UEQ,  "ueq",  0x3) \
+	FPU_COMPARE(X, FMT, fmt, enc, GET, OLT,  "olt",  0x4) \
+	FPU_COMPARE(X, FMT, fmt, enc, GET, ULT,  "ult",  0x5) \
+	FPU_COMPARE(X, FMT, fmt, enc, GET, OLE,  "ole",  0x6) \
+	FPU_COMPARE(X, FMT, fmt, enc, GET, ULE,  "ule",  0x7) \
+	FPU_COMPARE(X, FMT, fmt, enc, GET, SF,   "sf",   0x8) \
+	FPU_COMPARE(X, FMT, fmt, enc, GET, NGLE, "ngle", 0x9) \
+	FPU_COMPARE(X, FMT, fmt, enc, GET, SEQ,  "seq",  0xa) \
+	FPU_COMPARE(X, FMT, fmt, enc, GET, NGL,  "ngl",  0xb) \
+	FPU_COMPARE(X, FMT, fmt, enc, GET, LT,   "lt",   0xc) \
+	FPU_COMPARE(X, FMT, fmt, enc, GET, NGE,  "nge",  0xd) \
+	FPU_COMPARE(X, FMT, fmt, enc, GET, LE,   "le",   0xe) \
+	FPU_COMPARE(X, FMT, fmt, enc, GET, NGT,  "ngt",  0xf)
+
+/* C.cond.fmt: cond bit 0 = true if unordered, 1 = if equal, 2 = if less, 3 = signal on NaN */
+#define FPU_COMPARE(X, FMT, fmt, enc, GET, C, c, cond) \
+	X(C_##C##_##FMT, "c." c "." fmt, enc, 0x30 | cond, DIS_CC_FS_FT, CLS_FPU, 0, \
+		FP_RESULT(SET_FCC, CC_CMP, fpu_compare(GET(FS), GET(FT), cond));)
+
+/* major opcodes that select another table */
+#define OPC_SPECIAL	0x00
+#define OPC_REGIMM	0x01
+#define OPC_COP0	0x10
+#define OPC_COP1	0x11
+#define OPC_SPECIAL2	0x1c
+#define COP0_CO		0x02000000	/* COP0 word is a CP0 operation (ERET), not a move */
+#define FUNCT_MOVCI	0x01		/* SPECIAL funct of MOVF/MOVT */
+#define COP1_BC		0x08		/* COP1 rs values: branch on FCC and the formats */
+#define COP1_FMT_S	0x10
+#define COP1_FMT_D	0x11
+#define COP1_FMT_W	0x14
+
+enum {
+	OP_INVALID,
+#define X(name, mnem, enc, code, fmt, cls, size, ...) OP_##name,
+	MIPS_ISA(X)
+#undef X
+	OP_NUM
+};
 
+typedef struct {
+	const char *name;
+	uint8_t enc, code, fmt, cls, size;
+} isa_info_t;
+
+static const isa_info_t ISA_INFO[OP_NUM] = {
+	[OP_INVALID] = { NULL, 0, 0, DIS_NONE, CLS_SYSTEM, 0 },
+#define X(name, mnem, enc, code, fmt, cls, size, ...) [OP_##name] = { mnem, enc, code, fmt, cls, size },
+	MIPS_ISA(X)
+#undef X
+};
+
+/* field value -> OP_*, one row per encoding; holes are OP_INVALID */
+static const uint8_t ISA_DECODE[ENC_NUM][64] = {
+#define X(name, mnem, enc, code, fmt, cls, size, ...) [enc][code] = OP_##name,
+	MIPS_ISA(X)
+#undef X
+};
+
+static const uint8_t CLASS_STAT[CLS_NUM] = {
+	[CLS_ALU] = STAT_ALU, [CLS_MULDIV] = STAT_MULDIV, [CLS_LOAD] = STAT_LOADS,
+	[CLS_STORE] = STAT_STORES, [CLS_BRANCH] = STAT_BRANCHES, [CLS_SYSTEM] = STAT_SYSTEM,
+	[CLS_FPU] = STAT_FPU, [CLS_FPU_LOAD] = STAT_LOADS, [CLS_FPU_STORE] = STAT_STORES,
+	[CLS_FPU_BRANCH] = STAT_BRANCHES,
+};
 
 /***************************************************************/
 /* Print out a list of commands available                                                                  */
@@ -83,27 +278,99 @@ void help() {
 	printf("high <val>\t-- set the HI register to <val>\n");
 	printf("low <val>\t-- set the LO register to <val>\n");
 	printf("print\t-- print the program loaded into memory\n");
+	printf("stats\t-- print execution statistics\n");
+	printf("core <n>\t-- select the core rdump/input/high/low act on\n");
+	printf("tlb\t-- dump the selected core's TLB\n");
+	printf("devices\t-- list the memory-mapped devices and pending device events\n");
+	printf("cfg [dot|json <file>]\t-- summarise or export the program's control flow graph\n");
+	printf("coverage [<file>]\t-- list the program marked with the coverage recorded (-C) or in <file>\n");
+	printf("timing\t-- report IPC, stall causes and the critical path from the timing model (-O)\n");
+	printf("energy\t-- report energy in all, by instruction class and by function from the energy model (-E)\n");
+	printf("source <file>\t-- run the commands in <file>\n");
+	printf("history\t-- list earlier commands; !! or !<n> repeats one\n");
 	printf("?\t-- display help menu\n");
 	printf("quit\t-- exit the simulator\n\n");
 	printf("------------------------------------------------------------------\n\n");
 }
 
+/***************************************************************/
+/* Note guest pages as written, for the page limit and the     */
+/* decode cache; only the first write to a page and writes to   */
+/* code pages cost more than bit tests. The write that crosses  */
+/* the page limit stops its core at the next block.             */
+/***************************************************************/
+static void page_mark_slow(uint32_t page)
+{
+	uint8_t bit = 1 << (page & 7);
+
+	if (!(__atomic_fetch_or(&PAGE_BITMAP[page >> 3], bit, __ATOMIC_RELAXED) & bit) &&
+			atomic_fetch_add_explicit(&PAGES_WRITTEN, 1, memory_order_relaxed) >= MAX_PAGES &&
+			MAX_PAGES && CORE != NULL) {
+		/* over the limit: have the writer look at the next block boundary */
+		WATCHDOG_DEADLINE = 0;
+		EVENT_DEADLINE = 0;
+	}
+}
+
+static inline void page_mark(uint32_t address)
+{
+	uint32_t page = address >> MMU_PAGE_SHIFT;
+	uint8_t bit = 1 << (page & 7);
+
+	if (CODE_PAGES[page >> 3] & bit) {
+		code_invalidate(page);
+	}
+	if (!(PAGE_BITMAP[page >> 3] & bit)) {
+		page_mark_slow(page);
+	}
+}
+
+static void page_mark_range(uint32_t address, uint32_t len)
+{
+	uint32_t page, last;
+
+	if (len == 0) {
+		return;
+	}
+	last = (uint32_t)(((uint64_t)address + len - 1) >> MMU_PAGE_SHIFT);
+	for (page = address >> MMU_PAGE_SHIFT; page <= last; page++) {
+		page_mark(page << MMU_PAGE_SHIFT);
+	}
+}
+
+/***************************************************************/
+/* Backing for size bytes at address, NULL unless they all lie  */
+/* in one region. Regions are page aligned, so aligned guest    */
+/* words are aligned host words.                                 */
+/***************************************************************/
+static inline uint8_t *mem_ptr(uint32_t address, uint32_t size)
+{
+	mem_region_t *r = MEM_MAP[address >> 28];
+	uint32_t off;
+
+	if (r == NULL) {
+		return NULL;
+	}
+	off = address - r->begin;
+	if (off > r->end - r->begin || r->end - r->begin - off < size - 1) {
+		return NULL;
+	}
+	return r->mem + off;
+}
+
 /***************************************************************/
 /* Read a 32-bit word from memory                                                                            */
 /***************************************************************/
 uint32_t mem_read_32(uint32_t address)
 {
-	int i;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		if ( (address >= MEM_REGIONS[i].begin) &&  ( address <= MEM_REGIONS[i].end) ) {
-			uint32_t offset = address - MEM_REGIONS[i].begin;
-			return (MEM_REGIONS[i].mem[offset+3] << 24) |
-					(MEM_REGIONS[i].mem[offset+2] << 16) |
-					(MEM_REGIONS[i].mem[offset+1] <<  8) |
-					(MEM_REGIONS[i].mem[offset+0] <<  0);
-		}
+	uint8_t *p = mem_ptr(address, 4);
+	uint32_t v;
+
+	if (p == NULL) {
+		return mmio_read(address, 4);
 	}
-	return 0;
+	memcpy(&v, p, 4);
+	return guest32(v);
 }
 
 /***************************************************************/
@@ -111,1040 +378,8877 @@ uint32_t mem_read_32(uint32_t address)
 /***************************************************************/
 void mem_write_32(uint32_t address, uint32_t value)
 {
-	int i;
-	uint32_t offset;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		if ( (address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end) ) {
-			offset = address - MEM_REGIONS[i].begin;
+	uint8_t *p = mem_ptr(address, 4);
 
-			MEM_REGIONS[i].mem[offset+3] = (value >> 24) & 0xFF;
-			MEM_REGIONS[i].mem[offset+2] = (value >> 16) & 0xFF;
-			MEM_REGIONS[i].mem[offset+1] = (value >>  8) & 0xFF;
-			MEM_REGIONS[i].mem[offset+0] = (value >>  0) & 0xFF;
-		}
+	if (p != NULL) {
+		page_mark(address);
+		value = guest32(value);
+		memcpy(p, &value, 4);
+	} else {
+		mmio_write(address, value, 4);
 	}
 }
 
 /***************************************************************/
-/* Execute one cycle                                                                                                              */
+/* Read a byte / halfword from memory                           */
 /***************************************************************/
-void cycle() {                                                
-	handle_instruction();
-	//CURRENT_STATE = NEXT_STATE;
-	INSTRUCTION_COUNT++;
+uint8_t mem_read_8(uint32_t address)
+{
+	uint8_t *p = mem_ptr(address, 1);
+
+	return (p != NULL) ? *p : mmio_read(address, 1);
+}
+
+uint16_t mem_read_16(uint32_t address)
+{
+	uint8_t *p = mem_ptr(address, 2);
+	uint16_t v;
+
+	if (p == NULL) {
+		return mmio_read(address, 2);
+	}
+	memcpy(&v, p, 2);
+	return guest16(v);
 }
 
 /***************************************************************/
-/* Simulate MIPS for n cycles                                                                                       */
+/* Write a byte / halfword to memory                            */
 /***************************************************************/
-void run(int num_cycles) {                                      
-	
-	if (RUN_FLAG == FALSE) {
-		printf("Simulation Stopped\n\n");
-		return;
+void mem_write_8(uint32_t address, uint8_t value)
+{
+	uint8_t *p = mem_ptr(address, 1);
+
+	if (p != NULL) {
+		page_mark(address);
+		*p = value;
+	} else {
+		mmio_write(address, value, 1);
 	}
+}
 
-	printf("Running simulator for %d cycles...\n\n", num_cycles);
+void mem_write_16(uint32_t address, uint16_t value)
+{
+	uint8_t *p = mem_ptr(address, 2);
+
+	if (p != NULL) {
+		page_mark(address);
+		value = guest16(value);
+		memcpy(p, &value, 2);
+	} else {
+		mmio_write(address, value, 2);
+	}
+}
+
+/***************************************************************/
+/* Host view of a guest address: returns the backing pointer    */
+/* (NULL when unmapped) and in *run how many bytes follow before */
+/* the mapping changes.                                          */
+/***************************************************************/
+static uint8_t *mem_span(uint32_t address, uint32_t *run)
+{
 	int i;
-	for (i = 0; i < num_cycles; i++) {
-		if (RUN_FLAG == FALSE) {
-			printf("Simulation Stopped.\n\n");
-			break;
+	uint64_t next = ((uint64_t)1 << 32) - address;	/* up to the top of the address space */
+
+	for (i = 0; i < NUM_MEM_REGION; i++) {
+		if ( (address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end) ) {
+			*run = MEM_REGIONS[i].end - address + 1;
+			return MEM_REGIONS[i].mem + (address - MEM_REGIONS[i].begin);
+		}
+		if (MEM_REGIONS[i].begin > address && MEM_REGIONS[i].begin - address < next) {
+			next = MEM_REGIONS[i].begin - address;
 		}
-		cycle();
 	}
+	*run = (next > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t)next;
+	return NULL;
 }
 
 /***************************************************************/
-/* simulate to completion                                                                                               */
+/* Backing pointer for [address, address+len) if the whole range */
+/* lives in a single region, NULL otherwise                       */
 /***************************************************************/
-void runAll() {                                                     
-	if (RUN_FLAG == FALSE) {
-		printf("Simulation Stopped.\n\n");
-		return;
-	}
+uint8_t *mem_host_ptr(uint32_t address, uint32_t len)
+{
+	uint32_t run;
+	uint8_t *p = mem_span(address, &run);
 
-	printf("Simulation Started...\n\n");
-	while (RUN_FLAG){
-		cycle();
+	if (p == NULL || len > run) {
+		return NULL;
 	}
-	printf("Simulation Finished.\n\n");
+	return p;
 }
 
-/***************************************************************/ 
-/* Dump a word-aligned region of memory to the terminal                              */
 /***************************************************************/
-void mdump(uint32_t start, uint32_t stop) {          
-	uint32_t address;
+/* Fill n host bytes with the memory image of word, the first   */
+/* byte taking byte (phase) of the image                          */
+/***************************************************************/
+static void fill_pattern(uint8_t *dst, size_t n, uint32_t word, uint32_t phase)
+{
+	uint8_t b[4], image[4];
+	size_t done, chunk;
+	int k;
 
-	printf("-------------------------------------------------------------\n");
-	printf("Memory content [0x%08x..0x%08x] :\n", start, stop);
-	printf("-------------------------------------------------------------\n");
-	printf("\t[Address in Hex (Dec) ]\t[Value]\n");
-	for (address = start; address <= stop; address += 4){
-		printf("\t0x%08x (%d) :\t0x%08x\n", address, address, mem_read_32(address));
+	word = guest32(word);
+	memcpy(image, &word, 4);
+	for (k = 0; k < 4; k++) {
+		b[k] = image[(phase + k) & 3];
+	}
+	if (b[0] == b[1] && b[0] == b[2] && b[0] == b[3]) {
+#ifdef MADV_DONTNEED
+		/* zeroing a large span: hand whole pages back to the kernel, they
+		 * come back zero-filled on the next touch */
+		long page = sysconf(_SC_PAGESIZE);
+		if (b[0] == 0 && page > 0 && n >= BULK_MADVISE_MIN) {
+			uintptr_t lo = ((uintptr_t)dst + page - 1) & ~(uintptr_t)(page - 1);
+			uintptr_t hi = ((uintptr_t)dst + n) & ~(uintptr_t)(page - 1);
+			if (hi > lo && madvise((void *)lo, hi - lo, MADV_DONTNEED) == 0) {
+				memset(dst, 0, lo - (uintptr_t)dst);
+				memset((void *)hi, 0, (uintptr_t)dst + n - hi);
+				return;
+			}
+		}
+#endif
+		memset(dst, b[0], n);
+		return;
+	}
+
+	/* seed one pattern period, then keep doubling the filled prefix */
+	for (done = 0; done < n && done < 4; done++) {
+		dst[done] = b[done];
+	}
+	while (done < n) {
+		chunk = (done <= n - done) ? done : n - done;
+		memcpy(dst + done, dst, chunk);
+		done += chunk;
 	}
-	printf("\n");
 }
 
 /***************************************************************/
-/* Dump current values of registers to the teminal                                              */   
+/* Fill len bytes of guest memory starting at address with the   */
+/* repeated 32-bit word (as successive mem_write_32 calls would) */
 /***************************************************************/
-void rdump() {                               
-	int i; 
-	printf("-------------------------------------\n");
-	printf("Dumping Register Content\n");
-	printf("-------------------------------------\n");
-	printf("# Instructions Executed\t: %u\n", INSTRUCTION_COUNT);
-	printf("PC\t: 0x%08x\n", CURRENT_STATE.PC);
-	printf("-------------------------------------\n");
-	printf("[Register]\t[Value]\n");
-	printf("-------------------------------------\n");
-	for (i = 0; i < MIPS_REGS; i++){
-		printf("[R%d]\t: 0x%08x\n", i, CURRENT_STATE.R[i]);
+void mem_fill(uint32_t address, uint32_t word, uint32_t len)
+{
+	uint32_t done = 0, run, chunk;
+	uint8_t *p;
+
+	while (done < len) {
+		p = mem_span(address + done, &run);
+		chunk = (run < len - done) ? run : len - done;
+		if (p != NULL) {
+			page_mark_range(address + done, chunk);
+			fill_pattern(p, chunk, word, done & 3);
+		}
+		done += chunk;
 	}
-	printf("-------------------------------------\n");
-	printf("[HI]\t: 0x%08x\n", CURRENT_STATE.HI);
-	printf("[LO]\t: 0x%08x\n", CURRENT_STATE.LO);
-	printf("-------------------------------------\n");
 }
 
 /***************************************************************/
-/* Read a command from standard input.                                                               */  
+/* Copy host bytes into guest memory; unmapped bytes are dropped */
 /***************************************************************/
-void handle_command() {                         
-	char buffer[20];
-	uint32_t start, stop, cycles;
-	uint32_t register_no;
-	int register_value;
-	int hi_reg_value, lo_reg_value;
-
-	printf("MU-MIPS SIM:> ");
+void mem_write_block(uint32_t address, const void *src, uint32_t len)
+{
+	uint32_t done = 0, run, chunk;
+	uint8_t *p;
 
-	if (scanf("%s", buffer) == EOF){
-		exit(0);
+	while (done < len) {
+		p = mem_span(address + done, &run);
+		chunk = (run < len - done) ? run : len - done;
+		if (p != NULL) {
+			page_mark_range(address + done, chunk);
+			memcpy(p, (const uint8_t *)src + done, chunk);
+		}
+		done += chunk;
 	}
+}
 
-	switch(buffer[0]) {
-		case 'S':
-		case 's':
-			runAll(); 
-			break;
-		case 'M':
-		case 'm':
-			if (scanf("%x %x", &start, &stop) != 2){
-				break;
-			}
-			mdump(start, stop);
-			break;
-		case '?':
-			help();
-			break;
-		case 'Q':
-		case 'q':
-			printf("**************************\n");
-			printf("Exiting MU-MIPS! Good Bye...\n");
-			printf("**************************\n");
-			exit(0);
-		case 'R':
-		case 'r':
-			if (buffer[1] == 'd' || buffer[1] == 'D'){
-				rdump();
-			}else if(buffer[1] == 'e' || buffer[1] == 'E'){
-				reset();
-			}
-			else {
-				if (scanf("%d", &cycles) != 1) {
-					break;
-				}
-				run(cycles);
-			}
-			break;
-		case 'I':
-		case 'i':
-			if (scanf("%u %i", &register_no, &register_value) != 2){
-				break;
-			}
-			CURRENT_STATE.R[register_no] = register_value;
-			NEXT_STATE.R[register_no] = register_value;
-			break;
-		case 'H':
-		case 'h':
-			if (scanf("%i", &hi_reg_value) != 1){
-				break;
-			}
-			CURRENT_STATE.HI = hi_reg_value; 
-			NEXT_STATE.HI = hi_reg_value; 
-			break;
-		case 'L':
-		case 'l':
-			if (scanf("%i", &lo_reg_value) != 1){
-				break;
-			}
-			CURRENT_STATE.LO = lo_reg_value;
-			NEXT_STATE.LO = lo_reg_value;
-			break;
-		case 'P':
-		case 'p':
-			print_program(); 
-			break;
-		default:
-			printf("Invalid Command.\n");
-			break;
+/***************************************************************/
+/* Copy guest memory out to a host buffer; unmapped bytes read 0 */
+/***************************************************************/
+void mem_read_block(uint32_t address, void *dst, uint32_t len)
+{
+	uint32_t done = 0, run, chunk;
+	uint8_t *p;
+
+	while (done < len) {
+		p = mem_span(address + done, &run);
+		chunk = (run < len - done) ? run : len - done;
+		if (p != NULL) {
+			memcpy((uint8_t *)dst + done, p, chunk);
+		} else {
+			memset((uint8_t *)dst + done, 0, chunk);
+		}
+		done += chunk;
 	}
 }
 
 /***************************************************************/
-/* reset registers/memory and reload program                                                    */
+/* Copy len bytes of guest memory from src to dst with memmove   */
+/* semantics (overlapping ranges are handled)                    */
 /***************************************************************/
-void reset() {   
-	int i;
-	/*reset registers*/
-	for (i = 0; i < MIPS_REGS; i++){
-		CURRENT_STATE.R[i] = 0;
+void mem_copy(uint32_t dst, uint32_t src, uint32_t len)
+{
+	uint8_t *d, *s, *bounce;
+
+	if (len == 0) {
+		return;
 	}
-	CURRENT_STATE.HI = 0;
-	CURRENT_STATE.LO = 0;
-	
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		memset(MEM_REGIONS[i].mem, 0, region_size);
+	d = mem_host_ptr(dst, len);
+	s = mem_host_ptr(src, len);
+	if (d != NULL && s != NULL) {
+		page_mark_range(dst, len);
+		memmove(d, s, len);
+		return;
 	}
-	
-	/*load program*/
-	load_program();
-	
-	/*reset PC*/
-	INSTRUCTION_COUNT = 0;
-	CURRENT_STATE.PC =  MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
-	RUN_FLAG = TRUE;
+
+	/* range straddles a region boundary: go through the host */
+	bounce = malloc(len);
+	if (bounce == NULL) {
+		printf("Error: out of memory copying 0x%08x bytes\n", len);
+		return;
+	}
+	mem_read_block(src, bounce, len);
+	mem_write_block(dst, bounce, len);
+	free(bounce);
 }
 
 /***************************************************************/
-/* Allocate and set memory to zero                                                                            */
-/***************************************************************/
-void init_memory() {                                           
+/* Devices
+   mmio_read() and mmio_write() are only reached from the
+   accessors' unmapped path. A device sees the offset into its
+   range and register values as host numbers of the access size.
+   Callbacks from the event queue run with DEVICE_LOCK held, as
+   do the device read and write hooks, so none of them may touch
+   a device through the accessors themselves.
+***************************************************************/
+static pthread_mutex_t DEVICE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+static device_t *device_at(uint32_t pa)
+{
 	int i;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		MEM_REGIONS[i].mem = malloc(region_size);
-		memset(MEM_REGIONS[i].mem, 0, region_size);
+
+	for (i = 0; i < NUM_DEVICES; i++) {
+		if (pa - DEVICES[i]->base < DEVICES[i]->size) {
+			return DEVICES[i];
+		}
 	}
+	return NULL;
 }
 
-/**************************************************************/
-/* load program into memory                                                                                      */
-/**************************************************************/
-void load_program() {                   
-	FILE * fp;
-	int i, word;
-	uint32_t address;
+uint32_t mmio_read(uint32_t pa, int size)
+{
+	device_t *dev;
+	uint32_t v;
 
-	/* Open program file. */
-	fp = fopen(prog_file, "r");
-	if (fp == NULL) {
-		printf("Error: Can't open program file %s\n", prog_file);
-		exit(-1);
+	if (pa < MMIO_BEGIN || (dev = device_at(pa)) == NULL) {
+		return 0;
 	}
+	pthread_mutex_lock(&DEVICE_LOCK);
+	v = dev->read(dev, pa - dev->base, size);
+	pthread_mutex_unlock(&DEVICE_LOCK);
+	stat_add(STAT_MMIO, 1);
+	return v;
+}
 
-	/* Read in the program. */
+void mmio_write(uint32_t pa, uint32_t value, int size)
+{
+	device_t *dev;
 
-	i = 0;
-	while( fscanf(fp, "%x\n", &word) != EOF ) {
-		address = MEM_TEXT_BEGIN + i;
-		mem_write_32(address, word);
-		printf("writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
-		i += 4;
+	if (pa < MMIO_BEGIN || (dev = device_at(pa)) == NULL) {
+		return;
 	}
-	PROGRAM_SIZE = i/4;
-	printf("Program loaded into memory.\n%d words written into memory.\n\n", PROGRAM_SIZE);
-	fclose(fp);
+	pthread_mutex_lock(&DEVICE_LOCK);
+	dev->write(dev, pa - dev->base, value, size);
+	pthread_mutex_unlock(&DEVICE_LOCK);
+	stat_add(STAT_MMIO, 1);
 }
 
-/***********************************************
-    ALU functions
-	rs rd rt the int that will determine which temp variable value you are using
-***********************************************/
-
-void add(int rs, int rt, int rd)
+void device_register(device_t *dev)
 {
-	CURRENT_STATE.R[rd] = rs + rt;
+	if (NUM_DEVICES == MAX_DEVICES) {
+		printf("Error: no room for device %s\n", dev->name);
+		return;
+	}
+	DEVICES[NUM_DEVICES++] = dev;
 }
-void addu(int rs, int rt, int rd)
+
+/* have core 0 look at the queue and the lines at its next block
+ * boundary, leaving translated code early if need be */
+static void device_wake()
 {
-	unsigned int urs = (unsigned int)CURRENT_STATE.R[rs];
-	unsigned int urt = (unsigned int)CURRENT_STATE.R[rt];
-	unsigned int urd = (unsigned int)CURRENT_STATE.R[rd];
-	CURRENT_STATE.R[urd] = CURRENT_STATE.R[urs] + CURRENT_STATE.R[urt];
+	__atomic_store_n(&CORES[0].event_deadline, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&CORES[0].aot_go, FALSE, __ATOMIC_RELAXED);
 }
-void addi(int rs, int rt, uint32_t address)
+
+/* drive hardware line (0-4, IP2-IP6) of core 0 */
+void device_irq(int line, int level)
 {
-	int32_t value = mem_read_32(address);
-	CURRENT_STATE.R[rt] = CURRENT_STATE.R[rs] + value; 
+	uint32_t bit = 1u << line;
+
+	if (!!(atomic_load_explicit(&DEVICE_IRQ, memory_order_relaxed) & bit) == !!level) {
+		return;
+	}
+	if (level) {
+		atomic_fetch_or_explicit(&DEVICE_IRQ, bit, memory_order_relaxed);
+	} else {
+		atomic_fetch_and_explicit(&DEVICE_IRQ, ~bit, memory_order_relaxed);
+	}
+	device_wake();
 }
-void addiu(int rs, int rt, uint32_t address)
+
+uint64_t device_time()
 {
-	uint32_t value = mem_read_32(address);
-	CURRENT_STATE.R[rt] = CURRENT_STATE.R[rs] + value;
+	return __atomic_load_n(&CORES[0].instruction_count, __ATOMIC_RELAXED);
 }
-void sub(int rs, int rt, int rd)
+
+static int event_before(const event_t *a, const event_t *b)
 {
-	CURRENT_STATE.R[rd] = CURRENT_STATE.R[rs] - CURRENT_STATE.R[rt];
+	return a->when < b->when || (a->when == b->when && a->seq < b->seq);
 }
-void subu(int rs, int rt, int rd)
+
+static void event_swap(int i, int j)
 {
-	unsigned int urs = (unsigned int)CURRENT_STATE.R[rs];
-	unsigned int urt = (unsigned int)CURRENT_STATE.R[rt];
-	unsigned int urd = (unsigned int)CURRENT_STATE.R[rd];
-	CURRENT_STATE.R[urd] = CURRENT_STATE.R[urs] - CURRENT_STATE.R[urt]; 
+	event_t t = EVENTS[i];
+
+	EVENTS[i] = EVENTS[j];
+	EVENTS[j] = t;
 }
-void mult(int rs, int rt, int rd)
+
+static void event_sift_up(int i)
 {
-	int value = CURRENT_STATE.R[rs] * CURRENT_STATE.R[rt];
-	CURRENT_STATE.HI = 32 >> value;
-	CURRENT_STATE.LO = 32 << value;
+	while (i > 0 && event_before(&EVENTS[i], &EVENTS[(i - 1) / 2])) {
+		event_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
 }
-void multu(int rs, int rt, int rd)
+
+static void event_sift_down(int i)
 {
-	unsigned int urt = (unsigned int)CURRENT_STATE.R[rt];
-	unsigned int urs = (unsigned int)CURRENT_STATE.R[rd];
-	int value = CURRENT_STATE.R[urs] * CURRENT_STATE.R[urt];
-	CURRENT_STATE.HI = 32 >> value;
-	CURRENT_STATE.LO = 32 << value;
+	int least, c;
+
+	while (1) {
+		least = i;
+		for (c = 2 * i + 1; c <= 2 * i + 2 && c < NUM_EVENTS; c++) {
+			if (event_before(&EVENTS[c], &EVENTS[least])) {
+				least = c;
+			}
+		}
+		if (least == i) {
+			return;
+		}
+		event_swap(i, least);
+		i = least;
+	}
 }
-void div1(int rs, int rt, int rd)
+
+/* run fn(arg) once core 0 has retired delay more instructions;
+ * called from device hooks and callbacks, or with the machine stopped */
+void event_schedule(uint64_t delay, event_fn fn, void *arg)
 {
-	CURRENT_STATE.HI = CURRENT_STATE.R[rs] % CURRENT_STATE.R[rt];
-	CURRENT_STATE.LO = CURRENT_STATE.R[rs] / CURRENT_STATE.R[rt];
+	event_t *e;
+
+	if (NUM_EVENTS == MAX_EVENTS) {
+		printf("Error: device event queue full\n");
+		return;
+	}
+	e = &EVENTS[NUM_EVENTS];
+	e->when = device_time() + delay;
+	e->seq = EVENT_SEQ++;
+	e->fn = fn;
+	e->arg = arg;
+	event_sift_up(NUM_EVENTS++);
+	device_wake();
 }
-void divu(int rs, int rt, int rd)
+
+/* drop every pending fn(arg) */
+void event_cancel(event_fn fn, void *arg)
 {
-	unsigned int urs = (unsigned int)CURRENT_STATE.R[rs];
-	unsigned int urt = (unsigned int)CURRENT_STATE.R[rt];
-	unsigned int urd = (unsigned int)CURRENT_STATE.R[rd];
-	CURRENT_STATE.HI = CURRENT_STATE.R[urs] % CURRENT_STATE.R[urt];
-	CURRENT_STATE.LO = CURRENT_STATE.R[urs] / CURRENT_STATE.R[urt];
+	int i = 0;
+
+	while (i < NUM_EVENTS) {
+		if (EVENTS[i].fn != fn || EVENTS[i].arg != arg) {
+			i++;
+			continue;
+		}
+		EVENTS[i] = EVENTS[--NUM_EVENTS];
+		if (i < NUM_EVENTS) {
+			event_sift_up(i);
+			event_sift_down(i);
+		}
+		/* whatever moved into slot i is looked at again */
+		i = 0;
+	}
 }
-void and(int rs, int rt, int rd)
+
+/* core 0, from service_events(): run what is due and copy the lines
+ * into Cause; returns when the next event is due */
+static uint64_t devices_service()
 {
-	CURRENT_STATE.R[rd] = CURRENT_STATE.R[rs] && CURRENT_STATE.R[rt];
+	uint64_t next;
+	uint32_t lines;
+	event_t e;
+	int line;
+
+	pthread_mutex_lock(&DEVICE_LOCK);
+	while (NUM_EVENTS && EVENTS[0].when <= INSTRUCTION_COUNT) {
+		e = EVENTS[0];
+		EVENTS[0] = EVENTS[--NUM_EVENTS];
+		event_sift_down(0);
+		e.fn(e.arg);
+		stat_add(STAT_DEVICE_EVENTS, 1);
+	}
+	next = NUM_EVENTS ? EVENTS[0].when : UINT64_MAX;
+	pthread_mutex_unlock(&DEVICE_LOCK);
+
+	lines = atomic_load_explicit(&DEVICE_IRQ, memory_order_relaxed);
+	for (line = 0; line < 5; line++) {
+		if (lines & (1u << line)) {
+			if (!(CURRENT_STATE.CP0[CP0_CAUSE] & (CAUSE_IP2 << line))) {
+				cp0_assert_irq(line);
+			}
+		} else {
+			cp0_clear_irq(line);
+		}
+	}
+	return next;
 }
-void andi(int rs, int rt, uint32_t address)
+
+/* UART
+   SPIM's memory-mapped console. Each control word has ready in bit
+   0 and interrupt enable in bit 1; the line is up while a ready
+   side has its interrupt enabled. A written character goes to a
+   host buffer and the transmitter is busy for UART_TX_DELAY
+   instructions. Characters from -u arrive every UART_RX_DELAY
+   instructions, each waiting until the last one was read. */
+enum { UART_RX_CTRL = 0x0, UART_RX_DATA = 0x4, UART_TX_CTRL = 0x8, UART_TX_DATA = 0xC };
+
+static struct {
+	device_t dev;
+	int rx_ready, rx_ie, tx_ready, tx_ie;
+	uint8_t rx_data;
+	FILE *in;
+	char out[UART_BUF];
+	int out_len;
+} UART;
+
+static void uart_flush()
 {
-	int32_t value = mem_read_32(address);
-	unsigned int urs = (unsigned int)CURRENT_STATE.R[rs];
-	unsigned int urt = (unsigned int)CURRENT_STATE.R[rt];
-	CURRENT_STATE.R[urt] = CURRENT_STATE.R[urs] && value;
+	fwrite(UART.out, 1, UART.out_len, stdout);
+	UART.out_len = 0;
 }
-void or(int rs, int rt, int rd)
+
+static void uart_update()
 {
-	CURRENT_STATE.R[rd] = CURRENT_STATE.R[rs] || CURRENT_STATE.R[rt];
+	device_irq(UART_IRQ, (UART.rx_ready && UART.rx_ie) || (UART.tx_ready && UART.tx_ie));
 }
-void ori(int rs, int rt, uint32_t address)
+
+static void uart_tx_done(void *arg)
 {
-	int32_t value = mem_read_32(address);
-	unsigned int urs = (unsigned int)CURRENT_STATE.R[rs];
-	unsigned int urt = (unsigned int)CURRENT_STATE.R[rt];
-	CURRENT_STATE.R[urt] = CURRENT_STATE.R[urs] || value;
+	UART.tx_ready = 1;
+	uart_update();
 }
-void xor(int rs, int rt, int rd)
-{
-	CURRENT_STATE.R[rd] = (CURRENT_STATE.R[rs] ^ CURRENT_STATE.R[rt]);
-}
-void xori(int rs, int rt, uint32_t address)
-{
-	int32_t value = mem_read_32(address);
-	unsigned int urs = (unsigned int)CURRENT_STATE.R[rs];
-	unsigned int urt = (unsigned int)CURRENT_STATE.R[rt];
-	CURRENT_STATE.R[urt] = (CURRENT_STATE.R[urs] ^ value);
-}
-void nor(int rs, int rt, int rd)
-{
-	CURRENT_STATE.R[rd] = ~(CURRENT_STATE.R[rs] | CURRENT_STATE.R[rt]);
-}
-void slt(int rs, int rt, int rd)
-{
-	CURRENT_STATE.R[rd] = (CURRENT_STATE.R[rs] < CURRENT_STATE.R[rt]);
-}
-void slti(int rs, int rt, uint32_t address)
+
+static void uart_rx(void *arg)
 {
-	int32_t value = mem_read_32(address);
-	unsigned int urs = (unsigned int)CURRENT_STATE.R[rs];
-	unsigned int urt = (unsigned int)CURRENT_STATE.R[rt];
-	CURRENT_STATE.R[urt] = (CURRENT_STATE.R[urs] < value);
+	int c;
+
+	if (!UART.rx_ready) {
+		if ((c = fgetc(UART.in)) == EOF) {
+			return;
+		}
+		UART.rx_data = c;
+		UART.rx_ready = 1;
+		uart_update();
+	}
+	event_schedule(UART_RX_DELAY, uart_rx, NULL);
 }
-void sll(int rs, int rt, int shamt)
+
+static uint32_t uart_read(device_t *dev, uint32_t off, int size)
 {
-	CURRENT_STATE.R[rt] = CURRENT_STATE.R[rs] << CURRENT_STATE.R[shamt];
+	switch (off & ~3) {
+		case UART_RX_CTRL:
+			return UART.rx_ready | (UART.rx_ie << 1);
+		case UART_RX_DATA:
+			UART.rx_ready = 0;
+			uart_update();
+			return UART.rx_data;
+		case UART_TX_CTRL:
+			return UART.tx_ready | (UART.tx_ie << 1);
+		default:
+			return 0;
+	}
 }
-void srl(int rs, int rt, int rd)
+
+static void uart_write(device_t *dev, uint32_t off, uint32_t value, int size)
 {
-	CURRENT_STATE.R[rd] = CURRENT_STATE.R[rs] << CURRENT_STATE.R[rt];
+	switch (off & ~3) {
+		case UART_RX_CTRL:
+			UART.rx_ie = (value >> 1) & 1;
+			break;
+		case UART_TX_CTRL:
+			UART.tx_ie = (value >> 1) & 1;
+			break;
+		case UART_TX_DATA:
+			UART.out[UART.out_len++] = (char)value;
+			if ((char)value == '\n' || UART.out_len == UART_BUF) {
+				uart_flush();
+			}
+			UART.tx_ready = 0;
+			event_cancel(uart_tx_done, NULL);
+			event_schedule(UART_TX_DELAY, uart_tx_done, NULL);
+			break;
+	}
+	uart_update();
 }
-void sra(int rs, int rt, int shamt)
+
+static void uart_reset(device_t *dev)
 {
-	CURRENT_STATE.R[rt] = CURRENT_STATE.R[rs] >> CURRENT_STATE.R[shamt];
+	uart_flush();
+	UART.rx_ready = UART.rx_ie = UART.tx_ie = 0;
+	UART.tx_ready = 1;
+	if (UART.in != NULL) {
+		fclose(UART.in);
+		UART.in = NULL;
+	}
+	if (uart_in_file[0]) {
+		UART.in = fopen(uart_in_file, "rb");
+		if (UART.in == NULL) {
+			printf("Error: Can't open UART input %s\n", uart_in_file);
+		} else {
+			event_schedule(UART_RX_DELAY, uart_rx, NULL);
+		}
+	}
 }
 
-/*****************************************************************/
-/* Load and store instructions - J
-*****************************************************************/
+/* Timer
+   CONTROL: bit 0 enable, bit 1 periodic, bit 2 interrupt enable.
+   PERIOD instructions after it is enabled (or PERIOD is written)
+   STATUS bit 0 sets, and the line rises while interrupts are
+   enabled; writing 1 to it clears it. A periodic timer reloads,
+   a one-shot disables itself. REMAINING counts down to expiry. */
+enum { TIMER_CONTROL = 0x0, TIMER_PERIOD = 0x4, TIMER_STATUS = 0x8, TIMER_REMAINING = 0xC };
+enum { TIMER_ENABLE = 1, TIMER_PERIODIC = 2, TIMER_IE = 4 };
+
+static struct {
+	device_t dev;
+	uint32_t control, period, expired;
+	uint64_t due;
+} TIMER;
 
-void lw(int rs, int rt, uint32_t address)
+static void timer_fire(void *arg)
 {
-	int32_t value = mem_read_32(address); 
-	unsigned short SignExtImmm = value & 0xFFFF;
-	CURRENT_STATE.R[rt] = CURRENT_STATE.R[rs] + SignExtImmm;
+	TIMER.expired = 1;
+	if ((TIMER.control & TIMER_PERIODIC) && TIMER.period) {
+		TIMER.due = device_time() + TIMER.period;
+		event_schedule(TIMER.period, timer_fire, NULL);
+	} else {
+		TIMER.control &= ~TIMER_ENABLE;
+	}
+	device_irq(TIMER_IRQ, TIMER.expired && (TIMER.control & TIMER_IE));
 }
 
-void lb(int rs, int rt, uint32_t address) 
+static void timer_start()
 {
-	 // R[rt] = {24'b0, MR[rs] + SignExtImm](7:0)}
-	 int32_t value = mem_read_32(address);
-	 unsigned short SignExtImmm = value & 0xFFFF;
-	 unsigned int urs = (unsigned int)CURRENT_STATE.R[rs];
-	 unsigned int urt = (unsigned int)CURRENT_STATE.R[rt];
-	 CURRENT_STATE.R[rt] = CURRENT_STATE.R[rs] + SignExtImmm;
-	 CURRENT_STATE.R[rt] >> 24; 
-	 
+	event_cancel(timer_fire, NULL);
+	if ((TIMER.control & TIMER_ENABLE) && TIMER.period) {
+		TIMER.due = device_time() + TIMER.period;
+		event_schedule(TIMER.period, timer_fire, NULL);
+	}
 }
 
-void lh(int rs, int rt, uint32_t address)
+static uint32_t timer_read(device_t *dev, uint32_t off, int size)
 {
-	//CURRENT_STATE.R[rt-1] = {16'b0, M[CURRENT_STATE.R[rs-1] + SignExtImm](15:0)}
-	int32_t value = mem_read_32(address);
-	unsigned short SignExtImmm = value & 0xFFFF;
-	//printf("This is %d\n", SignExtImmm);
-	CURRENT_STATE.R[rt] = CURRENT_STATE.R[rs] + SignExtImmm;
-	CURRENT_STATE.R[rt] >> 16;
+	uint64_t now = device_time();
+
+	switch (off & ~3) {
+		case TIMER_CONTROL:
+			return TIMER.control;
+		case TIMER_PERIOD:
+			return TIMER.period;
+		case TIMER_STATUS:
+			return TIMER.expired;
+		case TIMER_REMAINING:
+			return (TIMER.control & TIMER_ENABLE) && TIMER.due > now ? (uint32_t)(TIMER.due - now) : 0;
+		default:
+			return 0;
+	}
 }
 
-void lui(int rt, uint32_t address)
+static void timer_write(device_t *dev, uint32_t off, uint32_t value, int size)
 {
-	//CURRENT_STATE.R[rt-1] = {imm, 16'b0}
-	//$1 = 100x2^16
-	int32_t value = mem_read_32(address);
-	unsigned short SignExtImmm = value & 0xFFFF;
-	CURRENT_STATE.R[rt] = SignExtImmm >> 16; 
+	switch (off & ~3) {
+		case TIMER_CONTROL:
+			TIMER.control = value & (TIMER_ENABLE | TIMER_PERIODIC | TIMER_IE);
+			timer_start();
+			break;
+		case TIMER_PERIOD:
+			TIMER.period = value;
+			timer_start();
+			break;
+		case TIMER_STATUS:
+			if (value & 1) {
+				TIMER.expired = 0;
+			}
+			break;
+	}
+	device_irq(TIMER_IRQ, TIMER.expired && (TIMER.control & TIMER_IE));
 }
-void sw(int rs, int rt, uint32_t address)
+
+static void timer_reset(device_t *dev)
 {
-	int32_t value = mem_read_32(address);
-	unsigned short SignExtImmm = value & 0xFFFF;
-	CURRENT_STATE.R[rt] = CURRENT_STATE.R[rs] + SignExtImmm;
-	//M[CURRENT_STATE.R[rs-1] + SignExtImm] = CURRENT_STATE.R[rt-1]
+	TIMER.control = TIMER.period = TIMER.expired = 0;
+	TIMER.due = 0;
 }
-void sb(int rs, int rt, uint32_t address)
+
+/* DMA
+   Writing CONTROL with bit 0 set copies LEN bytes from SRC to DST
+   (physical addresses): busy (bit 0) for LEN / DMA_RATE
+   instructions, after which the bytes land at once and done (bit
+   2) sets. With bit 1 set the line rises on done; writing bit 2
+   acknowledges it. A start while busy is ignored. */
+enum { DMA_SRC = 0x0, DMA_DST = 0x4, DMA_LEN = 0x8, DMA_CONTROL = 0xC };
+enum { DMA_START = 1, DMA_IE = 2, DMA_DONE = 4 };
+
+static struct {
+	device_t dev;
+	uint32_t src, dst, len;
+	int busy, ie, done;
+} DMA;
+
+static void dma_done(void *arg)
 {
-	//M[CURRENT_STATE.R[rs-1]+SignExtImm](7:0) = CURRENT_STATE.R[rt-1](7:0)
-	int32_t value = mem_read_32(address);
-	unsigned short SignExtImmm = value & 0xFFFF;
-	CURRENT_STATE.R[rt] = CURRENT_STATE.R[rs] + SignExtImmm;
+	mem_copy(DMA.dst, DMA.src, DMA.len);
+	DMA.busy = 0;
+	DMA.done = 1;
+	device_irq(DMA_IRQ, DMA.done && DMA.ie);
 }
-void sh(int rs, int rt, uint32_t address)
+
+static uint32_t dma_read(device_t *dev, uint32_t off, int size)
 {
-	//M[CURRENT_STATE.R[rs-1]+SignExtImm](15:0) = CURRENT_STATE.R[rt-1](15:0)
-	int32_t value = mem_read_32(address);
-	unsigned short SignExtImmm = value & 0xFFFF;
-	CURRENT_STATE.R[rt] = CURRENT_STATE.R[rs] + SignExtImmm;
+	switch (off & ~3) {
+		case DMA_SRC:
+			return DMA.src;
+		case DMA_DST:
+			return DMA.dst;
+		case DMA_LEN:
+			return DMA.len;
+		default:
+			return DMA.busy | (DMA.ie << 1) | (DMA.done << 2);
+	}
 }
-void mfhi(int rd)
+
+static void dma_write(device_t *dev, uint32_t off, uint32_t value, int size)
 {
-	//CURRENT_STATE.R[rd-1] = Hi
-	CURRENT_STATE.R[rd] = CURRENT_STATE.HI;
+	switch (off & ~3) {
+		case DMA_SRC:
+			DMA.src = value;
+			break;
+		case DMA_DST:
+			DMA.dst = value;
+			break;
+		case DMA_LEN:
+			DMA.len = value;
+			break;
+		default:
+			DMA.ie = !!(value & DMA_IE);
+			if (value & DMA_DONE) {
+				DMA.done = 0;
+			}
+			if ((value & DMA_START) && !DMA.busy) {
+				DMA.busy = 1;
+				event_schedule(DMA.len / DMA_RATE + 1, dma_done, NULL);
+			}
+			break;
+	}
+	device_irq(DMA_IRQ, DMA.done && DMA.ie);
 }
-void mflo(int rd)
+
+static void dma_reset(device_t *dev)
 {
-	//CURRENT_STATE.R[rd] = Lo
-	
-	CURRENT_STATE.R[rd] = CURRENT_STATE.LO;
+	DMA.src = DMA.dst = DMA.len = 0;
+	DMA.busy = DMA.ie = DMA.done = 0;
 }
 
+/* Framebuffer
+   FB_WIDTH x FB_HEIGHT bytes of grey at FB_PIXELS, laid out like
+   guest memory. At FB_BASE: WIDTH and HEIGHT, read-only, and
+   FRAMES, the number of frames presented; writing it presents
+   one, written to -f as a PGM. */
+enum { FB_WIDTH_REG = 0x0, FB_HEIGHT_REG = 0x4, FB_FRAMES = 0x8 };
 
-/****************************************************************/
-/* Control Flow Instructions - J
-****************************************************************/
+static struct {
+	device_t ctrl, mem;
+	uint32_t frames;
+	uint8_t pixels[FB_WIDTH * FB_HEIGHT];
+} FB;
 
-void beq(int rs, int rt, uint32_t b_address)
+static void fb_present()
 {
-	if(CURRENT_STATE.R[rs] == CURRENT_STATE.R[rt])
-	{
-		CURRENT_STATE.PC = CURRENT_STATE.PC + 4 + b_address;
+	FILE *fp;
+
+	FB.frames++;
+	if (!fb_file[0]) {
+		return;
+	}
+	fp = fopen(fb_file, "wb");
+	if (fp == NULL) {
+		printf("Error: Can't create %s\n", fb_file);
+		return;
+	}
+	fprintf(fp, "P5\n%d %d\n255\n", FB_WIDTH, FB_HEIGHT);
+	fwrite(FB.pixels, 1, sizeof(FB.pixels), fp);
+	if (fclose(fp) != 0) {
+		printf("Error: writing %s failed\n", fb_file);
 	}
 }
-void bne(int rs, int rt, uint32_t b_address)
-{
-	if(CURRENT_STATE.R[rs] != CURRENT_STATE.R[rt])
-	{
-		CURRENT_STATE.PC = CURRENT_STATE.PC + 4 + b_address;
 
+static uint32_t fb_ctrl_read(device_t *dev, uint32_t off, int size)
+{
+	switch (off & ~3) {
+		case FB_WIDTH_REG:
+			return FB_WIDTH;
+		case FB_HEIGHT_REG:
+			return FB_HEIGHT;
+		case FB_FRAMES:
+			return FB.frames;
+		default:
+			return 0;
 	}
 }
-void blez(int rs, int rt, int label)
+
+static void fb_ctrl_write(device_t *dev, uint32_t off, uint32_t value, int size)
 {
-	//ble
-	if(CURRENT_STATE.R[rs] <= CURRENT_STATE.R[rt])
-	{
-		CURRENT_STATE.PC = label;
+	if ((off & ~3) == FB_FRAMES) {
+		fb_present();
 	}
 }
-void bltz(int rs, int rt, int label)
+
+static uint32_t fb_mem_read(device_t *dev, uint32_t off, int size)
 {
-	//blt
-	if(CURRENT_STATE.R[rs] < CURRENT_STATE.R[rt])
-	{
-		CURRENT_STATE.PC = label;
+	uint32_t v = 0;
+	uint16_t h = 0;
+
+	switch (size) {
+		case 1:
+			return FB.pixels[off];
+		case 2:
+			memcpy(&h, FB.pixels + off, 2);
+			return guest16(h);
+		default:
+			memcpy(&v, FB.pixels + off, 4);
+			return guest32(v);
 	}
 }
-void j(uint32_t j_address)
+
+static void fb_mem_write(device_t *dev, uint32_t off, uint32_t value, int size)
 {
-	CURRENT_STATE.PC = j_address; 
+	uint16_t h;
+
+	switch (size) {
+		case 1:
+			FB.pixels[off] = value;
+			break;
+		case 2:
+			h = guest16(value);
+			memcpy(FB.pixels + off, &h, 2);
+			break;
+		default:
+			value = guest32(value);
+			memcpy(FB.pixels + off, &value, 4);
+			break;
+	}
 }
-void jr(uint32_t j_address, int rs)
+
+static void fb_reset(device_t *dev)
 {
-	CURRENT_STATE.PC = CURRENT_STATE.R[rs];
+	if (dev == &FB.ctrl) {
+		FB.frames = 0;
+	} else {
+		memset(FB.pixels, 0, sizeof(FB.pixels));
+	}
 }
-void jal(uint32_t j_address)
+
+void devices_init()
 {
-	CURRENT_STATE.R[31] = CURRENT_STATE.PC + 8; CURRENT_STATE.PC = j_address;
+	UART.dev = (device_t){ "uart", UART_BASE, 16, uart_read, uart_write, uart_reset };
+	TIMER.dev = (device_t){ "timer", TIMER_BASE, 16, timer_read, timer_write, timer_reset };
+	DMA.dev = (device_t){ "dma", DMA_BASE, 16, dma_read, dma_write, dma_reset };
+	FB.ctrl = (device_t){ "framebuffer", FB_BASE, 16, fb_ctrl_read, fb_ctrl_write, fb_reset };
+	FB.mem = (device_t){ "framebuffer pixels", FB_PIXELS, FB_WIDTH * FB_HEIGHT, fb_mem_read, fb_mem_write, fb_reset };
+	device_register(&UART.dev);
+	device_register(&TIMER.dev);
+	device_register(&DMA.dev);
+	device_register(&FB.ctrl);
+	device_register(&FB.mem);
+	devices_reset();
 }
-void jalr(uint32_t j_address, int rs)
+
+/* back to power-on: no events, every line low */
+void devices_reset()
 {
-	CURRENT_STATE.R[31] = CURRENT_STATE.PC + 8; CURRENT_STATE.PC = CURRENT_STATE.R[rs];
-}
+	int i;
 
+	pthread_mutex_lock(&DEVICE_LOCK);
+	NUM_EVENTS = 0;
+	atomic_store_explicit(&DEVICE_IRQ, 0, memory_order_relaxed);
+	for (i = 0; i < NUM_DEVICES; i++) {
+		DEVICES[i]->reset(DEVICES[i]);
+	}
+	pthread_mutex_unlock(&DEVICE_LOCK);
+}
 
-/***************************************************************/
-/* System call
-***************************************************************/
-//SYSCALL
-void syscall()
+/* push out buffered device output, at the end of a run */
+void devices_flush()
 {
-	exit(0);
+	pthread_mutex_lock(&DEVICE_LOCK);
+	uart_flush();
+	pthread_mutex_unlock(&DEVICE_LOCK);
 }
 
-/**************************************************************/
-/* Register Selection
-**************************************************************/
-
-void fill_reg()
+void print_devices()
 {
-	int i = 0;
-	while(i < 32)
-	{
-		CURRENT_STATE.R[i] = 5;
-		i++;
+	uint64_t now = device_time();
+	int i;
+
+	printf("-------------------------------------\n");
+	printf("Devices (lines 0x%02x up)\n", atomic_load_explicit(&DEVICE_IRQ, memory_order_relaxed));
+	printf("-------------------------------------\n");
+	for (i = 0; i < NUM_DEVICES; i++) {
+		printf("0x%08x..0x%08x\t%s\n", DEVICES[i]->base,
+			DEVICES[i]->base + DEVICES[i]->size - 1, DEVICES[i]->name);
 	}
+	printf("%d event(s) pending", NUM_EVENTS);
+	if (NUM_EVENTS) {
+		printf(", next in %" PRIu64 " instructions", EVENTS[0].when > now ? EVENTS[0].when - now : 0);
+	}
+	printf("\n-------------------------------------\n");
 }
 
-/***********************************************************/
-/* bit allocation for instruction set
-***********************************************************/
-
-// one is needed for J / I
+/***************************************************************/
+/* Execute one cycle                                                                                                              */
+/***************************************************************/
+void cycle() {                                                
+	handle_instruction();
+	//CURRENT_STATE = NEXT_STATE;
+	INSTRUCTION_COUNT++;
+	stat_add(STAT_INSTRUCTIONS, 1);
+}
 
-/***********************************************************/
-/* set the temp registers with the 
-***********************************************************/
+/***************************************************************/
+/* Execute one block: straight-line instructions up to the first */
+/* control transfer (or BLOCK_MAX of them), then look at pending  */
+/* events once                                                    */
+/***************************************************************/
+void run_block() {
+	uint32_t pc;
+	int n = 0;
 
-	/*IMPLEMENT THIS*/
-	/* execute one instruction at a time. Use/update CURRENT_STATE and and NEXT_STATE, as necessary.*/
+	if (AOT_ACTIVE && aot_enter()) {
+		if (INSTRUCTION_COUNT >= EVENT_DEADLINE) {
+			service_events();
+		}
+		return;
+	}
+	do {
+		pc = CURRENT_STATE.PC;
+		cycle();
+	} while (CURRENT_STATE.PC == pc + 4 && ++n < BLOCK_MAX &&
+			INSTRUCTION_COUNT < INSTRUCTION_LIMIT && RUN_FLAG);
 
-void parseInstruction(uint32_t addr) 
-{
-	int opCode = mem_read_32(addr) >> 26;
-	int data = mem_read_32(addr); 
-	//R-type format
-	if (opCode == 0)
-	{	
-		//shift and bit mask to get register values
+	if (INSTRUCTION_COUNT >= EVENT_DEADLINE) {
+		service_events();
+	}
+}
 
-		int rs = (data >> 21) & 0x1f;
-		int rt = (data >> 16) & 0x1f;
-		int rd = (data >> 11) & 0x1f;
-		int sa = (data >> 6) & 0x1f;
-		int func = data & 0x3f;
-		// int func = opCode << 26;
-		// func = func >> 26;
+/***************************************************************/
+/* Make core id the one the calling thread executes              */
+/***************************************************************/
+void select_core(int id) {
+	if (CORE != NULL) {
+		fpu_sync_out();
+	}
+	CORE = &CORES[id];
+	STATS = CORE->stats;
+	fpu_sync_in();
+}
 
-		if (func == ADD)
-		{
-			add(rs,rt,rd);
+int machine_running() {
+	int i;
+	for (i = 0; i < NUM_CORES; i++) {
+		if (CORES[i].run_flag) {
+			return TRUE;
 		}
-		else if (func == ADDU)
-		{
-			addu(rs,rt,rd);
+	}
+	return FALSE;
+}
 
-		}
-		
-		else if (func == SUB)
-		{
-			sub(rs,rt,rd);
+/***************************************************************/
+/* Stop the selected core; the first reason given sticks        */
+/***************************************************************/
+void machine_stop(int reason) {
+	if (RUN_FLAG) {
+		STOP_REASON = reason;
+	}
+	RUN_FLAG = FALSE;
+}
 
-		}
-		else if (func == SUBU)
-		{
-			subu(rs,rt,rd);
+/* run the selected core until it stops or reaches INSTRUCTION_LIMIT */
+static void core_run() {
+	PROF_CORE = CORE;
+	while (RUN_FLAG && INSTRUCTION_COUNT < INSTRUCTION_LIMIT) {
+		run_block();
+	}
+	PROF_CORE = NULL;
+	if (MAX_INSTRUCTIONS && INSTRUCTION_COUNT >= MAX_INSTRUCTIONS) {
+		machine_stop(STOP_INSTRUCTIONS);
+	}
+}
 
-		}
-		else if (func == MULT)
-		{
-			mult(rs,rt,rd);
+static void *core_thread(void *arg) {
+	select_core((int)(intptr_t)arg);
+	core_run();
+	fpu_sync_out();
+	return NULL;
+}
 
-		}
-		else if (func == MULTU)
-		{
-			multu(rs,rt,rd);
+/***************************************************************/
+/* Let every core retire up to budget more instructions.         */
+/* Round-robin mode interleaves them deterministically in slices */
+/* of SCHED_QUANTUM on this thread; parallel mode gives each core*/
+/* its own host thread.                                          */
+/***************************************************************/
+void machine_run(uint64_t budget) {
+	uint64_t stop[MAX_CORES];
+	pthread_t tids[MAX_CORES];
+	uint64_t start = monotonic_ns();
+	int i, active;
 
+	WALL_DEADLINE = start + MAX_NS - RUN_NS;
+	for (i = 0; i < NUM_CORES; i++) {
+		stop[i] = (budget > UINT64_MAX - CORES[i].instruction_count) ?
+			UINT64_MAX : CORES[i].instruction_count + budget;
+		if (MAX_INSTRUCTIONS && stop[i] > MAX_INSTRUCTIONS) {
+			stop[i] = MAX_INSTRUCTIONS;
 		}
-		else if (func == DIV)
-		{
-			div1(rs,rt,rd);
+		/* look at the other limits on the first block boundary */
+		CORES[i].watchdog_deadline = 0;
+		CORES[i].event_deadline = 0;
+	}
 
+	if (NUM_CORES == 1) {
+		select_core(0);
+		INSTRUCTION_LIMIT = stop[0];
+		core_run();
+	} else if (SCHED_MODE == SCHED_PARALLEL) {
+		for (i = 0; i < NUM_CORES; i++) {
+			CORES[i].instruction_limit = stop[i];
+			if (pthread_create(&tids[i], NULL, core_thread, (void *)(intptr_t)i) != 0) {
+				printf("Error: Can't start thread for core %d\n", i);
+				tids[i] = 0;
+			}
 		}
-		else if (func == DIVU)
-		{
-			divu(rs,rt,rd);
-
+		for (i = 0; i < NUM_CORES; i++) {
+			if (tids[i]) {
+				pthread_join(tids[i], NULL);
+			}
 		}
-		else if (func == AND)
-		{
-			and(rs,rt,rd);
+	} else {
+		do {
+			active = 0;
+			for (i = 0; i < NUM_CORES; i++) {
+				select_core(i);
+				if (!RUN_FLAG || INSTRUCTION_COUNT >= stop[i]) {
+					continue;
+				}
+				INSTRUCTION_LIMIT = (stop[i] - INSTRUCTION_COUNT > SCHED_QUANTUM) ?
+					INSTRUCTION_COUNT + SCHED_QUANTUM : stop[i];
+				core_run();
+				active = 1;
+			}
+		} while (active);
+	}
+	RUN_NS += monotonic_ns() - start;
+	devices_flush();
+	if (prof_file[0]) {
+		prof_report();
+	}
+	cov_save();
+	select_core(SELECTED_CORE);
+}
 
-		}
-		else if (func == OR)
-		{
-			or(rs,rt,rd);
+/***************************************************************/
+/* Say why each stopped core stopped                             */
+/***************************************************************/
+void print_stop_reasons() {
+	static const char *text[STOP_NUM] = {
+#define X(id, t) t,
+		STOP_REASONS(X)
+#undef X
+	};
+	int i;
 
+	for (i = 0; i < NUM_CORES; i++) {
+		if (CORES[i].run_flag) {
+			continue;
 		}
-		else if (func == NOR)
-		{
-			nor(rs,rt,rd);
+		if (NUM_CORES > 1) {
+			printf("Core %d: ", i);
 		}
-		else if (func == SLT)
-		{
-			slt(rs,rt,rd);
+		printf("%s after %" PRIu64 " instructions (%u pages written, %" PRIu64 ".%03" PRIu64 " s)\n",
+			text[CORES[i].stop_reason], CORES[i].instruction_count,
+			(unsigned)PAGES_WRITTEN, RUN_NS / 1000000000, RUN_NS / 1000000 % 1000);
+	}
+}
 
-		}
-		else if (func == SLL)
-		{
-			sll(rs,rt,sa);
+/***************************************************************/
+/* Simulate MIPS for n cycles                                                                                       */
+/***************************************************************/
+void run(int num_cycles) {                                      
+	
+	if (num_cycles <= 0) {
+		return;
+	}
+	if (!machine_running()) {
+		printf("Simulation Stopped\n\n");
+		return;
+	}
 
-		}
-		else if (func == SRL)
-		{
-			srl(rs,rt,rd);
+	printf("Running simulator for %d cycles...\n\n", num_cycles);
+	machine_run(num_cycles);
+	if (!machine_running()) {
+		print_stop_reasons();
+		printf("Simulation Stopped.\n\n");
+	}
+}
 
-		}
-		else if (func == SRA)
-		{
-			sra(rs,rt,sa);
+/***************************************************************/
+/* simulate to completion                                                                                               */
+/***************************************************************/
+void runAll() {                                                     
+	if (!machine_running()) {
+		printf("Simulation Stopped.\n\n");
+		return;
+	}
+
+	printf("Simulation Started...\n\n");
+	machine_run(UINT64_MAX);
+	print_stop_reasons();
+	if (ENERGY_ENABLED) {
+		print_energy();
+	}
+#ifdef MEM_TRACE
+	trace_report();
+#endif
+	printf("Simulation Finished.\n\n");
+}
+
+/***************************************************************/ 
+/* Dump a word-aligned region of memory to the terminal                              */
+/***************************************************************/
+void mdump(uint32_t start, uint32_t stop) {          
+	uint32_t address, words, n, k, word;
+	uint8_t buf[MDUMP_CHUNK];
 
+	printf("-------------------------------------------------------------\n");
+	printf("Memory content [0x%08x..0x%08x] :\n", start, stop);
+	printf("-------------------------------------------------------------\n");
+	printf("\t[Address in Hex (Dec) ]\t[Value]\n");
+	words = (stop >= start) ? (stop - start) / 4 + 1 : 0;
+	address = start;
+	while (words > 0) {
+		n = (words < MDUMP_CHUNK / 4) ? words : MDUMP_CHUNK / 4;
+		mem_read_block(address, buf, n * 4);
+		for (k = 0; k < n; k++, address += 4) {
+			memcpy(&word, buf + 4 * k, 4);
+			printf("\t0x%08x (%d) :\t0x%08x\n", address, address, guest32(word));
 		}
-		
+		words -= n;
+	}
+	printf("\n");
+}
+
+/***************************************************************/
+/* Dump current values of registers to the teminal                                              */   
+/***************************************************************/
+void rdump() {                               
+	int i; 
+	printf("-------------------------------------\n");
+	printf("Dumping Register Content\n");
+	printf("-------------------------------------\n");
+	if (NUM_CORES > 1) {
+		printf("Core\t: %d of %d\n", CORE->id, NUM_CORES);
+	}
+	printf("# Instructions Executed\t: %" PRIu64 "\n", INSTRUCTION_COUNT);
+	printf("PC\t: 0x%08x\n", CURRENT_STATE.PC);
+	printf("-------------------------------------\n");
+	printf("[Register]\t[Value]\n");
+	printf("-------------------------------------\n");
+	for (i = 0; i < MIPS_REGS; i++){
+		printf("[R%d]\t: 0x%08x\n", i, CURRENT_STATE.R[i]);
 	}
+	printf("-------------------------------------\n");
+	printf("[HI]\t: 0x%08x\n", CURRENT_STATE.HI);
+	printf("[LO]\t: 0x%08x\n", CURRENT_STATE.LO);
+	printf("-------------------------------------\n");
+	printf("[Status]\t: 0x%08x\n", CURRENT_STATE.CP0[CP0_STATUS]);
+	printf("[Cause]\t: 0x%08x\n", CURRENT_STATE.CP0[CP0_CAUSE]);
+	printf("[EPC]\t: 0x%08x\n", CURRENT_STATE.CP0[CP0_EPC]);
+	printf("[BadVAddr]\t: 0x%08x\n", CURRENT_STATE.CP0[CP0_BADVADDR]);
+	printf("[Count]\t: 0x%08x\n", cp0_count());
+	printf("[Compare]\t: 0x%08x\n", CURRENT_STATE.CP0[CP0_COMPARE]);
+	printf("-------------------------------------\n");
+	printf("[FCSR]\t: 0x%08x\n", CURRENT_STATE.FCSR);
+	for (i = 0; i < 32; i += 2) {
+		uint64_t pair = CURRENT_STATE.FPR[i] | ((uint64_t)CURRENT_STATE.FPR[i + 1] << 32);
+		float s0, s1;
+		double d;
 
-	//I format
-	else {
-			int rs = (data >> 21) & 0x1f;
-			int rt = (data >> 16) & 0x1f;
-			uint32_t immediate = data & 0xFFFF;
+		memcpy(&s0, &CURRENT_STATE.FPR[i], sizeof(s0));
+		memcpy(&s1, &CURRENT_STATE.FPR[i + 1], sizeof(s1));
+		memcpy(&d, &pair, sizeof(d));
+		printf("[F%d]\t: 0x%08x  %-14g [F%d]\t: 0x%08x  %-14g (double %g)\n",
+			i, CURRENT_STATE.FPR[i], s0, i + 1, CURRENT_STATE.FPR[i + 1], s1, d);
+	}
+	printf("-------------------------------------\n");
+}
 
-			if (opCode == ADDI)
-			{	
-			addi(rs,rt,immediate);
+/***************************************************************/
+/* Statistics
+   Every core owns one slot and whichever host thread runs the core
+   is its only writer, so counters are bumped with plain relaxed
+   load/store pairs (no locked instructions) and any other thread
+   may read them at any time.
+***************************************************************/
+stat_slot_t STAT_SLOTS[MAX_STAT_THREADS];
+atomic_int STAT_NSLOTS;
+_Thread_local stat_slot_t *STATS;
 
-			}
-			else if (opCode == ANDI)
-			{
-			andi(rs,rt,immediate);
+static const char *STAT_NAMES[STAT_NUM] = {
+#define X(id, name, help) name,
+	STAT_COUNTERS(X)
+#undef X
+};
 
-			}
-			else if (opCode == ORI)
-			{
-			ori(rs,rt,immediate);
+static const char *STAT_HELP[STAT_NUM] = {
+#define X(id, name, help) help,
+	STAT_COUNTERS(X)
+#undef X
+};
 
-			}
-			else if (opCode == XORI)
-			{
-			xori(rs,rt,immediate);
+/* hand out a fresh statistics slot (one per core) */
+stat_slot_t *stats_attach()
+{
+	int idx = atomic_fetch_add(&STAT_NSLOTS, 1);
 
-			}
-			else if (opCode == ADDIU)
-			{
-			
-			addiu(rs,rt,immediate);
+	if (idx >= MAX_STAT_THREADS) {
+		/* out of slots: share the last one, counts become approximate */
+		idx = MAX_STAT_THREADS - 1;
+		atomic_store(&STAT_NSLOTS, MAX_STAT_THREADS);
+	}
+	return &STAT_SLOTS[idx];
+}
 
-			}
-			else if (opCode == SLTI)
-			{
-			slti(rs,rt,immediate);
+/* sum of one counter over every thread */
+uint64_t stat_total(int which)
+{
+	int i, n = atomic_load(&STAT_NSLOTS);
+	uint64_t sum = 0;
 
-			}
-			else if (opCode == LW)
-			{
-				lw(rs,rt,immediate);
-			}
-			else if (opCode == LB)
-			{
-				lb(rs,rt,immediate);
-			}
-			else if (opCode == LH)
-			{
-				lh(rs,rt,immediate);
-			}
-			else if (opCode == SW)
-			{
-				sw(rs,rt,immediate);
-			}
-			else if (opCode == SB)
-			{
-				sb(rs,rt,immediate);
-			}
-			else if (opCode == SH)
-			{
-				sh(rs,rt,immediate);
-			}
-			else if (opCode == MFHI)
-			{
-			//	mfhi(rd,HI);
-			}
-			else if (opCode == MFLO)
-			{
-			//	mflo(rd);
-			}
-			else if (opCode == MTHI)
-			{
-			//	mthi(rs,rt,immediate);
-			}
-			else if (opCode == MTLO)
-			{
-			//	mtlo(rs,rt,immediate);
-			}
-		}
+	for (i = 0; i < n; i++) {
+		sum += atomic_load_explicit(&STAT_SLOTS[i].c[which], memory_order_relaxed);
+	}
+	return sum;
 }
-/************************************************************/
-/* decode and execute instruction                                                                     */ 
-/************************************************************/
-void handle_instruction()
+
+uint64_t monotonic_ns()
 {
-	//int i;
-	uint32_t addr = CURRENT_STATE.PC;
-	//printf("%0x",addr);
-	parseInstruction(addr);
-	CURRENT_STATE.PC = CURRENT_STATE.PC + 0x04;
-	//NEXT_STATE.PC = CURRENT_STATE.PC;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
-/************************************************************/
-/* Initialize Memory                                                                                                    */ 
-/************************************************************/
-void initialize() { 
-	init_memory();
-	CURRENT_STATE.PC = MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
-	RUN_FLAG = TRUE;
+
+/* for the telemetry thread, whose FPU flags no core sees */
+double monotonic_seconds()
+{
+	return monotonic_ns() * 1e-9;
+}
+
+/***************************************************************/
+/* Print the counters of every thread to the terminal           */
+/***************************************************************/
+void print_stats()
+{
+	int i, k, n = atomic_load(&STAT_NSLOTS);
+
+	if (!FEATURE_STATS) {
+		printf("Statistics are compiled out of this build (FEATURE_STATS=0)\n");
+		return;
+	}
+
+	printf("-------------------------------------\n");
+	printf("Execution Statistics\n");
+	printf("-------------------------------------\n");
+	for (k = 0; k < STAT_NUM; k++) {
+		printf("%-14s: %" PRIu64, STAT_NAMES[k], stat_total(k));
+		if (n > 1) {
+			for (i = 0; i < n; i++) {
+				printf("%s%" PRIu64, i ? "/" : "  (", atomic_load_explicit(&STAT_SLOTS[i].c[k], memory_order_relaxed));
+			}
+			printf(")");
+		}
+		printf("\n");
+	}
+	printf("-------------------------------------\n");
+}
+
+/***************************************************************/
+/* Render every counter in Prometheus text exposition format   */
+/***************************************************************/
+static size_t stats_prometheus(char *buf, size_t len, double uptime)
+{
+	int i, k, n = atomic_load(&STAT_NSLOTS);
+	size_t used = 0;
+
+#define EMIT(...) do { \
+		int w = snprintf(buf + used, len - used, __VA_ARGS__); \
+		if (w < 0 || (size_t)w >= len - used) return used; \
+		used += w; \
+	} while (0)
+
+	EMIT("# HELP mumips_uptime_seconds Seconds since the simulator started.\n");
+	EMIT("# TYPE mumips_uptime_seconds gauge\n");
+	EMIT("mumips_uptime_seconds %.3f\n", uptime);
+	for (k = 0; k < STAT_NUM; k++) {
+		EMIT("# HELP mumips_%s_total %s\n", STAT_NAMES[k], STAT_HELP[k]);
+		EMIT("# TYPE mumips_%s_total counter\n", STAT_NAMES[k]);
+		for (i = 0; i < n; i++) {
+			EMIT("mumips_%s_total{core=\"%d\"} %" PRIu64 "\n", STAT_NAMES[k], i,
+				atomic_load_explicit(&STAT_SLOTS[i].c[k], memory_order_relaxed));
+		}
+	}
+#undef EMIT
+	return used;
+}
+
+/***************************************************************/
+/* Telemetry sampler thread: prints throughput every interval   */
+/* seconds and/or answers each connection on a Unix socket with */
+/* the current counters                                          */
+/***************************************************************/
+static double TELEMETRY_INTERVAL;
+static char TELEMETRY_SOCKET[108];
+
+static void *telemetry_main(void *arg)
+{
+	int lfd = -1, cfd, timeout;
+	struct sockaddr_un sa;
+	struct pollfd pfd;
+	double start, last_t, now;
+	uint64_t last_n, cur;
+	char *page;
+	size_t len;
+
+	(void)arg;
+	page = malloc(TELEMETRY_PAGE);
+	if (page == NULL) {
+		return NULL;
+	}
+	if (TELEMETRY_SOCKET[0]) {
+		lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", TELEMETRY_SOCKET);
+		unlink(TELEMETRY_SOCKET);
+		if (lfd < 0 || bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(lfd, 8) < 0) {
+			fprintf(stderr, "Error: Can't listen on telemetry socket %s\n", TELEMETRY_SOCKET);
+			if (lfd >= 0) {
+				close(lfd);
+			}
+			lfd = -1;
+		}
+	}
+
+	start = last_t = monotonic_seconds();
+	last_n = stat_total(STAT_INSTRUCTIONS);
+	timeout = TELEMETRY_INTERVAL > 0 ? (int)(TELEMETRY_INTERVAL * 1000) : -1;
+	if (lfd < 0 && timeout < 0) {
+		free(page);
+		return NULL;
+	}
+	pfd.fd = lfd;
+	pfd.events = POLLIN;
+
+	while (1) {
+		if (poll(&pfd, lfd >= 0 ? 1 : 0, timeout) > 0 && (pfd.revents & POLLIN)) {
+			cfd = accept(lfd, NULL, NULL);
+			if (cfd >= 0) {
+				len = stats_prometheus(page, TELEMETRY_PAGE, monotonic_seconds() - start);
+				if (write(cfd, page, len) < 0) {
+					/* the scraper went away, nothing to do */
+				}
+				close(cfd);
+			}
+			continue;
+		}
+		if (timeout < 0) {
+			continue;
+		}
+		now = monotonic_seconds();
+		if (now - last_t < TELEMETRY_INTERVAL) {
+			continue;
+		}
+		cur = stat_total(STAT_INSTRUCTIONS);
+		if (cur != last_n) {
+			fprintf(stderr, "[stats] %.2f MIPS, %" PRIu64 " instructions, %" PRIu64 " loads, %" PRIu64 " stores, %" PRIu64 " branches\n",
+				(cur - last_n) / (now - last_t) / 1e6, cur, stat_total(STAT_LOADS),
+				stat_total(STAT_STORES), stat_total(STAT_BRANCHES));
+		}
+		last_n = cur;
+		last_t = now;
+	}
+	return NULL;
+}
+
+static void telemetry_cleanup()
+{
+	unlink(TELEMETRY_SOCKET);
+}
+
+/* start the sampler; interval <= 0 disables the periodic report, a NULL socket disables the endpoint */
+void telemetry_start(double interval, const char *socket_path)
+{
+	pthread_t tid;
+
+	if (!FEATURE_STATS && (interval > 0 || socket_path != NULL)) {
+		printf("Error: telemetry needs statistics, compiled out of this build\n");
+		return;
+	}
+	TELEMETRY_INTERVAL = interval;
+	if (socket_path != NULL) {
+		strncpy(TELEMETRY_SOCKET, socket_path, sizeof(TELEMETRY_SOCKET) - 1);
+		atexit(telemetry_cleanup);
+	}
+	if (interval <= 0 && socket_path == NULL) {
+		return;
+	}
+	if (pthread_create(&tid, NULL, telemetry_main, NULL) != 0) {
+		printf("Error: Can't start telemetry thread\n");
+		return;
+	}
+	pthread_detach(tid);
+}
+
+/***************************************************************/
+/* Command line
+   Commands are read a whole line at a time, split into words and
+   looked up in COMMANDS: a word selects the first command, in table
+   order, that it is a prefix of, so the old one-letter forms (s, r,
+   rd, re, m, ...) keep working. `source` pushes a script onto the
+   input stack; lines from scripts print no prompt and are not kept
+   in the history. '#' starts a comment.
+***************************************************************/
+typedef struct {
+	const char *name;
+	int nargs;			/* arguments required */
+	void (*fn)(char **argv);
+	const char *usage;
+} command_t;
+
+static FILE *INPUT_STACK[SOURCE_DEPTH];
+static int INPUT_DEPTH;			/* 0 = standard input */
+static char *HISTORY[HISTORY_SIZE];
+static int HISTORY_COUNT;		/* lines ever entered; the last HISTORY_SIZE are kept */
+
+static void cmd_sim(char **argv)     { runAll(); }
+static void cmd_stats(char **argv)   { print_stats(); }
+static void cmd_rdump(char **argv)   { rdump(); }
+static void cmd_reset(char **argv)   { reset(); }
+static void cmd_tlb(char **argv)     { print_tlb(); }
+static void cmd_devices(char **argv) { print_devices(); }
+static void cmd_print(char **argv)   { print_program(); }
+static void cmd_help(char **argv)    { help(); }
+
+static void cmd_run(char **argv)
+{
+	char *end;
+	long n = strtol(argv[1], &end, 0);
+
+	if (end == argv[1] || *end != '\0' || n <= 0 || n > INT32_MAX) {
+		printf("Usage: run <n>, n a positive number of cycles\n");
+		return;
+	}
+	run(n);
+}
+
+static void cmd_mdump(char **argv)
+{
+	mdump(strtoul(argv[1], NULL, 16), strtoul(argv[2], NULL, 16));
+}
+
+static void cmd_input(char **argv)
+{
+	uint32_t reg = strtoul(argv[1], NULL, 10);
+
+	if (reg >= MIPS_REGS) {
+		printf("Register must be 0..%d\n", MIPS_REGS - 1);
+		return;
+	}
+	CURRENT_STATE.R[reg] = strtoul(argv[2], NULL, 0);
+	NEXT_STATE.R[reg] = CURRENT_STATE.R[reg];
+}
+
+static void cmd_high(char **argv)
+{
+	CURRENT_STATE.HI = strtoul(argv[1], NULL, 0);
+	NEXT_STATE.HI = CURRENT_STATE.HI;
+}
+
+static void cmd_low(char **argv)
+{
+	CURRENT_STATE.LO = strtoul(argv[1], NULL, 0);
+	NEXT_STATE.LO = CURRENT_STATE.LO;
+}
+
+static void cmd_core(char **argv)
+{
+	char *end;
+	long id = strtol(argv[1], &end, 0);
+
+	if (*end != '\0' || id < 0 || id >= NUM_CORES) {
+		printf("Core must be 0..%d\n", NUM_CORES - 1);
+		return;
+	}
+	SELECTED_CORE = id;
+	select_core(SELECTED_CORE);
+}
+
+static void cmd_source(char **argv)
+{
+	FILE *fp;
+
+	if (INPUT_DEPTH + 1 >= SOURCE_DEPTH) {
+		printf("Error: scripts nested more than %d deep\n", SOURCE_DEPTH - 1);
+		return;
+	}
+	fp = fopen(argv[1], "r");
+	if (fp == NULL) {
+		printf("Error: Can't open script %s\n", argv[1]);
+		return;
+	}
+	INPUT_STACK[++INPUT_DEPTH] = fp;
+}
+
+static void cmd_history(char **argv)
+{
+	int i = (HISTORY_COUNT > HISTORY_SIZE) ? HISTORY_COUNT - HISTORY_SIZE : 0;
+
+	for (; i < HISTORY_COUNT; i++) {
+		printf("%5d  %s\n", i + 1, HISTORY[i % HISTORY_SIZE]);
+	}
+}
+
+static void cmd_cfg(char **argv)
+{
+	FILE *out = stdout;
+
+	if (argv[1] == NULL) {
+		printf("%d blocks, %d functions, %d loops in %u words at 0x%08x\n",
+			CFG.nblocks, CFG.nfuncs, CFG.nloops, CFG.words, CFG.base);
+		return;
+	}
+	if (argv[2] == NULL || (strcasecmp(argv[1], "dot") != 0 && strcasecmp(argv[1], "json") != 0)) {
+		printf("Usage: cfg [dot|json <file>]\n");
+		return;
+	}
+	if (strcmp(argv[2], "-") != 0 && (out = fopen(argv[2], "w")) == NULL) {
+		printf("Error: Can't write %s\n", argv[2]);
+		return;
+	}
+	if (strcasecmp(argv[1], "dot") == 0) {
+		cfg_write_dot(out);
+	} else {
+		cfg_write_json(out);
+	}
+	if (out != stdout) {
+		fclose(out);
+	}
+}
+
+static void cmd_coverage(char **argv)
+{
+	print_coverage(argv[1]);
+}
+
+static void cmd_timing(char **argv)
+{
+	print_timing();
+}
+
+static void cmd_energy(char **argv)
+{
+	print_energy();
+}
+
+static void cmd_quit(char **argv)
+{
+	printf("**************************\n");
+	printf("Exiting MU-MIPS! Good Bye...\n");
+	printf("**************************\n");
+	exit(0);
+}
+
+static const command_t COMMANDS[] = {
+	{ "sim",     0, cmd_sim,     "sim" },
+	{ "stats",   0, cmd_stats,   "stats" },
+	{ "source",  1, cmd_source,  "source <file>" },
+	{ "run",     1, cmd_run,     "run <n>" },
+	{ "rdump",   0, cmd_rdump,   "rdump" },
+	{ "reset",   0, cmd_reset,   "reset" },
+	{ "mdump",   2, cmd_mdump,   "mdump <start> <stop>" },
+	{ "input",   2, cmd_input,   "input <reg> <val>" },
+	{ "high",    1, cmd_high,    "high <val>" },
+	{ "history", 0, cmd_history, "history" },
+	{ "low",     1, cmd_low,     "low <val>" },
+	{ "print",   0, cmd_print,   "print" },
+	{ "core",    1, cmd_core,    "core <n>" },
+	{ "cfg",     0, cmd_cfg,     "cfg [dot|json <file>]" },
+	{ "coverage", 0, cmd_coverage, "coverage [<file>]" },
+	{ "timing",  0, cmd_timing,  "timing" },
+	{ "energy",  0, cmd_energy,  "energy" },
+	{ "tlb",     0, cmd_tlb,     "tlb" },
+	{ "devices", 0, cmd_devices, "devices" },
+	{ "quit",    0, cmd_quit,    "quit" },
+	{ "?",       0, cmd_help,    "?" },
+	{ "help",    0, cmd_help,    "help" },
+};
+
+static void history_add(const char *line)
+{
+	char **slot = &HISTORY[HISTORY_COUNT % HISTORY_SIZE];
+
+	free(*slot);
+	*slot = strdup(line);
+	HISTORY_COUNT++;
+}
+
+/* "!!" and "!n" stand for an earlier line; NULL if there is none */
+static const char *history_expand(const char *line)
+{
+	long n;
+
+	if (line[0] != '!') {
+		return line;
+	}
+	n = (line[1] == '!') ? HISTORY_COUNT : strtol(line + 1, NULL, 10);
+	if (n < 1 || n > HISTORY_COUNT || n <= HISTORY_COUNT - HISTORY_SIZE) {
+		printf("No such history entry: %s\n", line);
+		return NULL;
+	}
+	printf("%s\n", HISTORY[(n - 1) % HISTORY_SIZE]);
+	return HISTORY[(n - 1) % HISTORY_SIZE];
+}
+
+/***************************************************************/
+/* Split line into words and run the command they name          */
+/***************************************************************/
+void execute_command(const char *line)
+{
+	char copy[COMMAND_LINE_MAX], *argv[COMMAND_ARGS_MAX + 1], *p;
+	size_t i, len;
+	int argc = 0;
+	fexcept_t flags;
+
+	snprintf(copy, sizeof(copy), "%s", line);
+	if ((p = strchr(copy, '#')) != NULL) {
+		*p = '\0';
+	}
+	for (p = strtok(copy, " \t\r\n"); p != NULL && argc < COMMAND_ARGS_MAX; p = strtok(NULL, " \t\r\n")) {
+		argv[argc++] = p;
+	}
+	if (argc == 0) {
+		return;
+	}
+	argv[argc] = NULL;
+
+	len = strlen(argv[0]);
+	for (i = 0; i < sizeof(COMMANDS) / sizeof(COMMANDS[0]); i++) {
+		if (strncasecmp(argv[0], COMMANDS[i].name, len) == 0) {
+			if (argc - 1 < COMMANDS[i].nargs) {
+				printf("Usage: %s\n", COMMANDS[i].usage);
+				return;
+			}
+			/* reports do host floating point; keep its flags off the selected core */
+			fegetexceptflag(&flags, FE_ALL_EXCEPT);
+			COMMANDS[i].fn(argv);
+			fesetexceptflag(&flags, FE_ALL_EXCEPT);
+			return;
+		}
+	}
+	printf("Invalid Command.\n");
+}
+
+/***************************************************************/
+/* Read one line from the current input and execute it          */
+/***************************************************************/
+void handle_command() {                         
+	static char *buffer;
+	static size_t size;
+	const char *line;
+	FILE *in;
+	ssize_t n;
+
+	if (INPUT_DEPTH == 0) {
+		INPUT_STACK[0] = stdin;
+		printf("MU-MIPS SIM:> ");
+		if (isatty(STDIN_FILENO)) {
+			fflush(stdout);
+		}
+	}
+	in = INPUT_STACK[INPUT_DEPTH];
+
+	n = getline(&buffer, &size, in);
+	if (n < 0) {
+		if (INPUT_DEPTH == 0) {
+			exit(0);
+		}
+		fclose(in);
+		INPUT_DEPTH--;
+		return;
+	}
+	if (n > 0 && buffer[n - 1] == '\n') {
+		buffer[n - 1] = '\0';
+	}
+
+	line = buffer;
+	if (INPUT_DEPTH == 0) {
+		line = history_expand(buffer);
+		if (line == NULL) {
+			return;
+		}
+		if (strspn(line, " \t\r") != strlen(line)) {
+			history_add(line);
+		}
+	}
+	execute_command(line);
+}
+
+/***************************************************************/
+/* reset registers/memory and reload program                                                    */
+/***************************************************************/
+void reset() {   
+	int i, c;
+	
+	for (i = 0; i < NUM_MEM_REGION; i++) {
+		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
+		mem_fill(MEM_REGIONS[i].begin, 0, region_size);
+	}
+	RUN_NS = 0;
+#ifdef MEM_TRACE
+	trace_reset();
+#endif
+	
+	/* flushed before loading, which may fill them from an image */
+	for (c = 0; c < NUM_CORES; c++) {
+		select_core(c);
+		decode_flush();
+	}
+
+	/*load program*/
+	load_program();
+	aot_check();
+	if (prof_file[0]) {
+		prof_scan();
+	}
+	
+	for (c = 0; c < NUM_CORES; c++) {
+		select_core(c);
+		/*reset registers*/
+		for (i = 0; i < MIPS_REGS; i++){
+			CURRENT_STATE.R[i] = 0;
+		}
+		CURRENT_STATE.HI = 0;
+		CURRENT_STATE.LO = 0;
+		CURRENT_STATE.R[29] = STACK_TOP;
+		memset(CURRENT_STATE.FPR, 0, sizeof(CURRENT_STATE.FPR));
+		CURRENT_STATE.FCSR = 0;
+		fpu_sync_in();
+		CORE->ll_bit = 0;
+		CORE->load_reg = 0;
+		CORE->load_value = 0;
+		CORE->in_delay_slot = FALSE;
+		CORE->annul = FALSE;
+
+		/*reset PC*/
+		INSTRUCTION_COUNT = 0;
+		cp0_reset();
+		CURRENT_STATE.PC =  MEM_TEXT_BEGIN;
+		NEXT_STATE = CURRENT_STATE;
+		RUN_FLAG = TRUE;
+		STOP_REASON = STOP_NONE;
+	}
+	timing_reset();
+	energy_reset();
+	/* after the counts restart, which device time is read from */
+	devices_reset();
+	select_core(SELECTED_CORE);
+}
+
+/***************************************************************/
+/* Allocate and set memory to zero                                                                            */
+/***************************************************************/
+void init_memory() {                                           
+	int i, k;
+	for (i = 0; i < NUM_MEM_REGION; i++) {
+		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
+		/* anonymous mappings start zero-filled and only cost what is touched */
+		MEM_REGIONS[i].mem = mmap(NULL, region_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (MEM_REGIONS[i].mem == MAP_FAILED) {
+			printf("Error: Can't allocate memory region 0x%08x..0x%08x\n", MEM_REGIONS[i].begin, MEM_REGIONS[i].end);
+			exit(-1);
+		}
+		for (k = MEM_REGIONS[i].begin >> 28; k <= MEM_REGIONS[i].end >> 28; k++) {
+			MEM_MAP[k] = &MEM_REGIONS[i];
+		}
+	}
+}
+
+/**************************************************************/
+/* load a file of hex words into memory at base; returns the    */
+/* number of words written                                       */
+/**************************************************************/
+uint32_t load_hex(const char *file, uint32_t base) {
+	FILE * fp;
+	int i, word;
+	uint32_t address, image_word;
+	uint8_t *image = NULL;
+	size_t cap = 0;
+
+	/* Open program file. */
+	fp = fopen(file, "r");
+	if (fp == NULL) {
+		printf("Error: Can't open program file %s\n", file);
+		exit(-1);
+	}
+
+	/* Read in the program. */
+
+	i = 0;
+	while( fscanf(fp, "%x\n", &word) != EOF ) {
+		address = base + i;
+		if (i + 4 > cap) {
+			cap = cap ? cap * 2 : 4096;
+			image = realloc(image, cap);
+			if (image == NULL) {
+				printf("Error: out of memory loading %s\n", file);
+				exit(-1);
+			}
+		}
+		image_word = guest32(word);
+		memcpy(image + i, &image_word, 4);
+		printf("writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
+		i += 4;
+	}
+	/* one bulk copy into the text segment instead of a store per word */
+	mem_write_block(base, image, i);
+	free(image);
+	bulk_flush();
+	fclose(fp);
+	return i/4;
+}
+
+static int has_suffix(const char *name, const char *suffix)
+{
+	size_t n = strlen(name), k = strlen(suffix);
+
+	return n >= k && strcmp(name + n - k, suffix) == 0;
+}
+
+/**************************************************************/
+/* load program (and kernel, if any) into memory                                                                                      */
+/**************************************************************/
+void load_program() {                   
+	if (has_suffix(prog_file, ".s") || has_suffix(prog_file, ".asm")) {
+		PROGRAM_SIZE = load_asm(prog_file);
+	} else if (has_suffix(prog_file, IMG_SUFFIX)) {
+		PROGRAM_SIZE = load_image(prog_file);
+	} else {
+		PROGRAM_SIZE = load_hex(prog_file, MEM_TEXT_BEGIN);
+	}
+	printf("Program loaded into memory.\n%d words written into memory.\n\n", PROGRAM_SIZE);
+	if (cache_dir[0]) {
+		pcache_open();
+	}
+	cfg_build(MEM_TEXT_BEGIN, PROGRAM_SIZE);
+	cov_open();
+	energy_open();
+	if (kernel_file[0]) {
+		KERNEL_SIZE = load_hex(kernel_file, EXC_VECTOR);
+		printf("Exception handler loaded at 0x%08x.\n%d words written into memory.\n\n", EXC_VECTOR, KERNEL_SIZE);
+	}
+	if (refill_file[0]) {
+		uint32_t words = load_hex(refill_file, TLB_REFILL_VECTOR);
+		printf("TLB refill handler loaded at 0x%08x.\n%d words written into memory.\n\n", TLB_REFILL_VECTOR, words);
+		KERNEL_SIZE += words;
+	}
+	/* what the loader wrote is not the program's doing (-p) */
+	memset(PAGE_BITMAP, 0, sizeof(PAGE_BITMAP));
+	PAGES_WRITTEN = 0;
+}
+
+/***************************************************************/
+/* LL/SC
+   The reservation is the word LL saw; SC succeeds only if the
+   word still holds it, via a host compare-and-swap so it is atomic
+   against every other core.
+***************************************************************/
+uint32_t load_linked(uint32_t ea)
+{
+	uint32_t value = mem_read_32(ea);
+
+	CORE->ll_bit = 1;
+	CORE->ll_addr = ea;
+	CORE->ll_value = value;
+	return value;
+}
+
+/* returns 1 when the store happened, 0 when it did not */
+uint32_t store_conditional(uint32_t ea, uint32_t value)
+{
+	uint32_t *word = (uint32_t *)mem_host_ptr(ea, 4);
+	uint32_t expected = guest32(CORE->ll_value);
+	int ok = 0;
+
+	if (CORE->ll_bit && CORE->ll_addr == ea && word != NULL) {
+		page_mark(ea);
+		ok = __atomic_compare_exchange_n(word, &expected, guest32(value),
+				0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	}
+	CORE->ll_bit = 0;
+	return ok;
+}
+
+/***************************************************************/
+/* System call
+   Built-in services (SPIM numbering in $v0) used when no kernel
+   exception handler has been loaded.
+***************************************************************/
+//SYSCALL
+void syscall_handler()
+{
+	uint32_t a0 = CURRENT_STATE.R[4];
+	uint8_t c;
+
+	/* what the program sent the UART comes first */
+	devices_flush();
+	switch (CURRENT_STATE.R[2]) {
+		case 1:		/* print_int */
+			printf("%d", (int32_t)a0);
+			break;
+		case 4:		/* print_string */
+			while (1) {
+				mem_read_block(MMU_ENABLED ? mmu_peek(a0) : a0, &c, 1);
+				a0++;
+				if (c == 0) {
+					break;
+				}
+				putchar(c);
+			}
+			break;
+		case 10:	/* exit */
+			machine_stop(STOP_EXIT);
+			break;
+		case 11:	/* print_char */
+			putchar(a0 & 0xFF);
+			break;
+		case 17:	/* exit2 */
+			printf("Program exited with code %d\n", (int32_t)a0);
+			machine_stop(STOP_EXIT);
+			break;
+		default:
+			printf("Unknown syscall %d at 0x%08x\n", CURRENT_STATE.R[2], CURRENT_STATE.PC);
+			break;
+	}
+	fflush(stdout);
+}
+
+/***************************************************************/
+/* Coprocessor 0 and exceptions
+   Exceptions are precise: the faulting instruction has no effect,
+   EPC points at it and execution continues at EXC_VECTOR in ktext.
+   Asynchronous events (the Count/Compare timer, interrupt lines,
+   re-enabled interrupts) are not polled per instruction: each one
+   lowers EVENT_DEADLINE and the block loop compares the instruction
+   count against it once per block.
+***************************************************************/
+static const char *EXC_NAMES[32] = {
+	[EXC_INT] = "interrupt", [EXC_MOD] = "TLB modified", [EXC_TLBL] = "TLB miss on load/fetch",
+	[EXC_TLBS] = "TLB miss on store", [EXC_ADEL] = "address error on load/fetch",
+	[EXC_ADES] = "address error on store", [EXC_IBE] = "bus error on fetch",
+	[EXC_SYS] = "syscall", [EXC_BP] = "breakpoint", [EXC_RI] = "reserved instruction",
+	[EXC_CPU] = "coprocessor unusable", [EXC_OV] = "arithmetic overflow", [EXC_TR] = "trap",
+	[EXC_FPE] = "floating point",
+};
+
+
+uint32_t cp0_count()
+{
+	return (uint32_t)(INSTRUCTION_COUNT - COUNT_BASE);
+}
+
+/* recompute when Count will next equal Compare */
+static void cp0_schedule_timer()
+{
+	uint32_t delta = CURRENT_STATE.CP0[CP0_COMPARE] - cp0_count();
+	TIMER_DEADLINE = INSTRUCTION_COUNT + (delta ? delta : ((uint64_t)1 << 32));
+	EVENT_DEADLINE = 0;
+}
+
+void cp0_reset()
+{
+	memset(CURRENT_STATE.CP0, 0, sizeof(CURRENT_STATE.CP0));
+	CURRENT_STATE.CP0[CP0_PRID] = CP0_PRID_VALUE;
+	CURRENT_STATE.CP0[CP0_STATUS] = STATUS_CU1;
+	if (MMU_ENABLED) {
+		/* out of reset with ERL set, as the hardware is: kuseg unmapped until the kernel clears it */
+		CURRENT_STATE.CP0[CP0_STATUS] |= STATUS_ERL;
+	}
+	memset(TLB, 0, sizeof(TLB));
+	mmu_flush();
+	COUNT_BASE = INSTRUCTION_COUNT;
+	IRQ_RAISED_AT = 0;
+	cp0_schedule_timer();
+}
+
+/* interrupts are taken only when enabled, not already in an exception and the line is unmasked */
+static int interrupt_pending()
+{
+	uint32_t status = CURRENT_STATE.CP0[CP0_STATUS];
+
+	return (status & STATUS_IE) && !(status & (STATUS_EXL | STATUS_ERL)) &&
+		(CURRENT_STATE.CP0[CP0_CAUSE] & status & CAUSE_IP_MASK);
+}
+
+/* raise hardware interrupt line (0-5, IP2-IP7) */
+void cp0_assert_irq(int line)
+{
+	if (!(CURRENT_STATE.CP0[CP0_CAUSE] & (CAUSE_IP2 << line))) {
+		CURRENT_STATE.CP0[CP0_CAUSE] |= CAUSE_IP2 << line;
+		IRQ_RAISED_AT = INSTRUCTION_COUNT;
+	}
+	EVENT_DEADLINE = 0;
+}
+
+void cp0_clear_irq(int line)
+{
+	CURRENT_STATE.CP0[CP0_CAUSE] &= ~(CAUSE_IP2 << line);
+}
+
+/***************************************************************/
+/* Enter the exception handler for code; the instruction at     */
+/* CURRENT_STATE.PC is the one that faulted (or, for interrupts,*/
+/* the next one to run)                                          */
+/***************************************************************/
+void raise_exception(int code, uint32_t badvaddr)
+{
+	uint32_t *cp0 = CURRENT_STATE.CP0;
+
+	stat_add(code == EXC_INT ? STAT_INTERRUPTS : STAT_EXCEPTIONS, 1);
+	if (code == EXC_SYS) {
+		stat_add(STAT_SYSCALLS, 1);
+	}
+
+	if (KERNEL_SIZE == 0) {
+		/* no handler loaded: service what we can ourselves */
+		if (code == EXC_SYS) {
+			syscall_handler();
+			return;
+		}
+		CORE->trapped = TRUE;
+		printf("Unhandled exception: %s at 0x%08x", EXC_NAMES[code] ? EXC_NAMES[code] : "unknown", CURRENT_STATE.PC);
+		if (code == EXC_ADEL || code == EXC_ADES || code == EXC_IBE || (code >= EXC_MOD && code <= EXC_TLBS)) {
+			printf(" (address 0x%08x)", badvaddr);
+		}
+		printf("\n");
+		/* stop on the faulting instruction */
+		NEXT_STATE.PC = CURRENT_STATE.PC;
+		machine_stop(STOP_EXCEPTION);
+		return;
+	}
+
+	if (code == EXC_ADEL || code == EXC_ADES || code == EXC_IBE || (code >= EXC_MOD && code <= EXC_TLBS)) {
+		cp0[CP0_BADVADDR] = badvaddr;
+	}
+	/* in a delay slot, CURRENT_STATE.PC is still the branch's */
+	if (!(cp0[CP0_STATUS] & STATUS_EXL)) {
+		cp0[CP0_EPC] = CURRENT_STATE.PC;
+		cp0[CP0_CAUSE] = (cp0[CP0_CAUSE] & ~CAUSE_BD) | (CORE->in_delay_slot ? CAUSE_BD : 0);
+	}
+	cp0[CP0_CAUSE] = (cp0[CP0_CAUSE] & ~CAUSE_EXCCODE_MASK) | (code << CAUSE_EXCCODE_SHIFT);
+	cp0[CP0_STATUS] |= STATUS_EXL;
+	NEXT_STATE.PC = EXC_VECTOR;
+	CORE->trapped = TRUE;
+}
+
+/***************************************************************/
+/* Check the wall-time and page limits; re-arms itself only     */
+/* while one of them is set                                      */
+/***************************************************************/
+static void watchdog()
+{
+	if (!MAX_NS && !MAX_PAGES) {
+		WATCHDOG_DEADLINE = UINT64_MAX;
+		return;
+	}
+	WATCHDOG_DEADLINE = INSTRUCTION_COUNT + WATCHDOG_SLICE;
+	if (MAX_PAGES && PAGES_WRITTEN > MAX_PAGES) {
+		machine_stop(STOP_PAGES);
+	} else if (MAX_NS && monotonic_ns() >= WALL_DEADLINE) {
+		machine_stop(STOP_TIME);
+	}
+}
+
+/***************************************************************/
+/* Timer, device and interrupt delivery, run at block          */
+/* boundaries once the instruction count reaches EVENT_DEADLINE  */
+/***************************************************************/
+void service_events()
+{
+	uint64_t device_next = UINT64_MAX;
+
+	if (INSTRUCTION_COUNT >= WATCHDOG_DEADLINE) {
+		watchdog();
+	}
+	if (INSTRUCTION_COUNT >= TIMER_DEADLINE) {
+		if (!(CURRENT_STATE.CP0[CP0_CAUSE] & CAUSE_IP7)) {
+			CURRENT_STATE.CP0[CP0_CAUSE] |= CAUSE_IP7;
+			IRQ_RAISED_AT = TIMER_DEADLINE;
+		}
+		TIMER_DEADLINE += (uint64_t)1 << 32;
+	}
+	if (CORE == &CORES[0]) {
+		device_next = devices_service();
+	}
+	EVENT_DEADLINE = (TIMER_DEADLINE < WATCHDOG_DEADLINE) ? TIMER_DEADLINE : WATCHDOG_DEADLINE;
+	if (device_next < EVENT_DEADLINE) {
+		EVENT_DEADLINE = device_next;
+	}
+
+	if (RUN_FLAG && interrupt_pending()) {
+		stat_add(STAT_IRQ_LATENCY, INSTRUCTION_COUNT - IRQ_RAISED_AT);
+		NEXT_STATE.PC = CURRENT_STATE.PC;
+		raise_exception(EXC_INT, 0);
+		CURRENT_STATE.PC = NEXT_STATE.PC;
+	}
+}
+
+/* kernel mode, or coprocessor 0 made usable to user code */
+static int cp0_usable()
+{
+	uint32_t status = CURRENT_STATE.CP0[CP0_STATUS];
+	return !(status & STATUS_UM) || (status & (STATUS_EXL | STATUS_ERL | STATUS_CU0));
+}
+
+static uint32_t tlb_random();
+
+/***************************************************************/
+/* MFC0 / MTC0 / ERET                                           */
+/***************************************************************/
+void cop0(const decoded_t *d)
+{
+	int rt = d->rt;
+	int rd = d->rd;
+	uint32_t *cp0 = CURRENT_STATE.CP0;
+
+	if (!cp0_usable()) {
+		cp0[CP0_CAUSE] &= ~CAUSE_CE_MASK;
+		raise_exception(EXC_CPU, 0);
+		return;
+	}
+	if (d->op == OP_MFC0 && rd == CP0_EBASE && (d->word & 7) == 1) {
+		/* EBase: exception base and this core's number */
+		CURRENT_STATE.R[rt] = MEM_KTEXT_BEGIN | CORE->id;
+	} else if (d->op == OP_MFC0 && rd == CP0_CONFIG) {
+		if ((d->word & 7) == 1) {
+			CURRENT_STATE.R[rt] = CONFIG1_VALUE;
+		} else {
+			CURRENT_STATE.R[rt] = CONFIG_M | (MMU_ENABLED ? CONFIG_MT_TLB : CONFIG_MT_FIXED);
+		}
+	} else if (d->op == OP_MFC0) {
+		CURRENT_STATE.R[rt] = (rd == CP0_COUNT) ? cp0_count() : (rd == CP0_RANDOM) ? tlb_random() : cp0[rd];
+	} else if (d->op == OP_MTC0) {
+		switch (rd) {
+			case CP0_COUNT:
+				COUNT_BASE = INSTRUCTION_COUNT - CURRENT_STATE.R[rt];
+				cp0_schedule_timer();
+				break;
+			case CP0_COMPARE:
+				/* writing Compare acknowledges the timer interrupt */
+				cp0[CP0_COMPARE] = CURRENT_STATE.R[rt];
+				cp0[CP0_CAUSE] &= ~CAUSE_IP7;
+				cp0_schedule_timer();
+				break;
+			case CP0_CAUSE:
+				/* only the software interrupt bits are writable */
+				cp0[CP0_CAUSE] = (cp0[CP0_CAUSE] & ~CAUSE_IP_SW) | (CURRENT_STATE.R[rt] & CAUSE_IP_SW);
+				if (cp0[CP0_CAUSE] & CAUSE_IP_SW) {
+					IRQ_RAISED_AT = INSTRUCTION_COUNT;
+				}
+				EVENT_DEADLINE = 0;
+				break;
+			case CP0_STATUS:
+				if ((cp0[CP0_STATUS] ^ CURRENT_STATE.R[rt]) & STATUS_ERL) {
+					mmu_flush();	/* kuseg mapping changes */
+				}
+				cp0[CP0_STATUS] = CURRENT_STATE.R[rt];
+				EVENT_DEADLINE = 0;	/* may have unmasked something pending */
+				break;
+			case CP0_INDEX:
+				cp0[CP0_INDEX] = (cp0[CP0_INDEX] & INDEX_P) | (CURRENT_STATE.R[rt] & (TLB_ENTRIES - 1));
+				break;
+			case CP0_ENTRYLO0:
+			case CP0_ENTRYLO1:
+				cp0[rd] = CURRENT_STATE.R[rt] & ENTRYLO_MASK;
+				break;
+			case CP0_CONTEXT:
+				cp0[CP0_CONTEXT] = (cp0[CP0_CONTEXT] & ~CONTEXT_PTEBASE) | (CURRENT_STATE.R[rt] & CONTEXT_PTEBASE);
+				break;
+			case CP0_PAGEMASK:
+				cp0[CP0_PAGEMASK] = CURRENT_STATE.R[rt] & PAGEMASK_MASK;
+				break;
+			case CP0_WIRED:
+				cp0[CP0_WIRED] = CURRENT_STATE.R[rt] & (TLB_ENTRIES - 1);
+				break;
+			case CP0_ENTRYHI:
+				if ((cp0[CP0_ENTRYHI] ^ CURRENT_STATE.R[rt]) & ENTRYHI_ASID) {
+					mmu_flush();
+				}
+				cp0[CP0_ENTRYHI] = CURRENT_STATE.R[rt] & (ENTRYHI_VPN2 | ENTRYHI_ASID);
+				break;
+			case CP0_RANDOM:
+			case CP0_CONFIG:
+			case CP0_PRID:
+				break;	/* read only */
+			case CP0_EPC:
+			case CP0_BADVADDR:
+			default:
+				cp0[rd] = CURRENT_STATE.R[rt];
+				break;
+		}
+	} else if (d->op == OP_TLBR) {
+		tlb_read();
+	} else if (d->op == OP_TLBWI) {
+		tlb_write(cp0[CP0_INDEX]);
+	} else if (d->op == OP_TLBWR) {
+		tlb_write(tlb_random());
+	} else if (d->op == OP_TLBP) {
+		tlb_probe();
+	} else if (d->op == OP_ERET) {
+		if (cp0[CP0_STATUS] & STATUS_ERL) {
+			mmu_flush();
+		}
+		cp0[CP0_STATUS] &= ~(cp0[CP0_STATUS] & STATUS_ERL ? STATUS_ERL : STATUS_EXL);
+		NEXT_STATE.PC = cp0[CP0_EPC];
+		CORE->ll_bit = 0;
+		EVENT_DEADLINE = 0;
+	} else {
+		raise_exception(EXC_RI, 0);
+	}
+}
+
+/***************************************************************/
+/* Memory management
+   A MIPS32 TLB of TLB_ENTRIES entries, looked up only when the
+   host-side cache MMU_CACHE misses. Each cache slot remembers
+   one translated 4K page per access kind (writes are cached only
+   for dirty pages), so a hit is a compare and an add; any change
+   that could invalidate a slot (TLB writes, a new ASID, ERL
+   toggling) empties the whole cache.
+***************************************************************/
+void mmu_flush()
+{
+	int i;
+	for (i = 0; i < MMU_CACHE_SIZE; i++) {
+		MMU_CACHE[0][i].vpage = MMU_CACHE_EMPTY;
+		MMU_CACHE[1][i].vpage = MMU_CACHE_EMPTY;
+	}
+}
+
+static void mmu_fill(uint32_t va, uint32_t pa, int acc)
+{
+	mmu_cache_t *e = &MMU_CACHE[acc == ACC_STORE][(va >> MMU_PAGE_SHIFT) & (MMU_CACHE_SIZE - 1)];
+
+	e->vpage = va & ~MMU_PAGE_MASK;
+	e->delta = pa - va;
+}
+
+/* TLB entry mapping va under the current ASID, -1 if none */
+static int tlb_lookup(uint32_t va)
+{
+	uint32_t asid = CURRENT_STATE.CP0[CP0_ENTRYHI] & ENTRYHI_ASID;
+	uint32_t vmask;
+	int i;
+
+	for (i = 0; i < TLB_ENTRIES; i++) {
+		vmask = ENTRYHI_VPN2 & ~TLB[i].mask;
+		if ((va & vmask) == (TLB[i].hi & vmask) &&
+				((TLB[i].lo[0] & ENTRYLO_G) || (TLB[i].hi & ENTRYHI_ASID) == asid)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void tlb_exception(int code, uint32_t va, int refill)
+{
+	uint32_t *cp0 = CURRENT_STATE.CP0;
+	int exl = cp0[CP0_STATUS] & STATUS_EXL;
+
+	cp0[CP0_CONTEXT] = (cp0[CP0_CONTEXT] & CONTEXT_PTEBASE) | ((va & ENTRYHI_VPN2) >> 9);
+	cp0[CP0_ENTRYHI] = (va & ENTRYHI_VPN2) | (cp0[CP0_ENTRYHI] & ENTRYHI_ASID);
+	if (refill) {
+		stat_add(STAT_TLB_REFILLS, 1);
+	}
+	raise_exception(code, va);
+	if (refill && !exl && KERNEL_SIZE != 0) {
+		NEXT_STATE.PC = TLB_REFILL_VECTOR;
+	}
+}
+
+/***************************************************************/
+/* Translate *addr for an access of kind acc on an MMU cache    */
+/* miss. Returns FALSE, with the exception raised, on a fault.  */
+/***************************************************************/
+int mmu_translate_slow(uint32_t *addr, int acc)
+{
+	uint32_t va = *addr, page, pa, lo;
+	int i, store = (acc == ACC_STORE);
+
+	stat_add(STAT_MMU_LOOKUPS, 1);
+	/* kseg0/kseg1, and kuseg while ERL is set, are unmapped */
+	if ((va >= KSEG0_BEGIN && va < KSEG2_BEGIN) ||
+			(va < KSEG0_BEGIN && (CURRENT_STATE.CP0[CP0_STATUS] & STATUS_ERL))) {
+		mmu_fill(va, va, acc);
+		return TRUE;
+	}
+
+	i = tlb_lookup(va);
+	if (i < 0) {
+		tlb_exception(store ? EXC_TLBS : EXC_TLBL, va, TRUE);
+		return FALSE;
+	}
+	page = ((TLB[i].mask | ~ENTRYHI_VPN2) + 1) >> 1;
+	lo = TLB[i].lo[(va & page) != 0];
+	if (!(lo & ENTRYLO_V)) {
+		tlb_exception(store ? EXC_TLBS : EXC_TLBL, va, FALSE);
+		return FALSE;
+	}
+	if (store && !(lo & ENTRYLO_D)) {
+		tlb_exception(EXC_MOD, va, FALSE);
+		return FALSE;
+	}
+	pa = (((lo >> ENTRYLO_PFN_SHIFT) << MMU_PAGE_SHIFT) & ~(page - 1)) | (va & (page - 1));
+	mmu_fill(va, pa, acc);
+	*addr = pa;
+	return TRUE;
+}
+
+/* physical address of va for the simulator's own accesses: no
+ * exceptions, no cache fills, unmapped or invalid pages left as is */
+uint32_t mmu_peek(uint32_t va)
+{
+	uint32_t page, lo;
+	int i;
+
+	if ((va >= KSEG0_BEGIN && va < KSEG2_BEGIN) ||
+			(va < KSEG0_BEGIN && (CURRENT_STATE.CP0[CP0_STATUS] & STATUS_ERL)) || (i = tlb_lookup(va)) < 0) {
+		return va;
+	}
+	page = ((TLB[i].mask | ~ENTRYHI_VPN2) + 1) >> 1;
+	lo = TLB[i].lo[(va & page) != 0];
+	if (!(lo & ENTRYLO_V)) {
+		return va;
+	}
+	return (((lo >> ENTRYLO_PFN_SHIFT) << MMU_PAGE_SHIFT) & ~(page - 1)) | (va & (page - 1));
+}
+
+/* the entry TLBWR replaces: counts down from the top to Wired as instructions retire */
+static uint32_t tlb_random()
+{
+	uint32_t wired = CURRENT_STATE.CP0[CP0_WIRED];
+	return TLB_ENTRIES - 1 - (uint32_t)(INSTRUCTION_COUNT % (TLB_ENTRIES - wired));
+}
+
+/* TLBR */
+void tlb_read()
+{
+	uint32_t *cp0 = CURRENT_STATE.CP0;
+	tlb_entry_t *e = &TLB[cp0[CP0_INDEX] & (TLB_ENTRIES - 1)];
+
+	cp0[CP0_PAGEMASK] = e->mask;
+	cp0[CP0_ENTRYHI] = e->hi;
+	cp0[CP0_ENTRYLO0] = e->lo[0];
+	cp0[CP0_ENTRYLO1] = e->lo[1];
+	mmu_flush();	/* the ASID may have changed */
+}
+
+/* TLBWI / TLBWR */
+void tlb_write(int index)
+{
+	uint32_t *cp0 = CURRENT_STATE.CP0;
+	tlb_entry_t *e = &TLB[index & (TLB_ENTRIES - 1)];
+	uint32_t g = cp0[CP0_ENTRYLO0] & cp0[CP0_ENTRYLO1] & ENTRYLO_G;
+
+	e->mask = cp0[CP0_PAGEMASK];
+	e->hi = cp0[CP0_ENTRYHI] & ~e->mask;
+	e->lo[0] = (cp0[CP0_ENTRYLO0] & ~ENTRYLO_G) | g;
+	e->lo[1] = (cp0[CP0_ENTRYLO1] & ~ENTRYLO_G) | g;
+	mmu_flush();
+}
+
+/* TLBP */
+void tlb_probe()
+{
+	uint32_t *cp0 = CURRENT_STATE.CP0;
+	int i = tlb_lookup(cp0[CP0_ENTRYHI]);
+
+	cp0[CP0_INDEX] = (i < 0) ? INDEX_P : (uint32_t)i;
+}
+
+/* Dump the selected core's TLB */
+void print_tlb()
+{
+	int i;
+
+	printf("-------------------------------------\n");
+	printf("TLB (MMU %s)  EntryHi 0x%08x\n", MMU_ENABLED ? "on" : "off", CURRENT_STATE.CP0[CP0_ENTRYHI]);
+	printf("-------------------------------------\n");
+	printf("[#]\t[PageMask]\t[EntryHi]\t[EntryLo0]\t[EntryLo1]\n");
+	for (i = 0; i < TLB_ENTRIES; i++) {
+		printf("[%d]\t0x%08x\t0x%08x\t0x%08x\t0x%08x\n", i,
+			TLB[i].mask, TLB[i].hi, TLB[i].lo[0], TLB[i].lo[1]);
+	}
+	printf("-------------------------------------\n");
+}
+
+/***************************************************************/
+/* Coprocessor 1 (FPU)
+   Arithmetic runs on the host FPU with the host rounding mode kept
+   equal to FCSR.RM for whichever core the thread is executing.
+   While FCSR enables no exception, the host's sticky flags are left
+   to accumulate and are folded into FCSR.Flags only when something
+   looks (CFC1, a core switch, the end of a run). Once an enable bit
+   is set every operation clears and tests the host flags instead,
+   so Cause is exact and the trap is taken before the result is
+   written.
+***************************************************************/
+static const int FPU_HOST_RM[4] = {
+	[FCSR_RM_NEAREST] = FE_TONEAREST, [FCSR_RM_ZERO] = FE_TOWARDZERO,
+	[FCSR_RM_UP] = FE_UPWARD, [FCSR_RM_DOWN] = FE_DOWNWARD,
+};
+
+/* host exception flags raised so far, as FPE_* bits */
+static uint32_t fpu_host_flags()
+{
+	int e = fetestexcept(FE_ALL_EXCEPT);
+
+	return ((e & FE_INEXACT) ? FPE_I : 0) | ((e & FE_UNDERFLOW) ? FPE_U : 0) |
+		((e & FE_OVERFLOW) ? FPE_O : 0) | ((e & FE_DIVBYZERO) ? FPE_Z : 0) |
+		((e & FE_INVALID) ? FPE_V : 0);
+}
+
+/* load the current core's rounding mode into the host FPU */
+void fpu_sync_in()
+{
+	fesetround(FPU_HOST_RM[CURRENT_STATE.FCSR & FCSR_RM_MASK]);
+	feclearexcept(FE_ALL_EXCEPT);
+}
+
+/* fold the host flags raised on the current core's behalf into FCSR */
+void fpu_sync_out()
+{
+	CURRENT_STATE.FCSR |= fpu_host_flags() << FCSR_FLAGS_SHIFT;
+	feclearexcept(FE_ALL_EXCEPT);
+}
+
+/* TRUE when the next operation must report its exceptions exactly */
+static inline int fpu_begin()
+{
+	if (!(CURRENT_STATE.FCSR & FCSR_ENABLES)) {
+		return FALSE;
+	}
+	fpu_sync_out();
+	return TRUE;
+}
+
+/* record the operation's exceptions in Cause; TRUE when one traps */
+static int fpu_end()
+{
+	uint32_t *fcsr = &CURRENT_STATE.FCSR;
+	uint32_t cause = fpu_host_flags();
+
+	feclearexcept(FE_ALL_EXCEPT);
+	*fcsr = (*fcsr & ~FCSR_CAUSE) | (cause << FCSR_CAUSE_SHIFT);
+	if (cause & (*fcsr >> FCSR_ENABLES_SHIFT)) {
+		raise_exception(EXC_FPE, 0);
+		return TRUE;
+	}
+	*fcsr |= cause << FCSR_FLAGS_SHIFT;
+	return FALSE;
+}
+
+static inline int fpu_cc_bit(int cc)
+{
+	return cc ? 1u << (FCSR_FCC1_SHIFT + cc - 1) : FCSR_FCC0;
+}
+
+uint32_t fpu_read_control(int reg)
+{
+	switch (reg) {
+		case 0:
+			return FPU_FIR;
+		case 31:
+			fpu_sync_out();
+			return CURRENT_STATE.FCSR;
+		default:
+			return 0;
+	}
+}
+
+void fpu_write_control(int reg, uint32_t value)
+{
+	if (reg != 31) {
+		return;
+	}
+	fpu_sync_out();
+	CURRENT_STATE.FCSR = value;
+	fpu_sync_in();
+	/* a Cause bit written together with its enable traps at once */
+	if ((value >> FCSR_CAUSE_SHIFT) & ((value >> FCSR_ENABLES_SHIFT) | FPE_E) & 0x3F) {
+		raise_exception(EXC_FPE, 0);
+	}
+}
+
+/* v as a word rounded per rm; NaN and out of range give the default 2^31-1 and Invalid */
+static uint32_t fpu_to_word(double v, int rm)
+{
+	int saved = fegetround();
+	double r;
+
+	if (FPU_HOST_RM[rm] == saved) {
+		r = rint(v);
+	} else {
+		fesetround(FPU_HOST_RM[rm]);
+		r = rint(v);
+		fesetround(saved);
+	}
+	if (isnan(r) || r < -2147483648.0 || r > 2147483647.0) {
+		feclearexcept(FE_INEXACT);
+		feraiseexcept(FE_INVALID);
+		return 0x7FFFFFFF;
+	}
+	return (uint32_t)(int32_t)r;
+}
+
+/* C.cond: singles are compared exactly after widening */
+static int fpu_compare(double a, double b, int cond)
+{
+	if (isnan(a) || isnan(b)) {
+		if (cond & 0x8) {
+			feraiseexcept(FE_INVALID);
+		}
+		return cond & 0x1;
+	}
+	return ((cond & 0x2) && a == b) || ((cond & 0x4) && a < b);
+}
+
+static inline float fpr_get_s(int r)
+{
+	float f;
+	memcpy(&f, &CURRENT_STATE.FPR[r], sizeof(f));
+	return f;
+}
+
+static inline double fpr_get_d(int r)
+{
+	uint64_t v = CURRENT_STATE.FPR[r & ~1] | ((uint64_t)CURRENT_STATE.FPR[r | 1] << 32);
+	double f;
+	memcpy(&f, &v, sizeof(f));
+	return f;
+}
+
+/* results that are NaN take the MIPS default NaN rather than the host's */
+static inline void fpr_set_s(int r, float f)
+{
+	uint32_t v = FPU_NAN_S;
+
+	if (!isnan(f)) {
+		memcpy(&v, &f, sizeof(v));
+	}
+	CURRENT_STATE.FPR[r] = v;
+}
+
+static inline void fpr_set_d(int r, double f)
+{
+	uint64_t v = FPU_NAN_D;
+
+	if (!isnan(f)) {
+		memcpy(&v, &f, sizeof(v));
+	}
+	CURRENT_STATE.FPR[r & ~1] = (uint32_t)v;
+	CURRENT_STATE.FPR[r | 1] = v >> 32;
+}
+
+#ifdef MEM_TRACE
+/************************************************************/
+/* Memory access tracing (MEM_TRACE builds)
+   Every data access (physical address, size, R/W, PC) goes
+   into its core's buffer; a full buffer is folded into the
+   core's analysis:
+   - working set: distinct lines and pages per TRACE_WINDOW
+     accesses
+   - reuse distance: distinct lines touched since the last
+     access to the same line, i.e. the smallest fully
+     associative LRU cache that would hit, kept as a log2
+     histogram. Each line's last access is a position in a
+     Fenwick tree; positions are renumbered when it fills.
+   - per-page and per-instruction read and write counts for the
+     heatmaps
+   Builds without MEM_TRACE compile none of this in.
+************************************************************/
+typedef struct {
+	uint32_t pc, pa;
+	uint8_t size, write;
+} trace_rec_t;
+
+typedef struct {
+	uint32_t key;			/* line, page or word number + 1, 0 = empty */
+	uint32_t window;		/* last window it was counted in */
+	uint32_t stamp;			/* lines: Fenwick position of the last access */
+	uint64_t reads, writes;		/* pages and instructions: accesses */
+} trace_slot_t;
+
+typedef struct {
+	trace_slot_t *slot;
+	uint32_t cap, used;
+} trace_map_t;
+
+struct trace {
+	trace_rec_t buf[TRACE_BUF];
+	uint32_t n;
+	trace_map_t lines, pages, pcs;
+	uint32_t *fen;			/* Fenwick tree over stamps, 1-based */
+	uint32_t fen_cap, now;
+	uint64_t hist[TRACE_HIST];	/* [0] first touch, [k] distance in [2^(k-2), 2^(k-1)), [1] distance 0 */
+	uint64_t reads, writes;
+	uint32_t window, in_window, ws_lines, ws_pages;
+	uint64_t windows, ws_lines_sum, ws_pages_sum;
+	uint32_t ws_lines_max, ws_pages_max;
+};
+
+static trace_slot_t *trace_find(trace_map_t *m, uint32_t key)
+{
+	uint32_t k, i;
+	trace_slot_t *old;
+
+	if (2 * (m->used + 1) > m->cap) {
+		old = m->slot;
+		k = m->cap;
+		m->cap = m->cap ? 2 * m->cap : 1024;
+		m->slot = calloc(m->cap, sizeof(*m->slot));
+		if (m->slot == NULL) {
+			printf("Error: out of memory tracing\n");
+			exit(1);
+		}
+		m->used = 0;
+		while (k-- > 0) {
+			if (old[k].key) {
+				*trace_find(m, old[k].key) = old[k];
+				m->used++;
+			}
+		}
+		free(old);
+	}
+	for (i = (key * 0x9E3779B1u) & (m->cap - 1); m->slot[i].key && m->slot[i].key != key; i = (i + 1) & (m->cap - 1)) {
+	}
+	return &m->slot[i];
+}
+
+static void fen_add(struct trace *t, uint32_t pos, int32_t v)
+{
+	for (pos++; pos <= t->fen_cap; pos += pos & -pos) {
+		t->fen[pos] += v;
+	}
+}
+
+/* stamps in [0, pos) still live */
+static uint32_t fen_sum(struct trace *t, uint32_t pos)
+{
+	uint32_t s = 0;
+
+	for (; pos > 0; pos -= pos & -pos) {
+		s += t->fen[pos];
+	}
+	return s;
+}
+
+/* renumber the live stamps 0..n-1, growing the tree if they fill half of it */
+static void fen_compact(struct trace *t)
+{
+	uint32_t *owner, i, n = 0, j;
+
+	owner = malloc(t->fen_cap * sizeof(*owner));
+	if (owner == NULL) {
+		printf("Error: out of memory tracing\n");
+		exit(1);
+	}
+	memset(owner, 0xFF, t->fen_cap * sizeof(*owner));
+	for (i = 0; i < t->lines.cap; i++) {
+		if (t->lines.slot[i].key) {
+			owner[t->lines.slot[i].stamp] = i;
+		}
+	}
+	for (i = 0; i < t->fen_cap; i++) {
+		if (owner[i] != 0xFFFFFFFF) {
+			t->lines.slot[owner[i]].stamp = n++;
+		}
+	}
+	free(owner);
+	if (2 * n > t->fen_cap) {
+		t->fen_cap *= 2;
+	}
+	free(t->fen);
+	t->fen = calloc(t->fen_cap + 1, sizeof(*t->fen));
+	if (t->fen == NULL) {
+		printf("Error: out of memory tracing\n");
+		exit(1);
+	}
+	/* all ones in [0, n): build in place */
+	for (i = 1; i <= t->fen_cap; i++) {
+		t->fen[i] += (i <= n);
+		j = i + (i & -i);
+		if (j <= t->fen_cap) {
+			t->fen[j] += t->fen[i];
+		}
+	}
+	t->now = n;
+}
+
+static void trace_fold(struct trace *t)
+{
+	trace_rec_t *r;
+	trace_slot_t *s;
+	uint32_t k, d;
+
+	for (k = 0; k < t->n; k++) {
+		r = &t->buf[k];
+		if (t->now == t->fen_cap) {
+			fen_compact(t);
+		}
+		if (r->write) {
+			t->writes++;
+		} else {
+			t->reads++;
+		}
+
+		s = trace_find(&t->lines, (r->pa >> TRACE_LINE_SHIFT) + 1);
+		if (s->key == 0) {
+			s->key = (r->pa >> TRACE_LINE_SHIFT) + 1;
+			t->lines.used++;
+			t->hist[0]++;
+		} else {
+			d = fen_sum(t, t->now) - fen_sum(t, s->stamp + 1);
+			t->hist[d ? 2 + 31 - __builtin_clz(d) : 1]++;
+			fen_add(t, s->stamp, -1);
+		}
+		if (s->window != t->window + 1) {
+			s->window = t->window + 1;
+			t->ws_lines++;
+		}
+		s->stamp = t->now++;
+		fen_add(t, s->stamp, 1);
+
+		s = trace_find(&t->pages, (r->pa >> MMU_PAGE_SHIFT) + 1);
+		if (s->key == 0) {
+			s->key = (r->pa >> MMU_PAGE_SHIFT) + 1;
+			t->pages.used++;
+		}
+		if (r->write) {
+			s->writes++;
+		} else {
+			s->reads++;
+		}
+		if (s->window != t->window + 1) {
+			s->window = t->window + 1;
+			t->ws_pages++;
+		}
+
+		s = trace_find(&t->pcs, (r->pc >> 2) + 1);
+		if (s->key == 0) {
+			s->key = (r->pc >> 2) + 1;
+			t->pcs.used++;
+		}
+		if (r->write) {
+			s->writes++;
+		} else {
+			s->reads++;
+		}
+
+		if (++t->in_window == TRACE_WINDOW) {
+			t->windows++;
+			t->ws_lines_sum += t->ws_lines;
+			t->ws_pages_sum += t->ws_pages;
+			t->ws_lines_max = (t->ws_lines > t->ws_lines_max) ? t->ws_lines : t->ws_lines_max;
+			t->ws_pages_max = (t->ws_pages > t->ws_pages_max) ? t->ws_pages : t->ws_pages_max;
+			t->window++;
+			t->in_window = t->ws_lines = t->ws_pages = 0;
+		}
+	}
+	t->n = 0;
+}
+
+uint32_t trace_access(uint32_t pa, int size, int write)
+{
+	struct trace *t = CORE->trace;
+	trace_rec_t *r;
+
+	if (t == NULL) {
+		t = CORE->trace = calloc(1, sizeof(*t));
+		if (t == NULL) {
+			printf("Error: out of memory tracing\n");
+			exit(1);
+		}
+		t->fen_cap = TRACE_STAMPS;
+		t->fen = calloc(t->fen_cap + 1, sizeof(*t->fen));
+	}
+	r = &t->buf[t->n];
+	r->pc = CURRENT_STATE.PC;
+	r->pa = pa;
+	r->size = size;
+	r->write = write;
+	if (++t->n == TRACE_BUF) {
+		trace_fold(t);
+	}
+	return pa;
+}
+
+void trace_reset()
+{
+	struct trace *t;
+	int c;
+
+	for (c = 0; c < NUM_CORES; c++) {
+		if ((t = CORES[c].trace) != NULL) {
+			free(t->lines.slot);
+			free(t->pages.slot);
+			free(t->pcs.slot);
+			free(t->fen);
+			free(t);
+			CORES[c].trace = NULL;
+		}
+	}
+}
+
+/* the TRACE_HOT_PAGES most accessed entries of m, with bars */
+static void trace_print_hot(trace_map_t *m, int shift, int listing)
+{
+	trace_slot_t *hot[TRACE_HOT_PAGES], *s;
+	char line[LISTING_LINE];
+	uint64_t n, top;
+	uint32_t i, addr;
+	int h;
+
+	for (h = 0; h < TRACE_HOT_PAGES; h++) {
+		hot[h] = NULL;
+	}
+	for (i = 0; i < m->cap; i++) {
+		s = &m->slot[i];
+		if (s->key == 0) {
+			continue;
+		}
+		n = s->reads + s->writes;
+		for (h = TRACE_HOT_PAGES; h > 0 && (hot[h - 1] == NULL || hot[h - 1]->reads + hot[h - 1]->writes < n); h--) {
+			if (h < TRACE_HOT_PAGES) {
+				hot[h] = hot[h - 1];
+			}
+		}
+		if (h < TRACE_HOT_PAGES) {
+			hot[h] = s;
+		}
+	}
+	top = hot[0] ? hot[0]->reads + hot[0]->writes : 1;
+	for (h = 0; h < TRACE_HOT_PAGES && hot[h] != NULL; h++) {
+		n = hot[h]->reads + hot[h]->writes;
+		addr = (hot[h]->key - 1) << shift;
+		printf("    0x%08x %10llu %10llu  %-32.*s", addr, (unsigned long long)hot[h]->reads,
+			(unsigned long long)hot[h]->writes, (int)((n * 32 + top - 1) / top),
+			"################################");
+		if (listing) {
+			disassemble(addr, mem_read_32(MMU_ENABLED ? mmu_peek(addr) : addr), line, sizeof(line));
+			printf("  %s", line);
+		}
+		printf("\n");
+	}
+}
+
+/************************************************************/
+/* Print each core's working set, reuse distance histogram,    */
+/* hottest pages and busiest load/store instructions           */
+/************************************************************/
+void trace_report()
+{
+	struct trace *t;
+	uint64_t total, cum;
+	int c, k, last;
+
+	for (c = 0; c < NUM_CORES; c++) {
+		if ((t = CORES[c].trace) == NULL) {
+			continue;
+		}
+		trace_fold(t);
+		total = t->reads + t->writes;
+		printf("Memory trace, core %d: %llu accesses (%llu reads, %llu writes), %u lines, %u pages\n",
+			c, (unsigned long long)total, (unsigned long long)t->reads, (unsigned long long)t->writes,
+			t->lines.used, t->pages.used);
+		if (total == 0) {
+			continue;
+		}
+		if (t->windows) {
+			printf("  working set per %d accesses: %llu lines / %llu pages average, %u / %u most\n",
+				TRACE_WINDOW, (unsigned long long)(t->ws_lines_sum / t->windows),
+				(unsigned long long)(t->ws_pages_sum / t->windows), t->ws_lines_max, t->ws_pages_max);
+		} else {
+			printf("  working set (%llu accesses): %u lines / %u pages\n",
+				(unsigned long long)total, t->ws_lines, t->ws_pages);
+		}
+
+		/* bucket k >= 1 hits in an LRU cache of 2^(k-1) lines */
+		printf("  reuse distance (%d B lines)   accesses   LRU hit rate at that size\n", 1 << TRACE_LINE_SHIFT);
+		for (last = TRACE_HIST - 1; last > 1 && t->hist[last] == 0; last--) {
+		}
+		for (k = 1, cum = 0; k <= last; k++) {
+			cum += t->hist[k];
+			if (k == 1) {
+				printf("    %-26s %10llu   %5.1f%%  (%d B)\n", "0",
+					(unsigned long long)t->hist[k], 100.0 * cum / total, 1 << TRACE_LINE_SHIFT);
+			} else {
+				char range[32];
+				if (k == 2) {
+					snprintf(range, sizeof(range), "1");
+				} else {
+					snprintf(range, sizeof(range), "%u-%u", 1u << (k - 2), (uint32_t)((1ull << (k - 1)) - 1));
+				}
+				printf("    %-26s %10llu   %5.1f%%  (%llu B)\n", range, (unsigned long long)t->hist[k],
+					100.0 * cum / total, (unsigned long long)(1ull << (k - 1)) << TRACE_LINE_SHIFT);
+			}
+		}
+		printf("    %-26s %10llu\n", "first touch", (unsigned long long)t->hist[0]);
+
+		printf("  hottest pages             reads     writes\n");
+		trace_print_hot(&t->pages, MMU_PAGE_SHIFT, FALSE);
+		printf("  busiest instructions      reads     writes\n");
+		trace_print_hot(&t->pcs, 2, TRUE);
+	}
+}
+
+#define TRACE_ACCESS(pa, size, acc)	trace_access(pa, size, (acc) == ACC_STORE)
+#else
+#define TRACE_ACCESS(pa, size, acc)	(pa)
+#endif
+
+/************************************************************/
+/* Decoder and executor
+   Both are expanded from MIPS_ISA; nothing here knows about
+   individual instructions.
+************************************************************/
+
+/* OP_* for word, OP_INVALID if the table has no row for it */
+static inline int decode_op(uint32_t word)
+{
+	switch (word >> 26) {
+		case OPC_SPECIAL:
+			if ((word & 0x3f) == FUNCT_MOVCI) {
+				return ISA_DECODE[ENC_MOVCI][(word >> 16) & 1];
+			}
+			return ISA_DECODE[ENC_SPECIAL][word & 0x3f];
+		case OPC_REGIMM:
+			return ISA_DECODE[ENC_REGIMM][(word >> 16) & 0x1f];
+		case OPC_SPECIAL2:
+			return ISA_DECODE[ENC_SPECIAL2][word & 0x3f];
+		case OPC_COP0:
+			if (word & COP0_CO) {
+				return ISA_DECODE[ENC_COP0CO][word & 0x3f];
+			}
+			return ISA_DECODE[ENC_COP0][(word >> 21) & 0x1f];
+		case OPC_COP1:
+			switch ((word >> 21) & 0x1f) {
+				case COP1_BC:
+					return ISA_DECODE[ENC_COP1_BC][(word >> 16) & 3];
+				case COP1_FMT_S:
+					return ISA_DECODE[ENC_COP1_S][word & 0x3f];
+				case COP1_FMT_D:
+					return ISA_DECODE[ENC_COP1_D][word & 0x3f];
+				case COP1_FMT_W:
+					return ISA_DECODE[ENC_COP1_W][word & 0x3f];
+				default:
+					return ISA_DECODE[ENC_COP1][(word >> 21) & 0x1f];
+			}
+		default:
+			return ISA_DECODE[ENC_OPCODE][word >> 26];
+	}
+}
+
+/* split the word at pc into d, with imm extended as the operand format uses it */
+void decode(uint32_t pc, uint32_t word, decoded_t *d)
+{
+	int32_t simm = (int16_t)(word & 0xFFFF);
+
+	d->word = word;
+	d->op = decode_op(word);
+	d->rs = (word >> 21) & 0x1f;
+	d->rt = (word >> 16) & 0x1f;
+	d->rd = (word >> 11) & 0x1f;
+	d->sa = (word >> 6) & 0x1f;
+
+	switch (ISA_INFO[d->op].fmt) {
+		case DIS_RT_RS_SIMM: case DIS_RT_MEM: case DIS_RS_SIMM: case DIS_OP_MEM: case DIS_FT_MEM:
+			d->imm = simm;
+			break;
+		case DIS_RT_RS_UIMM: case DIS_RT_UIMM:
+			d->imm = word & 0xFFFF;
+			break;
+		case DIS_RS_RT_BRANCH: case DIS_RS_BRANCH: case DIS_CC_BRANCH:
+			d->imm = pc + 4 + ((uint32_t)simm << 2);
+			break;
+		case DIS_JUMP:
+			d->imm = ((pc + 4) & 0xF0000000) | ((word & 0x03FFFFFF) << 2);
+			break;
+		default:
+			d->imm = 0;
+			break;
+	}
+}
+
+/* virtual to physical through the MMU cache; hits never leave this function */
+static inline int mmu_translate(uint32_t *addr, int acc)
+{
+	const mmu_cache_t *e = &MMU_CACHE[acc == ACC_STORE][(*addr >> MMU_PAGE_SHIFT) & (MMU_CACHE_SIZE - 1)];
+
+	if (e->vpage == (*addr & ~MMU_PAGE_MASK)) {
+		*addr += e->delta;
+		return TRUE;
+	}
+	return mmu_translate_slow(addr, acc);
+}
+
+/* operands as the semantics in MIPS_ISA see them */
+#define RS		CURRENT_STATE.R[d->rs]
+#define RT		CURRENT_STATE.R[d->rt]
+#define RD		CURRENT_STATE.R[d->rd]
+#define SA		(d->sa)
+#define IMM		(d->imm)
+#define EA		(RS + IMM)
+#define LANE(a)		(((a) & 3) ^ (BIG_ENDIAN_GUEST ? 3 : 0))	/* byte's place in its word, 0 = least significant */
+#define DW_LO		(BIG_ENDIAN_GUEST ? 4 : 0)	/* offsets of a doubleword's low and high words */
+#define DW_HI		(4 - DW_LO)
+#define HI		CURRENT_STATE.HI
+#define LO		CURRENT_STATE.LO
+#define HILO		(((uint64_t)HI << 32) | LO)
+#define SET_HILO(v)	do { uint64_t hilo_ = (v); HI = hilo_ >> 32; LO = (uint32_t)hilo_; } while (0)
+#define CPC		CURRENT_STATE.PC
+#define NPC		NEXT_STATE.PC
+#define S32(x)		((int32_t)(x))
+#define LINK(r)		(CURRENT_STATE.R[r] = CPC + 8)
+#define BRANCH(c)	do { if (c) NPC = IMM; } while (0)
+#define BRANCH_LIKELY(c)	do { if (c) NPC = IMM; else CORE->annul = TRUE; } while (0)	/* -D skips the delay slot */
+#define TRAP(code)	do { raise_exception(code, 0); return; } while (0)
+#define TRAP_IF(c, code)	do { if (c) TRAP(code); } while (0)
+#define ADD_OVERFLOWS(a, b, r)	((~((a) ^ (b)) & ((a) ^ (r))) >> 31)
+#define SUB_OVERFLOWS(a, b, r)	((((a) ^ (b)) & ((a) ^ (r))) >> 31)
+/* physical address of a; a TLB fault abandons the instruction */
+#define PADDR(a, acc)	({ uint32_t pa_ = (a); if (MMU_ENABLED && !mmu_translate(&pa_, acc)) return; pa_; })
+/* ... of an access of size bytes, seen by the tracer when there is one */
+#define MEMREF(a, acc, size)	TRACE_ACCESS(PADDR(a, acc), size, acc)
+#define LOAD8(a)	mem_read_8(MEMREF(a, ACC_LOAD, 1))
+#define LOAD16(a)	mem_read_16(MEMREF(a, ACC_LOAD, 2))
+#define LOAD32(a)	mem_read_32(MEMREF(a, ACC_LOAD, 4))
+#define STORE8(a, v)	mem_write_8(MEMREF(a, ACC_STORE, 1), v)
+#define STORE16(a, v)	mem_write_16(MEMREF(a, ACC_STORE, 2), v)
+#define STORE32(a, v)	mem_write_32(MEMREF(a, ACC_STORE, 4), v)
+#define FS		(d->rd)		/* FPU operands: fs, ft, fd */
+#define FT		(d->rt)
+#define FD		(d->sa)
+#define FPR(r)		CURRENT_STATE.FPR[r]
+#define CC_CMP		(d->sa >> 2)	/* condition code a compare writes */
+#define CC_BR		(d->rt >> 2)	/* condition code a branch or MOVF/MOVT reads */
+#define GET_FCC(cc)	((CURRENT_STATE.FCSR & fpu_cc_bit(cc)) != 0)
+#define SET_FCC(cc, v)	(CURRENT_STATE.FCSR = (v) ? CURRENT_STATE.FCSR | fpu_cc_bit(cc) : CURRENT_STATE.FCSR & ~fpu_cc_bit(cc))
+#define GET_S(r)	fpr_get_s(r)
+#define GET_D(r)	fpr_get_d(r)
+#define SET_S(r, v)	fpr_set_s(r, v)
+#define SET_D(r, v)	fpr_set_d(r, v)
+#define SET_W(r, v)	(FPR(r) = (v))
+#define MOVE_S(rd, rs)	(FPR(rd) = FPR(rs))
+#define MOVE_D(rd, rs)	(FPR((rd) & ~1) = FPR((rs) & ~1), FPR((rd) | 1) = FPR((rs) | 1))
+#define HIWORD_S(r)	(r)		/* word holding the sign bit */
+#define HIWORD_D(r)	((r) | 1)
+/* the barriers keep the compiler from moving the arithmetic across the flag tests */
+#define FP_RESULT(set, r, expr)	do { \
+		__typeof__(expr) v_; \
+		if (fpu_begin()) { \
+			__asm__ volatile ("" ::: "memory"); \
+			v_ = (expr); \
+			__asm__ volatile ("" : "+m" (v_)); \
+			if (fpu_end()) return; \
+		} else { \
+			v_ = (expr); \
+		} \
+		set(r, v_); \
+	} while (0)
+
+/* run one decoded instruction; NEXT_STATE.PC already holds pc + 4 */
+void execute(const decoded_t *d)
+{
+	const isa_info_t *info = &ISA_INFO[d->op];
+
+	stat_add(CLASS_STAT[info->cls], 1);
+	if (info->cls >= CLS_FPU && !(CURRENT_STATE.CP0[CP0_STATUS] & STATUS_CU1)) {
+		CURRENT_STATE.CP0[CP0_CAUSE] = (CURRENT_STATE.CP0[CP0_CAUSE] & ~CAUSE_CE_MASK) | (1 << CAUSE_CE_SHIFT);
+		raise_exception(EXC_CPU, 0);
+		return;
+	}
+	if (info->size && !mem_access_ok(EA, info->size, info->cls == CLS_STORE || info->cls == CLS_FPU_STORE)) {
+		return;
+	}
+	switch (d->op) {
+#define X(name, mnem, enc, code, fmt, cls, size, ...) case OP_##name: { __VA_ARGS__ } break;
+		MIPS_ISA(X)
+#undef X
+		default:
+			raise_exception(EXC_RI, 0);
+			break;
+	}
+	CURRENT_STATE.R[0] = 0;
+}
+
+#undef RS
+#undef RT
+#undef RD
+#undef SA
+#undef IMM
+#undef EA
+#undef HI
+#undef LO
+#undef HILO
+#undef SET_HILO
+#undef CPC
+#undef NPC
+#undef S32
+#undef LINK
+#undef BRANCH
+#undef BRANCH_LIKELY
+#undef TRAP
+#undef TRAP_IF
+#undef ADD_OVERFLOWS
+#undef SUB_OVERFLOWS
+#undef LOAD8
+#undef LOAD16
+#undef LOAD32
+#undef STORE8
+#undef STORE16
+#undef STORE32
+#undef PADDR
+#undef LANE
+#undef DW_LO
+#undef DW_HI
+#undef MEMREF
+#undef FS
+#undef FT
+#undef FD
+#undef FPR
+#undef CC_CMP
+#undef CC_BR
+#undef GET_FCC
+#undef SET_FCC
+#undef GET_S
+#undef GET_D
+#undef SET_S
+#undef SET_D
+#undef SET_W
+#undef MOVE_S
+#undef MOVE_D
+#undef HIWORD_S
+#undef HIWORD_D
+#undef FP_RESULT
+
+/************************************************************/
+/* Instruction word for op with the given fields, the inverse  */
+/* of decode() for the field layout the table gives op          */
+/************************************************************/
+uint32_t isa_encode(int op, int rs, int rt, int rd, int sa, uint32_t imm)
+{
+	const isa_info_t *info = &ISA_INFO[op];
+	uint32_t regs = ((uint32_t)rs << 21) | (rt << 16);
+
+	switch (info->enc) {
+		case ENC_SPECIAL:
+			return (OPC_SPECIAL << 26) | regs | (rd << 11) | (sa << 6) | info->code;
+		case ENC_SPECIAL2:
+			return ((uint32_t)OPC_SPECIAL2 << 26) | regs | (rd << 11) | (sa << 6) | info->code;
+		case ENC_REGIMM:
+			return (OPC_REGIMM << 26) | ((uint32_t)rs << 21) | (info->code << 16) | (imm & 0xFFFF);
+		case ENC_COP0:
+			return ((uint32_t)OPC_COP0 << 26) | ((uint32_t)info->code << 21) | (rt << 16) | (rd << 11);
+		case ENC_COP0CO:
+			return ((uint32_t)OPC_COP0 << 26) | COP0_CO | info->code;
+		case ENC_MOVCI:
+			return (OPC_SPECIAL << 26) | ((uint32_t)rs << 21) | (((rt & ~3) | info->code) << 16) |
+				(rd << 11) | FUNCT_MOVCI;
+		case ENC_COP1:
+			return ((uint32_t)OPC_COP1 << 26) | ((uint32_t)info->code << 21) | (rt << 16) | (rd << 11);
+		case ENC_COP1_BC:
+			return ((uint32_t)OPC_COP1 << 26) | (COP1_BC << 21) | (((rt & ~3) | info->code) << 16) | (imm & 0xFFFF);
+		case ENC_COP1_S:
+		case ENC_COP1_D:
+		case ENC_COP1_W:
+			rs = (info->enc == ENC_COP1_S) ? COP1_FMT_S : (info->enc == ENC_COP1_D) ? COP1_FMT_D : COP1_FMT_W;
+			return ((uint32_t)OPC_COP1 << 26) | ((uint32_t)rs << 21) | (rt << 16) | (rd << 11) | (sa << 6) | info->code;
+		default:
+			if (info->fmt == DIS_JUMP) {
+				return ((uint32_t)info->code << 26) | (imm & 0x03FFFFFF);
+			}
+			return ((uint32_t)info->code << 26) | regs | (imm & 0xFFFF);
+	}
+}
+
+/************************************************************/
+/* Self-check generated from the table: every row must encode  */
+/* to a word that decodes back to it and disassembles under    */
+/* its own mnemonic. Returns the number of failures.           */
+/************************************************************/
+int isa_selftest()
+{
+	char line[LISTING_LINE];
+	decoded_t d;
+	uint32_t word;
+	size_t n;
+	int op, failures = 0;
+
+	for (op = OP_INVALID + 1; op < OP_NUM; op++) {
+		word = isa_encode(op, 5, 6, 7, 3, 0x1234);
+		decode(MEM_TEXT_BEGIN, word, &d);
+		disassemble(MEM_TEXT_BEGIN, word, line, sizeof(line));
+		n = strlen(ISA_INFO[op].name);
+		if (d.op != op || strncmp(line, ISA_INFO[op].name, n) != 0 ||
+				(line[n] != ' ' && line[n] != '\0')) {
+			printf("FAIL %-8s 0x%08x decodes as %s, \"%s\"\n", ISA_INFO[op].name, word,
+				ISA_INFO[d.op].name ? ISA_INFO[d.op].name : "(invalid)", line);
+			failures++;
+		}
+	}
+	printf("ISA self-check: %d instructions, %d failures\n", OP_NUM - 1, failures);
+	return failures;
+}
+
+/* from now on a store to addr's page calls code_invalidate() */
+static inline void code_page_mark(uint32_t addr)
+{
+	uint32_t page = addr >> MMU_PAGE_SHIFT;
+
+	if (!(CODE_PAGES[page >> 3] & (1 << (page & 7)))) {
+		__atomic_fetch_or(&CODE_PAGES[page >> 3], (uint8_t)(1 << (page & 7)), __ATOMIC_RELAXED);
+	}
+}
+
+/************************************************************/
+/* Bulk copy/fill loops
+   Word-by-word copy and fill loops of the shape
+
+	loop:	[lw    $t, soff($src)]
+		[nop]				(as .set reorder pads a load)
+		sw    $t|$v, doff($dst)
+		addiu $x, $x, step		(one per induction register)
+		bne   $ctr, $bound, loop
+		[nop]				(the delay slot, under -D)
+
+   are recognized once per loop head and, when the trip count is
+   large enough, executed as a single host memmove/memset on the
+   backing region memory with the registers left exactly as the
+   interpreted loop would leave them.
+************************************************************/
+
+/* drop every cached verdict, the text they were derived from is gone */
+void bulk_flush()
+{
+	int i;
+	for (i = 0; i < MAX_CORES; i++) {
+		memset(CORES[i].bulk_cache, 0, sizeof(CORES[i].bulk_cache));
+	}
+}
+
+static int bulk_induction(const bulk_loop_t *b, int reg)
+{
+	int k;
+	for (k = 0; k < b->nind; k++) {
+		if (b->ind_reg[k] == reg) {
+			return k;
+		}
+	}
+	return -1;
+}
+
+/* match the loop starting at pc against the canonical shapes */
+static void bulk_analyze(uint32_t pc, bulk_loop_t *b)
+{
+	uint32_t addr = pc;
+	decoded_t d;
+	int k, have_sw = 0, vreg = -1, src = -1, dst = -1, rs = 0, rt = 0;
+
+	memset(b, 0, sizeof(*b));
+	b->pc = pc;
+	b->kind = BULK_NONE;
+
+	for (k = 0; k < BULK_MAX_BODY; k++, addr += 4) {
+		code_page_mark(addr);	/* a store to the body drops the verdict */
+		decode(addr, mem_read_32(addr), &d);
+
+		if (d.op == OP_LW && k == 0) {
+			b->tmp = d.rt;
+			src = d.rs;
+			b->soff = d.imm;
+		} else if (d.word == 0 && k > 0 && b->nind == 0) {
+			/* a nop, as .set reorder puts between the lw and the sw */
+		} else if (d.op == OP_SW && !have_sw && b->nind == 0) {
+			have_sw = 1;
+			vreg = d.rt;
+			dst = d.rs;
+			b->doff = d.imm;
+		} else if (d.op == OP_ADDIU && have_sw && d.rs == d.rt && d.rt != 0 &&
+				b->nind < BULK_MAX_IND && bulk_induction(b, d.rt) < 0) {
+			b->ind_reg[b->nind] = d.rt;
+			b->ind_step[b->nind] = d.imm;
+			b->nind++;
+		} else if (d.op == OP_BNE && b->nind > 0 && d.imm == pc) {
+			rs = d.rs;
+			rt = d.rt;
+			b->len = k + 1;
+			if (DELAY_SLOTS) {
+				code_page_mark(addr + 4);
+				if (mem_read_32(addr + 4) != 0) {
+					return;	/* the slot runs every trip; only an empty one is understood */
+				}
+				b->len++;
+			}
+			break;
+		} else {
+			return;
+		}
+	}
+	if (b->len == 0) {
+		return;
+	}
+
+	/* exactly one side of the bne may be an induction register */
+	if (bulk_induction(b, rs) >= 0 && bulk_induction(b, rt) < 0) {
+		b->ctr = bulk_induction(b, rs);
+		b->bound = rt;
+	} else if (bulk_induction(b, rt) >= 0 && bulk_induction(b, rs) < 0) {
+		b->ctr = bulk_induction(b, rt);
+		b->bound = rs;
+	} else {
+		return;
+	}
+
+	/* the destination (and source) pointers must walk forward a word at a time */
+	k = bulk_induction(b, dst);
+	if (k < 0 || b->ind_step[k] != 4) {
+		return;
+	}
+	b->dst = dst;
+
+	if (src >= 0) {
+		/* copy: the loaded temporary is what gets stored and nothing else */
+		k = bulk_induction(b, src);
+		if (k < 0 || b->ind_step[k] != 4 || src == dst || vreg != b->tmp ||
+				b->tmp == 0 || bulk_induction(b, b->tmp) >= 0 || b->bound == b->tmp) {
+			return;
+		}
+		b->src = src;
+		b->kind = BULK_COPY;
+	} else {
+		/* fill: the stored value is loop invariant */
+		if (bulk_induction(b, vreg) >= 0) {
+			return;
+		}
+		b->tmp = vreg;
+		b->kind = BULK_FILL;
+	}
+}
+
+/* run the loop at pc in bulk if possible; returns TRUE when it did */
+int bulk_try(uint32_t pc)
+{
+	bulk_loop_t *b = &BULK_CACHE[(pc >> 2) & (BULK_CACHE_SIZE - 1)];
+	uint32_t diff, step, n, trips, bytes, daddr, saddr = 0, last = 0;
+	uint64_t limit;
+	int k;
+
+	if (MMU_ENABLED) {
+		return FALSE;	/* pointers are virtual; leave translation to the interpreter */
+	}
+#ifdef MEM_TRACE
+	return FALSE;		/* the tracer wants every access */
+#endif
+#if FEATURE_TIMING
+	if (TIMING != NULL) {
+		return FALSE;	/* so does the timing model, every instruction */
+	}
+#endif
+#if FEATURE_ENERGY
+	if (ENERGY != NULL) {
+		return FALSE;	/* and the energy model */
+	}
+#endif
+	if (b->pc != pc) {
+		bulk_analyze(pc, b);
+	}
+	if (b->kind == BULK_NONE) {
+		return FALSE;
+	}
+
+	/* trip count: first n >= 1 with ctr + n*step == bound (mod 2^32) */
+	diff = CURRENT_STATE.R[b->bound] - CURRENT_STATE.R[b->ind_reg[b->ctr]];
+	if (b->ind_step[b->ctr] > 0) {
+		step = b->ind_step[b->ctr];
+	} else {
+		step = -b->ind_step[b->ctr];
+		diff = -diff;
+	}
+	if (step == 0 || diff == 0 || diff % step != 0) {
+		return FALSE;
+	}
+	n = trips = diff / step;
+	/* no further than the next event or the instruction limit; a
+	 * clipped run leaves the remaining trips to start again at pc */
+	limit = (EVENT_DEADLINE < INSTRUCTION_LIMIT) ? EVENT_DEADLINE : INSTRUCTION_LIMIT;
+	if (INSTRUCTION_COUNT >= limit) {
+		return FALSE;
+	}
+	if ((uint64_t)n * b->len > limit - INSTRUCTION_COUNT) {
+		n = (limit - INSTRUCTION_COUNT) / b->len;
+	}
+	if (n < BULK_MIN_TRIPS || n > 0x3FFFFFFF) {
+		return FALSE;
+	}
+
+	/* both ranges word aligned, inside one region, clear of the loop itself */
+	bytes = n * 4;
+	daddr = CURRENT_STATE.R[b->dst] + b->doff;
+	if ((CURRENT_STATE.CP0[CP0_STATUS] & STATUS_UM) && !(CURRENT_STATE.CP0[CP0_STATUS] & (STATUS_EXL | STATUS_ERL))) {
+		return FALSE;	/* leave the address checks to the interpreter */
+	}
+	if ((daddr & 3) || mem_host_ptr(daddr, bytes) == NULL ||
+			(daddr < pc + 4 * b->len && pc < daddr + bytes)) {
+		return FALSE;
+	}
+	if (b->kind == BULK_COPY) {
+		saddr = CURRENT_STATE.R[b->src] + b->soff;
+		if ((saddr & 3) || mem_host_ptr(saddr, bytes) == NULL) {
+			return FALSE;
+		}
+		/* a forward word loop over an overlap that runs ahead of the
+		 * source replicates a pattern rather than moving bytes */
+		if (daddr > saddr && daddr < saddr + bytes) {
+			return FALSE;
+		}
+		last = mem_read_32(saddr + bytes - 4);
+		mem_copy(daddr, saddr, bytes);
+		CURRENT_STATE.R[b->tmp] = last;
+	} else {
+		mem_fill(daddr, CURRENT_STATE.R[b->tmp], bytes);
+	}
+
+	for (k = 0; k < b->nind; k++) {
+		CURRENT_STATE.R[b->ind_reg[k]] += n * (uint32_t)(int32_t)b->ind_step[k];
+	}
+	CURRENT_STATE.PC = (n == trips) ? pc + 4 * b->len : pc;
+	/* cycle() accounts for one of them */
+	INSTRUCTION_COUNT += n * b->len - 1;
+	stat_add(STAT_INSTRUCTIONS, (uint64_t)n * b->len - 1);
+	stat_add(STAT_LOADS, b->kind == BULK_COPY ? n : 0);
+	stat_add(STAT_STORES, n);
+	stat_add(STAT_BRANCHES, n);
+	stat_add(STAT_BULK_OPS, 1);
+#if FEATURE_COVERAGE
+	if (COV_BITS != NULL) {
+		cov_loop(pc, b->len);
+	}
+#endif
+	return TRUE;
+}
+
+/************************************************************/
+/* Decode cache
+   A store into a page whose bit is set in CODE_PAGES throws
+   away that page's entries in every core and clears the bit, so
+   stores anywhere else cost one bit test and code written before
+   it first runs (a loader copying a program) costs nothing. A
+   core sees its own stores on its next fetch; a fetch racing
+   another core's store may still run the old word, as on
+   hardware without SYNCI.
+************************************************************/
+void decode_flush()
+{
+	int k;
+
+	for (k = 0; k < DCACHE_SIZE; k++) {
+		DCACHE[k].pa = DCACHE_EMPTY;
+	}
+}
+
+void code_invalidate(uint32_t page)
+{
+	uint32_t first = (page << (MMU_PAGE_SHIFT - 2)) & (DCACHE_SIZE - 1), k, pc;
+	uint64_t dropped = 0;
+	dcache_entry_t *e;
+	int c;
+
+	__atomic_fetch_and(&CODE_PAGES[page >> 3], (uint8_t)~(1 << (page & 7)), __ATOMIC_RELAXED);
+	if (AOT_ACTIVE && page >= MEM_TEXT_BEGIN >> MMU_PAGE_SHIFT &&
+			page <= (MEM_TEXT_BEGIN + 4 * PROGRAM_SIZE - 1) >> MMU_PAGE_SHIFT) {
+		/* the translation no longer matches the text */
+		__atomic_store_n(&AOT_ACTIVE, FALSE, __ATOMIC_RELAXED);
+		for (c = 0; c < NUM_CORES; c++) {
+			__atomic_store_n(&CORES[c].aot_go, FALSE, __ATOMIC_RELAXED);
+		}
+	}
+	/* a page's words sit in consecutive slots */
+	for (c = 0; c < NUM_CORES; c++) {
+		e = &CORES[c].dcache[first];
+		for (k = 0; k < (1 << (MMU_PAGE_SHIFT - 2)); k++) {
+			if (__atomic_load_n(&e[k].pa, __ATOMIC_RELAXED) >> MMU_PAGE_SHIFT == page) {
+				__atomic_store_n(&e[k].pa, DCACHE_EMPTY, __ATOMIC_RELAXED);
+				dropped++;
+			}
+		}
+		/* and bulk verdicts on loops with a word there (bulk_try() runs flat, pc == pa) */
+		for (k = 0; k < BULK_CACHE_SIZE; k++) {
+			pc = __atomic_load_n(&CORES[c].bulk_cache[k].pc, __ATOMIC_RELAXED);
+			if (pc != 0 && (pc >> MMU_PAGE_SHIFT <= page &&
+					(pc + 4 * BULK_MAX_BODY) >> MMU_PAGE_SHIFT >= page)) {
+				__atomic_store_n(&CORES[c].bulk_cache[k].pc, 0, __ATOMIC_RELAXED);
+			}
+		}
+	}
+	stat_add(STAT_CODE_WRITES, 1);
+	stat_add(STAT_DECODES_DROPPED, dropped);
+}
+
+/* whether a record read from outside (an image, a cache file) is
+ * what decode() makes of word: the semantics index R[] and the FPRs
+ * with its fields unchecked */
+static int decode_record_ok(const decoded_t *d, uint32_t word)
+{
+	return d->word == word && d->op < OP_NUM &&
+		d->rs == ((word >> 21) & 0x1f) && d->rt == ((word >> 16) & 0x1f) &&
+		d->rd == ((word >> 11) & 0x1f) && d->sa == ((word >> 6) & 0x1f);
+}
+
+/* Fill every core's decode cache with records for the words from
+ * base on, as if each had been fetched. Not with the TLB on, where
+ * the cache is keyed by the physical address of a virtual one. A
+ * record that does not fit the word in memory is left out and that
+ * word decoded when it is fetched. */
+void decode_prefill(const decoded_t *records, uint32_t base, uint32_t words)
+{
+	uint32_t k, n, page, bad = 0;
+	dcache_entry_t *e;
+	int c, ok;
+
+	if (MMU_ENABLED || words == 0) {
+		return;
+	}
+	/* past DCACHE_SIZE words the slots alias; the first words win */
+	n = (words < DCACHE_SIZE) ? words : DCACHE_SIZE;
+	for (k = 0; k < n; k++) {
+		ok = decode_record_ok(&records[k], mem_read_32(base + 4 * k));
+		bad += !ok;
+		for (c = 0; c < NUM_CORES; c++) {
+			e = &CORES[c].dcache[((base >> 2) + k) & (DCACHE_SIZE - 1)];
+			if (!ok) {
+				e->pa = DCACHE_EMPTY;
+				continue;
+			}
+			e->d = records[k];
+			e->va = base + 4 * k;
+			e->pa = base + 4 * k;
+		}
+	}
+	if (bad != 0) {
+		printf("Error: %u pre-decoded records do not match their words; decoding those as usual\n", bad);
+	}
+	/* so stores into the text still drop the entries */
+	for (page = base >> MMU_PAGE_SHIFT; page <= (base + 4 * n - 1) >> MMU_PAGE_SHIFT; page++) {
+		CODE_PAGES[page >> 3] |= 1 << (page & 7);
+	}
+}
+
+/************************************************************/
+/* Fetch and decode the instruction at addr; on a fault the    */
+/* exception is raised instead and NULL returned               */
+/************************************************************/
+static const decoded_t *fetch(uint32_t addr)
+{
+	uint32_t pa = addr, page, word;
+	const decoded_t *saved;
+	dcache_entry_t *e;
+
+	if (addr & 3) {
+		raise_exception(EXC_ADEL, addr);
+		return NULL;
+	}
+	if (MMU_ENABLED && !mmu_translate(&pa, ACC_FETCH)) {
+		return NULL;
+	}
+	e = &DCACHE[(pa >> 2) & (DCACHE_SIZE - 1)];
+	if (__atomic_load_n(&e->pa, __ATOMIC_RELAXED) == pa && e->va == addr) {
+#if FEATURE_CHECKS
+		if (e->d.word != mem_read_32(pa)) {
+			printf("Error: decode cache holds 0x%08x for 0x%08x, memory has 0x%08x\n",
+				e->d.word, addr, mem_read_32(pa));
+			abort();
+		}
+#endif
+		return &e->d;
+	}
+	if (mem_host_ptr(pa, 4) == NULL) {
+		raise_exception(EXC_IBE, addr);
+		return NULL;
+	}
+	/* mark the page before the entry becomes visible */
+	page = pa >> MMU_PAGE_SHIFT;
+	if (!(CODE_PAGES[page >> 3] & (1 << (page & 7)))) {
+		__atomic_fetch_or(&CODE_PAGES[page >> 3], (uint8_t)(1 << (page & 7)), __ATOMIC_RELAXED);
+	}
+	word = mem_read_32(pa);
+	/* the persistent cache only holds flat text, where pa == addr */
+	saved = NULL;
+	if (PCACHE_MAP != NULL && pa - PCACHE_MAP->text_base < 4 * PCACHE_MAP->text_words) {
+		saved = (const decoded_t *)(PCACHE_MAP + 1) + ((pa - PCACHE_MAP->text_base) >> 2);
+	}
+	if (saved != NULL && decode_record_ok(saved, word)) {
+		e->d = *saved;
+		stat_add(STAT_DECODES_REUSED, 1);
+	} else {
+		decode(addr, word, &e->d);
+		stat_add(STAT_DECODES, 1);
+	}
+	e->va = addr;
+	__atomic_store_n(&e->pa, pa, __ATOMIC_RELEASE);
+	return &e->d;
+}
+
+/************************************************************/
+/* Delay slots
+   handle_instruction() takes an op off its plain path only when
+   STEP_KIND says so: LW and SW for bulk_try(), and with -D and -L
+   branches and loads for handle_delayed(). Everything else costs
+   what it did without delay slots, bar landing -L's pending load
+   in retired(), which needs no test.
+
+   A branch or jump runs with NPC at addr + 8, so one not taken
+   goes past its delay slot, then runs the slot before going to
+   the target; a branch-likely that falls through sets annul and
+   skips it. The slot runs with the PC still on the branch: an
+   exception there stops or vectors on the branch with Cause.BD
+   set, so ERET runs both again, and a branch in the slot is a
+   reserved instruction. A load puts back the old value of rt and
+   leaves the loaded one in load_reg/load_value until the next
+   instruction has run, except that LWL and LWR merge with a
+   pending load of their own register, as MIPS I lets them.
+************************************************************/
+enum { STEP_BULK = 1, STEP_BRANCH = 2, STEP_LOAD = 4 };
+
+static uint8_t STEP_KIND[OP_NUM] = { [OP_LW] = STEP_BULK, [OP_SW] = STEP_BULK };
+
+/* set -D and -L, and which ops the plain path hands on */
+void delay_configure(int slots, int loads)
+{
+	int op, cls;
+
+	DELAY_SLOTS = slots != 0;
+	LOAD_DELAY = loads != 0;
+	for (op = OP_INVALID + 1; op < OP_NUM; op++) {
+		cls = ISA_INFO[op].cls;
+		/* with -L a copy loop's sw stores the value before its lw */
+		STEP_KIND[op] = ((op == OP_LW || op == OP_SW) && !LOAD_DELAY ? STEP_BULK : 0) |
+			((cls == CLS_BRANCH || cls == CLS_FPU_BRANCH) && DELAY_SLOTS ? STEP_BRANCH : 0) |
+			(cls == CLS_LOAD && LOAD_DELAY ? STEP_LOAD : 0);
+	}
+	bulk_flush();	/* a verdict depends on whether the bne has a slot */
+}
+
+/* d, at addr, has run: a pending load lands (or $zero is zeroed
+ * again), and coverage and the timing model see d */
+static inline void retired(uint32_t addr, const decoded_t *d, uint32_t ea)
+{
+	CURRENT_STATE.R[CORE->load_reg] = CORE->load_value;
+	CORE->load_reg = 0;
+	CORE->load_value = 0;
+#if FEATURE_TIMING
+	if (TIMING != NULL) {
+		timing_step(addr, d, ea);
+	}
+#endif
+#if FEATURE_ENERGY
+	if (ENERGY != NULL) {
+		energy_step(addr, d, ea);
+	}
+#endif
+#if FEATURE_COVERAGE
+	if (COV_BITS != NULL) {
+		cov_record(addr, d);
+	}
+#endif
+}
+
+/* handle_instruction()'s plain path for d, at addr, except that
+ * with -L a load's value waits in load_reg/load_value */
+static void run_one(uint32_t addr, const decoded_t *d)
+{
+	uint32_t ea = CURRENT_STATE.R[d->rs] + d->imm, old, value;
+
+	if (!(STEP_KIND[d->op] & STEP_LOAD)) {
+		execute(d);
+		retired(addr, d, ea);
+		return;
+	}
+	if ((d->op == OP_LWL || d->op == OP_LWR) && CORE->load_reg == d->rt) {
+		CURRENT_STATE.R[d->rt] = CORE->load_value;
+	}
+	old = CURRENT_STATE.R[d->rt];
+	CORE->trapped = FALSE;
+	execute(d);
+	if (CORE->trapped || d->rt == 0) {
+		retired(addr, d, ea);
+		return;
+	}
+	value = CURRENT_STATE.R[d->rt];
+	CURRENT_STATE.R[d->rt] = old;
+	retired(addr, d, ea);		/* the load before may land in rt too */
+	CORE->load_reg = d->rt;
+	CORE->load_value = value;
+}
+
+/* a branch with -D or a load with -L, and its effect on the next instruction */
+static void handle_delayed(uint32_t addr, const decoded_t *d)
+{
+	const decoded_t *slot;
+	uint32_t target;
+
+	if (!(STEP_KIND[d->op] & STEP_BRANCH)) {
+		run_one(addr, d);
+		CURRENT_STATE.PC = NEXT_STATE.PC;
+		return;
+	}
+	NEXT_STATE.PC = addr + 8;
+	CORE->annul = FALSE;
+	CORE->trapped = FALSE;
+	run_one(addr, d);
+	if (!CORE->trapped && !CORE->annul) {
+		target = NEXT_STATE.PC;
+		NEXT_STATE.PC = addr + 8;	/* the slot's own next PC, for retired() */
+		CORE->in_delay_slot = TRUE;
+		if ((slot = fetch(addr + 4)) != NULL) {
+			if (STEP_KIND[slot->op] & STEP_BRANCH) {
+				raise_exception(EXC_RI, 0);
+			} else {
+				run_one(addr + 4, slot);
+			}
+		}
+		CORE->in_delay_slot = FALSE;
+		/* cycle() counts the branch */
+		INSTRUCTION_COUNT++;
+		stat_add(STAT_INSTRUCTIONS, 1);
+		if (!CORE->trapped) {
+			NEXT_STATE.PC = target;
+		}
+	}
+	CURRENT_STATE.PC = NEXT_STATE.PC;
+}
+
+/************************************************************/
+/* decode and execute instruction                                                                     */ 
+/************************************************************/
+void handle_instruction()
+{
+	uint32_t addr = CURRENT_STATE.PC;
+	const decoded_t *d;
+	uint32_t ea;
+
+	NEXT_STATE.PC = addr + 4;
+	if ((d = fetch(addr)) == NULL) {
+		CURRENT_STATE.PC = NEXT_STATE.PC;
+		return;
+	}
+	if (STEP_KIND[d->op]) {
+		if ((STEP_KIND[d->op] & STEP_BULK) && bulk_try(addr)) {
+			return;
+		}
+		if (STEP_KIND[d->op] & (STEP_BRANCH | STEP_LOAD)) {
+			handle_delayed(addr, d);
+			return;
+		}
+	}
+	ea = CURRENT_STATE.R[d->rs] + d->imm;	/* before execute() can change rs */
+	execute(d);
+	retired(addr, d, ea);
+	CURRENT_STATE.PC = NEXT_STATE.PC;
+}
+
+/************************************************************/
+/* Address checks for a size byte load/store at ea: alignment  */
+/* and user-mode access to kernel space raise an address error */
+/************************************************************/
+int mem_access_ok(uint32_t ea, uint32_t size, int store)
+{
+	if ((ea & (size - 1)) || (ea >= MEM_KTEXT_BEGIN && (CURRENT_STATE.CP0[CP0_STATUS] & STATUS_UM) &&
+			!(CURRENT_STATE.CP0[CP0_STATUS] & (STATUS_EXL | STATUS_ERL)))) {
+		raise_exception(store ? EXC_ADES : EXC_ADEL, ea);
+		return FALSE;
+	}
+	return TRUE;
+}
+/************************************************************/
+/* Initialize Memory                                                                                                    */ 
+/************************************************************/
+void initialize() { 
+	int c;
+
+	init_memory();
+	devices_init();
+	if (NUM_CORES < 1) {
+		NUM_CORES = 1;
+	}
+	if (SCHED_QUANTUM == 0) {
+		SCHED_QUANTUM = DEFAULT_QUANTUM;
+	}
+	for (c = 0; c < NUM_CORES; c++) {
+		CORES[c].id = c;
+		CORES[c].stats = stats_attach();
+		select_core(c);
+		cp0_reset();
+		decode_flush();
+		CURRENT_STATE.R[29] = STACK_TOP;
+		CURRENT_STATE.PC = MEM_TEXT_BEGIN;
+		NEXT_STATE = CURRENT_STATE;
+		RUN_FLAG = TRUE;
+	}
+	timing_init();
+	energy_init();
+	select_core(0);
+}
+
+/************************************************************/
+/* Disassembler
+   Mnemonic and operand format come from ISA_INFO for the decoded
+   op. Formatting goes straight into the caller's buffer with no
+   stdio and no heap.
+************************************************************/
+
+/* append helpers; p never moves past end, which keeps room for the NUL */
+static char *dis_str(char *p, char *end, const char *str)
+{
+	while (*str && p < end) {
+		*p++ = *str++;
+	}
+	return p;
+}
+
+static char *dis_reg(char *p, char *end, int reg)
+{
+	if (p < end) {
+		*p++ = '$';
+	}
+	return dis_str(p, end, RegNames[reg]);
+}
+
+static char *dis_hex(char *p, char *end, uint32_t v)
+{
+	static const char digits[] = "0123456789abcdef";
+	char tmp[8];
+	int n = 0;
+
+	p = dis_str(p, end, "0x");
+	do {
+		tmp[n++] = digits[v & 0xf];
+		v >>= 4;
+	} while (v);
+	while (n > 0 && p < end) {
+		*p++ = tmp[--n];
+	}
+	return p;
+}
+
+static char *dis_dec(char *p, char *end, int32_t v);
+
+static char *dis_freg(char *p, char *end, int reg)
+{
+	p = dis_str(p, end, "$f");
+	return dis_dec(p, end, reg);
+}
+
+/* condition code operand, left out when it is the default 0 */
+static char *dis_cc(char *p, char *end, int cc)
+{
+	if (cc == 0) {
+		return p;
+	}
+	p = dis_str(p, end, "$fcc");
+	p = dis_dec(p, end, cc);
+	return dis_str(p, end, ", ");
+}
+
+static char *dis_dec(char *p, char *end, int32_t v)
+{
+	char tmp[11];
+	int n = 0;
+	uint32_t u = (v < 0) ? -(uint32_t)v : (uint32_t)v;
+
+	if (v < 0 && p < end) {
+		*p++ = '-';
+	}
+	do {
+		tmp[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	while (n > 0 && p < end) {
+		*p++ = tmp[--n];
+	}
+	return p;
+}
+
+/************************************************************/
+/* Format the instruction word found at addr into buf (at most  */
+/* len bytes, always NUL terminated); returns the text length   */
+/************************************************************/
+int disassemble(uint32_t addr, uint32_t word, char *buf, size_t len)
+{
+	decoded_t d;
+	const isa_info_t *e;
+	int rs, rt, rd;
+	char *p = buf, *end;
+
+	if (len == 0) {
+		return 0;
+	}
+	end = buf + len - 1;
+
+	decode(addr, word, &d);
+	e = &ISA_INFO[d.op];
+	rs = d.rs;
+	rt = d.rt;
+	rd = d.rd;
+
+	if (word == 0) {
+		p = dis_str(p, end, "nop");
+	} else if (e->name == NULL) {
+		p = dis_str(p, end, ".word ");
+		p = dis_hex(p, end, word);
+	} else {
+		p = dis_str(p, end, e->name);
+		if (e->fmt != DIS_NONE) {
+			p = dis_str(p, end, " ");
+		}
+		switch (e->fmt) {
+			case DIS_RD_RS_RT:
+				p = dis_reg(p, end, rd); p = dis_str(p, end, ", ");
+				p = dis_reg(p, end, rs); p = dis_str(p, end, ", ");
+				p = dis_reg(p, end, rt);
+				break;
+			case DIS_RD_RT_RS:
+				p = dis_reg(p, end, rd); p = dis_str(p, end, ", ");
+				p = dis_reg(p, end, rt); p = dis_str(p, end, ", ");
+				p = dis_reg(p, end, rs);
+				break;
+			case DIS_RD_RT_SA:
+				p = dis_reg(p, end, rd); p = dis_str(p, end, ", ");
+				p = dis_reg(p, end, rt); p = dis_str(p, end, ", ");
+				p = dis_dec(p, end, d.sa);
+				break;
+			case DIS_RS_RT:
+				p = dis_reg(p, end, rs); p = dis_str(p, end, ", ");
+				p = dis_reg(p, end, rt);
+				break;
+			case DIS_RD_RS:
+				p = dis_reg(p, end, rd); p = dis_str(p, end, ", ");
+				p = dis_reg(p, end, rs);
+				break;
+			case DIS_RD:
+				p = dis_reg(p, end, rd);
+				break;
+			case DIS_RS:
+				p = dis_reg(p, end, rs);
+				break;
+			case DIS_RT_RS_SIMM:
+				p = dis_reg(p, end, rt); p = dis_str(p, end, ", ");
+				p = dis_reg(p, end, rs); p = dis_str(p, end, ", ");
+				p = dis_dec(p, end, d.imm);
+				break;
+			case DIS_RS_SIMM:
+				p = dis_reg(p, end, rs); p = dis_str(p, end, ", ");
+				p = dis_dec(p, end, d.imm);
+				break;
+			case DIS_RT_RS_UIMM:
+				p = dis_reg(p, end, rt); p = dis_str(p, end, ", ");
+				p = dis_reg(p, end, rs); p = dis_str(p, end, ", ");
+				p = dis_hex(p, end, d.imm);
+				break;
+			case DIS_RT_UIMM:
+				p = dis_reg(p, end, rt); p = dis_str(p, end, ", ");
+				p = dis_hex(p, end, d.imm);
+				break;
+			case DIS_RT_MEM:
+				p = dis_reg(p, end, rt); p = dis_str(p, end, ", ");
+				p = dis_dec(p, end, d.imm); p = dis_str(p, end, "(");
+				p = dis_reg(p, end, rs); p = dis_str(p, end, ")");
+				break;
+			case DIS_OP_MEM:
+				p = dis_dec(p, end, rt); p = dis_str(p, end, ", ");
+				p = dis_dec(p, end, d.imm); p = dis_str(p, end, "(");
+				p = dis_reg(p, end, rs); p = dis_str(p, end, ")");
+				break;
+			case DIS_RS_RT_BRANCH:
+				p = dis_reg(p, end, rs); p = dis_str(p, end, ", ");
+				p = dis_reg(p, end, rt); p = dis_str(p, end, ", ");
+				p = dis_hex(p, end, d.imm);
+				break;
+			case DIS_RS_BRANCH:
+				p = dis_reg(p, end, rs); p = dis_str(p, end, ", ");
+				p = dis_hex(p, end, d.imm);
+				break;
+			case DIS_JUMP:
+				p = dis_hex(p, end, d.imm);
+				break;
+			case DIS_RT_C0:
+			case DIS_RT_FCR:
+				p = dis_reg(p, end, rt); p = dis_str(p, end, ", $");
+				p = dis_dec(p, end, rd);
+				break;
+			case DIS_FD_FS_FT:
+				p = dis_freg(p, end, d.sa); p = dis_str(p, end, ", ");
+				p = dis_freg(p, end, rd); p = dis_str(p, end, ", ");
+				p = dis_freg(p, end, rt);
+				break;
+			case DIS_FD_FS:
+				p = dis_freg(p, end, d.sa); p = dis_str(p, end, ", ");
+				p = dis_freg(p, end, rd);
+				break;
+			case DIS_FD_FS_RT:
+				p = dis_freg(p, end, d.sa); p = dis_str(p, end, ", ");
+				p = dis_freg(p, end, rd); p = dis_str(p, end, ", ");
+				p = dis_reg(p, end, rt);
+				break;
+			case DIS_CC_FS_FT:
+				p = dis_cc(p, end, d.sa >> 2);
+				p = dis_freg(p, end, rd); p = dis_str(p, end, ", ");
+				p = dis_freg(p, end, rt);
+				break;
+			case DIS_RT_FS:
+				p = dis_reg(p, end, rt); p = dis_str(p, end, ", ");
+				p = dis_freg(p, end, rd);
+				break;
+			case DIS_FT_MEM:
+				p = dis_freg(p, end, rt); p = dis_str(p, end, ", ");
+				p = dis_dec(p, end, d.imm); p = dis_str(p, end, "(");
+				p = dis_reg(p, end, rs); p = dis_str(p, end, ")");
+				break;
+			case DIS_CC_BRANCH:
+				p = dis_cc(p, end, rt >> 2);
+				p = dis_hex(p, end, d.imm);
+				break;
+			case DIS_RD_RS_CC:
+				p = dis_reg(p, end, rd); p = dis_str(p, end, ", ");
+				p = dis_reg(p, end, rs); p = dis_str(p, end, ", $fcc");
+				p = dis_dec(p, end, rt >> 2);
+				break;
+		}
+	}
+	*p = '\0';
+	return p - buf;
+}
+
+/************************************************************/
+/* TRUE if word encodes an instruction the tables know about   */
+/************************************************************/
+int valid_instruction(uint32_t word)
+{
+	return decode_op(word) != OP_INVALID;
+}
+
+/************************************************************/
+/* Coverage
+   The interpreter calls cov_record() after each instruction it
+   executes while COV_BITS is set, and bulk_try() cov_loop() for
+   the loops it runs whole; -a is refused with -C, since the
+   translated code records nothing. A branch counts as taken when
+   it leaves NEXT_STATE.PC at its target. Bits are only ever set,
+   so merging is a word-wise OR and merging the same run twice
+   changes nothing.
+************************************************************/
+static uint64_t pcache_hash(uint64_t h, const void *p, size_t n);
+
+#define COV_WORDS(h)	(((h)->text_words + 63) / 64 + (2 * (h)->branches + 63) / 64)
+
+enum { COV_OUTSIDE, COV_MISSED, COV_HIT, COV_TAKEN_ONLY, COV_NOT_TAKEN_ONLY, COV_BOTH };
+
+static const char *COV_PREFIX[] = { "", "#####  ", "       ", "       ", "       ", "       " };
+static const char *COV_SUFFIX[] = { "", "", "", "\t[never falls through]", "\t[never taken]", "" };
+static const char *COV_COLOR[] = { NULL, "\033[31m", NULL, "\033[33m", "\033[33m", NULL };
+
+static int cov_is_branch(int op)
+{
+	int fmt = ISA_INFO[op].fmt;
+
+	return fmt == DIS_RS_RT_BRANCH || fmt == DIS_RS_BRANCH || fmt == DIS_CC_BRANCH;
+}
+
+static inline void cov_set(uint64_t *bits, uint32_t bit)
+{
+	uint64_t m = 1ull << (bit & 63);
+
+	if (!(__atomic_load_n(&bits[bit >> 6], __ATOMIC_RELAXED) & m)) {
+		__atomic_fetch_or(&bits[bit >> 6], m, __ATOMIC_RELAXED);
+	}
+}
+
+static int cov_test(const uint64_t *bits, uint32_t bit)
+{
+	return (bits[bit >> 6] >> (bit & 63)) & 1;
+}
+
+/* bit of branch number b (from 1) going the given way */
+static uint32_t cov_branch_bit(const cov_header_t *h, uint32_t b, int taken)
+{
+	return ((h->text_words + 63) & ~63u) + 2 * (b - 1) + !taken;
+}
+
+/* the header of the loaded text, and its branch index: by text word,
+ * branch number + 1, 0 if not a conditional branch */
+static uint32_t *cov_index(cov_header_t *out)
+{
+	cov_header_t h;
+	uint32_t *branch, k, word, n = 0;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = COV_MAGIC;
+	h.version = COV_VERSION;
+	h.text_base = MEM_TEXT_BEGIN;
+	h.text_words = PROGRAM_SIZE;
+	branch = calloc(PROGRAM_SIZE + 1, sizeof(uint32_t));
+	if (branch == NULL) {
+		printf("Error: out of memory for coverage\n");
+		return NULL;
+	}
+	h.key = pcache_hash(14695981039346656037ull, &h.text_base, 2 * sizeof(uint32_t));
+	for (k = 0; k < PROGRAM_SIZE; k++) {
+		word = mem_read_32(MEM_TEXT_BEGIN + 4 * k);
+		h.key = pcache_hash(h.key, &word, 4);
+		if (cov_is_branch(decode_op(word))) {
+			branch[k] = ++n;
+		}
+	}
+	h.branches = n;
+	*out = h;
+	return branch;
+}
+
+/* after loading: the header for the text, and fresh bits unless it is
+ * the text already being recorded */
+void cov_open()
+{
+	cov_header_t h;
+	uint32_t *branch;
+
+	if (!cov_file[0]) {
+		return;
+	}
+	if ((branch = cov_index(&h)) == NULL) {
+		exit(-1);
+	}
+	if (COV_BITS != NULL && memcmp(&h, &COV_HEADER, sizeof(h)) == 0) {
+		free(branch);
+		return;
+	}
+	free(COV_BITS);
+	free(COV_BRANCH);
+	COV_HEADER = h;
+	COV_BRANCH = branch;
+	COV_BITS = calloc(COV_WORDS(&h), sizeof(uint64_t));
+	if (COV_BITS == NULL) {
+		printf("Error: out of memory for coverage\n");
+		exit(-1);
+	}
+}
+
+/* d has just run at pc */
+void cov_record(uint32_t pc, const decoded_t *d)
+{
+	uint32_t k = (pc - COV_HEADER.text_base) >> 2, b;
+
+	if (k >= COV_HEADER.text_words) {
+		return;
+	}
+	cov_set(COV_BITS, k);
+	/* the op is checked too: the word may have been rewritten since loading */
+	if ((b = COV_BRANCH[k]) != 0 && cov_is_branch(d->op)) {
+		cov_set(COV_BITS, cov_branch_bit(&COV_HEADER, b, NEXT_STATE.PC == d->imm));
+	}
+}
+
+/* a loop run whole: every word, and its closing branch both ways
+ * (the only branch in a bulk body; under -D a nop slot follows it) */
+void cov_loop(uint32_t pc, uint32_t words)
+{
+	uint32_t k = (pc - COV_HEADER.text_base) >> 2, b;
+
+	for (; words > 0 && k < COV_HEADER.text_words; words--, k++) {
+		cov_set(COV_BITS, k);
+		if ((b = COV_BRANCH[k]) != 0) {
+			cov_set(COV_BITS, cov_branch_bit(&COV_HEADER, b, TRUE));
+			cov_set(COV_BITS, cov_branch_bit(&COV_HEADER, b, FALSE));
+		}
+	}
+}
+
+/* OR bits into file, creating it; runs sharing the file take turns */
+static int cov_merge_into(const char *file, const cov_header_t *h, const uint64_t *bits)
+{
+	size_t n = COV_WORDS(h), k, bytes = n * sizeof(uint64_t);
+	uint64_t *have = NULL;
+	cov_header_t old;
+	ssize_t got;
+	int fd, ret = -1;
+
+	if ((fd = open(file, O_RDWR | O_CREAT, 0644)) < 0) {
+		printf("Error: Can't open coverage file %s\n", file);
+		return -1;
+	}
+	if (flock(fd, LOCK_EX) != 0) {
+		printf("Error: Can't lock coverage file %s\n", file);
+		close(fd);
+		return -1;
+	}
+	got = pread(fd, &old, sizeof(old), 0);
+	if (got == 0) {
+		if (pwrite(fd, h, sizeof(*h), 0) == sizeof(*h) && pwrite(fd, bits, bytes, sizeof(*h)) == (ssize_t)bytes) {
+			ret = 0;
+		}
+	} else if (got != sizeof(old) || memcmp(&old, h, sizeof(old)) != 0) {
+		printf("Error: %s holds coverage of a different program\n", file);
+		close(fd);
+		return -1;
+	} else if ((have = malloc(bytes)) != NULL && pread(fd, have, bytes, sizeof(old)) == (ssize_t)bytes) {
+		for (k = 0; k < n; k++) {
+			have[k] |= bits[k];
+		}
+		if (pwrite(fd, have, bytes, sizeof(old)) == (ssize_t)bytes) {
+			ret = 0;
+		}
+	}
+	if (ret != 0) {
+		printf("Error: updating coverage file %s failed\n", file);
+	}
+	free(have);
+	close(fd);
+	return ret;
+}
+
+/* a whole coverage file, NULL if it cannot be read */
+static uint64_t *cov_read(const char *file, cov_header_t *h)
+{
+	uint64_t *bits = NULL;
+	size_t bytes;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY)) < 0) {
+		printf("Error: Can't open coverage file %s\n", file);
+		return NULL;
+	}
+	flock(fd, LOCK_SH);
+	if (pread(fd, h, sizeof(*h), 0) != sizeof(*h) || h->magic != COV_MAGIC || h->version != COV_VERSION) {
+		printf("Error: %s is not a coverage file\n", file);
+	} else if ((bytes = COV_WORDS(h) * sizeof(uint64_t), bits = malloc(bytes)) == NULL ||
+			pread(fd, bits, bytes, sizeof(*h)) != (ssize_t)bytes) {
+		printf("Error: %s is truncated\n", file);
+		free(bits);
+		bits = NULL;
+	}
+	close(fd);
+	return bits;
+}
+
+/* at the end of each run */
+void cov_save()
+{
+	if (COV_BITS != NULL) {
+		cov_merge_into(cov_file, &COV_HEADER, COV_BITS);
+	}
+}
+
+/* -J: OR files, which must all be of one program, into out */
+int cov_merge(const char *out, char **files, int n)
+{
+	cov_header_t first, h;
+	uint64_t *sum = NULL, *bits;
+	size_t k, words = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if ((bits = cov_read(files[i], &h)) == NULL) {
+			free(sum);
+			return 1;
+		}
+		if (sum == NULL) {
+			first = h;
+			sum = bits;
+			words = COV_WORDS(&h);
+			continue;
+		}
+		if (memcmp(&h, &first, sizeof(h)) != 0) {
+			printf("Error: %s holds coverage of a different program than %s\n", files[i], files[0]);
+			free(bits);
+			free(sum);
+			return 1;
+		}
+		for (k = 0; k < words; k++) {
+			sum[k] |= bits[k];
+		}
+		free(bits);
+	}
+	if (sum == NULL) {
+		printf("Error: -J needs coverage files to merge\n");
+		return 1;
+	}
+	i = cov_merge_into(out, &first, sum);
+	free(sum);
+	if (i == 0) {
+		printf("%d coverage files merged into %s\n", n, out);
+	}
+	return i != 0;
+}
+
+/* how the word at addr was covered, per cov laid out as COV_HEADER */
+static int cov_state(const uint64_t *cov, uint32_t addr)
+{
+	uint32_t k = (addr - COV_HEADER.text_base) >> 2, b;
+	int taken, fell;
+
+	if (cov == NULL || (addr & 3) || k >= COV_HEADER.text_words) {
+		return COV_OUTSIDE;
+	}
+	if (!cov_test(cov, k)) {
+		return COV_MISSED;
+	}
+	if ((b = COV_BRANCH[k]) == 0) {
+		return COV_HIT;
+	}
+	taken = cov_test(cov, cov_branch_bit(&COV_HEADER, b, TRUE));
+	fell = cov_test(cov, cov_branch_bit(&COV_HEADER, b, FALSE));
+	return taken ? (fell ? COV_BOTH : COV_TAKEN_ONLY) : COV_NOT_TAKEN_ONLY;
+}
+
+/* coverage: the -C file with this process's runs merged in, or file
+ * if given, as a summary and an annotated listing */
+void print_coverage(const char *file)
+{
+	cov_header_t h;
+	uint64_t *bits;
+	uint32_t k, hit = 0, ways = 0;
+	int s;
+
+	if (file == NULL) {
+		if (COV_BITS == NULL) {
+			printf("Error: no coverage is being recorded (start with -C <file>)\n");
+			return;
+		}
+		cov_save();
+		file = cov_file;
+	}
+	if ((bits = cov_read(file, &h)) == NULL) {
+		return;
+	}
+	if (COV_BITS == NULL) {
+		/* nothing recorded here (no -C): index the text as loaded now */
+		free(COV_BRANCH);
+		if ((COV_BRANCH = cov_index(&COV_HEADER)) == NULL) {
+			free(bits);
+			return;
+		}
+	}
+	if (memcmp(&h, &COV_HEADER, sizeof(h)) != 0) {
+		printf("Error: %s holds coverage of a different program\n", file);
+		free(bits);
+		return;
+	}
+	print_listing(stdout, MEM_TEXT_BEGIN, PROGRAM_SIZE, bits);
+	for (k = 0; k < h.text_words; k++) {
+		s = cov_state(bits, MEM_TEXT_BEGIN + 4 * k);
+		hit += s != COV_MISSED;
+		ways += (s == COV_BOTH) * 2 + (s == COV_TAKEN_ONLY || s == COV_NOT_TAKEN_ONLY);
+	}
+	printf("\nCoverage: %u of %u instructions (%.1f%%), %u of %u branch directions (%.1f%%)\n\n",
+		hit, h.text_words, h.text_words ? 100.0 * hit / h.text_words : 100.0,
+		ways, 2 * h.branches, h.branches ? 50.0 * ways / h.branches : 100.0);
+	free(bits);
+}
+
+/************************************************************/
+/* Write a listing of words instructions starting at start to  */
+/* out, formatted into one large buffer flushed with fwrite;   */
+/* with cov, marked with how each was covered                  */
+/************************************************************/
+void print_listing(FILE *out, uint32_t start, uint32_t words, const uint64_t *cov)
+{
+	static char buf[LISTING_BUF];
+	uint8_t raw[LISTING_FETCH * 4];
+	size_t used = 0;
+	uint32_t addr = start, n, k, word;
+	int color = cov != NULL && isatty(fileno(out)), state;
+	char *p, *end;
+
+	while (words > 0) {
+		n = (words < LISTING_FETCH) ? words : LISTING_FETCH;
+		mem_read_block(addr, raw, n * 4);
+		for (k = 0; k < n; k++, addr += 4) {
+			if (LISTING_BUF - used < LISTING_LINE) {
+				fwrite(buf, 1, used, out);
+				used = 0;
+			}
+			memcpy(&word, raw + 4 * k, 4);
+			word = guest32(word);
+			p = buf + used;
+			end = buf + LISTING_BUF;
+			state = cov_state(cov, addr);
+			if (color && COV_COLOR[state] != NULL) {
+				p = dis_str(p, end, COV_COLOR[state]);
+			}
+			p = dis_str(p, end, COV_PREFIX[state]);
+			p = dis_str(p, end, "[");
+			p = dis_hex(p, end, addr);
+			p = dis_str(p, end, "]\t");
+			p += disassemble(addr, word, p, end - p);
+			p = dis_str(p, end, COV_SUFFIX[state]);
+			if (color && COV_COLOR[state] != NULL) {
+				p = dis_str(p, end, "\033[0m");
+			}
+			*p++ = '\n';
+			used = p - buf;
+		}
+		words -= n;
+	}
+	fwrite(buf, 1, used, out);
+	fflush(out);
+}
+
+/************************************************************/
+/* Print the program loaded into memory (infMIPS assembly format)    */ 
+/************************************************************/
+void print_program(){
+	print_listing(stdout, MEM_TEXT_BEGIN, PROGRAM_SIZE, COV_BITS);
+}
+
+/************************************************************/
+/* Print the instruction at given memory address (in MIPS assembly format)    */
+/************************************************************/
+void print_instruction(uint32_t addr){
+	char line[LISTING_LINE];
+	int state = cov_state(COV_BITS, addr);
+
+	disassemble(addr, mem_read_32(addr), line, sizeof(line));
+	printf("%s%s%s\n", COV_PREFIX[state], line, COV_SUFFIX[state]);
+}
+/************************************************************/
+/* Assembler
+   Two passes over the source: the first only sizes statements
+   and records label addresses, the second encodes. A statement
+   takes the same number of words in both passes (li of a label
+   is always lui/ori), so forward references need no fixups.
+   Instructions go through isa_encode() with operands in the
+   order the disassembler prints them, so any listing is valid
+   input. Registers are $name or $number, $fN and $fccN;
+   expressions are numbers, 'c' and labels joined by + and -.
+
+   Under the default .set reorder a nop follows every branch and
+   jump, and goes between a load and an instruction that reads its
+   register, so the code runs the same with or without delay slots
+   (-D) and load delays (-L); .set noreorder leaves the layout to
+   the source.
+************************************************************/
+enum { ASM_TEXT, ASM_DATA };
+
+typedef struct {
+	const char *file;
+	int line, pass, errors;
+	int section;			/* ASM_TEXT or ASM_DATA */
+	int reorder;			/* a nop after each branch and jump */
+	int load_reg;			/* rt of a load just emitted, or 0 */
+	uint32_t base[2], pc[2];	/* first and next address of each section */
+	int cap;			/* symbols allocated */
+	asm_program_t *prog;
+} asm_state_t;
+
+enum { PS_NOP, PS_MOVE, PS_NOT, PS_NEG, PS_NEGU, PS_LI, PS_LA, PS_B, PS_BEQZ, PS_BNEZ, PS_COMPARE };
+
+typedef struct {
+	const char *name;
+	uint8_t kind;
+	uint8_t slt;			/* PS_COMPARE: OP_SLT or OP_SLTU into $at */
+	uint8_t swap;			/* compare rt < rs instead of rs < rt */
+	uint8_t branch;			/* OP_BNE if taken when $at is set, else OP_BEQ */
+} asm_pseudo_t;
+
+static const asm_pseudo_t ASM_PSEUDO[] = {
+	{ "nop", PS_NOP }, { "move", PS_MOVE }, { "not", PS_NOT }, { "neg", PS_NEG },
+	{ "negu", PS_NEGU }, { "li", PS_LI }, { "la", PS_LA }, { "b", PS_B },
+	{ "beqz", PS_BEQZ }, { "bnez", PS_BNEZ },
+	{ "blt",  PS_COMPARE, OP_SLT,  0, OP_BNE }, { "bge",  PS_COMPARE, OP_SLT,  0, OP_BEQ },
+	{ "bgt",  PS_COMPARE, OP_SLT,  1, OP_BNE }, { "ble",  PS_COMPARE, OP_SLT,  1, OP_BEQ },
+	{ "bltu", PS_COMPARE, OP_SLTU, 0, OP_BNE }, { "bgeu", PS_COMPARE, OP_SLTU, 0, OP_BEQ },
+	{ "bgtu", PS_COMPARE, OP_SLTU, 1, OP_BNE }, { "bleu", PS_COMPARE, OP_SLTU, 1, OP_BEQ },
+};
+
+/* pass 1 meets the same statements; each problem is reported once, from pass 2 */
+static void asm_error(asm_state_t *s, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (s->pass != 2) {
+		return;
+	}
+	printf("Error: %s:%d: ", s->file, s->line);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+	s->errors++;
+}
+
+static char *asm_skip(char *p)
+{
+	while (*p == ' ' || *p == '\t') {
+		p++;
+	}
+	return p;
+}
+
+static int asm_ident_char(int c)
+{
+	return isalnum(c) || c == '_' || c == '.';
+}
+
+/* copy the identifier at *p into name (truncated to ASM_SYMBOL); FALSE if there is none */
+static int asm_ident(char **p, char *name)
+{
+	char *q = *p;
+	int n = 0;
+
+	if (!isalpha((unsigned char)*q) && *q != '_' && *q != '.') {
+		return FALSE;
+	}
+	while (asm_ident_char((unsigned char)*q)) {
+		if (n < ASM_SYMBOL - 1) {
+			name[n++] = *q;
+		}
+		q++;
+	}
+	name[n] = '\0';
+	*p = q;
+	return TRUE;
+}
+
+/* cut the comment (# to the end of the line) unless it is quoted */
+static void asm_strip(char *p)
+{
+	char quote = 0;
+
+	for (; *p; p++) {
+		if (quote) {
+			if (*p == '\\' && p[1]) {
+				p++;
+			} else if (*p == quote) {
+				quote = 0;
+			}
+		} else if (*p == '"' || *p == '\'') {
+			quote = *p;
+		} else if (*p == '#' || *p == '\r') {
+			*p = '\0';
+			break;
+		}
+	}
+}
+
+/* one character of a quoted literal, with C escapes */
+static int asm_char(char **p)
+{
+	char *q = *p;
+	int c = (unsigned char)*q++;
+
+	if (c == '\\') {
+		c = (unsigned char)*q++;
+		switch (c) {
+			case 'n': c = '\n'; break;
+			case 't': c = '\t'; break;
+			case 'r': c = '\r'; break;
+			case '0': c = '\0'; break;
+			case '\0': q--; break;
+			default: break;		/* \\, \" and \' stand for themselves */
+		}
+	}
+	*p = q;
+	return c;
+}
+
+static asm_symbol_t *asm_lookup(asm_state_t *s, const char *name)
+{
+	int k;
+
+	for (k = 0; k < s->prog->nsyms; k++) {
+		if (strcmp(s->prog->syms[k].name, name) == 0) {
+			return &s->prog->syms[k];
+		}
+	}
+	return NULL;
+}
+
+/* pass 1 records the first definition; pass 2 finds any other at a different address */
+static void asm_define(asm_state_t *s, const char *name, uint32_t addr)
+{
+	asm_program_t *prog = s->prog;
+	asm_symbol_t *sym = asm_lookup(s, name);
+
+	if (sym != NULL) {
+		if (sym->addr != addr) {
+			asm_error(s, "%s defined twice", name);
+		}
+		return;
+	}
+	if (prog->nsyms == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 64;
+		prog->syms = realloc(prog->syms, s->cap * sizeof(asm_symbol_t));
+		if (prog->syms == NULL) {
+			printf("Error: out of memory assembling %s\n", s->file);
+			exit(-1);
+		}
+	}
+	sym = &prog->syms[prog->nsyms++];
+	snprintf(sym->name, sizeof(sym->name), "%s", name);
+	sym->addr = addr;
+}
+
+/* number, 'c' or symbol, optionally negated; *label is set if a symbol was used */
+static int asm_term(asm_state_t *s, char **p, uint32_t *value, int *label)
+{
+	char name[ASM_SYMBOL], *q = asm_skip(*p), *end;
+	asm_symbol_t *sym;
+	int neg = FALSE;
+
+	if (*q == '-') {
+		neg = TRUE;
+		q = asm_skip(q + 1);
+	}
+	if (isdigit((unsigned char)*q)) {
+		*value = strtoul(q, &end, 0);
+		q = end;
+	} else if (*q == '\'') {
+		q++;
+		*value = asm_char(&q);
+		if (*q++ != '\'') {
+			asm_error(s, "bad character literal");
+			return FALSE;
+		}
+	} else if (asm_ident(&q, name)) {
+		sym = asm_lookup(s, name);
+		if (sym == NULL) {
+			asm_error(s, "undefined symbol %s", name);
+		}
+		*value = sym ? sym->addr : 0;
+		*label = TRUE;
+	} else {
+		asm_error(s, "expected a number or label at \"%s\"", q);
+		return FALSE;
+	}
+	if (neg) {
+		*value = -*value;
+	}
+	*p = q;
+	return TRUE;
+}
+
+static int asm_expr(asm_state_t *s, char **p, uint32_t *value, int *label)
+{
+	uint32_t v;
+	char *q;
+	int op;
+
+	if (!asm_term(s, p, value, label)) {
+		return FALSE;
+	}
+	for (;;) {
+		q = asm_skip(*p);
+		if (*q != '+' && *q != '-') {
+			return TRUE;
+		}
+		op = *q++;
+		if (!asm_term(s, &q, &v, label)) {
+			return FALSE;
+		}
+		*value = (op == '+') ? *value + v : *value - v;
+		*p = q;
+	}
+}
+
+/* $name or $number; -1 if *p is not a general register */
+static int asm_reg(asm_state_t *s, char **p)
+{
+	char name[ASM_SYMBOL], *q = asm_skip(*p), *end;
+	long n;
+	int k;
+
+	if (*q++ == '$') {
+		if (isdigit((unsigned char)*q)) {
+			n = strtol(q, &end, 10);
+			if (n < 32 && !asm_ident_char((unsigned char)*end)) {
+				*p = end;
+				return n;
+			}
+		} else if (asm_ident(&q, name)) {
+			for (k = 0; k < 32; k++) {
+				if (strcmp(name, RegNames[k]) == 0) {
+					*p = q;
+					return k;
+				}
+			}
+			if (strcmp(name, "s8") == 0) {
+				*p = q;
+				return 30;
+			}
+		}
+	}
+	asm_error(s, "expected a register at \"%s\"", asm_skip(*p));
+	return -1;
+}
+
+/* prefix followed by a number below limit ($f2, $fcc1, $12); -1 otherwise */
+static int asm_prefixed(asm_state_t *s, char **p, const char *prefix, int limit, const char *what)
+{
+	char *q = asm_skip(*p), *end;
+	size_t n = strlen(prefix);
+	long v;
+
+	if (strncmp(q, prefix, n) == 0 && isdigit((unsigned char)q[n])) {
+		v = strtol(q + n, &end, 10);
+		if (v < limit && !asm_ident_char((unsigned char)*end)) {
+			*p = end;
+			return v;
+		}
+	}
+	asm_error(s, "expected %s at \"%s\"", what, q);
+	return -1;
+}
+
+static int asm_comma(asm_state_t *s, char **p)
+{
+	char *q = asm_skip(*p);
+
+	if (*q != ',') {
+		asm_error(s, "expected ',' at \"%s\"", q);
+		return FALSE;
+	}
+	*p = q + 1;
+	return TRUE;
+}
+
+/* another list element follows: skip its comma */
+static int asm_more(asm_state_t *s, char **p)
+{
+	if (*asm_skip(*p) == '\0') {
+		return FALSE;
+	}
+	return asm_comma(s, p);
+}
+
+/* TRUE if nothing but blanks is left of the statement */
+static int asm_done(asm_state_t *s, char *p)
+{
+	p = asm_skip(p);
+	if (*p != '\0') {
+		asm_error(s, "unexpected \"%s\"", p);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* offset(base), (base), or a bare address with *rs = -1 */
+static int asm_mem(asm_state_t *s, char **p, uint32_t *imm, int *rs)
+{
+	char *q = asm_skip(*p);
+	int label = FALSE;
+
+	*imm = 0;
+	*rs = -1;
+	if (*q != '(' && !asm_expr(s, &q, imm, &label)) {
+		return FALSE;
+	}
+	q = asm_skip(q);
+	if (*q == '(') {
+		q++;
+		if ((*rs = asm_reg(s, &q)) < 0) {
+			return FALSE;
+		}
+		q = asm_skip(q);
+		if (*q++ != ')') {
+			asm_error(s, "expected ')'");
+			return FALSE;
+		}
+	}
+	*p = q;
+	return TRUE;
+}
+
+static uint32_t asm_simm(asm_state_t *s, uint32_t v)
+{
+	if ((int32_t)v < -32768 || (int32_t)v > 32767) {
+		asm_error(s, "immediate %d does not fit in 16 signed bits", (int32_t)v);
+	}
+	return v;
+}
+
+static uint32_t asm_uimm(asm_state_t *s, uint32_t v)
+{
+	if (v > 0xFFFF) {
+		asm_error(s, "immediate 0x%x does not fit in 16 bits", v);
+	}
+	return v;
+}
+
+/* n bytes of guest-order data at the data pc; NULL src for zeros */
+static void asm_bytes(asm_state_t *s, const void *src, uint32_t n)
+{
+	uint32_t off = s->pc[ASM_DATA] - s->base[ASM_DATA];
+
+	if (s->section != ASM_DATA) {
+		asm_error(s, "only .word, .float and .double may appear in .text");
+		return;
+	}
+	if (s->pass == 2 && src != NULL && off + n <= s->prog->data_bytes) {
+		memcpy(s->prog->data + off, src, n);
+	}
+	s->pc[ASM_DATA] += n;
+}
+
+/* one text word at the text pc */
+static void asm_emit(asm_state_t *s, uint32_t word)
+{
+	uint32_t k = (s->pc[ASM_TEXT] - s->base[ASM_TEXT]) >> 2;
+
+	if (s->section != ASM_TEXT) {
+		asm_error(s, "instruction outside .text");
+		return;
+	}
+	if (s->pass == 2 && k < s->prog->text_words) {
+		s->prog->text[k] = word;
+	}
+	s->pc[ASM_TEXT] += 4;
+	s->load_reg = 0;
+}
+
+/* a size-byte value in the current section, in guest byte order */
+static void asm_value(asm_state_t *s, uint32_t v, int size)
+{
+	uint16_t half = v;
+	uint8_t byte = v;
+
+	if (size == 4 && s->section == ASM_TEXT) {
+		asm_emit(s, v);
+	} else if (size == 4) {
+		v = guest32(v);
+		asm_bytes(s, &v, 4);
+	} else if (size == 2) {
+		half = guest16(half);
+		asm_bytes(s, &half, 2);
+	} else {
+		asm_bytes(s, &byte, 1);
+	}
+}
+
+static void asm_align(asm_state_t *s, uint32_t align)
+{
+	uint32_t pad = -s->pc[s->section] & (align - 1);
+
+	if (s->section == ASM_TEXT) {
+		for (; pad >= 4; pad -= 4) {
+			asm_emit(s, 0);
+		}
+	} else if (pad) {
+		asm_bytes(s, NULL, pad);
+	}
+}
+
+/* whether op, with these fields, reads GPR reg (as rs, or as an rt
+ * it does not only write); LWL and LWR merge with a pending load of
+ * their own rt, so that does not count */
+static int asm_reads(int op, int rs, int rt, int reg)
+{
+	switch (ISA_INFO[op].fmt) {
+		case DIS_RD_RS_RT: case DIS_RD_RT_RS: case DIS_RS_RT: case DIS_RS_RT_BRANCH:
+			return rs == reg || rt == reg;
+		case DIS_RD_RT_SA: case DIS_RT_C0: case DIS_RT_FS: case DIS_RT_FCR: case DIS_FD_FS_RT:
+			return rt == reg;
+		case DIS_RT_MEM:
+			return rs == reg || (rt == reg && ISA_INFO[op].cls == CLS_STORE);
+		case DIS_RD_RS: case DIS_RS: case DIS_RT_RS_SIMM: case DIS_RT_RS_UIMM: case DIS_RS_SIMM:
+		case DIS_OP_MEM: case DIS_FT_MEM: case DIS_RS_BRANCH: case DIS_RD_RS_CC:
+			return rs == reg;
+		default:
+			return FALSE;
+	}
+}
+
+/* encode op at the text pc; imm is the target address for branches and jumps */
+static void asm_insn(asm_state_t *s, int op, int rs, int rt, int rd, int sa, uint32_t imm)
+{
+	const isa_info_t *info = &ISA_INFO[op];
+	uint32_t pc = s->pc[ASM_TEXT];
+	int32_t off;
+
+	switch (info->fmt) {
+		case DIS_RS_RT_BRANCH: case DIS_RS_BRANCH: case DIS_CC_BRANCH:
+			off = (int32_t)(imm - (pc + 4));
+			if ((off & 3) || off < -0x20000 || off > 0x1FFFC) {
+				asm_error(s, "branch target 0x%08x out of reach", imm);
+			}
+			imm = (uint32_t)off >> 2;
+			break;
+		case DIS_JUMP:
+			if ((imm & 3) || (imm & 0xF0000000) != ((pc + 4) & 0xF0000000)) {
+				asm_error(s, "jump target 0x%08x out of reach", imm);
+			}
+			imm >>= 2;
+			break;
+	}
+	if (s->reorder && s->load_reg != 0 && asm_reads(op, rs, rt, s->load_reg)) {
+		asm_emit(s, 0);
+	}
+	asm_emit(s, isa_encode(op, rs, rt, rd, sa, imm));
+	if (s->reorder && (info->cls == CLS_BRANCH || info->cls == CLS_FPU_BRANCH)) {
+		asm_emit(s, 0);
+	}
+	if (info->cls == CLS_LOAD) {
+		s->load_reg = rt;
+	}
+}
+
+/* shortest of addiu, ori, lui and lui/ori */
+static void asm_li(asm_state_t *s, int rt, uint32_t v)
+{
+	if ((int32_t)v >= -32768 && (int32_t)v <= 32767) {
+		asm_insn(s, OP_ADDIU, 0, rt, 0, 0, v);
+	} else if (v <= 0xFFFF) {
+		asm_insn(s, OP_ORI, 0, rt, 0, 0, v);
+	} else {
+		asm_insn(s, OP_LUI, 0, rt, 0, 0, v >> 16);
+		if (v & 0xFFFF) {
+			asm_insn(s, OP_ORI, rt, rt, 0, 0, v & 0xFFFF);
+		}
+	}
+}
+
+/* operand parsers for one statement; each is a no-op once one has failed */
+#define REG(r)		(ok = ok && ((r) = asm_reg(s, &p)) >= 0)
+#define FREG(r)		(ok = ok && ((r) = asm_prefixed(s, &p, "$f", 32, "an FP register")) >= 0)
+#define CC(r)		(ok = ok && ((r) = asm_prefixed(s, &p, "$fcc", 8, "a condition code")) >= 0)
+#define COMMA		(ok = ok && asm_comma(s, &p))
+#define EXPR(v)		(ok = ok && asm_expr(s, &p, &(v), &label))
+#define HAS_CC		(strncmp(asm_skip(p), "$fcc", 4) == 0)
+
+/* expand a pseudo-instruction; FALSE if mnem is not one */
+static int asm_pseudo(asm_state_t *s, const char *mnem, char *p)
+{
+	const asm_pseudo_t *ps = NULL;
+	int rd = 0, rs = 0, rt = -1, ok = TRUE, label = FALSE;
+	uint32_t imm = 0, n = 0;
+	size_t k;
+
+	for (k = 0; k < sizeof(ASM_PSEUDO) / sizeof(ASM_PSEUDO[0]); k++) {
+		if (strcmp(mnem, ASM_PSEUDO[k].name) == 0) {
+			ps = &ASM_PSEUDO[k];
+		}
+	}
+	if (ps == NULL) {
+		return FALSE;
+	}
+	switch (ps->kind) {
+		case PS_MOVE: case PS_NOT: case PS_NEG: case PS_NEGU:
+			REG(rd); COMMA; REG(rs);
+			break;
+		case PS_LI: case PS_LA:
+			REG(rd); COMMA; EXPR(imm);
+			break;
+		case PS_B:
+			EXPR(imm);
+			break;
+		case PS_BEQZ: case PS_BNEZ:
+			REG(rs); COMMA; EXPR(imm);
+			break;
+		case PS_COMPARE:
+			REG(rs); COMMA;
+			if (*asm_skip(p) == '$') {
+				REG(rt);
+			} else {
+				EXPR(n);
+			}
+			COMMA; EXPR(imm);
+			break;
+	}
+	if (!ok || !asm_done(s, p)) {
+		return TRUE;
+	}
+	switch (ps->kind) {
+		case PS_NOP:
+			asm_emit(s, 0);
+			break;
+		case PS_MOVE:
+			asm_insn(s, OP_ADDU, rs, 0, rd, 0, 0);
+			break;
+		case PS_NOT:
+			asm_insn(s, OP_NOR, rs, 0, rd, 0, 0);
+			break;
+		case PS_NEG:
+			asm_insn(s, OP_SUB, 0, rs, rd, 0, 0);
+			break;
+		case PS_NEGU:
+			asm_insn(s, OP_SUBU, 0, rs, rd, 0, 0);
+			break;
+		case PS_LI:
+			/* a label may be 0 in pass 1, so it cannot pick the form */
+			if (!label) {
+				asm_li(s, rd, imm);
+				break;
+			}
+			/* fall through */
+		case PS_LA:
+			asm_insn(s, OP_LUI, 0, rd, 0, 0, imm >> 16);
+			asm_insn(s, OP_ORI, rd, rd, 0, 0, imm & 0xFFFF);
+			break;
+		case PS_B:
+			asm_insn(s, OP_BEQ, 0, 0, 0, 0, imm);
+			break;
+		case PS_BEQZ:
+		case PS_BNEZ:
+			asm_insn(s, ps->kind == PS_BEQZ ? OP_BEQ : OP_BNE, rs, 0, 0, 0, imm);
+			break;
+		case PS_COMPARE:
+			if (rt >= 0) {
+				asm_insn(s, ps->slt, ps->swap ? rt : rs, ps->swap ? rs : rt, 1, 0, 0);
+				asm_insn(s, ps->branch, 1, 0, 0, 0, imm);
+			} else {
+				/* rs > n is !(rs < n + 1) */
+				asm_insn(s, ps->slt == OP_SLT ? OP_SLTI : OP_SLTIU, rs, 1, 0, 0, asm_simm(s, n + ps->swap));
+				asm_insn(s, (ps->branch == OP_BNE) != ps->swap ? OP_BNE : OP_BEQ, 1, 0, 0, 0, imm);
+			}
+			break;
+	}
+	return TRUE;
+}
+
+/* a table instruction, operands in disassembler order */
+static void asm_operands(asm_state_t *s, int op, char *p)
+{
+	const isa_info_t *info = &ISA_INFO[op];
+	int rs = 0, rt = 0, rd = 0, sa = 0, cc = 0, ok = TRUE, label = FALSE, mem = FALSE;
+	uint32_t imm = 0;
+
+	switch (info->fmt) {
+		case DIS_NONE:
+			break;
+		case DIS_RD_RS_RT:
+			REG(rd); COMMA; REG(rs); COMMA; REG(rt);
+			break;
+		case DIS_RD_RT_RS:
+			REG(rd); COMMA; REG(rt); COMMA; REG(rs);
+			break;
+		case DIS_RD_RT_SA:
+			REG(rd); COMMA; REG(rt); COMMA; EXPR(imm);
+			if (ok && imm > 31) {
+				asm_error(s, "shift amount %u out of range", imm);
+			}
+			sa = imm & 31;
+			break;
+		case DIS_RS_RT:
+			REG(rs); COMMA; REG(rt);
+			break;
+		case DIS_RD_RS:
+			/* jalr rs links through $ra; clz and clo repeat rd in rt */
+			REG(rd);
+			if (op == OP_JALR && *asm_skip(p) != ',') {
+				rs = rd;
+				rd = 31;
+			} else {
+				COMMA; REG(rs);
+			}
+			if (op != OP_JALR) {
+				rt = rd;
+			}
+			break;
+		case DIS_RD:
+			REG(rd);
+			break;
+		case DIS_RS:
+			REG(rs);
+			break;
+		case DIS_RT_RS_SIMM:
+		case DIS_RT_RS_UIMM:
+			REG(rt); COMMA; REG(rs); COMMA; EXPR(imm);
+			break;
+		case DIS_RS_SIMM:
+			REG(rs); COMMA; EXPR(imm);
+			break;
+		case DIS_RT_UIMM:
+			REG(rt); COMMA; EXPR(imm);
+			break;
+		case DIS_RT_MEM:
+			REG(rt); COMMA;
+			mem = TRUE;
+			break;
+		case DIS_FT_MEM:
+			FREG(rt); COMMA;
+			mem = TRUE;
+			break;
+		case DIS_OP_MEM:
+			EXPR(imm); COMMA;
+			rt = imm & 31;
+			mem = TRUE;
+			break;
+		case DIS_RS_RT_BRANCH:
+			REG(rs); COMMA; REG(rt); COMMA; EXPR(imm);
+			break;
+		case DIS_RS_BRANCH:
+			REG(rs); COMMA; EXPR(imm);
+			break;
+		case DIS_JUMP:
+			EXPR(imm);
+			break;
+		case DIS_RT_C0:
+		case DIS_RT_FCR:
+			REG(rt); COMMA;
+			ok = ok && (rd = asm_prefixed(s, &p, "$", 32, "a coprocessor register")) >= 0;
+			break;
+		case DIS_FD_FS_FT:
+			FREG(sa); COMMA; FREG(rd); COMMA; FREG(rt);
+			break;
+		case DIS_FD_FS:
+			FREG(sa); COMMA; FREG(rd);
+			break;
+		case DIS_FD_FS_RT:
+			FREG(sa); COMMA; FREG(rd); COMMA; REG(rt);
+			break;
+		case DIS_CC_FS_FT:
+			if (HAS_CC) {
+				CC(cc); COMMA;
+			}
+			FREG(rd); COMMA; FREG(rt);
+			sa = cc << 2;
+			break;
+		case DIS_RT_FS:
+			REG(rt); COMMA; FREG(rd);
+			break;
+		case DIS_CC_BRANCH:
+			if (HAS_CC) {
+				CC(cc); COMMA;
+			}
+			EXPR(imm);
+			rt = cc << 2;
+			break;
+		case DIS_RD_RS_CC:
+			REG(rd); COMMA; REG(rs); COMMA; CC(cc);
+			rt = cc << 2;
+			break;
+	}
+	if (mem) {
+		ok = ok && asm_mem(s, &p, &imm, &rs);
+	}
+	if (!ok || !asm_done(s, p)) {
+		return;
+	}
+	switch (info->fmt) {
+		case DIS_RT_RS_SIMM: case DIS_RS_SIMM:
+			asm_simm(s, imm);
+			break;
+		case DIS_RT_RS_UIMM: case DIS_RT_UIMM:
+			asm_uimm(s, imm);
+			break;
+	}
+	if (mem && rs < 0) {
+		/* a bare address: $at takes its upper half, rounded for the signed offset */
+		asm_insn(s, OP_LUI, 0, 1, 0, 0, (imm + 0x8000) >> 16);
+		rs = 1;
+	} else if (mem) {
+		asm_simm(s, imm);
+	}
+	asm_insn(s, op, rs, rt, rd, sa, imm);
+}
+
+#undef REG
+#undef FREG
+#undef CC
+#undef COMMA
+#undef EXPR
+#undef HAS_CC
+
+static void asm_directive(asm_state_t *s, const char *name, char *p)
+{
+	char opt[ASM_SYMBOL], *q;
+	uint32_t v, words[2];
+	int label = FALSE, size, c;
+	uint8_t byte;
+	uint64_t bits;
+	double d;
+	float f;
+
+	opt[0] = '\0';
+	p = asm_skip(p);
+	if (strcmp(name, ".text") == 0 || strcmp(name, ".data") == 0) {
+		if (asm_done(s, p)) {
+			s->section = (name[1] == 't') ? ASM_TEXT : ASM_DATA;
+		}
+	} else if (strcmp(name, ".set") == 0) {
+		/* only reordering matters here; at, macro and the like are accepted and ignored */
+		if (asm_ident(&p, opt) && strcmp(opt, "noreorder") == 0) {
+			s->reorder = FALSE;
+		} else if (strcmp(opt, "reorder") == 0) {
+			s->reorder = TRUE;
+		}
+	} else if (strcmp(name, ".globl") == 0 || strcmp(name, ".global") == 0 ||
+			strcmp(name, ".ent") == 0 || strcmp(name, ".end") == 0) {
+		/* one flat image: nothing to export or delimit */
+	} else if (strcmp(name, ".equ") == 0) {
+		if (!asm_ident(&p, opt)) {
+			asm_error(s, ".equ needs a name");
+		} else if (asm_comma(s, &p) && asm_expr(s, &p, &v, &label) && asm_done(s, p)) {
+			asm_define(s, opt, v);
+		}
+	} else if (strcmp(name, ".align") == 0 || strcmp(name, ".space") == 0) {
+		if (!asm_expr(s, &p, &v, &label) || !asm_done(s, p)) {
+			return;
+		}
+		if (name[1] == 'a') {
+			if (v > 16) {
+				asm_error(s, ".align %u is too large", v);
+			} else {
+				asm_align(s, 1u << v);
+			}
+		} else if (s->section == ASM_TEXT) {
+			if (v & 3) {
+				asm_error(s, ".space in .text must be whole words");
+			}
+			for (; v >= 4; v -= 4) {
+				asm_emit(s, 0);
+			}
+		} else {
+			asm_bytes(s, NULL, v);
+		}
+	} else if (strcmp(name, ".byte") == 0 || strcmp(name, ".half") == 0 || strcmp(name, ".word") == 0) {
+		size = (name[1] == 'b') ? 1 : (name[1] == 'h') ? 2 : 4;
+		do {
+			if (!asm_expr(s, &p, &v, &label)) {
+				return;
+			}
+			asm_value(s, v, size);
+		} while (asm_more(s, &p));
+	} else if (strcmp(name, ".float") == 0 || strcmp(name, ".double") == 0) {
+		do {
+			q = asm_skip(p);
+			d = strtod(q, &p);
+			if (p == q) {
+				asm_error(s, "expected a number at \"%s\"", q);
+				return;
+			}
+			if (name[1] == 'f') {
+				f = d;
+				memcpy(&v, &f, 4);
+				asm_value(s, v, 4);
+			} else {
+				/* the word at the lower address is the high half on a big-endian guest */
+				memcpy(&bits, &d, 8);
+				words[!BIG_ENDIAN_GUEST] = bits >> 32;
+				words[BIG_ENDIAN_GUEST] = (uint32_t)bits;
+				asm_value(s, words[0], 4);
+				asm_value(s, words[1], 4);
+			}
+		} while (asm_more(s, &p));
+	} else if (strcmp(name, ".ascii") == 0 || strcmp(name, ".asciiz") == 0) {
+		do {
+			p = asm_skip(p);
+			if (*p++ != '"') {
+				asm_error(s, "expected a string");
+				return;
+			}
+			while (*p && *p != '"') {
+				c = asm_char(&p);
+				byte = c;
+				asm_bytes(s, &byte, 1);
+			}
+			if (*p++ != '"') {
+				asm_error(s, "unterminated string");
+				return;
+			}
+			if (name[6] == 'z') {
+				byte = 0;
+				asm_bytes(s, &byte, 1);
+			}
+		} while (asm_more(s, &p));
+	} else {
+		asm_error(s, "unknown directive %s", name);
+	}
+}
+
+/* alignment a statement's labels must see */
+static uint32_t asm_natural(const char *mnem)
+{
+	if (strcmp(mnem, ".half") == 0) {
+		return 2;
+	}
+	if (strcmp(mnem, ".word") == 0 || strcmp(mnem, ".float") == 0) {
+		return 4;
+	}
+	if (strcmp(mnem, ".double") == 0) {
+		return 8;
+	}
+	return 1;
+}
+
+static int asm_op(const char *mnem)
+{
+	int op;
+
+	for (op = OP_INVALID + 1; op < OP_NUM; op++) {
+		if (strcmp(ISA_INFO[op].name, mnem) == 0) {
+			return op;
+		}
+	}
+	return OP_INVALID;
+}
+
+/* [label:]... [mnemonic operands] */
+static void asm_line(asm_state_t *s, char *line)
+{
+	char name[ASM_SYMBOL], mnem[ASM_SYMBOL], *labels, *p, *q;
+	int n = 0, op;
+
+	labels = p = asm_skip(line);
+	for (;;) {
+		q = p;
+		if (!asm_ident(&q, name) || *(q = asm_skip(q)) != ':') {
+			break;
+		}
+		p = asm_skip(q + 1);
+	}
+	q = p;
+	while (*p && *p != ' ' && *p != '\t') {
+		if (n < ASM_SYMBOL - 1) {
+			mnem[n++] = tolower((unsigned char)*p);
+		}
+		p++;
+	}
+	mnem[n] = '\0';
+
+	/* labels name the aligned address of what follows them */
+	asm_align(s, asm_natural(mnem));
+	while (labels < q) {
+		asm_ident(&labels, name);
+		asm_define(s, name, s->pc[s->section]);
+		labels = asm_skip(asm_skip(labels) + 1);
+	}
+	if (n == 0) {
+		return;
+	}
+	if (mnem[0] == '.') {
+		asm_directive(s, mnem, p);
+	} else if (!asm_pseudo(s, mnem, p)) {
+		if ((op = asm_op(mnem)) == OP_INVALID) {
+			asm_error(s, "unknown instruction %s", mnem);
+		} else {
+			asm_operands(s, op, p);
+		}
+	}
+}
+
+/************************************************************/
+/* Assemble file into prog; returns the number of errors, and  */
+/* on success the caller owns prog (see asm_free)              */
+/************************************************************/
+int assemble(const char *file, asm_program_t *prog)
+{
+	asm_state_t s;
+	char buf[ASM_LINE], *src, *line, *next;
+	size_t len, size = 0, cap = 0, got;
+	uint32_t k;
+	FILE *fp;
+
+	memset(prog, 0, sizeof(*prog));
+	fp = fopen(file, "r");
+	if (fp == NULL) {
+		printf("Error: Can't open program file %s\n", file);
+		return 1;
+	}
+	src = NULL;
+	do {
+		if (size + 4096 >= cap) {
+			cap = cap ? cap * 2 : 65536;
+			if ((src = realloc(src, cap)) == NULL) {
+				printf("Error: out of memory reading %s\n", file);
+				exit(-1);
+			}
+		}
+		got = fread(src + size, 1, cap - size - 1, fp);
+		size += got;
+	} while (got > 0);
+	src[size] = '\0';
+	fclose(fp);
+
+	memset(&s, 0, sizeof(s));
+	s.file = file;
+	s.prog = prog;
+	s.base[ASM_TEXT] = MEM_TEXT_BEGIN;
+	s.base[ASM_DATA] = MEM_DATA_BEGIN;
+	for (s.pass = 1; s.pass <= 2; s.pass++) {
+		s.section = ASM_TEXT;
+		s.reorder = TRUE;
+		s.line = 0;
+		s.pc[ASM_TEXT] = s.base[ASM_TEXT];
+		s.pc[ASM_DATA] = s.base[ASM_DATA];
+		for (line = src; *line; line = next) {
+			next = strchr(line, '\n');
+			len = next ? (size_t)(next - line) : strlen(line);
+			next = line + len + (next != NULL);
+			s.line++;
+			if (len >= ASM_LINE) {
+				asm_error(&s, "line longer than %d characters", ASM_LINE - 1);
+				continue;
+			}
+			memcpy(buf, line, len);
+			buf[len] = '\0';
+			asm_strip(buf);
+			asm_line(&s, buf);
+		}
+		if (s.pass == 1) {
+			prog->text_words = (s.pc[ASM_TEXT] - s.base[ASM_TEXT]) / 4;
+			prog->data_bytes = s.pc[ASM_DATA] - s.base[ASM_DATA];
+			prog->text = calloc(prog->text_words + 1, sizeof(uint32_t));
+			prog->decoded = calloc(prog->text_words + 1, sizeof(decoded_t));
+			prog->data = calloc(prog->data_bytes + 1, 1);
+			if (prog->text == NULL || prog->decoded == NULL || prog->data == NULL) {
+				printf("Error: out of memory assembling %s\n", file);
+				exit(-1);
+			}
+		}
+	}
+	free(src);
+	if (s.errors) {
+		printf("%s: %d error%s\n", file, s.errors, s.errors == 1 ? "" : "s");
+		asm_free(prog);
+		return s.errors;
+	}
+	for (k = 0; k < prog->text_words; k++) {
+		decode(s.base[ASM_TEXT] + 4 * k, prog->text[k], &prog->decoded[k]);
+	}
+	return 0;
+}
+
+void asm_free(asm_program_t *prog)
+{
+	free(prog->text);
+	free(prog->decoded);
+	free(prog->data);
+	free(prog->syms);
+	memset(prog, 0, sizeof(*prog));
+}
+
+/* FNV-1a of the table fields decode() depends on; records are only
+ * trusted by a build whose OP_* numbering and formats match */
+static uint32_t isa_fingerprint()
+{
+	uint32_t h = 2166136261u;
+	const char *c;
+	int op;
+
+	for (op = OP_INVALID + 1; op < OP_NUM; op++) {
+		for (c = ISA_INFO[op].name; *c; c++) {
+			h = (h ^ (uint8_t)*c) * 16777619u;
+		}
+		h = (h ^ ISA_INFO[op].enc) * 16777619u;
+		h = (h ^ ISA_INFO[op].code) * 16777619u;
+		h = (h ^ ISA_INFO[op].fmt) * 16777619u;
+	}
+	return h;
+}
+
+/************************************************************/
+/* Write prog as an image if file ends in IMG_SUFFIX, else as  */
+/* hex words; returns nonzero on failure                       */
+/************************************************************/
+int asm_write(const asm_program_t *prog, const char *file)
+{
+	image_header_t h;
+	uint32_t k;
+	FILE *fp;
+	int image = has_suffix(file, IMG_SUFFIX), failed;
+
+	if (!image && prog->data_bytes) {
+		printf("Error: hex words cannot hold %u bytes of .data; write a %s image instead\n",
+			prog->data_bytes, IMG_SUFFIX);
+		return 1;
+	}
+	fp = fopen(file, image ? "wb" : "w");
+	if (fp == NULL) {
+		printf("Error: Can't create %s\n", file);
+		return 1;
+	}
+	if (image) {
+		memset(&h, 0, sizeof(h));
+		h.magic = IMG_MAGIC;
+		h.version = IMG_VERSION;
+		h.record = sizeof(decoded_t);
+		h.ops = OP_NUM;
+		h.isa_hash = isa_fingerprint();
+		h.big_endian = BIG_ENDIAN_GUEST;
+		h.text_base = MEM_TEXT_BEGIN;
+		h.text_words = prog->text_words;
+		h.data_base = MEM_DATA_BEGIN;
+		h.data_bytes = prog->data_bytes;
+		fwrite(&h, sizeof(h), 1, fp);
+		fwrite(prog->text, sizeof(uint32_t), prog->text_words, fp);
+		fwrite(prog->decoded, sizeof(decoded_t), prog->text_words, fp);
+		fwrite(prog->data, 1, prog->data_bytes, fp);
+	} else {
+		for (k = 0; k < prog->text_words; k++) {
+			fprintf(fp, "%08X\n", prog->text[k]);
+		}
+	}
+	failed = ferror(fp);
+	if (fclose(fp) != 0 || failed) {
+		printf("Error: writing %s failed\n", file);
+		return 1;
+	}
+	return 0;
+}
+
+/************************************************************/
+/* Copy prog into guest memory and, unless addresses go through */
+/* the TLB, fill every core's decode cache from its records so   */
+/* the text runs without being decoded. Returns text words.      */
+/************************************************************/
+static uint32_t asm_load(const asm_program_t *prog, const char *file, uint32_t text_base, uint32_t data_base)
+{
+	uint32_t k, *image;
+
+	if (mem_host_ptr(text_base, prog->text_words * 4) == NULL ||
+			mem_host_ptr(data_base, prog->data_bytes) == NULL) {
+		printf("Error: %s does not fit in the text and data segments\n", file);
+		exit(-1);
+	}
+	image = malloc(prog->text_words * 4 + 4);
+	if (image == NULL) {
+		printf("Error: out of memory loading %s\n", file);
+		exit(-1);
+	}
+	for (k = 0; k < prog->text_words; k++) {
+		image[k] = guest32(prog->text[k]);
+	}
+	mem_write_block(text_base, image, prog->text_words * 4);
+	mem_write_block(data_base, prog->data, prog->data_bytes);
+	free(image);
+	bulk_flush();
+
+	if (prog->decoded != NULL) {
+		decode_prefill(prog->decoded, text_base, prog->text_words);
+	}
+	return prog->text_words;
+}
+
+uint32_t load_asm(const char *file)
+{
+	asm_program_t prog;
+	uint32_t words;
+	int k;
+
+	if (assemble(file, &prog) != 0) {
+		exit(-1);
+	}
+	words = asm_load(&prog, file, MEM_TEXT_BEGIN, MEM_DATA_BEGIN);
+	if (!sym_file[0]) {
+		sym_clear();
+		for (k = 0; k < prog.nsyms; k++) {
+			sym_add(prog.syms[k].name, prog.syms[k].addr);
+		}
+	}
+	printf("Assembled %s: %u words of text, %u bytes of data at 0x%08x\n", file,
+		prog.text_words, prog.data_bytes, MEM_DATA_BEGIN);
+	asm_free(&prog);
+	return words;
+}
+
+/************************************************************/
+/* Load an image written by asm_write(). Records from a build  */
+/* with another instruction table are skipped and the words     */
+/* decoded at run time as usual.                                */
+/************************************************************/
+uint32_t load_image(const char *file)
+{
+	asm_program_t prog;
+	image_header_t h;
+	uint32_t words;
+	FILE *fp;
+	int usable, ok;
+
+	fp = fopen(file, "rb");
+	if (fp == NULL) {
+		printf("Error: Can't open program file %s\n", file);
+		exit(-1);
+	}
+	if (fread(&h, sizeof(h), 1, fp) != 1 || h.magic != IMG_MAGIC || h.version != IMG_VERSION) {
+		printf("Error: %s is not a version %d program image\n", file, IMG_VERSION);
+		exit(-1);
+	}
+	if (h.big_endian != (uint32_t)BIG_ENDIAN_GUEST) {
+		printf("Error: %s was assembled for a %s-endian guest; run %s -B\n", file,
+			h.big_endian ? "big" : "little", h.big_endian ? "with" : "without");
+		exit(-1);
+	}
+	usable = h.record == sizeof(decoded_t) && h.ops == OP_NUM && h.isa_hash == isa_fingerprint();
+	memset(&prog, 0, sizeof(prog));
+	prog.text_words = h.text_words;
+	prog.data_bytes = h.data_bytes;
+	prog.text = malloc((size_t)h.text_words * 4 + 4);
+	prog.decoded = usable ? malloc((size_t)h.text_words * sizeof(decoded_t) + 1) : NULL;
+	prog.data = malloc((size_t)h.data_bytes + 1);
+	if (prog.text == NULL || (usable && prog.decoded == NULL) || prog.data == NULL) {
+		printf("Error: out of memory loading %s\n", file);
+		exit(-1);
+	}
+	ok = fread(prog.text, 4, h.text_words, fp) == h.text_words;
+	if (usable) {
+		ok = ok && fread(prog.decoded, sizeof(decoded_t), h.text_words, fp) == h.text_words;
+	} else {
+		ok = ok && fseek(fp, (long)h.record * h.text_words, SEEK_CUR) == 0;
+	}
+	ok = ok && fread(prog.data, 1, h.data_bytes, fp) == h.data_bytes;
+	fclose(fp);
+	if (!ok) {
+		printf("Error: %s is truncated\n", file);
+		exit(-1);
+	}
+	words = asm_load(&prog, file, h.text_base, h.data_base);
+	printf("Image %s: %u words of text, %u bytes of data at 0x%08x, %s\n", file,
+		h.text_words, h.data_bytes, h.data_base,
+		usable ? "pre-decoded" : "decoded at run time (another instruction table)");
+	asm_free(&prog);
+	return words;
+}
+
+/************************************************************/
+/* Persistent decode cache
+   The file is a pcache_header_t and a decoded_t per text word.
+   It is written once, to a private name renamed into place, so
+   a process racing another on a cold key either maps a complete
+   file or writes an identical one itself. Nothing in it is
+   trusted until the header matches the text just loaded and every
+   record the word it stands for.
+************************************************************/
+static uint64_t pcache_hash(uint64_t h, const void *p, size_t n)
+{
+	const uint8_t *b = p;
+
+	while (n--) {
+		h = (h ^ *b++) * 1099511628211ull;
+	}
+	return h;
+}
+
+/* the header a cache file for the loaded text must have */
+static void pcache_expect(pcache_header_t *h)
+{
+	uint32_t k, word;
+
+	memset(h, 0, sizeof(*h));
+	h->magic = PCACHE_MAGIC;
+	h->version = PCACHE_VERSION;
+	h->record = sizeof(decoded_t);
+	h->ops = OP_NUM;
+	h->isa_hash = isa_fingerprint();
+	h->big_endian = BIG_ENDIAN_GUEST;
+	h->text_base = MEM_TEXT_BEGIN;
+	h->text_words = PROGRAM_SIZE;
+	h->key = pcache_hash(14695981039346656037ull, h, sizeof(*h));
+	for (k = 0; k < PROGRAM_SIZE; k++) {
+		word = mem_read_32(MEM_TEXT_BEGIN + 4 * k);
+		h->key = pcache_hash(h->key, &word, 4);
+	}
+}
+
+static int pcache_write(const char *path, const pcache_header_t *h)
+{
+	char tmp[sizeof(cache_dir) + 64];
+	decoded_t d;
+	uint32_t k;
+	FILE *fp;
+	int failed;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+	fp = fopen(tmp, "wb");
+	if (fp == NULL) {
+		printf("Error: Can't create %s\n", tmp);
+		return 1;
+	}
+	fwrite(h, sizeof(*h), 1, fp);
+	for (k = 0; k < h->text_words; k++) {
+		decode(h->text_base + 4 * k, mem_read_32(h->text_base + 4 * k), &d);
+		fwrite(&d, sizeof(d), 1, fp);
+	}
+	failed = ferror(fp);
+	if (fclose(fp) != 0 || failed || rename(tmp, path) != 0) {
+		printf("Error: writing %s failed\n", path);
+		unlink(tmp);
+		return 1;
+	}
+	return 0;
+}
+
+/* map path if it holds records for the text h describes */
+static int pcache_map(const char *path, const pcache_header_t *h)
+{
+	size_t bytes = sizeof(*h) + (size_t)h->text_words * sizeof(decoded_t);
+	const decoded_t *records;
+	struct stat st;
+	uint32_t k;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return FALSE;
+	}
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size != bytes) {
+		close(fd);
+		return FALSE;
+	}
+	map = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return FALSE;
+	}
+	if (memcmp(map, h, sizeof(*h)) != 0) {
+		munmap(map, bytes);
+		return FALSE;
+	}
+	/* nor are the records, until each fits its word */
+	records = (const decoded_t *)((const pcache_header_t *)map + 1);
+	for (k = 0; k < h->text_words; k++) {
+		if (!decode_record_ok(&records[k], mem_read_32(h->text_base + 4 * k))) {
+			munmap(map, bytes);
+			return FALSE;
+		}
+	}
+	PCACHE_MAP = map;
+	PCACHE_BYTES = bytes;
+	return TRUE;
+}
+
+void pcache_close()
+{
+	if (PCACHE_MAP != NULL) {
+		munmap((void *)PCACHE_MAP, PCACHE_BYTES);
+		PCACHE_MAP = NULL;
+		PCACHE_BYTES = 0;
+	}
+}
+
+/************************************************************/
+/* Map (writing it first if need be) the cache file for the   */
+/* text just loaded and fill the decode caches from it. Runs   */
+/* on flat addresses only; a cache that cannot be used is      */
+/* reported and the text decoded as usual.                     */
+/************************************************************/
+void pcache_open()
+{
+	char path[sizeof(cache_dir) + 32];
+	pcache_header_t h;
+	int written = FALSE;
+
+	pcache_close();
+	if (MMU_ENABLED || PROGRAM_SIZE == 0) {
+		return;
+	}
+	pcache_expect(&h);
+	PCACHE_KEY = h.key;
+	snprintf(path, sizeof(path), "%s/%016" PRIx64 "%s", cache_dir, h.key, PCACHE_SUFFIX);
+	if (!pcache_map(path, &h)) {
+		/* missing, left by another build or damaged: replace it */
+		if (pcache_write(path, &h) != 0 || !pcache_map(path, &h)) {
+			printf("Error: decode cache %s is unusable; decoding as usual\n", path);
+			return;
+		}
+		written = TRUE;
+	}
+	decode_prefill((const decoded_t *)(PCACHE_MAP + 1), h.text_base, h.text_words);
+	printf("Decode cache %s: %u records %s.\n", path, h.text_words, written ? "written" : "mapped");
+}
+
+/************************************************************/
+/* Control flow analysis
+   A block starts at the entry, at every branch or jump target
+   inside the text and after every control transfer, and ends at
+   a control transfer or where the next block starts. Calls (jal,
+   jalr, the branch-and-link forms) continue at their return
+   point two words on, so a function is the blocks reachable
+   from its entry without following calls or running into another
+   entry; a block reachable from two entries belongs to the first
+   one walked. Loop headers are the targets of back edges in a
+   depth-first walk from each entry.
+************************************************************/
+static const char *CFG_END_NAMES[CFG_END_NUM] = {
+#define X(id, name) name,
+	CFG_ENDS(X)
+#undef X
+};
+
+/* how the instruction in d ends a block, and its direct target (0 if none) */
+static int cfg_classify(const decoded_t *d, uint32_t *target)
+{
+	*target = 0;
+	switch (d->op) {
+		case OP_INVALID:
+			return CFG_END_INVALID;
+		case OP_ERET:
+			return CFG_END_ERET;
+		case OP_J:
+			*target = d->imm;
+			return CFG_END_JUMP;
+		case OP_JAL:
+		case OP_BLTZAL:
+		case OP_BGEZAL:
+		case OP_BLTZALL:
+		case OP_BGEZALL:
+			*target = d->imm;
+			return CFG_END_CALL;
+		case OP_JALR:
+			return CFG_END_CALL;
+		case OP_JR:
+			return (d->rs == 31) ? CFG_END_RETURN : CFG_END_INDIRECT;
+	}
+	if (ISA_INFO[d->op].cls == CLS_BRANCH || ISA_INFO[d->op].cls == CLS_FPU_BRANCH) {
+		*target = d->imm;
+		return CFG_END_BRANCH;
+	}
+	return CFG_END_FALL;
+}
+
+/* block containing addr, CFG_NONE outside the analysed text */
+int cfg_block_at(uint32_t addr)
+{
+	uint32_t off = addr - CFG.base;
+
+	if ((off & 3) || off / 4 >= CFG.words) {
+		return CFG_NONE;
+	}
+	return CFG.block_of[off / 4];
+}
+
+/* function whose entry is addr, CFG_NONE if there is none */
+static int cfg_func_at(uint32_t addr)
+{
+	int lo = 0, hi = CFG.nfuncs - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (CFG.funcs[mid] == addr) {
+			return mid;
+		}
+		if (CFG.funcs[mid] < addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return CFG_NONE;
+}
+
+/************************************************************/
+/* Build CFG over the words instructions starting at base      */
+/************************************************************/
+void cfg_build(uint32_t base, uint32_t words)
+{
+	uint8_t *mark, *state;
+	int *stack, *next;
+	uint32_t i, t;
+	decoded_t d;
+	cfg_block_t *blk = NULL;
+	int b, f, s, sp;
+
+	free(CFG.blocks);
+	free(CFG.block_of);
+	free(CFG.funcs);
+	memset(&CFG, 0, sizeof(CFG));
+	CFG.base = base;
+	if (words == 0) {
+		return;
+	}
+
+	/* leaders: 1 = block start, 2 = function entry as well */
+	mark = calloc(words, 1);
+	CFG.block_of = malloc(words * sizeof(*CFG.block_of));
+	CFG.funcs = malloc(words * sizeof(*CFG.funcs));
+	if (mark == NULL || CFG.block_of == NULL || CFG.funcs == NULL) {
+		printf("Error: out of memory analysing %u words\n", words);
+		free(mark);
+		free(CFG.block_of);
+		free(CFG.funcs);
+		memset(&CFG, 0, sizeof(CFG));
+		return;
+	}
+	CFG.words = words;
+	mark[0] = 2;
+	for (i = 0; i < words; i++) {
+		decode(base + 4 * i, mem_read_32(base + 4 * i), &d);
+		s = cfg_classify(&d, &t);
+		if (s == CFG_END_FALL) {
+			continue;
+		}
+		if (i + 1 < words && !mark[i + 1]) {
+			mark[i + 1] = 1;
+		}
+		if (s == CFG_END_CALL && i + 2 < words && !mark[i + 2]) {
+			mark[i + 2] = 1;
+		}
+		if (t != 0 && cfg_block_at(t) != CFG_NONE) {
+			t = (t - base) / 4;
+			mark[t] = (s == CFG_END_CALL) ? 2 : (mark[t] ? mark[t] : 1);
+		}
+	}
+
+	for (i = 0; i < words; i++) {
+		CFG.nblocks += mark[i] != 0;
+		if (mark[i] == 2) {
+			CFG.funcs[CFG.nfuncs++] = base + 4 * i;
+		}
+	}
+	CFG.blocks = calloc(CFG.nblocks, sizeof(*CFG.blocks));
+	if (CFG.blocks == NULL) {
+		printf("Error: out of memory analysing %u words\n", words);
+		free(mark);
+		cfg_build(base, 0);
+		return;
+	}
+
+	/* carve the blocks, then link each by its last instruction */
+	for (i = 0, b = -1; i < words; i++) {
+		if (mark[i]) {
+			blk = &CFG.blocks[++b];
+			blk->start = base + 4 * i;
+			blk->func = CFG_NONE;
+		}
+		blk->end = base + 4 * i;
+		CFG.block_of[i] = b;
+	}
+	free(mark);
+	for (b = 0; b < CFG.nblocks; b++) {
+		blk = &CFG.blocks[b];
+		decode(blk->end, mem_read_32(blk->end), &d);
+		blk->kind = cfg_classify(&d, &t);
+		blk->succ[0] = blk->succ[1] = CFG_NONE;
+		if (blk->kind == CFG_END_FALL || blk->kind == CFG_END_BRANCH) {
+			blk->succ[0] = cfg_block_at(blk->end + 4);
+		} else if (blk->kind == CFG_END_CALL) {
+			blk->succ[0] = cfg_block_at(blk->end + 8);	/* LINK skips the slot word */
+		}
+		if (blk->kind == CFG_END_BRANCH || blk->kind == CFG_END_JUMP) {
+			blk->succ[1] = cfg_block_at(t);
+		}
+		if (blk->kind == CFG_END_CALL) {
+			blk->callee = t;
+		}
+	}
+
+	/* walk each function: claim its blocks, find the back edges */
+	state = calloc(CFG.nblocks, 1);		/* 0 unseen, 1 on the walk, 2 done */
+	stack = malloc(CFG.nblocks * sizeof(*stack));
+	next = calloc(CFG.nblocks, sizeof(*next));
+	if (state == NULL || stack == NULL || next == NULL) {
+		printf("Error: out of memory analysing %u words\n", words);
+	} else {
+		for (f = 0; f < CFG.nfuncs; f++) {
+			CFG.blocks[cfg_block_at(CFG.funcs[f])].func = f;
+		}
+		for (f = 0; f < CFG.nfuncs; f++) {
+			b = cfg_block_at(CFG.funcs[f]);
+			sp = 0;
+			stack[sp++] = b;
+			state[b] = 1;
+			while (sp > 0) {
+				b = stack[sp - 1];
+				if (next[b] == 2) {
+					state[b] = 2;
+					sp--;
+					continue;
+				}
+				s = CFG.blocks[b].succ[next[b]++];
+				if (s == CFG_NONE) {
+					continue;
+				}
+				if (state[s] == 1) {
+					if (!CFG.blocks[s].loop_header) {
+						CFG.blocks[s].loop_header = TRUE;
+						CFG.nloops++;
+					}
+				} else if (state[s] == 0 && (CFG.blocks[s].func == CFG_NONE || CFG.blocks[s].func == f)) {
+					state[s] = 1;
+					CFG.blocks[s].func = f;
+					stack[sp++] = s;
+				}
+			}
+		}
+	}
+	free(state);
+	free(stack);
+	free(next);
+}
+
+/************************************************************/
+/* Graphviz view: one cluster per function, instructions in     */
+/* each node, taken edges labelled and calls dashed             */
+/************************************************************/
+void cfg_write_dot(FILE *out)
+{
+	char line[LISTING_LINE];
+	cfg_block_t *blk;
+	uint32_t addr;
+	int b, f, s;
+
+	fprintf(out, "digraph cfg {\n\tnode [shape=box, fontname=\"monospace\"];\n");
+	for (f = -1; f < CFG.nfuncs; f++) {
+		if (f >= 0) {
+			fprintf(out, "\tsubgraph cluster_f%d {\n\t\tlabel=\"0x%08x\";\n", f, CFG.funcs[f]);
+		}
+		for (b = 0; b < CFG.nblocks; b++) {
+			blk = &CFG.blocks[b];
+			if (blk->func != f) {
+				continue;
+			}
+			fprintf(out, "%sb%d [label=\"", f >= 0 ? "\t\t" : "\t", b);
+			for (addr = blk->start; addr <= blk->end; addr += 4) {
+				disassemble(addr, mem_read_32(addr), line, sizeof(line));
+				fprintf(out, "0x%08x  %s\\l", addr, line);
+			}
+			fprintf(out, "\"%s];\n", blk->loop_header ? ", peripheries=2" : "");
+		}
+		if (f >= 0) {
+			fprintf(out, "\t}\n");
+		}
+	}
+	for (b = 0; b < CFG.nblocks; b++) {
+		blk = &CFG.blocks[b];
+		if (blk->succ[0] != CFG_NONE) {
+			fprintf(out, "\tb%d -> b%d;\n", b, blk->succ[0]);
+		}
+		if (blk->succ[1] != CFG_NONE) {
+			fprintf(out, "\tb%d -> b%d%s;\n", b, blk->succ[1],
+				blk->kind == CFG_END_BRANCH ? " [label=\"taken\"]" : "");
+		}
+		if (blk->kind == CFG_END_CALL && (s = cfg_block_at(blk->callee)) != CFG_NONE) {
+			fprintf(out, "\tb%d -> b%d [style=dashed];\n", b, s);
+		}
+	}
+	fprintf(out, "}\n");
+	fflush(out);
+}
+
+/************************************************************/
+/* The same graph as JSON: blocks, functions, call sites and   */
+/* loop headers, addresses as hex strings                      */
+/************************************************************/
+void cfg_write_json(FILE *out)
+{
+	cfg_block_t *blk;
+	int b, f, first;
+
+	fprintf(out, "{\n  \"base\": \"0x%08x\",\n  \"words\": %u,\n  \"blocks\": [", CFG.base, CFG.words);
+	for (b = 0; b < CFG.nblocks; b++) {
+		blk = &CFG.blocks[b];
+		fprintf(out, "%s\n    {\"id\": %d, \"start\": \"0x%08x\", \"end\": \"0x%08x\", \"kind\": \"%s\", \"succ\": [",
+			b ? "," : "", b, blk->start, blk->end, CFG_END_NAMES[blk->kind]);
+		if (blk->succ[0] != CFG_NONE) {
+			fprintf(out, "%d", blk->succ[0]);
+		}
+		if (blk->succ[1] != CFG_NONE) {
+			fprintf(out, "%s%d", blk->succ[0] != CFG_NONE ? ", " : "", blk->succ[1]);
+		}
+		fprintf(out, "], \"func\": %d, \"loop_header\": %s}", blk->func, blk->loop_header ? "true" : "false");
+	}
+	fprintf(out, "\n  ],\n  \"functions\": [");
+	for (f = 0; f < CFG.nfuncs; f++) {
+		fprintf(out, "%s\n    {\"id\": %d, \"entry\": \"0x%08x\", \"block\": %d}",
+			f ? "," : "", f, CFG.funcs[f], cfg_block_at(CFG.funcs[f]));
+	}
+	fprintf(out, "\n  ],\n  \"calls\": [");
+	for (b = 0, first = 1; b < CFG.nblocks; b++) {
+		blk = &CFG.blocks[b];
+		if (blk->kind != CFG_END_CALL) {
+			continue;
+		}
+		fprintf(out, "%s\n    {\"site\": \"0x%08x\", \"from\": %d, \"to\": %d}",
+			first ? "" : ",", blk->end, blk->func, blk->callee ? cfg_func_at(blk->callee) : CFG_NONE);
+		first = 0;
+	}
+	fprintf(out, "\n  ],\n  \"loops\": [");
+	for (b = 0, first = 1; b < CFG.nblocks; b++) {
+		if (CFG.blocks[b].loop_header) {
+			fprintf(out, "%s%d", first ? "" : ", ", b);
+			first = 0;
+		}
+	}
+	fprintf(out, "]\n}\n");
+	fflush(out);
+}
+
+/************************************************************/
+/* Ahead-of-time translation
+   Each CFG block becomes a C function that runs the block's
+   instructions with the MIPS_ISA semantics pasted in and the
+   operand macros below bound to constants, so the compiler sees
+   R[5] + 12 where execute() sees d->rs and d->imm. Rows whose
+   semantics need the simulator's internals (CP0, the FPU, traps
+   and system calls) call back into the interpreter for that one
+   instruction. A block returns the instructions it retired and
+   leaves the next PC in *npc; it stops early after an exception
+   or a fallback that did not continue in line, in which case its
+   class counts are not added. Only flat (no -M) runs use the
+   module, and a store into its text switches it off until reset
+   finds the text unchanged again.
+************************************************************/
+static const char *ISA_SEMANTICS[OP_NUM] = {
+#define X(name, mnem, enc, code, fmt, cls, size, ...) [OP_##name] = #__VA_ARGS__,
+	MIPS_ISA(X)
+#undef X
+};
+
+/* operand macros for the generated code; see execute() for the originals */
+static const char AOT_PRELUDE[] =
+	"#define RS\t\tR[rs_]\n"
+	"#define RT\t\tR[rt_]\n"
+	"#define RD\t\tR[rd_]\n"
+	"#define SA\t\tsa_\n"
+	"#define IMM\t\timm_\n"
+	"#define EA\t\t(RS + IMM)\n"
+	"#define HI\t\t(*e->hi)\n"
+	"#define LO\t\t(*e->lo)\n"
+	"#define HILO\t\t(((uint64_t)HI << 32) | LO)\n"
+	"#define SET_HILO(v)\tdo { uint64_t hilo_ = (v); HI = hilo_ >> 32; LO = (uint32_t)hilo_; } while (0)\n"
+	"#define CPC\t\tpc_\n"
+	"#define NPC\t\tnpc\n"
+	"#define S32(x)\t\t((int32_t)(x))\n"
+	"#define LINK(r)\t\t(R[r] = CPC + 8)\n"
+	"#define BRANCH(c)\tdo { if (c) NPC = IMM; } while (0)\n"
+	"#define BRANCH_LIKELY(c)\tBRANCH(c)\n"
+	"#define TRAP(code)\tdo { e->raise(pc_, code); return k_ + 1; } while (0)\n"
+	"#define TRAP_IF(c, code)\tdo { if (c) TRAP(code); } while (0)\n"
+	"#define ADD_OVERFLOWS(a, b, r)\t((~((a) ^ (b)) & ((a) ^ (r))) >> 31)\n"
+	"#define SUB_OVERFLOWS(a, b, r)\t((((a) ^ (b)) & ((a) ^ (r))) >> 31)\n"
+	"#define MEMREF(a, acc, size)\t(a)\n"
+	"#define LOAD_(a, size, T, SWAP)\t({ const uint8_t *p_ = aot_ptr(e, (a), size); T v_ = 0; \\\n"
+	"\t\tif (p_) { __builtin_memcpy(&v_, p_, size); v_ = SWAP(v_); } else { v_ = e->read((a), size); } v_; })\n"
+	"#define LOAD8(a)\tLOAD_(a, 1, uint8_t, )\n"
+	"#define LOAD16(a)\tLOAD_(a, 2, uint16_t, SWAP16)\n"
+	"#define LOAD32(a)\tLOAD_(a, 4, uint32_t, SWAP32)\n"
+	"#define STORE8(a, v)\te->write8(a, v)\n"
+	"#define STORE16(a, v)\te->write16(a, v)\n"
+	"#define STORE32(a, v)\te->write32(a, v)\n"
+	"#define load_linked(a)\te->load_linked(a)\n"
+	"#define store_conditional(a, v)\te->store_conditional(a, v)\n"
+	"\n"
+	"/* mem_ptr() */\n"
+	"static inline const uint8_t *aot_ptr(const aot_env_t *e, uint32_t a, uint32_t size)\n"
+	"{\n"
+	"\tuint32_t s = a >> 28;\n"
+	"\n"
+	"\tif (e->map_mem[s] == 0 || a - e->map_lo[s] > e->map_hi[s] - e->map_lo[s] - (size - 1)) {\n"
+	"\t\treturn 0;\n"
+	"\t}\n"
+	"\treturn e->map_mem[s] + (a - e->map_lo[s]);\n"
+	"}\n";
+
+/* rows translated in line; the rest go through the interpreter */
+static int aot_native(int op)
+{
+	switch (ISA_INFO[op].cls) {
+		case CLS_ALU: case CLS_MULDIV: case CLS_LOAD: case CLS_STORE: case CLS_BRANCH:
+			return op != OP_INVALID;
+		default:
+			return FALSE;
+	}
+}
+
+static uint32_t aot_hash(uint32_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--) {
+		h = (h ^ *p++) * 16777619u;
+	}
+	return h;
+}
+
+static uint32_t aot_abi()
+{
+	static const char decls[] = AOT_XSTR(AOT_DECLS);
+
+	return aot_hash(2166136261u, decls, sizeof(decls) - 1);
+}
+
+/* the loaded text, as host words */
+static uint32_t aot_text_hash()
+{
+	uint32_t h = 2166136261u, k, word;
+
+	for (k = 0; k < PROGRAM_SIZE; k++) {
+		word = mem_read_32(MEM_TEXT_BEGIN + 4 * k);
+		h = aot_hash(h, &word, 4);
+	}
+	return h;
+}
+
+/* class counts for the instructions emitted so far */
+static void aot_emit_classes(FILE *out, const uint64_t *classes, const char *indent)
+{
+	int c;
+
+	for (c = 0; c < CLS_NUM; c++) {
+		if (classes[c]) {
+			fprintf(out, "%se->classes[%d] += %" PRIu64 ";\n", indent, c, classes[c]);
+		}
+	}
+}
+
+/* one instruction of a block, k-th from its start */
+static void aot_emit_insn(FILE *out, uint32_t addr, int k, uint64_t *classes)
+{
+	const isa_info_t *info;
+	char line[LISTING_LINE];
+	decoded_t d;
+
+	decode(addr, mem_read_32(addr), &d);
+	info = &ISA_INFO[d.op];
+	disassemble(addr, d.word, line, sizeof(line));
+	fprintf(out, "\t/* [0x%08x] %s */\n", addr, line);
+	if (!aot_native(d.op)) {
+		fprintf(out, "\tif ((npc = e->step(0x%08xu)) != 0x%08xu || !*e->run) {\n", addr, addr + 4);
+		aot_emit_classes(out, classes, "\t\t");
+		fprintf(out, "\t\treturn %d;\n\t}\n", k + 1);
+		return;
+	}
+	classes[info->cls]++;
+	fprintf(out, "\t{\n\t\tenum { rs_ = %d, rt_ = %d, rd_ = %d, sa_ = %d, k_ = %d };\n"
+		"\t\tconst uint32_t pc_ = 0x%08xu, imm_ = 0x%08xu;\n",
+		d.rs, d.rt, d.rd, d.sa, k, addr, d.imm);
+	if (info->size) {
+		fprintf(out, "\t\tif (((EA) & %d) || EA >= 0x%08xu) {\n"
+			"\t\t\tif (!e->access_ok(pc_, EA, %d, %d)) {\n\t\t\t\treturn k_ + 1;\n\t\t\t}\n\t\t}\n",
+			info->size - 1, MEM_KTEXT_BEGIN, info->size, info->cls == CLS_STORE);
+	}
+	fprintf(out, "\t\t{ %s }\n", ISA_SEMANTICS[d.op]);
+	if (d.rt == 0 || d.rd == 0) {
+		fprintf(out, "\t\tR[0] = 0;\n");
+	}
+	fprintf(out, "\t}\n");
+	if (info->cls == CLS_STORE) {
+		/* the rest of the block may be what was just overwritten */
+		fprintf(out, "\tif (!*e->active) {\n");
+		aot_emit_classes(out, classes, "\t\t");
+		fprintf(out, "\t\t*e->npc = 0x%08xu;\n\t\treturn %d;\n\t}\n", addr + 4, k + 1);
+	}
+}
+
+/************************************************************/
+/* Write the loaded text to file as a C translation unit for   */
+/* aot_open(); returns nonzero on failure                      */
+/************************************************************/
+int aot_translate(const char *file)
+{
+	uint64_t classes[CLS_NUM];
+	uint32_t addr, native = 0, total = 0;
+	cfg_block_t *b;
+	FILE *out;
+	int i, k, c, failed;
+
+	out = fopen(file, "w");
+	if (out == NULL) {
+		printf("Error: Can't create %s\n", file);
+		return 1;
+	}
+	fprintf(out, "/* %s translated by mu-mips; do not edit */\n#include <stdint.h>\n\n%s\n\n",
+		prog_file, AOT_XSTR(AOT_DECLS));
+	fprintf(out, "#define EXC_OV\t\t%d\n#define EXC_TR\t\t%d\n", EXC_OV, EXC_TR);
+	fprintf(out, "#define LANE(a)\t\t(((a) & 3) ^ %d)\n", BIG_ENDIAN_GUEST ? 3 : 0);
+	fprintf(out, "#define SWAP16(v)\t%s\n#define SWAP32(v)\t%s\n",
+		guest16(1) == 1 ? "(v)" : "__builtin_bswap16(v)", guest32(1) == 1 ? "(v)" : "__builtin_bswap32(v)");
+	fprintf(out, "%s\n", AOT_PRELUDE);
+
+	for (i = 0; i < CFG.nblocks; i++) {
+		b = &CFG.blocks[i];
+		memset(classes, 0, sizeof(classes));
+		fprintf(out, "static int b_%08x(aot_env_t *e)\n{\n\tuint32_t *R = e->R, npc = 0x%08xu;\n\n",
+			b->start, b->end + 4);
+		for (addr = b->start, k = 0; addr <= b->end; addr += 4, k++) {
+			aot_emit_insn(out, addr, k, classes);
+		}
+		aot_emit_classes(out, classes, "\t");
+		for (c = 0; c < CLS_NUM; c++) {
+			native += classes[c];
+		}
+		total += k;
+		fprintf(out, "\t*e->npc = npc;\n\treturn %d;\n}\n\n", k);
+	}
+
+	fprintf(out, "uint64_t aot_run(aot_env_t *e, uint64_t budget)\n{\n"
+		"\tuint32_t pc = *e->cpc;\n\tuint64_t done = 0;\n\tint n;\n\n"
+		"\twhile (*e->run && *e->active) {\n\t\tswitch (pc) {\n");
+	for (i = 0; i < CFG.nblocks; i++) {
+		b = &CFG.blocks[i];
+		k = (b->end - b->start) / 4 + 1;
+		fprintf(out, "\t\t\tcase 0x%08xu: if (budget - done < %d) goto out; n = b_%08x(e); break;\n",
+			b->start, k, b->start);
+	}
+	fprintf(out, "\t\t\tdefault: goto out;\n\t\t}\n\t\tdone += n;\n\t\t*e->cpc = pc = *e->npc;\n\t}\n"
+		"out:\n\t*e->cpc = pc;\n\treturn done;\n}\n\n");
+	fprintf(out, "const aot_info_t aot_info = { 0x%08xu, %d, 0x%08xu, %uu, 0x%08xu, %d, %u, %u };\n",
+		aot_abi(), BIG_ENDIAN_GUEST, MEM_TEXT_BEGIN, PROGRAM_SIZE, aot_text_hash(),
+		CFG.nblocks, native, total - native);
+	failed = ferror(out);
+	if (fclose(out) != 0 || failed) {
+		printf("Error: writing %s failed\n", file);
+		return 1;
+	}
+	return 0;
+}
+
+/* $CC (default cc) -O2 -shared -fPIC -o so_file c_file */
+static int aot_compile(const char *c_file, const char *so_file)
+{
+	const char *cc = getenv("CC") ? getenv("CC") : "cc";
+	char *argv[] = { (char *)cc, "-O2", "-shared", "-fPIC", "-o", (char *)so_file, (char *)c_file, NULL };
+	pid_t pid;
+	int status;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0) {
+		execvp(cc, argv);
+		_exit(127);
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf("Error: %s could not compile %s\n", cc, c_file);
+		return 1;
+	}
+	return 0;
+}
+
+/* the module was made from the text now in memory, by a matching build */
+static int aot_matches(const aot_info_t *info)
+{
+	return info->abi == aot_abi() && info->big_endian == (uint32_t)BIG_ENDIAN_GUEST &&
+		info->text_base == MEM_TEXT_BEGIN && info->text_words == PROGRAM_SIZE &&
+		info->text_hash == aot_text_hash();
+}
+
+/* make stores into the translated text reach code_invalidate() */
+static void aot_watch_text()
+{
+	uint32_t page;
+
+	for (page = MEM_TEXT_BEGIN >> MMU_PAGE_SHIFT;
+			page <= (MEM_TEXT_BEGIN + 4 * PROGRAM_SIZE - 1) >> MMU_PAGE_SHIFT; page++) {
+		CODE_PAGES[page >> 3] |= 1 << (page & 7);
+	}
+}
+
+static int aot_load(const char *file)
+{
+	static void *handle;
+	const aot_info_t *info;
+	void *h, *run;
+
+	if ((h = dlopen(file, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+		return FALSE;
+	}
+	info = dlsym(h, "aot_info");
+	run = dlsym(h, "aot_run");
+	if (info == NULL || run == NULL || !aot_matches(info)) {
+		dlclose(h);
+		return FALSE;
+	}
+	if (handle != NULL) {
+		dlclose(handle);
+	}
+	handle = h;
+	AOT_INFO = info;
+	*(void **)&AOT_RUN = run;
+	AOT_ACTIVE = TRUE;
+	aot_watch_text();
+	printf("Translated program %s: %u blocks, %u instructions native, %u interpreted\n",
+		file, info->blocks, info->native, info->interpreted);
+	return TRUE;
+}
+
+/************************************************************/
+/* Use the module in file, translating and compiling the       */
+/* program into it first unless it already matches the loaded  */
+/* text. Returns nonzero on failure.                           */
+/************************************************************/
+int aot_open(const char *file)
+{
+	char c_file[sizeof(aot_file) + 2], tmp[sizeof(aot_file) + 32], tmp_c[sizeof(tmp) + 2];
+	const char *why;
+
+	if (MMU_ENABLED) {
+		printf("Error: translated code runs on flat addresses only; drop -M\n");
+		return 1;
+	}
+	if (aot_load(file)) {
+		return 0;
+	}
+	/* built under a private name, so a run sharing the file never
+	 * loads it half written */
+	snprintf(c_file, sizeof(c_file), "%s.c", file);
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", file, (int)getpid());
+	snprintf(tmp_c, sizeof(tmp_c), "%s.c", tmp);
+	if (aot_translate(tmp_c) != 0 || aot_compile(tmp_c, tmp) != 0) {
+		unlink(tmp);
+		return 1;
+	}
+	if (rename(tmp_c, c_file) != 0 || rename(tmp, file) != 0) {
+		printf("Error: Can't create %s\n", file);
+		unlink(tmp);
+		return 1;
+	}
+	if (!aot_load(file)) {
+		why = dlerror();
+		printf("Error: %s does not load: %s\n", file, why ? why : "it does not match the program");
+		return 1;
+	}
+	return 0;
+}
+
+/* after reset: the reloaded text may still be what was translated */
+void aot_check()
+{
+	if (AOT_INFO != NULL && !MMU_ENABLED && aot_matches(AOT_INFO)) {
+		AOT_ACTIVE = TRUE;
+		aot_watch_text();
+	}
+}
+
+/* callbacks; each makes the PCs what raise_exception() expects */
+static uint32_t aot_step(uint32_t pc)
+{
+	CURRENT_STATE.PC = pc;
+	handle_instruction();
+	return CURRENT_STATE.PC;
+}
+
+static void aot_raise(uint32_t pc, int code)
+{
+	CURRENT_STATE.PC = pc;
+	NEXT_STATE.PC = pc + 4;
+	raise_exception(code, 0);
+}
+
+static int aot_access_ok(uint32_t pc, uint32_t ea, uint32_t size, int store)
+{
+	CURRENT_STATE.PC = pc;
+	NEXT_STATE.PC = pc + 4;
+	return mem_access_ok(ea, size, store);
+}
+
+/************************************************************/
+/* Run translated blocks from the PC for as long as they fit   */
+/* before the instruction limit and the next event. FALSE if   */
+/* none ran: the PC starts no block, or the first does not fit */
+/************************************************************/
+int aot_enter()
+{
+	uint64_t classes[CLS_NUM] = { 0 }, limit, done;
+	aot_env_t env;
+	int i;
+
+#ifdef MEM_TRACE
+	return 0;	/* the tracer sees interpreted accesses only */
+#endif
+	/* raised before the deadline is read, so a device waking this
+	 * core from now on is seen by the module */
+	__atomic_store_n(&AOT_GO, TRUE, __ATOMIC_RELAXED);
+	limit = (EVENT_DEADLINE < INSTRUCTION_LIMIT) ? EVENT_DEADLINE : INSTRUCTION_LIMIT;
+	if (INSTRUCTION_COUNT >= limit) {
+		return 0;
+	}
+	env.R = CURRENT_STATE.R;
+	env.hi = &CURRENT_STATE.HI;
+	env.lo = &CURRENT_STATE.LO;
+	env.cpc = &CURRENT_STATE.PC;
+	env.npc = &NEXT_STATE.PC;
+	env.run = &RUN_FLAG;
+	env.active = &AOT_GO;
+	env.classes = classes;
+	for (i = 0; i < 16; i++) {
+		env.map_mem[i] = MEM_MAP[i] ? MEM_MAP[i]->mem : NULL;
+		env.map_lo[i] = MEM_MAP[i] ? MEM_MAP[i]->begin : 1;
+		env.map_hi[i] = MEM_MAP[i] ? MEM_MAP[i]->end : 0;
+	}
+	env.step = aot_step;
+	env.raise = aot_raise;
+	env.access_ok = aot_access_ok;
+	env.write8 = mem_write_8;
+	env.write16 = mem_write_16;
+	env.write32 = mem_write_32;
+	env.load_linked = load_linked;
+	env.store_conditional = store_conditional;
+	env.read = mmio_read;
+
+	done = AOT_RUN(&env, limit - INSTRUCTION_COUNT);
+	INSTRUCTION_COUNT += done;
+	stat_add(STAT_INSTRUCTIONS, done);
+	stat_add(STAT_AOT_INSTRUCTIONS, done);
+	for (i = 0; i < CLS_NUM; i++) {
+		if (classes[i]) {
+			stat_add(CLASS_STAT[i], classes[i]);
+		}
+	}
+	return done > 0;
+}
+
+/************************************************************/
+/* Symbols                                                     */
+/************************************************************/
+static int SYMBOLS_SORTED = TRUE;
+static int SYMBOLS_CAP;
+
+static int sym_compare(const void *a, const void *b)
+{
+	const asm_symbol_t *x = a, *y = b;
+
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+void sym_clear()
+{
+	free(SYMBOLS);
+	SYMBOLS = NULL;
+	NUM_SYMBOLS = SYMBOLS_CAP = 0;
+	SYMBOLS_SORTED = TRUE;
+}
+
+void sym_add(const char *name, uint32_t addr)
+{
+	asm_symbol_t *grown;
+
+	if (NUM_SYMBOLS == SYMBOLS_CAP) {
+		grown = realloc(SYMBOLS, (SYMBOLS_CAP ? 2 * SYMBOLS_CAP : 64) * sizeof(asm_symbol_t));
+		if (grown == NULL) {
+			printf("Error: out of memory for symbol %s\n", name);
+			return;
+		}
+		SYMBOLS = grown;
+		SYMBOLS_CAP = SYMBOLS_CAP ? 2 * SYMBOLS_CAP : 64;
+	}
+	snprintf(SYMBOLS[NUM_SYMBOLS].name, ASM_SYMBOL, "%s", name);
+	SYMBOLS[NUM_SYMBOLS].addr = addr;
+	if (NUM_SYMBOLS && addr < SYMBOLS[NUM_SYMBOLS - 1].addr) {
+		SYMBOLS_SORTED = FALSE;
+	}
+	NUM_SYMBOLS++;
+}
+
+/* replace the symbols with those in file; returns nonzero on failure */
+int sym_load(const char *file)
+{
+	char line[ASM_LINE], a[ASM_LINE], b[ASM_LINE];
+	unsigned int addr;
+	FILE *fp;
+	int n;
+
+	fp = fopen(file, "r");
+	if (fp == NULL) {
+		printf("Error: Can't open symbol file %s\n", file);
+		return 1;
+	}
+	sym_clear();
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		/* "0040001c T loop" from nm, or just "0040001c loop"; the rest (nm's U lines) are skipped */
+		n = sscanf(line, "%x %511s %511s", &addr, a, b);
+		if (n >= 2) {
+			sym_add(n == 3 ? b : a, addr);
+		}
+	}
+	fclose(fp);
+	printf("Read %d symbols from %s.\n", NUM_SYMBOLS, file);
+	return 0;
+}
+
+/* index of the last symbol at or below addr, -1 if none */
+int sym_find(uint32_t addr)
+{
+	int lo = 0, hi = NUM_SYMBOLS - 1, mid, found = -1;
+
+	if (!SYMBOLS_SORTED) {
+		qsort(SYMBOLS, NUM_SYMBOLS, sizeof(asm_symbol_t), sym_compare);
+		SYMBOLS_SORTED = TRUE;
+	}
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if (SYMBOLS[mid].addr <= addr) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return found;
+}
+
+/************************************************************/
+/* Sampling profiler
+   The SIGPROF handler only reads: the interrupted core's
+   registers, guest stack words through mem_ptr() and PROF_FUNCS,
+   which is rebuilt only while nothing runs. It claims a ring slot
+   with a compare-and-swap on PROF_HEAD and publishes it through
+   the slot's seq, so handlers on several core threads never wait
+   for each other and the drain never reads half a sample. Stacks
+   are unwound heuristically: a function that has run past its
+   addiu $sp and sw $ra finds its caller in its frame, any other
+   innermost function in $ra, unless $ra points back into that
+   function (a frameless root like main, after its last call).
+   The function at the start of the text has no caller.
+************************************************************/
+#define JR_RA	0x03e00008
+
+typedef struct {
+	char *stack;
+	uint64_t count;
+} prof_stack_t;
+
+static pthread_mutex_t PROF_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static prof_stack_t *PROF_STACKS;	/* open addressing on the folded string */
+static size_t PROF_NSTACKS, PROF_STACKS_CAP;
+static uint64_t PROF_TOTAL;
+
+static int prof_func_compare(const void *a, const void *b)
+{
+	const prof_func_t *x = a, *y = b;
+
+	return (x->entry > y->entry) - (x->entry < y->entry);
+}
+
+/* find each function's frame setup; with the machine stopped */
+void prof_scan()
+{
+	prof_func_t *funcs, *f;
+	decoded_t d;
+	uint32_t addr;
+	int i, k;
+
+	funcs = calloc(CFG.nfuncs + 1, sizeof(prof_func_t));
+	if (funcs == NULL) {
+		printf("Error: out of memory for the profiler\n");
+		return;
+	}
+	for (i = 0; i < CFG.nfuncs; i++) {
+		f = &funcs[i];
+		f->entry = CFG.funcs[i];
+		for (k = 0, addr = f->entry; k < PROF_PROLOGUE && cfg_block_at(addr) != CFG_NONE; k++, addr += 4) {
+			decode(addr, mem_read_32(addr), &d);
+			if (d.op == OP_ADDIU && d.rs == 29 && d.rt == 29 && (int32_t)d.imm < 0 && !f->sp_set) {
+				f->frame = -d.imm;
+				f->sp_set = addr + 4;
+			} else if (d.op == OP_SW && d.rs == 29 && d.rt == 31 && !f->ra_saved) {
+				f->ra_off = (int32_t)d.imm;
+				f->ra_saved = addr + 4;
+			} else if (ISA_INFO[d.op].cls == CLS_BRANCH) {
+				break;
+			}
+		}
+	}
+	qsort(funcs, CFG.nfuncs, sizeof(prof_func_t), prof_func_compare);
+	free(PROF_FUNCS);
+	PROF_FUNCS = funcs;
+	PROF_NFUNCS = CFG.nfuncs;
+}
+
+/* the function pc is in, NULL outside the analysed text */
+static const prof_func_t *prof_func_of(uint32_t pc)
+{
+	int lo = 0, hi = PROF_NFUNCS - 1, mid;
+	const prof_func_t *found = NULL;
+
+	if (cfg_block_at(pc) == CFG_NONE) {
+		return NULL;
+	}
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if (PROF_FUNCS[mid].entry <= pc) {
+			found = &PROF_FUNCS[mid];
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return found;
+}
+
+static int prof_peek(uint32_t addr, uint32_t *v)
+{
+	uint8_t *p;
+
+	if ((addr & 3) || (p = mem_ptr(addr, 4)) == NULL) {
+		return FALSE;
+	}
+	memcpy(v, p, 4);
+	*v = guest32(*v);
+	return TRUE;
+}
+
+static void prof_signal(int sig)
+{
+	core_t *c = PROF_CORE;
+	const prof_func_t *f;
+	prof_sample_t *s;
+	uint32_t pc, sp, ret, word;
+	uint64_t h;
+	int depth = 0, leaving;
+
+	(void)sig;
+	if (c == NULL) {
+		atomic_fetch_add_explicit(&PROF_OUTSIDE, 1, memory_order_relaxed);
+		return;
+	}
+	h = atomic_load_explicit(&PROF_HEAD, memory_order_relaxed);
+	do {
+		if (h - atomic_load_explicit(&PROF_TAIL, memory_order_acquire) >= PROF_RING) {
+			atomic_fetch_add_explicit(&PROF_DROPPED, 1, memory_order_relaxed);
+			return;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&PROF_HEAD, &h, h + 1,
+			memory_order_relaxed, memory_order_relaxed));
+	s = &PROF_SAMPLES[h & (PROF_RING - 1)];
+	s->core = c->id;
+	pc = c->cur.PC;
+	sp = c->cur.R[29];
+	s->pc[depth++] = pc;
+	/* under -M $sp is virtual; keep the PC alone */
+	while (depth < PROF_DEPTH && !MMU_ENABLED && (f = prof_func_of(pc)) != NULL) {
+		if (f->entry == MEM_TEXT_BEGIN) {
+			break;		/* the program starts here: nothing called it */
+		}
+		/* on its jr $ra a function has already torn its frame down */
+		leaving = depth == 1 && prof_peek(pc, &word) && word == JR_RA;
+		if (!leaving && f->ra_saved && pc >= f->ra_saved) {
+			if (!prof_peek(sp + f->ra_off, &ret)) {
+				break;
+			}
+		} else if (depth == 1) {
+			ret = c->cur.R[31];
+			/* $ra back inside a frameless function is its own last call,
+			 * not its caller: it could not have called out and kept $ra */
+			if (!f->ra_saved && prof_func_of(ret - 4) == f) {
+				break;
+			}
+		} else {
+			break;
+		}
+		if (!leaving && f->sp_set && pc >= f->sp_set) {
+			sp += f->frame;
+		}
+		if (ret == 0 || (ret & 3)) {
+			break;
+		}
+		/* inside the caller, whether or not the call has a delay slot */
+		pc = ret - 4;
+		s->pc[depth++] = pc;
+	}
+	s->depth = depth;
+	atomic_store_explicit(&s->seq, h + 1, memory_order_release);
+}
+
+/* a frame's name: its function's symbol, else the nearest one */
+static void prof_frame_name(uint32_t pc, char *buf, size_t len)
+{
+	const prof_func_t *f = prof_func_of(pc);
+	int i;
+
+	if (f != NULL) {
+		i = sym_find(f->entry);
+		if (i >= 0 && SYMBOLS[i].addr == f->entry) {
+			snprintf(buf, len, "%s", SYMBOLS[i].name);
+		} else {
+			snprintf(buf, len, "fn_%08x", f->entry);
+		}
+		return;
+	}
+	i = sym_find(pc);
+	if (i >= 0) {
+		snprintf(buf, len, "%s", SYMBOLS[i].name);
+	} else if (pc >= MEM_KTEXT_BEGIN) {
+		snprintf(buf, len, "[kernel]");
+	} else {
+		snprintf(buf, len, "0x%08x", pc);
+	}
+}
+
+static uint64_t prof_hash(const char *s)
+{
+	uint64_t h = 14695981039346656037ull;
+
+	while (*s) {
+		h = (h ^ (uint8_t)*s++) * 1099511628211ull;
+	}
+	return h;
+}
+
+static prof_stack_t *prof_slot(prof_stack_t *table, size_t cap, const char *stack)
+{
+	size_t k = prof_hash(stack) & (cap - 1);
+
+	while (table[k].stack != NULL && strcmp(table[k].stack, stack) != 0) {
+		k = (k + 1) & (cap - 1);
+	}
+	return &table[k];
+}
+
+static void prof_count(const char *stack)
+{
+	prof_stack_t *table, *slot;
+	size_t k, cap;
+
+	if (2 * (PROF_NSTACKS + 1) > PROF_STACKS_CAP) {
+		cap = PROF_STACKS_CAP ? 2 * PROF_STACKS_CAP : 256;
+		table = calloc(cap, sizeof(prof_stack_t));
+		if (table == NULL) {
+			printf("Error: out of memory for the profile\n");
+			return;
+		}
+		for (k = 0; k < PROF_STACKS_CAP; k++) {
+			if (PROF_STACKS[k].stack != NULL) {
+				*prof_slot(table, cap, PROF_STACKS[k].stack) = PROF_STACKS[k];
+			}
+		}
+		free(PROF_STACKS);
+		PROF_STACKS = table;
+		PROF_STACKS_CAP = cap;
+	}
+	slot = prof_slot(PROF_STACKS, PROF_STACKS_CAP, stack);
+	if (slot->stack == NULL) {
+		if ((slot->stack = strdup(stack)) == NULL) {
+			return;
+		}
+		PROF_NSTACKS++;
+	}
+	slot->count++;
+	PROF_TOTAL++;
+}
+
+/* fold what the handlers have published; PROF_LOCK held */
+static void prof_drain()
+{
+	char stack[PROF_DEPTH * (ASM_SYMBOL + 1) + 16], name[ASM_SYMBOL];
+	uint64_t t = atomic_load_explicit(&PROF_TAIL, memory_order_relaxed);
+	prof_sample_t *s;
+	size_t len;
+	int k;
+
+	while (1) {
+		s = &PROF_SAMPLES[t & (PROF_RING - 1)];
+		if (atomic_load_explicit(&s->seq, memory_order_acquire) != t + 1) {
+			break;
+		}
+		/* outermost first, as flamegraph.pl reads them */
+		len = 0;
+		if (NUM_CORES > 1) {
+			len += snprintf(stack, sizeof(stack), "core%d;", s->core);
+		}
+		for (k = s->depth - 1; k >= 0; k--) {
+			prof_frame_name(s->pc[k], name, sizeof(name));
+			len += snprintf(stack + len, sizeof(stack) - len, "%s%s", name, k ? ";" : "");
+		}
+		prof_count(stack);
+		t++;
+		atomic_store_explicit(&PROF_TAIL, t, memory_order_release);
+	}
+}
+
+static void *prof_main(void *arg)
+{
+	struct timespec nap = { 0, PROF_DRAIN_MS * 1000000L };
+
+	(void)arg;
+	while (1) {
+		nanosleep(&nap, NULL);
+		pthread_mutex_lock(&PROF_LOCK);
+		prof_drain();
+		pthread_mutex_unlock(&PROF_LOCK);
+	}
+	return NULL;
+}
+
+/************************************************************/
+/* Start sampling into prof_file; the program must be loaded   */
+/************************************************************/
+void prof_start()
+{
+	struct itimerval period;
+	struct sigaction sa;
+	pthread_t tid;
+
+	prof_scan();
+	if (pthread_create(&tid, NULL, prof_main, NULL) != 0) {
+		printf("Error: Can't start the profiler's drain thread\n");
+		return;
+	}
+	pthread_detach(tid);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = prof_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPROF, &sa, NULL);
+	period.it_interval.tv_sec = 0;
+	period.it_interval.tv_usec = 1000000 / PROF_HZ;
+	period.it_value = period.it_interval;
+	setitimer(ITIMER_PROF, &period, NULL);
+}
+
+static int prof_stack_compare(const void *a, const void *b)
+{
+	const prof_stack_t *x = a, *y = b;
+
+	return strcmp(x->stack, y->stack);
+}
+
+/************************************************************/
+/* Write every stack sampled so far to prof_file, sorted       */
+/************************************************************/
+void prof_report()
+{
+	prof_stack_t *sorted;
+	size_t k, n = 0;
+	FILE *fp;
+	int failed;
+
+	pthread_mutex_lock(&PROF_LOCK);
+	prof_drain();
+	sorted = malloc((PROF_NSTACKS + 1) * sizeof(prof_stack_t));
+	fp = fopen(prof_file, "w");
+	if (sorted == NULL || fp == NULL) {
+		printf("Error: Can't write profile %s\n", prof_file);
+		free(sorted);
+		if (fp != NULL) {
+			fclose(fp);
+		}
+		pthread_mutex_unlock(&PROF_LOCK);
+		return;
+	}
+	for (k = 0; k < PROF_STACKS_CAP; k++) {
+		if (PROF_STACKS[k].stack != NULL) {
+			sorted[n++] = PROF_STACKS[k];
+		}
+	}
+	qsort(sorted, n, sizeof(prof_stack_t), prof_stack_compare);
+	for (k = 0; k < n; k++) {
+		fprintf(fp, "%s %" PRIu64 "\n", sorted[k].stack, sorted[k].count);
+	}
+	free(sorted);
+	failed = ferror(fp);
+	if (fclose(fp) != 0 || failed) {
+		printf("Error: writing %s failed\n", prof_file);
+	} else {
+		printf("Profile: %" PRIu64 " samples in %zu stacks written to %s (%" PRIu64 " dropped, %" PRIu64 " outside the simulator)\n\n",
+			PROF_TOTAL, n, prof_file, atomic_load(&PROF_DROPPED), atomic_load(&PROF_OUTSIDE));
+	}
+	pthread_mutex_unlock(&PROF_LOCK);
+}
+
+/************************************************************/
+/* Out-of-order timing model
+   Trace driven: handle_instruction() passes timing_step() each
+   instruction once it has executed, with its effective address,
+   and NEXT_STATE.PC shows where it went. In one pass the model
+   works out the cycle the instruction is
+
+	fetched	    WIDTH a cycle, a group ending at a taken branch;
+		    after a mispredicted branch or an exception, not
+		    before it completes
+	dispatched  DEPTH cycles later, in order, WIDTH a cycle, once
+		    the ROB, a reservation station and, for loads and
+		    stores, the LSQ have room; SYSCALL, BREAK, SYNC and
+		    COP0 instructions also wait for everything older
+		    to retire
+	issued	    out of order, when its operands and, for a load,
+		    an older in-flight store to the same word are
+		    ready, and a unit is free: WIDTH a cycle in all,
+		    one a cycle per pipelined unit, dividers busy for
+		    their whole latency
+	retired	    in order, WIDTH a cycle, after it completes
+
+   ROB and LSQ entries free up at retirement, stations at issue.
+   Each cycle between one retirement and the next is charged to one
+   cause, so the causes add up to the total: retirement bandwidth,
+   then the latency of the instruction holding up retirement, then
+   why it issued late, then why it dispatched late. Charging the
+   same cycles to that instruction's address shows where the
+   critical path ran.
+************************************************************/
+enum { FU_ALU, FU_MUL, FU_DIV, FU_MEM, FU_FPU, FU_FDIV, FU_NUM };
+
+/* what a cycle was spent on; execution latency causes follow FU_* */
+enum {
+	TC_BASE, TC_FRONTEND, TC_MISPREDICT, TC_ROB, TC_RS, TC_LSQ, TC_SERIAL,
+	TC_DEPENDENCY, TC_MEMORY, TC_UNITS, TC_EXEC, TC_NUM = TC_EXEC + FU_NUM
+};
+
+static const char *TC_NAMES[TC_NUM] = {
+	"retirement bandwidth", "frontend", "branch mispredicts", "ROB full",
+	"reservation stations full", "LSQ full", "serializing instructions",
+	"waiting for operands", "waiting for an older store", "units busy",
+	"integer latency", "multiply latency", "divide latency", "memory latency",
+	"FPU latency", "FPU divide latency"
+};
+
+/* per op, worked out once from MIPS_ISA */
+enum { TK_LOAD = 1, TK_STORE = 2, TK_SERIAL = 4, TK_COND = 8, TK_JUMP = 16, TK_INDIRECT = 32, TK_LINK = 64 };
+
+static uint8_t TIMING_FU[OP_NUM], TIMING_KIND[OP_NUM];
+
+/* HI, LO, the FPRs and the FP condition codes follow the GPRs */
+#define TR_HI	32
+#define TR_LO	33
+#define TR_FPR	34
+#define TR_FCC	66
+#define TIMING_REGS	67
+
+typedef struct {
+	uint64_t cycle;
+	uint8_t n[FU_NUM + 1];		/* issued to each kind of unit, then in all */
+} timing_slot_t;
+
+typedef struct {
+	uint32_t pc;
+	uint64_t cycles[TC_NUM];
+} timing_pc_t;
+
+struct timing {
+	uint64_t instructions, mem_ops, branches, mispredicts;
+	uint64_t cycles[TC_NUM];
+	uint64_t fetch_cycle, redirect;
+	int fetch_used, fetch_break;
+	uint64_t last_dispatch, last_retire;
+	uint64_t *dispatched;		/* last WIDTH dispatch cycles */
+	uint64_t *retired;		/* last ROB retirement cycles */
+	uint64_t *lsq;			/* last LSQ retirement cycles of loads and stores */
+	uint64_t *rs;			/* min-heap of issue cycles of occupied stations */
+	int rs_used;
+	uint64_t ready[TIMING_REGS];
+	uint64_t unit_free[FU_NUM][TIMING_MAX_UNITS];	/* dividers */
+	struct {
+		uint32_t word;
+		uint64_t ready, retire;
+	} stores[TIMING_STORES];
+	uint8_t *counters;		/* 2-bit, taken from 2 */
+	uint32_t *targets;		/* last target of each indirect jump */
+	uint32_t ras[TIMING_RAS];
+	int ras_top;
+	timing_pc_t *pcs;
+	uint64_t pcs_dropped;
+	timing_slot_t slots[TIMING_WINDOW];
+};
+
+static const int *timing_param(int k)
+{
+	static const int *params[] = {
+#define X(name, value, help) &TIMING_CONFIG.name,
+		TIMING_PARAMS(X)
+#undef X
+	};
+	return params[k];
+}
+
+/* -O: "default" or name=value,... */
+int timing_parse(const char *spec)
+{
+	static const char *names[] = {
+#define X(name, value, help) #name,
+		TIMING_PARAMS(X)
+#undef X
+	};
+	static const char *helps[] = {
+#define X(name, value, help) help,
+		TIMING_PARAMS(X)
+#undef X
+	};
+	timing_config_t *c = &TIMING_CONFIG;
+	char copy[256], *p, *eq, *end;
+	size_t k, n = sizeof(names) / sizeof(names[0]);
+	long v;
+
+	TIMING_ENABLED = TRUE;
+	if (strcmp(spec, "default") == 0) {
+		return 0;
+	}
+	snprintf(copy, sizeof(copy), "%s", spec);
+	for (p = strtok(copy, ","); p != NULL; p = strtok(NULL, ",")) {
+		if ((eq = strchr(p, '=')) == NULL) {
+			k = n;
+		} else {
+			*eq = '\0';
+			for (k = 0; k < n && strcmp(p, names[k]) != 0; k++) {
+			}
+		}
+		if (k == n) {
+			printf("Error: unknown timing parameter \"%s\"; -O takes \"default\" or name=value pairs of\n", p);
+			for (k = 0; k < n; k++) {
+				printf("  %-6s %5d  %s\n", names[k], *timing_param(k), helps[k]);
+			}
+			return -1;
+		}
+		v = strtol(eq + 1, &end, 0);
+		if (*end != '\0' || v < 1 || v > INT32_MAX) {
+			printf("Error: timing parameter %s must be a positive number\n", names[k]);
+			return -1;
+		}
+		*(int *)timing_param(k) = v;
+	}
+	if (c->width > TIMING_MAX_WIDTH || c->rob < c->width || (c->bp & (c->bp - 1)) ||
+			c->alus > TIMING_MAX_UNITS || c->muls > TIMING_MAX_UNITS || c->divs > TIMING_MAX_UNITS ||
+			c->ports > TIMING_MAX_UNITS || c->fpus > TIMING_MAX_UNITS || c->fdivs > TIMING_MAX_UNITS ||
+			c->alu > TIMING_MAX_LATENCY || c->mul > TIMING_MAX_LATENCY || c->div > TIMING_MAX_LATENCY ||
+			c->load > TIMING_MAX_LATENCY || c->fpu > TIMING_MAX_LATENCY || c->fdiv > TIMING_MAX_LATENCY) {
+		printf("Error: timing needs width <= %d, rob >= width, bp a power of two, at most %d of each unit\n"
+			"       and latencies up to %d\n", TIMING_MAX_WIDTH, TIMING_MAX_UNITS, TIMING_MAX_LATENCY);
+		return -1;
+	}
+	return 0;
+}
+
+static int timing_latency(int fu, int kind)
+{
+	switch (fu) {
+		case FU_MUL: return TIMING_CONFIG.mul;
+		case FU_DIV: return TIMING_CONFIG.div;
+		case FU_MEM: return (kind & TK_LOAD) ? TIMING_CONFIG.load : 1;
+		case FU_FPU: return TIMING_CONFIG.fpu;
+		case FU_FDIV: return TIMING_CONFIG.fdiv;
+		default: return TIMING_CONFIG.alu;
+	}
+}
+
+static int timing_units(int fu)
+{
+	switch (fu) {
+		case FU_MUL: return TIMING_CONFIG.muls;
+		case FU_DIV: return TIMING_CONFIG.divs;
+		case FU_MEM: return TIMING_CONFIG.ports;
+		case FU_FPU: return TIMING_CONFIG.fpus;
+		case FU_FDIV: return TIMING_CONFIG.fdivs;
+		default: return TIMING_CONFIG.alus;
+	}
+}
+
+/* the unit kind and TK_* flags of every op */
+static void timing_classify()
+{
+	const isa_info_t *info;
+	int op;
+
+	for (op = OP_INVALID + 1; op < OP_NUM; op++) {
+		info = &ISA_INFO[op];
+		switch (info->cls) {
+			case CLS_MULDIV:
+				TIMING_FU[op] = (op == OP_DIV || op == OP_DIVU) ? FU_DIV :
+					(info->fmt == DIS_RD || info->fmt == DIS_RS) ? FU_ALU : FU_MUL;
+				break;
+			case CLS_LOAD: case CLS_FPU_LOAD:
+				TIMING_FU[op] = FU_MEM;
+				TIMING_KIND[op] = TK_LOAD;
+				break;
+			case CLS_STORE: case CLS_FPU_STORE:
+				TIMING_FU[op] = FU_MEM;
+				TIMING_KIND[op] = TK_STORE | (op == OP_SC ? TK_LOAD : 0);
+				break;
+			case CLS_FPU:
+				TIMING_FU[op] = (op == OP_DIV_S || op == OP_DIV_D || op == OP_SQRT_S || op == OP_SQRT_D) ? FU_FDIV :
+					(info->fmt == DIS_RT_FS || info->fmt == DIS_RT_FCR || info->fmt == DIS_RD_RS_CC) ? FU_ALU : FU_FPU;
+				break;
+			case CLS_SYSTEM:
+				TIMING_FU[op] = FU_ALU;
+				if (info->fmt == DIS_NONE || info->fmt == DIS_RT_C0) {
+					TIMING_KIND[op] = TK_SERIAL;
+				}
+				break;
+			default:
+				TIMING_FU[op] = FU_ALU;
+				break;
+		}
+		switch (info->fmt) {
+			case DIS_RS_RT_BRANCH: case DIS_RS_BRANCH: case DIS_CC_BRANCH:
+				TIMING_KIND[op] |= TK_COND;
+				break;
+			case DIS_JUMP:
+				TIMING_KIND[op] |= TK_JUMP;
+				break;
+			case DIS_RS: case DIS_RD_RS:
+				if (info->cls == CLS_BRANCH) {
+					TIMING_KIND[op] |= TK_JUMP | TK_INDIRECT;
+				}
+				break;
+		}
+	}
+	TIMING_KIND[OP_JAL] |= TK_LINK;
+	TIMING_KIND[OP_JALR] |= TK_LINK;
+	TIMING_KIND[OP_BLTZAL] |= TK_LINK;
+	TIMING_KIND[OP_BGEZAL] |= TK_LINK;
+	TIMING_KIND[OP_BLTZALL] |= TK_LINK;
+	TIMING_KIND[OP_BGEZALL] |= TK_LINK;
+}
+
+/* registers d reads and writes, as TR_* numbers */
+static void timing_operands(const decoded_t *d, uint8_t *src, int *ns, uint8_t *dst, int *nd)
+{
+	int s = 0, w = 0, fs = TR_FPR + d->rd, ft = TR_FPR + d->rt, fd = TR_FPR + d->sa;
+
+	switch (ISA_INFO[d->op].fmt) {
+		case DIS_RD_RS_RT:
+			src[s++] = d->rs; src[s++] = d->rt; dst[w++] = d->rd;
+			if (d->op == OP_MOVZ || d->op == OP_MOVN) {
+				src[s++] = d->rd;
+			}
+			break;
+		case DIS_RD_RT_RS:
+			src[s++] = d->rs; src[s++] = d->rt; dst[w++] = d->rd;
+			break;
+		case DIS_RD_RT_SA:
+			src[s++] = d->rt; dst[w++] = d->rd;
+			break;
+		case DIS_RS_RT:
+			src[s++] = d->rs; src[s++] = d->rt;
+			if (ISA_INFO[d->op].cls == CLS_MULDIV) {
+				if (d->op == OP_MADD || d->op == OP_MADDU || d->op == OP_MSUB || d->op == OP_MSUBU) {
+					src[s++] = TR_HI; src[s++] = TR_LO;
+				}
+				dst[w++] = TR_HI; dst[w++] = TR_LO;
+			}
+			break;
+		case DIS_RD_RS:
+			src[s++] = d->rs; dst[w++] = d->rd;
+			break;
+		case DIS_RD:
+			src[s++] = d->op == OP_MFHI ? TR_HI : TR_LO; dst[w++] = d->rd;
+			break;
+		case DIS_RS:
+			src[s++] = d->rs;
+			if (d->op == OP_MTHI || d->op == OP_MTLO) {
+				dst[w++] = d->op == OP_MTHI ? TR_HI : TR_LO;
+			}
+			break;
+		case DIS_RT_RS_SIMM: case DIS_RT_RS_UIMM:
+			src[s++] = d->rs; dst[w++] = d->rt;
+			break;
+		case DIS_RT_UIMM:
+			dst[w++] = d->rt;
+			break;
+		case DIS_RT_MEM:
+			src[s++] = d->rs;
+			if (TIMING_KIND[d->op] & TK_STORE) {
+				src[s++] = d->rt;
+			}
+			if (TIMING_KIND[d->op] & TK_LOAD) {
+				dst[w++] = d->rt;
+			}
+			if (d->op == OP_LWL || d->op == OP_LWR) {
+				src[s++] = d->rt;
+			}
+			break;
+		case DIS_RS_RT_BRANCH:
+			src[s++] = d->rs; src[s++] = d->rt;
+			break;
+		case DIS_RS_BRANCH: case DIS_RS_SIMM: case DIS_OP_MEM:
+			src[s++] = d->rs;
+			break;
+		case DIS_RT_C0:
+			if (d->op == OP_MFC0) {
+				dst[w++] = d->rt;
+			} else {
+				src[s++] = d->rt;
+			}
+			break;
+		case DIS_FD_FS_FT:
+			src[s++] = fs; src[s++] = ft; dst[w++] = fd;
+			break;
+		case DIS_FD_FS:
+			src[s++] = fs; dst[w++] = fd;
+			break;
+		case DIS_FD_FS_RT:
+			src[s++] = fs; src[s++] = d->rt; src[s++] = fd; dst[w++] = fd;
+			break;
+		case DIS_CC_FS_FT:
+			src[s++] = fs; src[s++] = ft; dst[w++] = TR_FCC;
+			break;
+		case DIS_RT_FS:
+			if (d->op == OP_MFC1) {
+				src[s++] = fs; dst[w++] = d->rt;
+			} else {
+				src[s++] = d->rt; dst[w++] = fs;
+			}
+			break;
+		case DIS_RT_FCR:
+			if (d->op == OP_CFC1) {
+				src[s++] = TR_FCC; dst[w++] = d->rt;
+			} else {
+				src[s++] = d->rt; dst[w++] = TR_FCC;
+			}
+			break;
+		case DIS_FT_MEM:
+			src[s++] = d->rs;
+			if (TIMING_KIND[d->op] & TK_STORE) {
+				src[s++] = ft;
+			} else {
+				dst[w++] = ft;
+			}
+			break;
+		case DIS_CC_BRANCH:
+			src[s++] = TR_FCC;
+			break;
+		case DIS_RD_RS_CC:
+			src[s++] = d->rs; src[s++] = TR_FCC; src[s++] = d->rd; dst[w++] = d->rd;
+			break;
+	}
+	if ((TIMING_KIND[d->op] & TK_LINK) && d->op != OP_JALR) {
+		dst[w++] = 31;
+	}
+	*ns = s;
+	*nd = w;
+}
+
+static void rs_push(struct timing *t, uint64_t v)
+{
+	int k = t->rs_used++, up;
+
+	while (k > 0 && t->rs[up = (k - 1) / 2] > v) {
+		t->rs[k] = t->rs[up];
+		k = up;
+	}
+	t->rs[k] = v;
+}
+
+static void rs_pop(struct timing *t)
+{
+	uint64_t v = t->rs[--t->rs_used];
+	int k = 0, c;
+
+	while ((c = 2 * k + 1) < t->rs_used) {
+		if (c + 1 < t->rs_used && t->rs[c + 1] < t->rs[c]) {
+			c++;
+		}
+		if (t->rs[c] >= v) {
+			break;
+		}
+		t->rs[k] = t->rs[c];
+		k = c;
+	}
+	t->rs[k] = v;
+}
+
+static timing_pc_t *timing_pc(struct timing *t, uint32_t pc)
+{
+	uint32_t k = (pc >> 2) * 0x9E3779B1u, n;
+	timing_pc_t *e;
+
+	for (n = 0; n < TIMING_PCS; n++, k++) {
+		e = &t->pcs[k & (TIMING_PCS - 1)];
+		if (e->pc == pc) {
+			return e;
+		}
+		if (e->pc == 0) {
+			e->pc = pc;
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/* charge cycles to cause, and to pc */
+static inline void timing_charge(struct timing *t, timing_pc_t **e, uint32_t pc, int cause, uint64_t cycles)
+{
+	if (cycles == 0) {
+		return;
+	}
+	t->cycles[cause] += cycles;
+	if (*e == NULL && (*e = timing_pc(t, pc)) == NULL) {
+		t->pcs_dropped += cycles;
+		return;
+	}
+	(*e)->cycles[cause] += cycles;
+}
+
+/* d, at pc, has executed; ea was its effective address */
+void timing_step(uint32_t pc, const decoded_t *d, uint32_t ea)
+{
+	const timing_config_t *c = &TIMING_CONFIG;
+	struct timing *t = TIMING;
+	uint64_t i = t->instructions, f, dsp, s, done, r, base, x, stall, part, *free_at = NULL;
+	uint32_t npc = NEXT_STATE.PC, predicted, word = ea >> 2;
+	int kind = TIMING_KIND[d->op], fu = TIMING_FU[d->op], dcause, icause = TC_BASE, lat, ns, nd, k;
+	uint8_t src[4], dst[4];
+	timing_slot_t *slot;
+	timing_pc_t *e = NULL;
+
+	/* fetch */
+	f = t->fetch_cycle;
+	if (t->fetch_used >= c->width || t->fetch_break) {
+		f++;
+		t->fetch_used = 0;
+		t->fetch_break = FALSE;
+	}
+	dcause = TC_FRONTEND;
+	if (t->redirect > f) {
+		f = t->redirect;
+		t->fetch_used = 0;
+		dcause = TC_MISPREDICT;
+	}
+	t->fetch_used++;
+	t->fetch_cycle = f;
+
+	/* dispatch */
+	dsp = f + c->depth;
+	if ((x = t->dispatched[i % c->width] + 1) > dsp) {
+		dsp = x;
+		dcause = TC_FRONTEND;
+	}
+	if (dsp < t->last_dispatch) {
+		dsp = t->last_dispatch;
+	}
+	if ((x = t->retired[i % c->rob]) > dsp) {
+		dsp = x;
+		dcause = TC_ROB;
+	}
+	if ((kind & (TK_LOAD | TK_STORE)) && (x = t->lsq[t->mem_ops % c->lsq]) > dsp) {
+		dsp = x;
+		dcause = TC_LSQ;
+	}
+	if ((kind & TK_SERIAL) && t->last_retire > dsp) {
+		dsp = t->last_retire;
+		dcause = TC_SERIAL;
+	}
+	while (t->rs_used > 0 && t->rs[0] <= dsp) {
+		rs_pop(t);
+	}
+	if (t->rs_used == c->rs) {
+		dsp = t->rs[0];
+		dcause = TC_RS;
+		rs_pop(t);
+	}
+
+	/* issue */
+	s = dsp + 1;
+	timing_operands(d, src, &ns, dst, &nd);
+	for (k = 0; k < ns; k++) {
+		if (t->ready[src[k]] > s) {
+			s = t->ready[src[k]];
+			icause = TC_DEPENDENCY;
+		}
+	}
+	if ((kind & TK_LOAD) && t->stores[word & (TIMING_STORES - 1)].word == word &&
+			t->stores[word & (TIMING_STORES - 1)].retire > dsp && t->stores[word & (TIMING_STORES - 1)].ready > s) {
+		s = t->stores[word & (TIMING_STORES - 1)].ready;
+		icause = TC_MEMORY;
+	}
+	lat = timing_latency(fu, kind);
+	if (fu == FU_DIV || fu == FU_FDIV) {
+		free_at = &t->unit_free[fu][0];
+		for (k = 1; k < timing_units(fu); k++) {
+			if (t->unit_free[fu][k] < *free_at) {
+				free_at = &t->unit_free[fu][k];
+			}
+		}
+		if (*free_at > s) {
+			s = *free_at;
+			icause = TC_UNITS;
+		}
+	}
+	for (;; s++) {
+		slot = &t->slots[s & (TIMING_WINDOW - 1)];
+		if (slot->cycle != s) {
+			memset(slot, 0, sizeof(*slot));
+			slot->cycle = s;
+		}
+		if (slot->n[FU_NUM] < c->width && slot->n[fu] < timing_units(fu)) {
+			break;
+		}
+		icause = TC_UNITS;
+	}
+	slot->n[FU_NUM]++;
+	slot->n[fu]++;
+	if (free_at != NULL) {
+		*free_at = s + lat;
+	}
+	done = s + lat;
+	for (k = 0; k < nd; k++) {
+		t->ready[dst[k]] = done;
+	}
+	t->ready[0] = 0;
+	rs_push(t, s);
+
+	/* where fetch goes next */
+	if (kind & TK_COND) {
+		uint8_t *ctr = &t->counters[(pc >> 2) & (c->bp - 1)];
+		int taken = npc == d->imm;	/* not npc != pc + 4: -D falls through to pc + 8 */
+
+		t->branches++;
+		if ((*ctr >= 2) != taken) {
+			t->mispredicts++;
+			t->redirect = done + 1;
+		}
+		*ctr = taken ? (*ctr < 3 ? *ctr + 1 : 3) : (*ctr > 0 ? *ctr - 1 : 0);
+		t->fetch_break = taken;
+	} else if (kind & TK_JUMP) {
+		t->fetch_break = TRUE;
+		if (kind & TK_INDIRECT) {
+			t->branches++;
+			if (d->op == OP_JR && d->rs == 31 && t->ras_top > 0) {
+				predicted = t->ras[--t->ras_top % TIMING_RAS];
+			} else {
+				predicted = t->targets[(pc >> 2) & (c->bp - 1)];
+			}
+			t->targets[(pc >> 2) & (c->bp - 1)] = npc;
+			if (predicted != npc) {
+				t->mispredicts++;
+				t->redirect = done + 1;
+			}
+		}
+	} else if (npc != pc + 4) {
+		t->redirect = done + 1;		/* an exception: refetch from the vector */
+	}
+	if (kind & TK_LINK) {
+		t->ras[t->ras_top++ % TIMING_RAS] = pc + 8;
+	}
+
+	/* retire, charging the wait since the last retirement */
+	base = t->last_retire;
+	if (i >= (uint64_t)c->width && (x = t->retired[(i - c->width) % c->rob] + 1) > base) {
+		base = x;
+	}
+	r = done + 1 > base ? done + 1 : base;
+	t->cycles[TC_BASE] += base - t->last_retire;
+	if ((stall = r - base) > 0) {
+		part = stall < (uint64_t)lat ? stall : (uint64_t)lat;
+		timing_charge(t, &e, pc, TC_EXEC + fu, part);
+		stall -= part;
+		part = stall < s - dsp - 1 ? stall : s - dsp - 1;
+		timing_charge(t, &e, pc, icause, part);
+		timing_charge(t, &e, pc, dcause, stall - part);
+	}
+	t->last_retire = r;
+	t->last_dispatch = dsp;
+	t->retired[i % c->rob] = r;
+	t->dispatched[i % c->width] = dsp;
+	if (kind & (TK_LOAD | TK_STORE)) {
+		t->lsq[t->mem_ops++ % c->lsq] = r;
+	}
+	if (kind & TK_STORE) {
+		t->stores[word & (TIMING_STORES - 1)].word = word;
+		t->stores[word & (TIMING_STORES - 1)].ready = done;
+		t->stores[word & (TIMING_STORES - 1)].retire = r;
+	}
+	t->instructions = i + 1;
+}
+
+/* allocate every core's model; -O has been parsed */
+void timing_init()
+{
+	const timing_config_t *c = &TIMING_CONFIG;
+	struct timing *t;
+	int n;
+
+	if (!TIMING_ENABLED) {
+		return;
+	}
+	timing_classify();
+	for (n = 0; n < NUM_CORES; n++) {
+		t = calloc(1, sizeof(*t));
+		if (t == NULL || (t->dispatched = calloc(c->width, sizeof(uint64_t))) == NULL ||
+				(t->retired = calloc(c->rob, sizeof(uint64_t))) == NULL ||
+				(t->lsq = calloc(c->lsq, sizeof(uint64_t))) == NULL ||
+				(t->rs = calloc(c->rs, sizeof(uint64_t))) == NULL ||
+				(t->counters = calloc(c->bp, 1)) == NULL ||
+				(t->targets = calloc(c->bp, sizeof(uint32_t))) == NULL ||
+				(t->pcs = calloc(TIMING_PCS, sizeof(timing_pc_t))) == NULL) {
+			printf("Error: out of memory for the timing model\n");
+			exit(-1);
+		}
+		CORES[n].timing = t;
+	}
+	timing_reset();
+}
+
+/* back to an empty pipeline, with the predictor weakly not taken */
+void timing_reset()
+{
+	const timing_config_t *c = &TIMING_CONFIG;
+	struct timing *t;
+	int n;
+
+	for (n = 0; n < NUM_CORES; n++) {
+		if ((t = CORES[n].timing) == NULL) {
+			continue;
+		}
+		memset(t->dispatched, 0, c->width * sizeof(uint64_t));
+		memset(t->retired, 0, c->rob * sizeof(uint64_t));
+		memset(t->lsq, 0, c->lsq * sizeof(uint64_t));
+		memset(t->counters, 1, c->bp);
+		memset(t->targets, 0, c->bp * sizeof(uint32_t));
+		memset(t->pcs, 0, TIMING_PCS * sizeof(timing_pc_t));
+		t->instructions = t->mem_ops = t->branches = t->mispredicts = 0;
+		memset(t->cycles, 0, sizeof(t->cycles));
+		t->fetch_cycle = t->redirect = t->last_dispatch = t->last_retire = 0;
+		t->fetch_used = t->fetch_break = 0;
+		t->rs_used = 0;
+		memset(t->ready, 0, sizeof(t->ready));
+		memset(t->unit_free, 0, sizeof(t->unit_free));
+		memset(t->stores, 0, sizeof(t->stores));
+		t->ras_top = 0;
+		t->pcs_dropped = 0;
+		memset(t->slots, 0, sizeof(t->slots));
+	}
+}
+
+static int timing_pc_compare(const void *a, const void *b)
+{
+	const timing_pc_t *x = a, *y = b;
+	uint64_t sx = 0, sy = 0;
+	int k;
+
+	for (k = 0; k < TC_NUM; k++) {
+		sx += x->cycles[k];
+		sy += y->cycles[k];
+	}
+	return sx < sy ? 1 : sx > sy ? -1 : (x->pc > y->pc) - (x->pc < y->pc);
+}
+
+void print_timing()
+{
+	const timing_config_t *c = &TIMING_CONFIG;
+	char line[LISTING_LINE];
+	timing_pc_t *top;
+	struct timing *t;
+	uint64_t sum, most;
+	int n, k, j, worst;
+
+	if (!TIMING_ENABLED) {
+		printf("Error: no timing model is running (start with -O)\n");
+		return;
+	}
+	printf("-------------------------------------\n");
+	printf("Timing: %d wide, %d-stage frontend, ROB %d, RS %d, LSQ %d\n", c->width, c->depth, c->rob, c->rs, c->lsq);
+	printf("-------------------------------------\n");
+	for (n = 0; n < NUM_CORES; n++) {
+		t = CORES[n].timing;
+		if (NUM_CORES > 1) {
+			printf("core %d:\n", n);
+		}
+		printf("instructions  : %" PRIu64 "\n", t->instructions);
+		printf("cycles        : %" PRIu64 "\n", t->last_retire);
+		printf("IPC           : %.3f\n", t->last_retire ? (double)t->instructions / t->last_retire : 0.0);
+		printf("branches      : %" PRIu64 ", %" PRIu64 " mispredicted (%.2f%%)\n", t->branches, t->mispredicts,
+			t->branches ? 100.0 * t->mispredicts / t->branches : 0.0);
+		printf("\ncycles by cause:\n");
+		for (k = 0; k < TC_NUM; k++) {
+			if (t->cycles[k] != 0) {
+				printf("  %-28s %14" PRIu64 "  %5.1f%%\n", TC_NAMES[k], t->cycles[k],
+					100.0 * t->cycles[k] / t->last_retire);
+			}
+		}
+
+		/* the addresses retirement waited on longest */
+		top = malloc(TIMING_PCS * sizeof(timing_pc_t));
+		if (top == NULL) {
+			continue;
+		}
+		memcpy(top, t->pcs, TIMING_PCS * sizeof(timing_pc_t));
+		qsort(top, TIMING_PCS, sizeof(timing_pc_t), timing_pc_compare);
+		printf("\ncritical path (cycles retirement waited on each instruction):\n");
+		for (j = 0; j < TIMING_TOP && top[j].pc != 0; j++) {
+			for (sum = most = 0, worst = 0, k = 0; k < TC_NUM; k++) {
+				sum += top[j].cycles[k];
+				if (top[j].cycles[k] > most) {
+					most = top[j].cycles[k];
+					worst = k;
+				}
+			}
+			disassemble(top[j].pc, mem_read_32(top[j].pc), line, sizeof(line));
+			printf("  [0x%08x] %-28s %12" PRIu64 "  %5.1f%%  mostly %s\n", top[j].pc, line, sum,
+				100.0 * sum / t->last_retire, TC_NAMES[worst]);
+		}
+		if (t->pcs_dropped) {
+			printf("  (%" PRIu64 " cycles at addresses past the first %d)\n", t->pcs_dropped, TIMING_PCS);
+		}
+		free(top);
+		printf("\n");
+	}
+}
+
+/************************************************************/
+/* Energy model
+   retired() passes energy_step() each instruction once it has
+   run, with its effective address. The op picks one of a few
+   classes, worked out once from MIPS_ISA, whose counter goes up
+   by one; a load or store also counts a memory access and, with
+   a cache, looks its line up in a direct-mapped tag array (by
+   virtual address under -M). What the instruction cost is added
+   to its text word too, and the report sums the words by
+   function, with the functions and names the profiler uses.
+   bulk_try() is off while the model runs, so every word of a
+   copy loop is charged.
+************************************************************/
+enum { EC_ALU, EC_MULDIV, EC_LOAD, EC_STORE, EC_BRANCH, EC_SYSTEM, EC_FPU, EC_NUM };
+
+static const char *EC_NAMES[EC_NUM] = {
+	"alu", "muldiv", "load", "store", "branch", "system", "fpu"
+};
+
+static uint8_t ENERGY_CLASS[OP_NUM];
+static uint32_t ENERGY_COST[EC_NUM];	/* pJ, from ENERGY_CONFIG */
+static int ENERGY_LINE_SHIFT;
+
+struct energy {
+	uint64_t count[EC_NUM];
+	uint64_t accesses, misses;
+	uint32_t *tags;			/* line number + 1 held by each cache line, 0 = empty */
+	uint64_t *words;		/* pJ charged to each text word */
+	uint32_t text_words;
+	uint64_t outside;		/* pJ charged to instructions outside the text */
+};
+
+typedef struct {
+	uint32_t entry;			/* 0 for text in no function */
+	uint64_t pj;
+} energy_func_t;
+
+static const int *energy_param(int k)
+{
+	static const int *params[] = {
+#define X(name, value, help) &ENERGY_CONFIG.name,
+		ENERGY_PARAMS(X)
+#undef X
+	};
+	return params[k];
+}
+
+/* -E: "default" or name=value,... */
+int energy_parse(const char *spec)
+{
+	static const char *names[] = {
+#define X(name, value, help) #name,
+		ENERGY_PARAMS(X)
+#undef X
+	};
+	static const char *helps[] = {
+#define X(name, value, help) help,
+		ENERGY_PARAMS(X)
+#undef X
+	};
+	energy_config_t *c = &ENERGY_CONFIG;
+	char copy[256], *p, *eq, *end;
+	size_t k, n = sizeof(names) / sizeof(names[0]);
+	long v;
+
+	ENERGY_ENABLED = TRUE;
+	if (strcmp(spec, "default") == 0) {
+		return 0;
+	}
+	snprintf(copy, sizeof(copy), "%s", spec);
+	for (p = strtok(copy, ","); p != NULL; p = strtok(NULL, ",")) {
+		if ((eq = strchr(p, '=')) == NULL) {
+			k = n;
+		} else {
+			*eq = '\0';
+			for (k = 0; k < n && strcmp(p, names[k]) != 0; k++) {
+			}
+		}
+		if (k == n) {
+			printf("Error: unknown energy parameter \"%s\"; -E takes \"default\" or name=value pairs of\n", p);
+			for (k = 0; k < n; k++) {
+				printf("  %-6s %5d  %s\n", names[k], *energy_param(k), helps[k]);
+			}
+			return -1;
+		}
+		v = strtol(eq + 1, &end, 0);
+		if (*end != '\0' || v < 0 || v > INT32_MAX) {
+			printf("Error: energy parameter %s must be a number, 0 or more\n", names[k]);
+			return -1;
+		}
+		*(int *)energy_param(k) = v;
+	}
+	if (c->lines > ENERGY_MAX_LINES || (c->lines & (c->lines - 1)) ||
+			c->line < 4 || c->line > ENERGY_MAX_LINE || (c->line & (c->line - 1))) {
+		printf("Error: energy needs lines 0 or a power of two up to %d, and line a power of two\n"
+			"       from 4 to %d bytes\n", ENERGY_MAX_LINES, ENERGY_MAX_LINE);
+		return -1;
+	}
+	return 0;
+}
+
+/* the class of every op */
+static void energy_classify()
+{
+	int op;
+
+	for (op = OP_INVALID + 1; op < OP_NUM; op++) {
+		switch (ISA_INFO[op].cls) {
+			case CLS_MULDIV: ENERGY_CLASS[op] = EC_MULDIV; break;
+			case CLS_LOAD: case CLS_FPU_LOAD: ENERGY_CLASS[op] = EC_LOAD; break;
+			case CLS_STORE: case CLS_FPU_STORE: ENERGY_CLASS[op] = EC_STORE; break;
+			case CLS_BRANCH: case CLS_FPU_BRANCH: ENERGY_CLASS[op] = EC_BRANCH; break;
+			case CLS_SYSTEM: ENERGY_CLASS[op] = EC_SYSTEM; break;
+			case CLS_FPU: ENERGY_CLASS[op] = EC_FPU; break;
+			default: ENERGY_CLASS[op] = EC_ALU; break;
+		}
+	}
+}
+
+/* d, at pc, has run */
+void energy_step(uint32_t pc, const decoded_t *d, uint32_t ea)
+{
+	struct energy *e = ENERGY;
+	int ec = ENERGY_CLASS[d->op];
+	uint32_t pj = ENERGY_COST[ec], line, k = (pc - MEM_TEXT_BEGIN) >> 2;
+
+	e->count[ec]++;
+	if (ec == EC_LOAD || ec == EC_STORE) {
+		e->accesses++;
+		pj += ENERGY_CONFIG.mem;
+		if (e->tags != NULL) {
+			line = (ea >> ENERGY_LINE_SHIFT) + 1;
+			if (e->tags[line & (ENERGY_CONFIG.lines - 1)] != line) {
+				e->tags[line & (ENERGY_CONFIG.lines - 1)] = line;
+				e->misses++;
+				pj += ENERGY_CONFIG.miss;
+			}
+		}
+	}
+	if (k < e->text_words) {
+		e->words[k] += pj;
+	} else {
+		e->outside += pj;
+	}
+}
+
+/* allocate every core's model; -E has been parsed */
+void energy_init()
+{
+	const energy_config_t *c = &ENERGY_CONFIG;
+	struct energy *e;
+	int n;
+
+	if (!ENERGY_ENABLED) {
+		return;
+	}
+	energy_classify();
+	ENERGY_COST[EC_ALU] = c->alu;
+	ENERGY_COST[EC_MULDIV] = c->muldiv;
+	ENERGY_COST[EC_LOAD] = c->load;
+	ENERGY_COST[EC_STORE] = c->store;
+	ENERGY_COST[EC_BRANCH] = c->branch;
+	ENERGY_COST[EC_SYSTEM] = c->system;
+	ENERGY_COST[EC_FPU] = c->fpu;
+	for (ENERGY_LINE_SHIFT = 0; (1 << ENERGY_LINE_SHIFT) < c->line; ENERGY_LINE_SHIFT++) {
+	}
+	for (n = 0; n < NUM_CORES; n++) {
+		e = calloc(1, sizeof(*e));
+		if (e == NULL || (c->lines && (e->tags = calloc(c->lines, sizeof(uint32_t))) == NULL)) {
+			printf("Error: out of memory for the energy model\n");
+			exit(-1);
+		}
+		CORES[n].energy = e;
+	}
+}
+
+/* after loading: a charge per word of the new text, and its functions */
+void energy_open()
+{
+	struct energy *e;
+	int n;
+
+	if (!ENERGY_ENABLED) {
+		return;
+	}
+	prof_scan();
+	for (n = 0; n < NUM_CORES; n++) {
+		e = CORES[n].energy;
+		free(e->words);
+		if ((e->words = calloc(PROGRAM_SIZE + 1, sizeof(uint64_t))) == NULL) {
+			printf("Error: out of memory for the energy model\n");
+			exit(-1);
+		}
+		e->text_words = PROGRAM_SIZE;
+	}
+}
+
+/* nothing charged yet, and a cold cache */
+void energy_reset()
+{
+	struct energy *e;
+	int n;
+
+	for (n = 0; n < NUM_CORES; n++) {
+		if ((e = CORES[n].energy) == NULL) {
+			continue;
+		}
+		memset(e->count, 0, sizeof(e->count));
+		e->accesses = e->misses = e->outside = 0;
+		if (e->tags != NULL) {
+			memset(e->tags, 0, ENERGY_CONFIG.lines * sizeof(uint32_t));
+		}
+		if (e->words != NULL) {
+			memset(e->words, 0, e->text_words * sizeof(uint64_t));
+		}
+	}
+}
+
+/* pj in the largest unit that keeps it at 1 or more */
+static void energy_format(char *buf, size_t len, double pj)
+{
+	static const char *units[] = { "pJ", "nJ", "uJ", "mJ", "J" };
+	int u = 0;
+
+	while (u < 4 && pj >= 1000) {
+		pj /= 1000;
+		u++;
+	}
+	snprintf(buf, len, "%.3f %s", pj, units[u]);
+}
+
+static int energy_func_compare(const void *a, const void *b)
+{
+	const energy_func_t *x = a, *y = b;
+
+	return x->pj < y->pj ? 1 : x->pj > y->pj ? -1 : (x->entry > y->entry) - (x->entry < y->entry);
+}
+
+static void energy_row(const char *what, uint64_t count, uint64_t pj, uint64_t total)
+{
+	char amount[32];
+
+	energy_format(amount, sizeof(amount), pj);
+	printf("  %-16s %14" PRIu64 "  %14s  %5.1f%%\n", what, count, amount, total ? 100.0 * pj / total : 0.0);
+}
+
+void print_energy()
+{
+	const energy_config_t *c = &ENERGY_CONFIG;
+	uint64_t count[EC_NUM] = { 0 }, accesses = 0, misses = 0, outside = 0, instructions = 0, total, pj;
+	const struct energy *e;
+	const prof_func_t *f;
+	energy_func_t *funcs;
+	char amount[32], name[64];
+	uint32_t k;
+	int n, i;
+
+	if (!ENERGY_ENABLED) {
+		printf("Error: no energy model is running (start with -E)\n");
+		return;
+	}
+	for (n = 0; n < NUM_CORES; n++) {
+		e = CORES[n].energy;
+		for (i = 0; i < EC_NUM; i++) {
+			count[i] += e->count[i];
+		}
+		accesses += e->accesses;
+		misses += e->misses;
+		outside += e->outside;
+	}
+	total = accesses * c->mem + misses * c->miss;
+	for (i = 0; i < EC_NUM; i++) {
+		instructions += count[i];
+		total += count[i] * ENERGY_COST[i];
+	}
+
+	printf("-------------------------------------\n");
+	if (c->lines) {
+		printf("Energy: %d-line direct-mapped data cache, %d-byte lines\n", c->lines, c->line);
+	} else {
+		printf("Energy: no data cache\n");
+	}
+	printf("-------------------------------------\n");
+	energy_format(amount, sizeof(amount), total);
+	printf("instructions  : %" PRIu64 "\n", instructions);
+	printf("energy        : %s\n", amount);
+	printf("per instr.    : %.1f pJ\n", instructions ? (double)total / instructions : 0.0);
+	if (c->lines) {
+		printf("data cache    : %" PRIu64 " accesses, %" PRIu64 " misses (%.2f%%)\n", accesses, misses,
+			accesses ? 100.0 * misses / accesses : 0.0);
+	}
+	printf("\nenergy by class:\n");
+	for (i = 0; i < EC_NUM; i++) {
+		if (count[i] != 0) {
+			energy_row(EC_NAMES[i], count[i], count[i] * ENERGY_COST[i], total);
+		}
+	}
+	energy_row("memory accesses", accesses, accesses * c->mem, total);
+	if (c->lines) {
+		energy_row("cache misses", misses, misses * c->miss, total);
+	}
+
+	/* text words summed over the cores, then by function */
+	funcs = calloc(PROF_NFUNCS + 1, sizeof(energy_func_t));
+	if (funcs == NULL) {
+		return;
+	}
+	e = CORES[0].energy;
+	for (k = 0; k < e->text_words; k++) {
+		for (pj = 0, n = 0; n < NUM_CORES; n++) {
+			pj += CORES[n].energy->words[k];
+		}
+		if (pj == 0) {
+			continue;
+		}
+		f = prof_func_of(MEM_TEXT_BEGIN + 4 * k);
+		i = f != NULL ? f - PROF_FUNCS : PROF_NFUNCS;
+		funcs[i].entry = f != NULL ? f->entry : 0;
+		funcs[i].pj += pj;
+	}
+	qsort(funcs, PROF_NFUNCS + 1, sizeof(energy_func_t), energy_func_compare);
+	printf("\nenergy by function:\n");
+	for (i = 0; i < ENERGY_TOP && i <= PROF_NFUNCS && funcs[i].pj != 0; i++) {
+		if (funcs[i].entry != 0) {
+			prof_frame_name(funcs[i].entry, name, sizeof(name));
+		} else {
+			snprintf(name, sizeof(name), "(in no function)");
+		}
+		energy_format(amount, sizeof(amount), funcs[i].pj);
+		printf("  %-28s %14s  %5.1f%%\n", name, amount, total ? 100.0 * funcs[i].pj / total : 0.0);
+	}
+	if (i < PROF_NFUNCS + 1 && i == ENERGY_TOP && funcs[i].pj != 0) {
+		printf("  (more functions past the first %d)\n", ENERGY_TOP);
+	}
+	if (outside != 0) {
+		energy_format(amount, sizeof(amount), outside);
+		printf("  %-28s %14s  %5.1f%%\n", "(outside the text)", amount, 100.0 * outside / total);
+	}
+	free(funcs);
+	printf("\n");
 }
 
 /************************************************************/
-/* Print the program loaded into memory (infMIPS assembly format)    */ 
-/************************************************************/
-void print_program(){
+/* Fuzzing harness
+   fuzz_one() runs an input (layout in mu-mips.h) on core 0 and,
+   one instruction at a time, on a reference model written from
+   the architecture manual rather than from MIPS_ISA: its own
+   field decoding, its own sparse word memory and byte lanes
+   worked out per endianness. After every step the registers,
+   HI, LO, the PC and any word just stored must agree, and when
+   the run ends every page the simulator wrote must match the
+   model. A difference is reported on stderr and aborts, which
+   libFuzzer (make mu-mips-fuzz) and AFL (mu-mips -X @@) both
+   keep as a crash.
+
+   The model stops comparing, without judging, at whatever it
+   does not cover: COP0, the FPU, LL/SC, SYSCALL (the built-in
+   handler would block or exit) and device addresses. The flags
+   byte can turn on -D and -L for both; a branch then steps
+   together with its delay slot, as handle_delayed() runs them,
+   so a slot the model cannot follow never reaches the simulator.
+   A bulk copy or fill retires many instructions in one cycle();
+   the model steps as many.
+
+   Machines are not rebuilt per input. The first input runs
+   initialize(); after that only the pages PAGE_BITMAP says were
+   written are zeroed, their decoded words dropped, and core 0
+   put back to its reset state.
+************************************************************/
+enum { REF_OK, REF_EXCEPTION, REF_UNSUPPORTED };
+
+typedef struct {
+	uint32_t addr;			/* word address, 0 = empty (never mapped) */
+	uint32_t word;
+} fuzz_word_t;
+
+static struct {
+	uint32_t R[32], HI, LO, PC;
+	int big_endian, delay_slots, load_delay;
+	uint32_t load_reg, load_value;	/* -L: the load waiting for the next instruction */
+	uint32_t stored;		/* word written by the last step, 0 = none */
+	int retired;			/* instructions the last step ran, 2 for a branch and its slot */
+	fuzz_word_t mem[FUZZ_REF_SLOTS];
+} REF;
+
+static int FUZZ_READY;
+
+static int ref_mapped(uint32_t a)
+{
+	return (a >= MEM_TEXT_BEGIN && a <= MEM_TEXT_END) || (a >= MEM_DATA_BEGIN && a <= MEM_DATA_END) ||
+		(a >= MEM_KTEXT_BEGIN && a <= MEM_KTEXT_END) || (a >= MEM_KDATA_BEGIN && a <= MEM_KDATA_END);
+}
+
+static fuzz_word_t *ref_slot(uint32_t a)
+{
+	uint32_t k = (a >> 2) * 0x9E3779B1u >> 20;
+	int n;
+
+	for (n = 0; n < FUZZ_REF_SLOTS; n++, k++) {
+		fuzz_word_t *w = &REF.mem[k & (FUZZ_REF_SLOTS - 1)];
+		if (w->addr == a || w->addr == 0) {
+			return w;
+		}
+	}
+	return NULL;
+}
+
+/* a is word aligned; unmapped words read as zero and ignore writes */
+static uint32_t ref_read(uint32_t a)
+{
+	fuzz_word_t *w = ref_slot(a);
+
+	return (w != NULL && w->addr == a) ? w->word : 0;
+}
+
+static void ref_write(uint32_t a, uint32_t v)
+{
+	fuzz_word_t *w;
+
+	if (!ref_mapped(a) || (w = ref_slot(a)) == NULL) {
+		return;
+	}
+	w->addr = a;
+	w->word = v;
+	REF.stored = a;
+}
+
+/* bit offset in its word of the byte at a */
+static int ref_byte_shift(uint32_t a)
+{
+	return 8 * (REF.big_endian ? 3 - (a & 3) : a & 3);
+}
+
+/* for LWL/SWL (left) and LWR/SWR: which byte of the register the
+ * memory byte at offset i of the word pairs with, -1 if none; k is
+ * the offset the effective address names */
+static int ref_partial(int left, int k, int i)
+{
+	if (REF.big_endian) {
+		if (left) {
+			return i >= k ? 3 - (i - k) : -1;
+		}
+		return i <= k ? k - i : -1;
+	}
+	if (left) {
+		return i <= k ? 3 - (k - i) : -1;
+	}
+	return i >= k ? i - k : -1;
+}
+
+static uint32_t ref_count_leading(uint32_t v)
+{
+	uint32_t n = 0;
+
+	while (n < 32 && !(v & 0x80000000u)) {
+		v <<= 1;
+		n++;
+	}
+	return n;
+}
+
+/* 1 for a branch or jump, 2 for a branch-likely, else 0 */
+static int ref_branch_kind(uint32_t w)
+{
+	int r = (w >> 16) & 31;
+
+	switch (w >> 26) {
+		case 0x00:
+			return (w & 0x3f) == 0x08 || (w & 0x3f) == 0x09;
+		case 0x01:
+			return (r & ~0x11) == 0 ? 1 : (r & ~0x11) == 0x02 ? 2 : 0;
+		case 0x02: case 0x03: case 0x04: case 0x05: case 0x06: case 0x07:
+			return 1;
+		case 0x14: case 0x15: case 0x16: case 0x17:
+			return 2;
+	}
+	return 0;
+}
+
+/* the instruction at pc, without -D or -L: its next PC in *next and
+ * whether it branched in *taken; leaves the model untouched unless
+ * it returns REF_OK, and $zero to the caller */
+static int ref_execute(uint32_t pc, uint32_t *next, int *taken)
+{
+	uint32_t w, rs, rt, simm, uimm, ea, base, npc = pc + 4, v, t;
+	uint32_t *R = REF.R;
+	uint64_t acc;
+	int op, s, r, d, sa, i, j, k, size = 0, store = 0;
+
+	if ((pc & 3) || !ref_mapped(pc)) {
+		return REF_EXCEPTION;
+	}
+	w = ref_read(pc);
+	op = w >> 26;
+	s = (w >> 21) & 31;
+	r = (w >> 16) & 31;
+	d = (w >> 11) & 31;
+	sa = (w >> 6) & 31;
+	rs = R[s];
+	rt = R[r];
+	simm = (uint32_t)(int32_t)(int16_t)w;
+	uimm = w & 0xFFFF;
+	ea = rs + simm;
+	*taken = FALSE;
+
+	/* memory operands: alignment first, then whether the model can follow */
+	switch (op) {
+		case 0x21: case 0x25: case 0x29:
+			size = 2;
+			break;
+		case 0x23: case 0x2b:
+			size = 4;
+			break;
+		case 0x20: case 0x24: case 0x28: case 0x22: case 0x26: case 0x2a: case 0x2e:
+			size = 1;
+			break;
+	}
+	store = op >= 0x28;
+	if (size != 0) {
+		if (ea & (size - 1)) {
+			return REF_EXCEPTION;
+		}
+		if ((ea & ~3u) >= MMIO_BEGIN) {
+			return REF_UNSUPPORTED;
+		}
+	}
+	base = ea & ~3u;
+	k = ea & 3;
+
+	/* the branch-likely forms match the plain ones; ref_step() annuls their slot */
+	switch (op) {
+		case 0x00:
+			switch (w & 0x3f) {
+				case 0x00: R[d] = rt << sa; break;
+				case 0x02: R[d] = rt >> sa; break;
+				case 0x03: R[d] = (uint32_t)((int32_t)rt >> sa); break;
+				case 0x04: R[d] = rt << (rs & 31); break;
+				case 0x06: R[d] = rt >> (rs & 31); break;
+				case 0x07: R[d] = (uint32_t)((int32_t)rt >> (rs & 31)); break;
+				case 0x08: npc = rs; *taken = TRUE; break;
+				case 0x09: R[d] = pc + 8; npc = rs; *taken = TRUE; break;
+				case 0x0a: if (rt == 0) R[d] = rs; break;
+				case 0x0b: if (rt != 0) R[d] = rs; break;
+				case 0x0d: return REF_EXCEPTION;
+				case 0x0f: break;
+				case 0x10: R[d] = REF.HI; break;
+				case 0x11: REF.HI = rs; break;
+				case 0x12: R[d] = REF.LO; break;
+				case 0x13: REF.LO = rs; break;
+				case 0x18:
+					acc = (uint64_t)((int64_t)(int32_t)rs * (int32_t)rt);
+					REF.HI = acc >> 32;
+					REF.LO = (uint32_t)acc;
+					break;
+				case 0x19:
+					acc = (uint64_t)rs * rt;
+					REF.HI = acc >> 32;
+					REF.LO = (uint32_t)acc;
+					break;
+				case 0x1a:
+					/* by -1: the negation, wrapping for INT_MIN; by 0: unpredictable, HI/LO kept */
+					if (rt == 0xFFFFFFFFu) {
+						REF.LO = 0 - rs;
+						REF.HI = 0;
+					} else if (rt != 0) {
+						REF.LO = (uint32_t)((int32_t)rs / (int32_t)rt);
+						REF.HI = (uint32_t)((int32_t)rs % (int32_t)rt);
+					}
+					break;
+				case 0x1b:
+					if (rt != 0) {
+						REF.LO = rs / rt;
+						REF.HI = rs % rt;
+					}
+					break;
+				case 0x20:
+					v = rs + rt;
+					if ((int64_t)(int32_t)rs + (int32_t)rt != (int32_t)v) return REF_EXCEPTION;
+					R[d] = v;
+					break;
+				case 0x21: R[d] = rs + rt; break;
+				case 0x22:
+					v = rs - rt;
+					if ((int64_t)(int32_t)rs - (int32_t)rt != (int32_t)v) return REF_EXCEPTION;
+					R[d] = v;
+					break;
+				case 0x23: R[d] = rs - rt; break;
+				case 0x24: R[d] = rs & rt; break;
+				case 0x25: R[d] = rs | rt; break;
+				case 0x26: R[d] = rs ^ rt; break;
+				case 0x27: R[d] = ~(rs | rt); break;
+				case 0x2a: R[d] = (int32_t)rs < (int32_t)rt; break;
+				case 0x2b: R[d] = rs < rt; break;
+				case 0x30: if ((int32_t)rs >= (int32_t)rt) return REF_EXCEPTION; break;
+				case 0x31: if (rs >= rt) return REF_EXCEPTION; break;
+				case 0x32: if ((int32_t)rs < (int32_t)rt) return REF_EXCEPTION; break;
+				case 0x33: if (rs < rt) return REF_EXCEPTION; break;
+				case 0x34: if (rs == rt) return REF_EXCEPTION; break;
+				case 0x36: if (rs != rt) return REF_EXCEPTION; break;
+				case 0x01: case 0x0c:
+					return REF_UNSUPPORTED;	/* MOVF/MOVT, SYSCALL */
+				default:
+					return REF_EXCEPTION;	/* reserved */
+			}
+			break;
+		case 0x01:
+			switch (r) {
+				case 0x00: case 0x02: if ((*taken = (int32_t)rs < 0)) npc = pc + 4 + (simm << 2); break;
+				case 0x01: case 0x03: if ((*taken = (int32_t)rs >= 0)) npc = pc + 4 + (simm << 2); break;
+				case 0x10: case 0x12: R[31] = pc + 8; if ((*taken = (int32_t)rs < 0)) npc = pc + 4 + (simm << 2); break;
+				case 0x11: case 0x13: R[31] = pc + 8; if ((*taken = (int32_t)rs >= 0)) npc = pc + 4 + (simm << 2); break;
+				case 0x08: if ((int32_t)rs >= (int32_t)simm) return REF_EXCEPTION; break;
+				case 0x09: if (rs >= simm) return REF_EXCEPTION; break;
+				case 0x0a: if ((int32_t)rs < (int32_t)simm) return REF_EXCEPTION; break;
+				case 0x0b: if (rs < simm) return REF_EXCEPTION; break;
+				case 0x0c: if (rs == simm) return REF_EXCEPTION; break;
+				case 0x0e: if (rs != simm) return REF_EXCEPTION; break;
+				default: return REF_EXCEPTION;
+			}
+			break;
+		case 0x03:
+			R[31] = pc + 8;
+			/* fall through */
+		case 0x02:
+			npc = ((pc + 4) & 0xF0000000u) | ((w & 0x03FFFFFF) << 2);
+			*taken = TRUE;
+			break;
+		case 0x04: case 0x14: if ((*taken = rs == rt)) npc = pc + 4 + (simm << 2); break;
+		case 0x05: case 0x15: if ((*taken = rs != rt)) npc = pc + 4 + (simm << 2); break;
+		case 0x06: case 0x16: if ((*taken = (int32_t)rs <= 0)) npc = pc + 4 + (simm << 2); break;
+		case 0x07: case 0x17: if ((*taken = (int32_t)rs > 0)) npc = pc + 4 + (simm << 2); break;
+		case 0x08:
+			v = rs + simm;
+			if ((int64_t)(int32_t)rs + (int32_t)simm != (int32_t)v) return REF_EXCEPTION;
+			R[r] = v;
+			break;
+		case 0x09: R[r] = rs + simm; break;
+		case 0x0a: R[r] = (int32_t)rs < (int32_t)simm; break;
+		case 0x0b: R[r] = rs < simm; break;
+		case 0x0c: R[r] = rs & uimm; break;
+		case 0x0d: R[r] = rs | uimm; break;
+		case 0x0e: R[r] = rs ^ uimm; break;
+		case 0x0f: R[r] = uimm << 16; break;
+		case 0x1c:
+			switch (w & 0x3f) {
+				case 0x00: case 0x01: case 0x04: case 0x05:
+					acc = ((uint64_t)REF.HI << 32) | REF.LO;
+					if (w & 1) {
+						acc = (w & 4) ? acc - (uint64_t)rs * rt : acc + (uint64_t)rs * rt;
+					} else {
+						acc = (w & 4) ? acc - (uint64_t)((int64_t)(int32_t)rs * (int32_t)rt) :
+							acc + (uint64_t)((int64_t)(int32_t)rs * (int32_t)rt);
+					}
+					REF.HI = acc >> 32;
+					REF.LO = (uint32_t)acc;
+					break;
+				case 0x02: R[d] = (uint32_t)((int64_t)(int32_t)rs * (int32_t)rt); break;
+				case 0x20: R[d] = ref_count_leading(rs); break;
+				case 0x21: R[d] = ref_count_leading(~rs); break;
+				default: return REF_EXCEPTION;
+			}
+			break;
+		case 0x20: R[r] = (uint32_t)(int32_t)(int8_t)(ref_read(base) >> ref_byte_shift(ea)); break;
+		case 0x24: R[r] = (uint8_t)(ref_read(base) >> ref_byte_shift(ea)); break;
+		case 0x21: case 0x25:
+			/* a halfword sits where its less significant byte does */
+			v = (uint16_t)(ref_read(base) >> ref_byte_shift(REF.big_endian ? ea + 1 : ea));
+			R[r] = op == 0x21 ? (uint32_t)(int32_t)(int16_t)v : v;
+			break;
+		case 0x23: R[r] = ref_read(base); break;
+		case 0x28:
+			t = ref_byte_shift(ea);
+			ref_write(base, (ref_read(base) & ~(0xFFu << t)) | ((rt & 0xFF) << t));
+			break;
+		case 0x29:
+			t = ref_byte_shift(REF.big_endian ? ea + 1 : ea);
+			ref_write(base, (ref_read(base) & ~(0xFFFFu << t)) | ((rt & 0xFFFF) << t));
+			break;
+		case 0x2b: ref_write(base, rt); break;
+		case 0x22: case 0x26: case 0x2a: case 0x2e:
+			v = store ? ref_read(base) : rt;
+			t = store ? rt : ref_read(base);
+			for (i = 0; i < 4; i++) {
+				if ((j = ref_partial(op == 0x22 || op == 0x2a, k, i)) < 0) {
+					continue;
+				}
+				if (store) {
+					v = (v & ~(0xFFu << ref_byte_shift(base + i))) | (((t >> (8 * j)) & 0xFF) << ref_byte_shift(base + i));
+				} else {
+					v = (v & ~(0xFFu << (8 * j))) | (((t >> ref_byte_shift(base + i)) & 0xFF) << (8 * j));
+				}
+			}
+			if (store) {
+				ref_write(base, v);
+			} else {
+				R[r] = v;
+			}
+			break;
+		case 0x2f: case 0x33:
+			break;			/* CACHE, PREF */
+		case 0x10: case 0x11: case 0x30: case 0x31: case 0x35: case 0x38: case 0x39: case 0x3d:
+			return REF_UNSUPPORTED;	/* COP0, COP1, LL, LWC1, LDC1, SC, SWC1, SDC1 */
+		default:
+			return REF_EXCEPTION;	/* reserved */
+	}
+	*next = npc;
+	return REF_OK;
+}
+
+/* the instruction at pc with -L: a load's value waits in load_reg and
+ * load_value for the next instruction, which lands it whether or not
+ * it raises an exception */
+static int ref_one(uint32_t pc, uint32_t *next, int *taken)
+{
+	uint32_t w = ref_read(pc), old = 0;
+	int op = w >> 26, r = (w >> 16) & 31, ret, load;
+
+	load = REF.load_delay && op >= 0x20 && op <= 0x26;
+	if (load) {
+		old = REF.R[r];
+		if ((op == 0x22 || op == 0x26) && REF.load_reg == (uint32_t)r) {
+			REF.R[r] = REF.load_value;	/* LWL and LWR merge with it */
+		}
+	}
+	ret = ref_execute(pc, next, taken);
+	if (ret == REF_UNSUPPORTED) {
+		if (load) {
+			REF.R[r] = old;
+		}
+		return ret;
+	}
+	if (ret == REF_OK && load && r != 0) {
+		w = REF.R[r];
+		REF.R[r] = old;
+		REF.R[REF.load_reg] = REF.load_value;
+		REF.load_reg = r;
+		REF.load_value = w;
+	} else {
+		REF.R[REF.load_reg] = REF.load_value;
+		REF.load_reg = 0;
+		REF.load_value = 0;
+	}
+	REF.R[0] = 0;
+	return ret;
+}
+
+/* one instruction, or with -D a branch and its delay slot; leaves the
+ * model untouched unless it returns REF_OK, except that an exception
+ * in a slot keeps the branch's link and stops on the branch */
+static int ref_step()
+{
+	uint32_t pc = REF.PC, npc, slot, saved[32], load_reg = REF.load_reg, load_value = REF.load_value;
+	int kind, taken, ret;
+
+	REF.stored = 0;	/* ref_write() sets it */
+	REF.retired = 1;
+	if ((pc & 3) || !ref_mapped(pc)) {
+		return REF_EXCEPTION;
+	}
+	kind = REF.delay_slots ? ref_branch_kind(ref_read(pc)) : 0;
+	memcpy(saved, REF.R, sizeof(saved));
+	if ((ret = ref_one(pc, &npc, &taken)) != REF_OK) {
+		return ret;
+	}
+	if (kind == 0) {
+		REF.PC = npc;
+		return REF_OK;
+	}
+	if (kind == 2 && !taken) {
+		REF.PC = pc + 8;	/* annulled */
+		return REF_OK;
+	}
+	REF.retired = 2;
+	if (!ref_mapped(pc + 4) || ref_branch_kind(ref_read(pc + 4)) != 0) {
+		return REF_EXCEPTION;	/* a branch in a slot is reserved */
+	}
+	if ((ret = ref_one(pc + 4, &slot, &kind)) == REF_UNSUPPORTED) {
+		memcpy(REF.R, saved, sizeof(saved));
+		REF.load_reg = load_reg;
+		REF.load_value = load_value;
+		return ret;
+	}
+	if (ret == REF_OK) {
+		REF.PC = taken ? npc : pc + 8;
+	}
+	return ret;
+}
+
+static void fuzz_fail(const char *what, uint32_t pc, uint32_t sim, uint32_t ref)
+{
+	char line[LISTING_LINE];
+
+	disassemble(pc, ref_read(pc & ~3u), line, sizeof(line));
+	fflush(stdout);
+	fprintf(stderr, "fuzz: %s differs after 0x%08x %s (%" PRIu64 " instructions): simulator 0x%08x, reference 0x%08x\n",
+		what, pc, line, INSTRUCTION_COUNT, sim, ref);
+	abort();
+}
+
+/* registers, HI, LO, PC and the word the last step stored */
+static void fuzz_compare(uint32_t pc)
+{
+	char name[8];
 	int i;
-	uint32_t addr = mem_read_32(addr);
-	
-	for(i=0; i<PROGRAM_SIZE; i++){
-		addr = MEM_TEXT_BEGIN + (i*4);
-		printf("[0x%x]\t", addr);
-		print_instruction(addr);
+
+	for (i = 1; i < MIPS_REGS; i++) {
+		if (CURRENT_STATE.R[i] != REF.R[i]) {
+			snprintf(name, sizeof(name), "$%s", RegNames[i]);
+			fuzz_fail(name, pc, CURRENT_STATE.R[i], REF.R[i]);
+		}
+	}
+	if (CURRENT_STATE.HI != REF.HI) {
+		fuzz_fail("HI", pc, CURRENT_STATE.HI, REF.HI);
+	}
+	if (CURRENT_STATE.LO != REF.LO) {
+		fuzz_fail("LO", pc, CURRENT_STATE.LO, REF.LO);
+	}
+	if (CURRENT_STATE.PC != REF.PC) {
+		fuzz_fail("PC", pc, CURRENT_STATE.PC, REF.PC);
+	}
+	if (REF.stored != 0 && mem_read_32(REF.stored) != ref_read(REF.stored)) {
+		fuzz_fail("stored word", pc, mem_read_32(REF.stored), ref_read(REF.stored));
 	}
 }
 
-/************************************************************/
-/* Print the instruction at given memory address (in MIPS assembly format)    */
-/************************************************************/
-void print_instruction(uint32_t addr){
-	
-	int opCode = mem_read_32(addr) >> 26;
-	int data = mem_read_32(addr);
-
-	//R-type format
-	if (opCode == 0)
-	{	
-		//shift and bit mask to get register values
-
-		int rs = (data >> 21) & 0x1f;
-		int rt = (data >> 16) & 0x1f;
-		int rd = (data >> 11) & 0x1f;
-		int sa = (data >> 6) & 0x1f;
-		int func = data & 0x3f;
-		// int func = opCode << 26;
-		// func = func >> 26;
-
-		if (func == ADD)
-		{
-			printf("ADD ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%s\n", RegNames[rd-1]);	
-		}
-		else if (func == ADDU)
-		{
-			printf("ADDU ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%s\n", RegNames[rd-1]);			
-		}
-		
-		else if (func == SUB)
-		{
-			printf("SUB ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%s\n", RegNames[rd-1]);
-
-		}
-		else if (func == SUBU)
-		{
-			printf("SUBU ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%s\n", RegNames[rd-1]);
-
-		}
-		else if (func == MULT)
-		{
-			printf("MULT ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%s\n", RegNames[rd-1]);
-
-		}
-		else if (func == MULTU)
-		{
-			printf("MULTU ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%s\n", RegNames[rd-1]);
-
-		}
-		else if (func == DIV)
-		{
-			printf("DIV ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%s\n", RegNames[rd-1]);
-
-		}
-		else if (func == DIVU)
-		{
-			printf("DIVU ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%s\n", RegNames[rd-1]);	
-			
-
-		}
-		else if (func == AND)
-		{
-			printf("AND ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%s\n", RegNames[rd-1]);
-
-		}
-		else if (func == OR)
-		{
-			printf("OR ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%s\n", RegNames[rd-1]);
-
-		}
-		else if (func == NOR)
-		{
-			printf("NOR ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%s\n", RegNames[rd-1]);
-		}
-		else if (func == SLT)
-		{
-			printf("SLT ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%s\n", RegNames[rd-1]);
-			
-
-		}
-		else if (func == SLL)
-		{
-			printf("SLL ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%s\n", RegNames[rd-1]);
-
-		}
-		else if (func == SRL)
-		{
-			printf("SRL ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%s\n", RegNames[rd-1]);
-
-		}
-		else if (func == SRA)
-		{
-			printf("SRA ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%s\n", RegNames[rd-1]);
-
-		}
-		
-
-	}
-	//I format
-	else {
-			int rs = (data >> 21) & 0x1f;
-			int rt = (data >> 16) & 0x1f;
-			int immediate = data & 0xFFFF;
-
-			if (opCode == ADDI)
-			{	
-			printf("ADDI ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%04x\n", immediate);
-
-			}
-			else if (opCode == ANDI)
-			{
-			printf("ANDI ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%04x\n", immediate);
-				
-
-			}
-			else if (opCode == ORI)
-			{
-			printf("ORI ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%04x\n", immediate);
-			}
-			else if (opCode == XORI)
-			{
-			printf("XORI ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%04x\n", immediate);
-
-			}
-			else if (opCode == ADDIU)
-			{
-			printf("ADDIU ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%04x\n", immediate);
-
-			}
-			else if (opCode == SLTI)
-			{
-			printf("SLTI ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%04x\n", immediate);
-
-			}
-			else if (opCode == LW)
-			{
-			printf("LW ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%04x\n", immediate);
-			}
-			else if (opCode == LB)
-			{
-			printf("LB ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%04x\n", immediate);
-			}
-			else if (opCode == LH)
-			{
-			printf("LH ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%04x\n", immediate);
-			}
-			else if (opCode == SW)
-			{
-			printf("SW ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%04x\n", immediate);
-			}
-			else if (opCode == SB)
-			{
-			printf("SB ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%04x\n", immediate);
-			}
-			else if (opCode == SH)
-			{
-			printf("SH ");
-			printf("%s, ", RegNames[rs-1]);
-			printf("%s, ", RegNames[rt-1]);
-			printf("%04x\n", immediate);
-			}
-			else if (opCode == MFHI)
-			{
-			//	mfhi(rd,HI);
-			}
-			else if (opCode == MFLO)
-			{
-			//	mflo(rd);
-			}
-			else if (opCode == MTHI)
-			{
-			//	mthi(rs,rt,immediate);
-			}
-			else if (opCode == MTLO)
-			{
-			//	mtlo(rs,rt,immediate);
-			}
-			else if (opCode == LUI)
-			{
-			printf("LUI ");
-			printf("%s, ", RegNames[rt-1]);
-			printf("%04x\n", immediate);
+/* the first page at or after page that PAGE_BITMAP marks written, 0 if none */
+static uint32_t fuzz_next_page(uint32_t page)
+{
+	uint64_t chunk;
+
+	for (; page < (1u << (32 - MMU_PAGE_SHIFT)); page++) {
+		if ((page & 63) == 0) {
+			memcpy(&chunk, &PAGE_BITMAP[page >> 3], sizeof(chunk));
+			if (chunk == 0) {
+				page += 63;
+				continue;
 			}
 		}
-	
+		if (PAGE_BITMAP[page >> 3] & (1 << (page & 7))) {
+			return page;
+		}
+	}
+	return 0;
+}
+
+/* every word on every page the simulator wrote */
+static void fuzz_compare_memory(uint32_t pc)
+{
+	char what[32];
+	uint32_t page, a, left;
+
+	for (left = PAGES_WRITTEN, page = 0; left > 0 && (page = fuzz_next_page(page)) != 0; left--, page++) {
+		for (a = page << MMU_PAGE_SHIFT; a < (page + 1) << MMU_PAGE_SHIFT; a += 4) {
+			if (mem_read_32(a) != ref_read(a)) {
+				snprintf(what, sizeof(what), "word at 0x%08x", a);
+				fuzz_fail(what, pc, mem_read_32(a), ref_read(a));
+			}
+		}
+	}
+}
+
+/* put memory and core 0 back to where initialize() left them: only
+ * the pages written since are zeroed, and their decoded words dropped */
+static void fuzz_reset()
+{
+	uint32_t page, left;
+	uint8_t *p;
+
+	for (left = PAGES_WRITTEN, page = 0; left > 0 && (page = fuzz_next_page(page)) != 0; left--, page++) {
+		if (CODE_PAGES[page >> 3] & (1 << (page & 7))) {
+			code_invalidate(page);
+		}
+		if ((p = mem_host_ptr(page << MMU_PAGE_SHIFT, 1 << MMU_PAGE_SHIFT)) != NULL) {
+			memset(p, 0, 1 << MMU_PAGE_SHIFT);
+		}
+		PAGE_BITMAP[page >> 3] &= ~(1 << (page & 7));
+	}
+	PAGES_WRITTEN = 0;
+
+	select_core(0);
+	memset(BULK_CACHE, 0, sizeof(CORE->bulk_cache));
+	memset(CURRENT_STATE.R, 0, sizeof(CURRENT_STATE.R));
+	CURRENT_STATE.HI = 0;
+	CURRENT_STATE.LO = 0;
+	memset(CURRENT_STATE.FPR, 0, sizeof(CURRENT_STATE.FPR));
+	CURRENT_STATE.FCSR = 0;
+	fpu_sync_in();
+	CORE->ll_bit = 0;
+	CORE->load_reg = 0;
+	CORE->load_value = 0;
+	CORE->in_delay_slot = FALSE;
+	CORE->annul = FALSE;
+	INSTRUCTION_COUNT = 0;
+	INSTRUCTION_LIMIT = FUZZ_STEPS;	/* bounds bulk_try() too */
+	cp0_reset();
+	CURRENT_STATE.PC = MEM_TEXT_BEGIN;
+	RUN_FLAG = TRUE;
+	STOP_REASON = STOP_NONE;
+}
+
+static uint32_t fuzz_word(const uint8_t *data, size_t size, size_t at)
+{
+	uint8_t b[4] = { 0, 0, 0, 0 };
+
+	if (at < size) {
+		memcpy(b, data + at, size - at < 4 ? size - at : 4);
+	}
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+/* run one input against the model; aborts on a difference */
+int fuzz_one(const uint8_t *data, size_t size)
+{
+	uint32_t words = 0, pc, i;
+	uint64_t before, n;
+	int ref;
+
+	if (!FUZZ_READY) {
+		NUM_CORES = 1;
+		initialize();
+		FUZZ_READY = TRUE;
+	}
+	fuzz_reset();
+	memset(&REF, 0, sizeof(REF));
+	BIG_ENDIAN_GUEST = REF.big_endian = size > 0 && (data[0] & FUZZ_BIG_ENDIAN);
+	delay_configure(size > 0 && (data[0] & FUZZ_DELAY_SLOTS), size > 0 && (data[0] & FUZZ_LOAD_DELAY));
+	REF.delay_slots = DELAY_SLOTS;
+	REF.load_delay = LOAD_DELAY;
+	for (i = 1; i < MIPS_REGS; i++) {
+		CURRENT_STATE.R[i] = REF.R[i] = fuzz_word(data, size, 1 + 4 * (i - 1));
+	}
+	CURRENT_STATE.HI = REF.HI = fuzz_word(data, size, 1 + 4 * 31);
+	CURRENT_STATE.LO = REF.LO = fuzz_word(data, size, 1 + 4 * 32);
+	for (; size > FUZZ_HEADER + 4 * words && words < FUZZ_WORDS; words++) {
+		mem_write_32(MEM_TEXT_BEGIN + 4 * words, fuzz_word(data, size, FUZZ_HEADER + 4 * words));
+		ref_write(MEM_TEXT_BEGIN + 4 * words, fuzz_word(data, size, FUZZ_HEADER + 4 * words));
+	}
+	PROGRAM_SIZE = words;
+	REF.PC = MEM_TEXT_BEGIN;
+	NEXT_STATE = CURRENT_STATE;
+
+	pc = REF.PC;
+	while (INSTRUCTION_COUNT < FUZZ_STEPS) {
+		/* the model goes first, so nothing it cannot follow reaches the simulator */
+		pc = REF.PC;
+		if ((ref = ref_step()) == REF_UNSUPPORTED) {
+			break;
+		}
+		before = INSTRUCTION_COUNT;
+		cycle();
+		for (n = INSTRUCTION_COUNT - before; n > (uint64_t)REF.retired && ref == REF_OK; ) {
+			n -= REF.retired;
+			ref = ref_step();
+		}
+		if (ref == REF_UNSUPPORTED) {
+			break;
+		}
+		if (ref == REF_EXCEPTION) {
+			if (RUN_FLAG || STOP_REASON != STOP_EXCEPTION) {
+				fuzz_fail("exception", pc, 0, 1);
+			}
+			fuzz_compare(pc);
+			break;
+		}
+		if (!RUN_FLAG) {
+			fuzz_fail("exception", pc, 1, 0);
+		}
+		fuzz_compare(pc);
+	}
+	fuzz_compare_memory(pc);
+	return 0;
+}
+
+/* -X: one input from a file, for AFL (afl-fuzz ... -- mu-mips -X @@) or
+ * to replay a crash libFuzzer saved */
+int fuzz_file(const char *file)
+{
+	uint8_t data[FUZZ_HEADER + 4 * FUZZ_WORDS];
+	size_t size;
+	FILE *fp;
+
+	if ((fp = fopen(file, "rb")) == NULL) {
+		printf("Error: Can't open fuzz input %s\n", file);
+		return 1;
+	}
+	size = fread(data, 1, sizeof(data), fp);
+	fclose(fp);
+	fuzz_one(data, size);
+	printf("%s: no difference from the reference model\n", file);
+	return 0;
+}
+
+#ifdef FUZZ
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+	/* the simulator reports each exception it stops on; differences go to stderr */
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		return 1;
+	}
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	return fuzz_one(data, size);
 }
+#endif
+
+#ifndef FUZZ
 /***************************************************************/
 /* main                                                                                                                                   */
 /***************************************************************/
 int main(int argc, char *argv[]) {                              
+	int opt;
+	double interval = 0;
+	const char *metrics = NULL;
+	const char *out_file = NULL;
+	asm_program_t prog;
+	int merge = FALSE;
+
+	/* scripted sessions: one write per buffer, not per line */
+	if (!isatty(STDOUT_FILENO)) {
+		setvbuf(stdout, NULL, _IOFBF, REPL_OUT_BUF);
+	}
+
 	printf("\n**************************\n");
 	printf("Welcome to MU-MIPS SIM...\n");
 	printf("**************************\n\n");
 	
-	if (argc < 2) {
-		printf("Error: You should provide input file.\nUsage: %s <input program> \n\n",  argv[0]);
+	while ((opt = getopt(argc, argv, "s:m:k:r:n:q:i:w:p:o:a:c:u:f:g:y:X:C:O:E:ABPMTJDL")) != -1) {
+		switch (opt) {
+			case 'n':
+				NUM_CORES = atoi(optarg);
+				if (NUM_CORES < 1 || NUM_CORES > MAX_CORES) {
+					printf("Error: core count must be 1..%d\n", MAX_CORES);
+					exit(1);
+				}
+				break;
+			case 'q':
+				SCHED_QUANTUM = strtoul(optarg, NULL, 0);
+				break;
+			case 'P':
+				SCHED_MODE = SCHED_PARALLEL;
+				break;
+			case 'B':
+				BIG_ENDIAN_GUEST = TRUE;
+				break;
+			case 'D':
+				delay_configure(TRUE, LOAD_DELAY);
+				break;
+			case 'L':
+				delay_configure(DELAY_SLOTS, TRUE);
+				break;
+			case 'T':
+				exit(isa_selftest() ? 1 : 0);
+			case 'X':
+				exit(fuzz_file(optarg));
+			case 'C':
+#if FEATURE_COVERAGE
+				strncpy(cov_file, optarg, sizeof(cov_file) - 1);
+#else
+				printf("Error: this build records no coverage (FEATURE_COVERAGE=0)\n");
+				exit(1);
+#endif
+				break;
+			case 'J':
+				merge = TRUE;
+				break;
+			case 'O':
+#if FEATURE_TIMING
+				if (timing_parse(optarg) != 0) {
+					exit(1);
+				}
+#else
+				printf("Error: this build has no timing model (FEATURE_TIMING=0)\n");
+				exit(1);
+#endif
+				break;
+			case 'E':
+#if FEATURE_ENERGY
+				if (energy_parse(optarg) != 0) {
+					exit(1);
+				}
+#else
+				printf("Error: this build has no energy model (FEATURE_ENERGY=0)\n");
+				exit(1);
+#endif
+				break;
+			case 'k':
+				strncpy(kernel_file, optarg, sizeof(kernel_file) - 1);
+				break;
+			case 'r':
+				strncpy(refill_file, optarg, sizeof(refill_file) - 1);
+				break;
+			case 'M':
+#if FEATURE_MMU
+				MMU_ENABLED = TRUE;
+#else
+				printf("Error: this build has no MMU (FEATURE_MMU=0)\n");
+				exit(1);
+#endif
+				break;
+			case 'i':
+				MAX_INSTRUCTIONS = strtoull(optarg, NULL, 0);
+				break;
+			case 'w':
+				MAX_NS = atof(optarg) * 1e9;
+				break;
+			case 'p':
+				MAX_PAGES = strtoul(optarg, NULL, 0);
+				break;
+			case 's':
+				interval = atof(optarg);
+				break;
+			case 'm':
+				metrics = optarg;
+				break;
+			case 'o':
+				out_file = optarg;
+				break;
+			case 'a':
+				strncpy(aot_file, optarg, sizeof(aot_file) - 1);
+				break;
+			case 'c':
+				strncpy(cache_dir, optarg, sizeof(cache_dir) - 1);
+				break;
+			case 'A':
+				CACHE_AOT = TRUE;
+				break;
+			case 'u':
+				strncpy(uart_in_file, optarg, sizeof(uart_in_file) - 1);
+				break;
+			case 'f':
+				strncpy(fb_file, optarg, sizeof(fb_file) - 1);
+				break;
+			case 'g':
+				strncpy(prof_file, optarg, sizeof(prof_file) - 1);
+				break;
+			case 'y':
+				strncpy(sym_file, optarg, sizeof(sym_file) - 1);
+				break;
+			default:
+				optind = argc;
+				break;
+		}
+	}
+	if (merge) {
+		if (!cov_file[0]) {
+			printf("Error: -J needs the coverage file to merge into (-C)\n");
+			exit(1);
+		}
+		exit(cov_merge(cov_file, argv + optind, argc - optind));
+	}
+	if (optind >= argc) {
+		printf("Error: You should provide input file.\nUsage: %s [-k <handler>] [-M [-r <handler>]] [-n <cores> [-q <quantum>|-P]] [-i <count>] [-w <seconds>] [-p <pages>] [-B] [-D] [-L] [-s <seconds>] [-m <socket>] [-T] [-o <output>] [-a <module>] [-c <dir> [-A]] [-u <input>] [-f <frame.pgm>] [-g <profile> [-y <symbols>]] [-X <input>] [-C <coverage> [-J <coverage>...]] [-O <timing>] [-E <energy>] <input program> \n\n",  argv[0]);
+		printf("  <input program> is hex words, assembly (.s, .asm) or an image (%s)\n", IMG_SUFFIX);
+		printf("  -k <handler>\tload an exception handler (hex words) at 0x%08x\n", EXC_VECTOR);
+		printf("  -M\t\ttranslate addresses through the TLB (default: flat, no MMU)\n");
+		printf("  -r <handler>\tload a TLB refill handler at 0x%08x\n", TLB_REFILL_VECTOR);
+		printf("  -n <cores>\tsimulate <cores> cores sharing memory (default 1)\n");
+		printf("  -q <quantum>\tround-robin slice in instructions (default %d)\n", DEFAULT_QUANTUM);
+		printf("  -P\t\trun each core on its own host thread instead\n");
+		printf("  -i <count>\tstop each core after <count> instructions\n");
+		printf("  -w <seconds>\tstop after <seconds> of wall time spent simulating\n");
+		printf("  -p <pages>\tstop once the program has written more than <pages> 4 KiB pages\n");
+		printf("  -B\t\tbig-endian guest memory (default little-endian)\n");
+		printf("  -D\t\tbranch delay slots: the instruction after a branch or jump runs before\n\t\tthe target, unless a branch-likely is not taken\n");
+		printf("  -L\t\tMIPS I load delay: the instruction after a load sees the old value\n");
+		printf("  -T\t\tcheck the instruction tables against themselves and exit\n");
+		printf("  -a <module>\trun the program natively from the shared object <module>, first\n\t\ttranslating and compiling ($CC, default cc) it there if missing or stale\n");
+		printf("  -c <dir>\tkeep decoded text in <dir>, keyed by the program, and reuse it\n\t\ton later runs\n");
+		printf("  -A\t\tlike -a, with the module kept in the -c directory\n");
+		printf("  -o <output>\tassemble the program into <output> and exit: a pre-decoded image\n\t\tif it ends in %s, hex words otherwise\n", IMG_SUFFIX);
+		printf("  -u <input>\tfeed <input> to the UART receiver at 0x%08x\n", UART_BASE);
+		printf("  -f <frame.pgm>\twrite each frame presented on the framebuffer to <frame.pgm>\n");
+		printf("  -g <profile>\tsample the running code %d times a second of CPU time and write\n\t\tfolded call stacks (flamegraph.pl input) to <profile> after each run\n", PROF_HZ);
+		printf("  -y <symbols>\tname addresses from <symbols> (nm output) instead of assembler labels\n");
+		printf("  -X <input>\trun the fuzzing input <input> against the reference model and exit,\n\t\taborting if they differ\n");
+		printf("  -C <coverage>\trecord the instructions and branch directions each run executes,\n\t\tmerged into <coverage> (shared safely between processes)\n");
+		printf("  -J\t\tmerge the coverage files given instead of a program into -C's and exit\n");
+		printf("  -O <timing>\tmodel an out-of-order core alongside the run, \"default\" or name=value,...\n\t\t(an unknown name lists them); the timing command reports it\n");
+		printf("  -E <energy>\tcharge each instruction, memory access and cache miss in picojoules,\n\t\t\"default\" or name=value,... (an unknown name lists them); reported\n\t\tafter sim and by the energy command\n");
+		printf("  -s <seconds>\tprint throughput every <seconds> while simulating\n");
+		printf("  -m <socket>\tserve counters in Prometheus text format on a Unix socket\n\n");
 		exit(1);
 	}
 
-	strcpy(prog_file, argv[1]);
+	if (out_file != NULL) {
+		if (!has_suffix(argv[optind], ".s") && !has_suffix(argv[optind], ".asm")) {
+			printf("Error: -o needs an assembly (.s) program\n");
+			exit(1);
+		}
+		if (assemble(argv[optind], &prog) != 0 || asm_write(&prog, out_file) != 0) {
+			exit(1);
+		}
+		printf("%s: %u words of text, %u bytes of data written to %s\n", argv[optind],
+			prog.text_words, prog.data_bytes, out_file);
+		exit(0);
+	}
+
+	strncpy(prog_file, argv[optind], sizeof(prog_file) - 1);
+	if (sym_file[0] && sym_load(sym_file) != 0) {
+		exit(1);
+	}
+	telemetry_start(interval, metrics);
 	initialize();
-	fill_reg();
 	load_program();
+	if (prof_file[0]) {
+		prof_start();
+	}
+	if (CACHE_AOT) {
+		if (!cache_dir[0]) {
+			printf("Error: -A needs a cache directory (-c)\n");
+			exit(1);
+		}
+		snprintf(aot_file, sizeof(aot_file), "%s/%016" PRIx64 ".so", cache_dir, PCACHE_KEY);
+	}
+	if (aot_file[0] && cov_file[0]) {
+		printf("Error: coverage (-C) is recorded by the interpreter, not by -a/-A modules\n");
+		exit(1);
+	}
+	if (aot_file[0] && TIMING_ENABLED) {
+		printf("Error: the timing model (-O) follows the interpreter, not -a/-A modules\n");
+		exit(1);
+	}
+	if (aot_file[0] && ENERGY_ENABLED) {
+		printf("Error: the energy model (-E) follows the interpreter, not -a/-A modules\n");
+		exit(1);
+	}
+	if (aot_file[0] && (DELAY_SLOTS || LOAD_DELAY)) {
+		printf("Error: delay slots (-D, -L) are run by the interpreter, not by -a/-A modules\n");
+		exit(1);
+	}
+	if (aot_file[0] && aot_open(aot_file) != 0) {
+		exit(1);
+	}
 	help();
 	while (1){
 		handle_command();
 	}
 	return 0;
 }
+#endif
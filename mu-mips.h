@@ -1,8 +1,35 @@
+#include <stdio.h>
 #include <stdint.h>
+#include <stdatomic.h>
 
 #define FALSE 0
 #define TRUE  1
 
+/******************************************************************************/
+/* Build features                                                              */
+/* Each is 0 or 1. The Makefile variants switch them with -D and what they     */
+/* guard compiles out entirely, hot loop included. MEM_TRACE (defined or not)  */
+/* selects the memory access tracer.                                           */
+/******************************************************************************/
+#ifndef FEATURE_STATS
+#define FEATURE_STATS	1	/* counters behind stats, -s and -m */
+#endif
+#ifndef FEATURE_MMU
+#define FEATURE_MMU	1	/* -M: translation through the TLB */
+#endif
+#ifndef FEATURE_CHECKS
+#define FEATURE_CHECKS	0	/* cross-check the decode cache against memory on every hit */
+#endif
+#ifndef FEATURE_COVERAGE
+#define FEATURE_COVERAGE	1	/* -C: executed-word and branch-direction bitmaps */
+#endif
+#ifndef FEATURE_TIMING
+#define FEATURE_TIMING	1	/* -O: out-of-order timing model */
+#endif
+#ifndef FEATURE_ENERGY
+#define FEATURE_ENERGY	1	/* -E: energy model */
+#endif
+
 /******************************************************************************/
 /* MIPS memory layout                                                                                                                                      */
 /******************************************************************************/
@@ -18,9 +45,14 @@
 #define MEM_KDATA_BEGIN 0x90000000
 #define MEM_KDATA_END  0xFFFEFFFF
 
+/* device registers, see "Devices" below; no region backs them */
+#define MMIO_BEGIN	0xFFFF0000
+#define MMIO_END	0xFFFFFFFF
+
 /*stack and data segments occupy the same memory space. Stack grows backward (from higher address to lower address) */
 #define MEM_STACK_BEGIN 0x7FFFFFFF
 #define MEM_STACK_END  0x10010000
+#define STACK_TOP	0x7FFFFFFC	/* initial $sp, the highest word of the stack */
 
 typedef struct {
 	uint32_t begin, end;
@@ -38,25 +70,856 @@ mem_region_t MEM_REGIONS[] = {
 #define NUM_MEM_REGION 4
 #define MIPS_REGS 32
 
+/* region of each 256 MiB slice of the address space (top four bits), NULL if none */
+mem_region_t *MEM_MAP[16];
+
+int BIG_ENDIAN_GUEST;		/* -B: guest memory is big-endian rather than little-endian */
+int DELAY_SLOTS;		/* -D: branches and jumps run the next instruction before the target */
+int LOAD_DELAY;			/* -L: MIPS I, the instruction after a load sees rt's old value */
+
+/* region memory holds guest byte order; these convert between it
+ * and host values, a bswap only when the two differ */
+static inline uint32_t guest32(uint32_t v)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return BIG_ENDIAN_GUEST ? v : __builtin_bswap32(v);
+#else
+	return BIG_ENDIAN_GUEST ? __builtin_bswap32(v) : v;
+#endif
+}
+
+static inline uint16_t guest16(uint16_t v)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return BIG_ENDIAN_GUEST ? v : __builtin_bswap16(v);
+#else
+	return BIG_ENDIAN_GUEST ? __builtin_bswap16(v) : v;
+#endif
+}
+
+/* bulk memory operations */
+#define BULK_MADVISE_MIN	(1 << 20)	/* zero fills this large give pages back instead of writing them */
+#define BULK_CACHE_SIZE	256		/* recognized loop heads, direct mapped; power of two */
+#define BULK_MAX_BODY	7		/* lw + nop + sw + up to three addiu + bne */
+#define BULK_MAX_IND	3
+#define BULK_MIN_TRIPS	16		/* shorter loops are cheaper to interpret */
+#define MDUMP_CHUNK	4096
+
+/* command line */
+#define COMMAND_LINE_MAX	1024	/* longest command line; the rest is ignored */
+#define COMMAND_ARGS_MAX	8
+#define SOURCE_DEPTH	8		/* standard input plus nested scripts */
+#define HISTORY_SIZE	256		/* lines remembered */
+#define REPL_OUT_BUF	(1 << 20)	/* stdout buffer when not talking to a terminal */
+
+/* disassembler */
+#define LISTING_LINE	112		/* longest listing line: coverage marks, "[0x...]\t" + instruction + newline */
+#define LISTING_FETCH	1024		/* words fetched from guest memory per step */
+#define LISTING_BUF	(256 * 1024)	/* listing output buffer */
+
+/* operand layouts */
+enum {
+	DIS_NONE, DIS_RD_RS_RT, DIS_RD_RT_RS, DIS_RD_RT_SA, DIS_RS_RT, DIS_RD_RS,
+	DIS_RD, DIS_RS, DIS_RT_RS_SIMM, DIS_RT_RS_UIMM, DIS_RT_UIMM, DIS_RT_MEM,
+	DIS_RS_RT_BRANCH, DIS_RS_BRANCH, DIS_JUMP, DIS_RT_C0, DIS_RS_SIMM, DIS_OP_MEM,
+	DIS_FD_FS_FT, DIS_FD_FS, DIS_FD_FS_RT, DIS_CC_FS_FT, DIS_RT_FS, DIS_RT_FCR,
+	DIS_FT_MEM, DIS_CC_BRANCH, DIS_RD_RS_CC
+};
+
+/* where an instruction's code lives in the word, see MIPS_ISA */
+enum {
+	ENC_OPCODE, ENC_SPECIAL, ENC_REGIMM, ENC_SPECIAL2, ENC_COP0, ENC_COP0CO,
+	ENC_MOVCI, ENC_COP1, ENC_COP1_BC, ENC_COP1_S, ENC_COP1_D, ENC_COP1_W, ENC_NUM
+};
+
+/* instruction classes, each counted by its own statistic */
+enum {
+	CLS_ALU, CLS_MULDIV, CLS_LOAD, CLS_STORE, CLS_BRANCH, CLS_SYSTEM,
+	CLS_FPU, CLS_FPU_LOAD, CLS_FPU_STORE, CLS_FPU_BRANCH,	/* need Status.CU1 */
+	CLS_NUM
+};
+
+/* an instruction word with its fields pulled out; imm is already
+ * extended the way the instruction uses it (branch and jump targets
+ * are absolute). Holds no pointers so it can be cached or saved. */
+typedef struct {
+	uint32_t word;
+	uint32_t imm;
+	uint8_t op;			/* OP_* from the instruction table */
+	uint8_t rs, rt, rd, sa;
+} decoded_t;
+
+enum { BULK_NONE, BULK_FILL, BULK_COPY };
+
+typedef struct {
+	uint32_t pc;			/* loop head this entry describes, 0 = empty */
+	uint8_t kind;			/* BULK_NONE, BULK_FILL or BULK_COPY */
+	uint8_t len;			/* instructions in the loop body */
+	uint8_t tmp;			/* loaded temporary (copy) or stored value (fill) */
+	uint8_t src, dst;		/* pointer registers */
+	uint8_t bound;			/* register the bne compares against */
+	uint8_t ctr;			/* index of the induction register the bne tests */
+	uint8_t nind;
+	uint8_t ind_reg[BULK_MAX_IND];	/* registers stepped by addiu */
+	int16_t ind_step[BULK_MAX_IND];
+	int16_t soff, doff;		/* lw / sw displacements */
+} bulk_loop_t;
+
 typedef struct CPU_State_Struct {
 
   uint32_t PC;		                   /* program counter */
   uint32_t R[MIPS_REGS]; /* register file. */
   uint32_t HI, LO;                          /* special regs for mult/div. */
+  uint32_t CP0[32];                         /* coprocessor 0, indexed by register number */
+  uint32_t FPR[32];                         /* coprocessor 1; doubles use even/odd pairs, low word even */
+  uint32_t FCSR;                            /* FPU control/status */
 } CPU_State;
 
+/***************************************************************/
+/* Coprocessor 0                                                */
+/***************************************************************/
+#define CP0_INDEX	0
+#define CP0_RANDOM	1
+#define CP0_ENTRYLO0	2
+#define CP0_ENTRYLO1	3
+#define CP0_CONTEXT	4
+#define CP0_PAGEMASK	5
+#define CP0_WIRED	6
+#define CP0_BADVADDR	8
+#define CP0_COUNT	9
+#define CP0_COMPARE	11
+#define CP0_STATUS	12
+#define CP0_CAUSE	13
+#define CP0_ENTRYHI	10
+#define CP0_EPC		14
+#define CP0_PRID	15
+#define CP0_EBASE	15	/* select 1 */
+#define CP0_CONFIG	16	/* select 1 is Config1 */
+
+#define CP0_PRID_VALUE	0x00018000	/* MIPS Technologies, 4Kc-class */
+#define CONFIG_M	0x80000000	/* Config1 follows */
+#define CONFIG_MT_TLB	0x00000080	/* MMU type: standard TLB */
+#define CONFIG_MT_FIXED	0x00000180	/* MMU type: fixed mapping */
+#define CONFIG1_VALUE	(((TLB_ENTRIES - 1) << 25) | 0x1)	/* MMU size, FPU present */
+
+#define STATUS_IE	0x00000001	/* interrupts enabled */
+#define STATUS_EXL	0x00000002	/* exception level */
+#define STATUS_ERL	0x00000004	/* error level */
+#define STATUS_UM	0x00000010	/* user mode */
+#define STATUS_CU0	0x10000000	/* coprocessor 0 usable in user mode */
+#define STATUS_CU1	0x20000000	/* coprocessor 1 (FPU) usable */
+
+#define CAUSE_EXCCODE_SHIFT	2
+#define CAUSE_EXCCODE_MASK	0x0000007C
+#define CAUSE_IP_SW	0x00000300	/* software interrupts IP0-IP1 */
+#define CAUSE_IP2	0x00000400	/* first hardware interrupt line */
+#define CAUSE_IP7	0x00008000	/* timer interrupt */
+#define CAUSE_IP_MASK	0x0000FF00
+#define CAUSE_CE_SHIFT	28		/* coprocessor number of a CpU exception */
+#define CAUSE_CE_MASK	0x30000000
+#define CAUSE_BD	0x80000000	/* the exception was in a branch delay slot; EPC is the branch */
+
+/* exception codes (Cause.ExcCode) */
+#define EXC_INT		0
+#define EXC_MOD		1
+#define EXC_TLBL	2
+#define EXC_TLBS	3
+#define EXC_ADEL	4
+#define EXC_ADES	5
+#define EXC_IBE		6
+#define EXC_SYS		8
+#define EXC_BP		9
+#define EXC_RI		10
+#define EXC_CPU		11
+#define EXC_OV		12
+#define EXC_TR		13
+#define EXC_FPE		15
+
+/***************************************************************/
+/* TLB                                                          */
+/* Physical addresses are the ones MEM_REGIONS are laid out in; */
+/* with the MMU off every virtual address is its own physical   */
+/* address. With it on, kuseg and kseg2/3 go through the TLB    */
+/* and kseg0/kseg1 stay identity mapped.                        */
+/***************************************************************/
+#define TLB_ENTRIES	16
+#define TLB_REFILL_VECTOR	MEM_KTEXT_BEGIN	/* refill entry while EXL is clear */
+#define KSEG0_BEGIN	0x80000000
+#define KSEG2_BEGIN	0xC0000000
+
+#define MMU_PAGE_SHIFT	12
+#define MMU_PAGE_MASK	0x00000FFF
+#define MMU_CACHE_SIZE	256		/* translated 4K pages per access kind, direct mapped; power of two */
+#define MMU_CACHE_EMPTY	1		/* tag no page-aligned address matches */
+
+#define ENTRYHI_VPN2	0xFFFFE000
+#define ENTRYHI_ASID	0x000000FF
+#define ENTRYLO_G	0x00000001
+#define ENTRYLO_V	0x00000002
+#define ENTRYLO_D	0x00000004
+#define ENTRYLO_MASK	0x3FFFFFFF
+#define ENTRYLO_PFN_SHIFT	6
+#define PAGEMASK_MASK	0x1FFFE000
+#define CONTEXT_PTEBASE	0xFF800000
+#define INDEX_P		0x80000000	/* TLBP found no match */
+
+enum { ACC_LOAD, ACC_STORE, ACC_FETCH };
+
+typedef struct {
+	uint32_t mask;			/* PageMask */
+	uint32_t hi;			/* EntryHi: VPN2 and ASID */
+	uint32_t lo[2];			/* EntryLo0/1; G is set in both or neither */
+} tlb_entry_t;
+
+/* one translated 4K page: virtual page tag and the offset to its physical page */
+typedef struct {
+	uint32_t vpage;
+	uint32_t delta;
+} mmu_cache_t;
+
+#if FEATURE_MMU
+int MMU_ENABLED;		/* -M: translate through the TLB */
+#else
+#define MMU_ENABLED	0
+#endif
+
+/***************************************************************/
+/* Decode cache                                                 */
+/* Each core keeps the decoded form of the words it fetched,    */
+/* direct mapped by physical address. CODE_PAGES marks pages    */
+/* some core has cached; stores test it, see code_invalidate(). */
+/***************************************************************/
+#define DCACHE_SIZE	4096		/* entries per core; power of two, at least a page of words */
+#define DCACHE_EMPTY	1		/* pa no fetch can have */
+
+typedef struct {
+	uint32_t pa, va;		/* decoded words depend on both: targets are virtual */
+	decoded_t d;
+} dcache_entry_t;
+
+uint8_t CODE_PAGES[(1u << (32 - MMU_PAGE_SHIFT)) / 8];
+
+/***************************************************************/
+/* Memory access tracing, built with -DMEM_TRACE                */
+/***************************************************************/
+#define TRACE_BUF	4096		/* accesses buffered per core before analysis */
+#define TRACE_LINE_SHIFT	6		/* reuse distance and working set in 64 B lines */
+#ifndef TRACE_WINDOW
+#define TRACE_WINDOW	10000		/* accesses per working set sample */
+#endif
+#define TRACE_HIST	34		/* first touch, distance 0, then log2 buckets */
+#define TRACE_STAMPS	(1 << 16)	/* initial reuse distance tree size */
+#define TRACE_HOT_PAGES	16
+
+struct trace;
+
+/***************************************************************/
+/* Coprocessor 1 (FPU)                                          */
+/***************************************************************/
+#define FPU_FIR		0x00130000	/* W, D and S formats implemented */
+#define FPU_NAN_S	0x7FBFFFFF	/* default quiet NaNs (legacy encoding) */
+#define FPU_NAN_D	0x7FF7FFFFFFFFFFFFULL
+
+#define FCSR_RM_MASK	0x00000003
+#define FCSR_RM_NEAREST	0
+#define FCSR_RM_ZERO	1
+#define FCSR_RM_UP	2
+#define FCSR_RM_DOWN	3
+#define FCSR_FLAGS_SHIFT	2	/* sticky I U O Z V */
+#define FCSR_ENABLES_SHIFT	7
+#define FCSR_CAUSE_SHIFT	12	/* I U O Z V E */
+#define FCSR_FLAGS	(0x1F << FCSR_FLAGS_SHIFT)
+#define FCSR_ENABLES	(0x1F << FCSR_ENABLES_SHIFT)
+#define FCSR_CAUSE	(0x3F << FCSR_CAUSE_SHIFT)
+#define FCSR_FCC0	0x00800000
+#define FCSR_FCC1_SHIFT	25	/* FCC1-7 follow FS */
+
+/* IEEE exception bits, in the order of each FCSR field */
+#define FPE_I		0x01	/* inexact */
+#define FPE_U		0x02	/* underflow */
+#define FPE_O		0x04	/* overflow */
+#define FPE_Z		0x08	/* divide by zero */
+#define FPE_V		0x10	/* invalid */
+#define FPE_E		0x20	/* unimplemented, cause only */
+
+#define EXC_VECTOR	(MEM_KTEXT_BEGIN + 0x180)	/* general exception entry */
+#define BLOCK_MAX	64		/* instructions between pending-event checks at most */
+
+/***************************************************************/
+/* Control flow graph                                           */
+/* cfg_build() splits the loaded text into basic blocks, links  */
+/* them by fall-through and branch edges, groups them into      */
+/* functions (the entry point and every call target) and marks  */
+/* loop headers. CFG.block_of maps each text word to its block, */
+/* so run-time consumers get blocks without rediscovering them.  */
+/***************************************************************/
+#define CFG_NONE	(-1)
+
+/* how a block ends: id, name used in exports */
+#define CFG_ENDS(X) \
+	X(CFG_END_FALL,     "fall") \
+	X(CFG_END_BRANCH,   "branch") \
+	X(CFG_END_JUMP,     "jump") \
+	X(CFG_END_CALL,     "call") \
+	X(CFG_END_RETURN,   "return") \
+	X(CFG_END_INDIRECT, "indirect") \
+	X(CFG_END_ERET,     "eret") \
+	X(CFG_END_INVALID,  "invalid")
+
+enum {
+#define X(id, name) id,
+	CFG_ENDS(X)
+#undef X
+	CFG_END_NUM
+};
+
+typedef struct {
+	uint32_t start, end;		/* first and last instruction */
+	int succ[2];			/* fall-through (or not taken), taken; CFG_NONE if absent */
+	int kind;			/* CFG_END_* */
+	int func;			/* index into CFG.funcs, CFG_NONE if unreachable */
+	uint32_t callee;		/* direct call target, 0 if none */
+	int loop_header;		/* some edge back to this block closes a loop */
+} cfg_block_t;
+
+typedef struct {
+	uint32_t base, words;		/* the text analysed */
+	int nblocks, nfuncs, nloops;
+	cfg_block_t *blocks;
+	int32_t *block_of;		/* per text word, its block */
+	uint32_t *funcs;		/* entry addresses; funcs[0] is the program entry */
+} cfg_t;
+
+cfg_t CFG;
+
+/***************************************************************/
+/* Assembler                                                    */
+/* assemble() turns a .s file into text words, their decoded_t  */
+/* records and .data bytes in two passes. The result is loaded  */
+/* directly (decode caches filled from the records), or written */
+/* out as hex words or as an image: the same three arrays behind */
+/* an image_header_t, so loading one runs no decoder at all.     */
+/***************************************************************/
+#define ASM_LINE	512		/* longest source line */
+#define ASM_SYMBOL	64		/* longest label, with its NUL */
+#define IMG_MAGIC	0x474d494d	/* "MIMG" in host byte order */
+#define IMG_VERSION	1
+#define IMG_SUFFIX	".img"
+
+typedef struct {
+	char name[ASM_SYMBOL];
+	uint32_t addr;
+} asm_symbol_t;
+
+typedef struct {
+	uint32_t *text;			/* instruction words, host order */
+	decoded_t *decoded;		/* one per text word, NULL if not usable */
+	uint32_t text_words;
+	uint8_t *data;			/* .data, already in guest byte order */
+	uint32_t data_bytes;
+	asm_symbol_t *syms;
+	int nsyms;
+} asm_program_t;
+
+typedef struct {
+	uint32_t magic, version;
+	uint32_t record;		/* sizeof(decoded_t) of the writer */
+	uint32_t ops;			/* OP_NUM of the writer */
+	uint32_t isa_hash;		/* fingerprint of the writer's instruction table */
+	uint32_t big_endian;		/* data laid out for a -B guest */
+	uint32_t text_base, text_words;
+	uint32_t data_base, data_bytes;
+} image_header_t;
+
+/***************************************************************/
+/* Ahead-of-time translation                                    */
+/* aot_translate() writes the loaded text as C: a function per   */
+/* CFG block, built from the MIPS_ISA semantics, and aot_run()   */
+/* switching on the PC between them. Compiled to a shared object */
+/* it runs against the simulator through an aot_env_t. AOT_DECLS */
+/* is also pasted into the generated source, so both sides agree */
+/* on the layout.                                                */
+/***************************************************************/
+#define AOT_DECLS \
+	typedef struct { \
+		uint32_t *R, *hi, *lo;		/* the core's registers */ \
+		uint32_t *cpc, *npc; \
+		int *run;			/* RUN_FLAG */ \
+		int *active;			/* AOT_GO: cleared by a store into the text or a device */ \
+		uint64_t *classes;		/* CLS_* counts, added to the statistics */ \
+		const uint8_t *map_mem[16];	/* MEM_MAP: backing of each 256 MiB slice */ \
+		uint32_t map_lo[16], map_hi[16]; \
+		uint32_t (*step)(uint32_t pc);	/* interpret one instruction, returns the next PC */ \
+		void (*raise)(uint32_t pc, int code); \
+		int (*access_ok)(uint32_t pc, uint32_t ea, uint32_t size, int store); \
+		void (*write8)(uint32_t a, uint8_t v); \
+		void (*write16)(uint32_t a, uint16_t v); \
+		void (*write32)(uint32_t a, uint32_t v); \
+		uint32_t (*load_linked)(uint32_t a); \
+		uint32_t (*store_conditional)(uint32_t a, uint32_t v); \
+		uint32_t (*read)(uint32_t a, int size);	/* addresses no region backs */ \
+	} aot_env_t; \
+	typedef struct { \
+		uint32_t abi;			/* hash of AOT_DECLS */ \
+		uint32_t big_endian; \
+		uint32_t text_base, text_words, text_hash; \
+		uint32_t blocks, native, interpreted; \
+	} aot_info_t;
+
+AOT_DECLS
+
+#define AOT_STR(...)	#__VA_ARGS__
+#define AOT_XSTR(...)	AOT_STR(__VA_ARGS__)
+
+const aot_info_t *AOT_INFO;	/* the loaded module, NULL if none */
+uint64_t (*AOT_RUN)(aot_env_t *env, uint64_t budget);
+int AOT_ACTIVE;			/* module matches the text in memory */
+char aot_file[256];		/* -a: the module */
+
+/***************************************************************/
+/* Persistent decode cache                                      */
+/* With -c <dir> the decoded text is kept in <dir>/<key>.dc,     */
+/* key being a hash of the loaded text and of everything that    */
+/* shapes a decoded_t. Later runs of the same program, however   */
+/* many at once, map the file read-only and shared, fill the     */
+/* decode caches from it and take misses from it instead of      */
+/* decode(). -A keeps the translated module there as <key>.so.   */
+/***************************************************************/
+#define PCACHE_MAGIC	0x4344554d	/* "MUDC" in host byte order */
+#define PCACHE_VERSION	1		/* bump when decode() output changes */
+#define PCACHE_SUFFIX	".dc"
+
+typedef struct {
+	uint32_t magic, version;
+	uint32_t record, ops, isa_hash;	/* as in image_header_t */
+	uint32_t big_endian;
+	uint32_t text_base, text_words;
+	uint64_t key;			/* the file's name */
+} pcache_header_t;
+
+char cache_dir[200];		/* -c: the directory, empty if none; leaves room for a module name in aot_file */
+int CACHE_AOT;			/* -A: keep translated code there too */
+uint64_t PCACHE_KEY;		/* of the loaded text */
+const pcache_header_t *PCACHE_MAP;	/* the mapped file, NULL if none */
+size_t PCACHE_BYTES;
+
+/***************************************************************/
+/* Devices                                                      */
+/* Loads and stores no region backs are offered to the devices, */
+/* so RAM accesses never look at them. Device time is core 0's  */
+/* instruction count: callbacks wait in EVENTS, a binary heap   */
+/* on due time, and run from core 0's service_events(), which   */
+/* also copies the lines in DEVICE_IRQ into its Cause register. */
+/* Any core may touch a device; they take turns on a lock.      */
+/***************************************************************/
+#define MAX_DEVICES	8
+#define MAX_EVENTS	64
+
+typedef struct device {
+	const char *name;
+	uint32_t base, size;
+	uint32_t (*read)(struct device *dev, uint32_t off, int size);
+	void (*write)(struct device *dev, uint32_t off, uint32_t value, int size);
+	void (*reset)(struct device *dev);
+} device_t;
+
+typedef void (*event_fn)(void *arg);
+
+typedef struct {
+	uint64_t when;			/* core 0 instruction count */
+	uint64_t seq;			/* ties run in the order scheduled */
+	event_fn fn;
+	void *arg;
+} event_t;
+
+device_t *DEVICES[MAX_DEVICES];
+int NUM_DEVICES;
+event_t EVENTS[MAX_EVENTS];
+int NUM_EVENTS;
+uint64_t EVENT_SEQ;
+_Atomic uint32_t DEVICE_IRQ;	/* hardware lines (0-4, IP2-IP6) held by devices */
+
+/* SPIM's console: receiver control/data, transmitter control/data */
+#define UART_BASE	0xFFFF0000
+#define UART_IRQ	0
+#define UART_TX_DELAY	100		/* instructions to send a character */
+#define UART_RX_DELAY	1000		/* between characters fed from -u */
+#define UART_BUF	4096		/* host output held until a newline or full */
+
+#define TIMER_BASE	0xFFFF0010
+#define TIMER_IRQ	1
+
+#define DMA_BASE	0xFFFF0020
+#define DMA_IRQ		2
+#define DMA_RATE	4		/* bytes moved per instruction */
+
+#define FB_BASE		0xFFFF0030	/* control; the pixels are at FB_PIXELS */
+#define FB_PIXELS	0xFFFF8000
+#define FB_WIDTH	256
+#define FB_HEIGHT	128		/* 8-bit grey, one byte per pixel */
+
+char uart_in_file[256];		/* -u: fed to the UART receiver */
+char fb_file[256];		/* -f: each presented frame is written here as PGM */
+
+/***************************************************************/
+/* Sampling profiler                                            */
+/* With -g, SIGPROF every 1/PROF_HZ s of host CPU time (or each */
+/* host clock tick, if coarser) samples the PC of the core the  */
+/* interrupted thread is running, and the guest call stack      */
+/* unwound from $sp and $ra using the frame each function's     */
+/* prologue sets up. Samples go into a lock-free ring that a    */
+/* host thread drains; nothing is added to the run loop. Stacks */
+/* are written folded, one per line with its count, for         */
+/* flamegraph.pl.                                               */
+/***************************************************************/
+#define PROF_HZ		1000		/* samples per second of host CPU time */
+#define PROF_DEPTH	32		/* frames kept per sample */
+#define PROF_RING	(1 << 14)	/* power of two */
+#define PROF_PROLOGUE	32		/* words searched for a function's frame setup */
+#define PROF_DRAIN_MS	50		/* between drains of the ring */
+
+typedef struct {
+	_Atomic uint64_t seq;		/* ring position + 1 once the sample is complete */
+	int core, depth;
+	uint32_t pc[PROF_DEPTH];	/* innermost first */
+} prof_sample_t;
+
+/* what a function's prologue does to $sp and $ra */
+typedef struct {
+	uint32_t entry;
+	uint32_t frame;			/* bytes taken off $sp, 0 if none */
+	uint32_t sp_set;		/* first address past that addiu, 0 if none */
+	uint32_t ra_saved;		/* first address past sw $ra, 0 if none */
+	int32_t ra_off;			/* where, from the new $sp */
+} prof_func_t;
+
+char prof_file[256];		/* -g: folded stacks, rewritten after every run */
+char sym_file[256];		/* -y: "address [type] name" lines, as nm prints */
+
+prof_sample_t PROF_SAMPLES[PROF_RING];
+_Atomic uint64_t PROF_HEAD, PROF_TAIL;
+_Atomic uint64_t PROF_DROPPED;	/* ring full */
+_Atomic uint64_t PROF_OUTSIDE;	/* the interrupted thread was not simulating */
+prof_func_t *PROF_FUNCS;	/* by entry */
+int PROF_NFUNCS;
+
+/* program symbols by address: -y, else the assembler's labels */
+asm_symbol_t *SYMBOLS;
+int NUM_SYMBOLS;
+
+/***************************************************************/
+/* Fuzzing harness                                              */
+/* An input is a flags byte, R1..R31, HI and LO as little-      */
+/* endian words, then up to FUZZ_WORDS instruction words loaded */
+/* at MEM_TEXT_BEGIN; a short header is padded with zeros. Each */
+/* input runs for at most FUZZ_STEPS instructions in step with  */
+/* a reference model of the integer instructions.               */
+/***************************************************************/
+#define FUZZ_WORDS	256		/* instructions taken from an input */
+#define FUZZ_STEPS	1000		/* instructions compared per input */
+#define FUZZ_HEADER	(1 + 33 * 4)
+#define FUZZ_BIG_ENDIAN	0x01		/* flags: run the guest big-endian */
+#define FUZZ_DELAY_SLOTS	0x02		/* flags: -D */
+#define FUZZ_LOAD_DELAY	0x04		/* flags: -L */
+#define FUZZ_REF_SLOTS	4096		/* reference memory words; power of two, over FUZZ_WORDS + FUZZ_STEPS */
+
+/***************************************************************/
+/* Coverage                                                     */
+/* With -C, each text word executed sets a bit and each         */
+/* conditional branch two more, one per direction. After every  */
+/* run they are ORed into the -C file under an exclusive lock,  */
+/* so any number of runs and processes can share a file, and -J */
+/* ORs whole files together. A file is a cov_header_t, the      */
+/* executed bits, then the branch bits (taken, not taken, by    */
+/* branch number), each padded to whole 64-bit host words.      */
+/***************************************************************/
+#define COV_MAGIC	0x564f434d	/* "MCOV" */
+#define COV_VERSION	1
+
+typedef struct {
+	uint32_t magic, version;
+	uint32_t text_base, text_words;
+	uint32_t branches;		/* conditional branches in the text */
+	uint32_t reserved;
+	uint64_t key;			/* hash of the text */
+} cov_header_t;
+
+char cov_file[256];		/* -C */
+cov_header_t COV_HEADER;	/* of the loaded text */
+uint64_t *COV_BITS;		/* NULL unless recording */
+uint32_t *COV_BRANCH;		/* by text word: branch number + 1, 0 if not a conditional branch */
+
+/***************************************************************/
+/* Out-of-order timing model                                    */
+/* With -O, every instruction a core executes is also passed,   */
+/* in program order, to a model of an out-of-order core that    */
+/* works out when it would have been fetched, dispatched,       */
+/* issued and retired. Results still come from the functional   */
+/* model; the timing model only counts cycles, and why they     */
+/* were spent. -O takes name=value pairs, comma separated, from */
+/* the list below, or "default".                                */
+/***************************************************************/
+#define TIMING_PARAMS(X) \
+	X(width,  4,    "instructions fetched, dispatched, issued and retired a cycle") \
+	X(depth,  5,    "frontend stages between fetch and dispatch") \
+	X(rob,    128,  "reorder buffer entries") \
+	X(rs,     48,   "reservation station entries") \
+	X(lsq,    48,   "load/store queue entries") \
+	X(bp,     4096, "branch predictor counters and indirect targets (power of two)") \
+	X(alu,    1,    "integer latency") \
+	X(mul,    3,    "MULT, MUL, MADD and MSUB latency") \
+	X(div,    20,   "DIV and DIVU latency") \
+	X(load,   3,    "load-to-use latency") \
+	X(fpu,    4,    "FPU latency") \
+	X(fdiv,   12,   "FPU divide and square root latency") \
+	X(alus,   4,    "integer units") \
+	X(muls,   1,    "multipliers, pipelined") \
+	X(divs,   1,    "dividers, busy for a whole divide") \
+	X(ports,  2,    "load/store ports") \
+	X(fpus,   2,    "FPU pipelines") \
+	X(fdivs,  1,    "FPU dividers, busy for a whole divide")
+
+#define TIMING_MAX_WIDTH	16
+#define TIMING_MAX_UNITS	16
+#define TIMING_MAX_LATENCY	1000
+#define TIMING_WINDOW	(1 << 14)	/* cycles past dispatch issue slots are booked for; power of two */
+#define TIMING_STORES	1024		/* recent stores by word, for load ordering; power of two */
+#define TIMING_RAS	16		/* return address stack */
+#define TIMING_PCS	4096		/* instruction addresses retirement stalls are charged to; power of two */
+#define TIMING_TOP	10		/* of them reported */
+
+typedef struct {
+#define X(name, value, help) int name;
+	TIMING_PARAMS(X)
+#undef X
+} timing_config_t;
+
+int TIMING_ENABLED;		/* -O */
+timing_config_t TIMING_CONFIG = {
+#define X(name, value, help) value,
+	TIMING_PARAMS(X)
+#undef X
+};
+
+/***************************************************************/
+/* Energy model                                                 */
+/* With -E, every instruction a core executes is charged the    */
+/* energy of its class, every load and store one data memory    */
+/* access more and, when a data cache is configured, every      */
+/* access that misses it a miss more. Costs are in picojoules;  */
+/* -E takes name=value pairs, comma separated, from the list    */
+/* below, or "default". The report gives the total, each class  */
+/* and each function.                                           */
+/***************************************************************/
+#define ENERGY_PARAMS(X) \
+	X(alu,    10,   "pJ per integer ALU instruction") \
+	X(muldiv, 40,   "pJ per multiply, divide and HI/LO instruction") \
+	X(load,   15,   "pJ per load, before its memory access") \
+	X(store,  15,   "pJ per store, before its memory access") \
+	X(branch, 12,   "pJ per branch and jump") \
+	X(system, 30,   "pJ per system and coprocessor 0 instruction") \
+	X(fpu,    50,   "pJ per FPU instruction, other than loads, stores and branches") \
+	X(mem,    60,   "pJ per data memory access (a cache hit, with a cache)") \
+	X(miss,   600,  "pJ more per data cache miss") \
+	X(lines,  0,    "data cache lines, direct mapped (power of two, 0 = no cache)") \
+	X(line,   32,   "data cache line bytes (power of two)")
+
+#define ENERGY_MAX_LINES	(1 << 20)
+#define ENERGY_MAX_LINE		4096
+#define ENERGY_TOP	20		/* functions reported */
+
+typedef struct {
+#define X(name, value, help) int name;
+	ENERGY_PARAMS(X)
+#undef X
+} energy_config_t;
+
+int ENERGY_ENABLED;		/* -E */
+energy_config_t ENERGY_CONFIG = {
+#define X(name, value, help) value,
+	ENERGY_PARAMS(X)
+#undef X
+};
+
 
 
 /***************************************************************/
 /* CPU State info.                                                                                                               */
 /***************************************************************/
 
-CPU_State CURRENT_STATE, NEXT_STATE;
-int RUN_FLAG;	/* run flag*/
-uint32_t INSTRUCTION_COUNT;
 uint32_t PROGRAM_SIZE; /*in words*/
 
-char prog_file[32];
+char prog_file[256];
+
+int KERNEL_SIZE;		/* words of exception handler loaded, 0 = built-in handling */
+char kernel_file[256];
+char refill_file[256];		/* -r: TLB refill handler */
+
+/***************************************************************/
+/* Run limits                                                   */
+/* A run can be bounded by retired instructions, wall time and  */
+/* guest pages written. None of them costs a per-instruction    */
+/* check: the instruction cap rides on INSTRUCTION_LIMIT, and    */
+/* wall time and pages are looked at from service_events() every */
+/* WATCHDOG_SLICE instructions. The first limit a core hits      */
+/* stops it and is kept as its stop reason.                      */
+/***************************************************************/
+#define WATCHDOG_SLICE		(1 << 20)	/* instructions between wall-time and page checks */
+#define PAGE_BITMAP_BYTES	((1u << (32 - MMU_PAGE_SHIFT)) / 8)
+
+#define STOP_REASONS(X) \
+	X(STOP_NONE,         "running") \
+	X(STOP_EXIT,         "program exited") \
+	X(STOP_EXCEPTION,    "unhandled exception") \
+	X(STOP_INSTRUCTIONS, "instruction limit reached") \
+	X(STOP_TIME,         "wall-time limit reached") \
+	X(STOP_PAGES,        "memory page limit reached")
+
+enum {
+#define X(id, text) id,
+	STOP_REASONS(X)
+#undef X
+	STOP_NUM
+};
+
+uint64_t MAX_INSTRUCTIONS;	/* -i: instructions each core may retire, 0 = no limit */
+uint64_t MAX_NS;		/* -w: wall time spent simulating, 0 = no limit */
+uint32_t MAX_PAGES;		/* -p: distinct guest pages written, 0 = no limit */
+/* in integer nanoseconds: host floating point on a core's thread would
+ * raise flags fpu_sync_out() folds into the guest's FCSR */
+uint64_t RUN_NS;		/* wall time spent simulating since reset */
+uint64_t WALL_DEADLINE;		/* monotonic time at which the current run is out of time */
+uint8_t PAGE_BITMAP[PAGE_BITMAP_BYTES];	/* one bit per guest physical page written */
+_Atomic uint32_t PAGES_WRITTEN;
+
+/***************************************************************/
+/* Live statistics                                              */
+/***************************************************************/
+#define MAX_STAT_THREADS	64
+#define TELEMETRY_PAGE	(64 * 1024)	/* largest metrics response */
+
+/* id, metric name, help text */
+#define STAT_COUNTERS(X) \
+	X(STAT_INSTRUCTIONS, "instructions", "Instructions retired.") \
+	X(STAT_LOADS,        "loads",        "Load instructions executed.") \
+	X(STAT_STORES,       "stores",       "Store instructions executed.") \
+	X(STAT_BRANCHES,     "branches",     "Branch and jump instructions executed.") \
+	X(STAT_ALU,          "alu",          "Integer ALU instructions executed.") \
+	X(STAT_MULDIV,       "muldiv",       "Multiply, divide and HI/LO instructions executed.") \
+	X(STAT_SYSTEM,       "system",       "System and coprocessor 0 instructions executed.") \
+	X(STAT_FPU,          "fpu",          "Floating point instructions executed, other than loads, stores and branches.") \
+	X(STAT_SYSCALLS,     "syscalls",     "System calls executed.") \
+	X(STAT_BULK_OPS,     "bulk_ops",     "Copy/fill loops executed in bulk.") \
+	X(STAT_EXCEPTIONS,   "exceptions",   "Synchronous exceptions raised.") \
+	X(STAT_INTERRUPTS,   "interrupts",   "Interrupts delivered.") \
+	X(STAT_TLB_REFILLS,  "tlb_refills",  "TLB refill exceptions raised.") \
+	X(STAT_MMU_LOOKUPS,  "mmu_lookups",  "Translations that missed the host translation cache.") \
+	X(STAT_IRQ_LATENCY,  "irq_latency_instructions", "Instructions between raising and delivering interrupts, summed.") \
+	X(STAT_DECODES,      "decodes",      "Instructions decoded on a decode cache miss.") \
+	X(STAT_DECODES_REUSED, "decodes_reused", "Decode cache misses filled from the persistent cache (-c).") \
+	X(STAT_CODE_WRITES,  "code_page_writes", "Stores into a page with cached decodes.") \
+	X(STAT_DECODES_DROPPED, "decodes_dropped", "Decode cache entries discarded by those stores.") \
+	X(STAT_AOT_INSTRUCTIONS, "aot_instructions", "Instructions retired by ahead-of-time translated code.") \
+	X(STAT_MMIO,         "mmio_accesses", "Loads and stores that reached a device.") \
+	X(STAT_DEVICE_EVENTS, "device_events", "Device callbacks run from the event queue.")
+
+enum {
+#define X(id, name, help) id,
+	STAT_COUNTERS(X)
+#undef X
+	STAT_NUM
+};
+
+/* one per simulating thread, written only by its owner */
+typedef struct {
+	_Alignas(64) _Atomic uint64_t c[STAT_NUM];
+} stat_slot_t;
+
+extern _Thread_local stat_slot_t *STATS;
+
+/***************************************************************/
+/* Cores                                                        */
+/* Each simulated core has its own architectural state and run  */
+/* bookkeeping; memory is shared. CORE is the core the calling  */
+/* host thread is executing, and the names below always refer  */
+/* to it.                                                       */
+/***************************************************************/
+#define MAX_CORES	32
+#define DEFAULT_QUANTUM	1000	/* round-robin slice, in instructions */
+
+enum { SCHED_ROUND_ROBIN, SCHED_PARALLEL };
+
+typedef struct {
+	CPU_State cur, next;
+	int run_flag;			/* run flag */
+	int stop_reason;		/* STOP_*, why run_flag was last cleared */
+	int id;
+	uint64_t instruction_count;
+	uint64_t instruction_limit;	/* count at which the current run() stops */
+
+	/* event scheduling, see service_events() */
+	uint64_t event_deadline;	/* instruction count at which service_events() must run */
+	uint64_t timer_deadline;	/* instruction count at which Count reaches Compare */
+	uint64_t count_base;		/* instruction count at which Count read 0 */
+	uint64_t irq_raised_at;		/* when the oldest undelivered interrupt was raised */
+	uint64_t watchdog_deadline;	/* instruction count of the next run limit check */
+	int aot_go;			/* translated code returns once this clears, see aot_enter() */
+
+	/* LL/SC reservation */
+	int ll_bit;
+	uint32_t ll_addr, ll_value;
+
+	/* -D and -L, see handle_delayed() */
+	int in_delay_slot;		/* raise_exception() sets Cause.BD */
+	int trapped;			/* raise_exception() vectored or stopped the core */
+	int annul;			/* a branch-likely fell through */
+	uint32_t load_reg, load_value;	/* -L: lands once the next instruction has run */
+
+	stat_slot_t *stats;
+	bulk_loop_t bulk_cache[BULK_CACHE_SIZE];
+
+	tlb_entry_t tlb[TLB_ENTRIES];
+	mmu_cache_t mmu_cache[2][MMU_CACHE_SIZE];	/* reads (loads, fetches) and writes */
+	dcache_entry_t dcache[DCACHE_SIZE];
+	struct trace *trace;		/* MEM_TRACE builds: access buffer and analysis */
+	struct timing *timing;		/* -O: timing model state */
+	struct energy *energy;		/* -E: energy model state */
+} core_t;
+
+core_t CORES[MAX_CORES];
+int NUM_CORES;
+int SCHED_MODE;
+uint32_t SCHED_QUANTUM;
+int SELECTED_CORE;		/* core the REPL inspects and edits */
+_Thread_local core_t *CORE;
+_Thread_local core_t *volatile PROF_CORE;	/* CORE while it runs, for the profiler */
+
+#define CURRENT_STATE		(CORE->cur)
+#define NEXT_STATE		(CORE->next)
+#define RUN_FLAG		(CORE->run_flag)
+#define STOP_REASON		(CORE->stop_reason)
+#define INSTRUCTION_COUNT	(CORE->instruction_count)
+#define INSTRUCTION_LIMIT	(CORE->instruction_limit)
+#define EVENT_DEADLINE		(CORE->event_deadline)
+#define TIMER_DEADLINE		(CORE->timer_deadline)
+#define COUNT_BASE		(CORE->count_base)
+#define IRQ_RAISED_AT		(CORE->irq_raised_at)
+#define WATCHDOG_DEADLINE	(CORE->watchdog_deadline)
+#define AOT_GO			(CORE->aot_go)
+#define BULK_CACHE		(CORE->bulk_cache)
+#define TLB			(CORE->tlb)
+#define MMU_CACHE		(CORE->mmu_cache)
+#define DCACHE			(CORE->dcache)
+#define TIMING			(CORE->timing)
+#define ENERGY			(CORE->energy)
+
+static inline void stat_add(int which, uint64_t n)
+{
+#if FEATURE_STATS
+	atomic_store_explicit(&STATS->c[which],
+		atomic_load_explicit(&STATS->c[which], memory_order_relaxed) + n, memory_order_relaxed);
+#endif
+}
 
 
 /***************************************************************/
@@ -71,42 +934,130 @@ char prog_file[32];
 void help();
 uint32_t mem_read_32(uint32_t address);
 void mem_write_32(uint32_t address, uint32_t value);
+uint8_t mem_read_8(uint32_t address);
+uint16_t mem_read_16(uint32_t address);
+void mem_write_8(uint32_t address, uint8_t value);
+void mem_write_16(uint32_t address, uint16_t value);
+uint8_t *mem_host_ptr(uint32_t address, uint32_t len);
+void mem_copy(uint32_t dst, uint32_t src, uint32_t len);
+void mem_fill(uint32_t address, uint32_t word, uint32_t len);
+void mem_read_block(uint32_t address, void *dst, uint32_t len);
+void mem_write_block(uint32_t address, const void *src, uint32_t len);
+void bulk_flush();
+int bulk_try(uint32_t pc);
 void cycle();
 void run(int num_cycles);
 void runAll();
 void mdump(uint32_t start, uint32_t stop) ;
 void rdump();
 void handle_command();
+void execute_command(const char *line);
+stat_slot_t *stats_attach();
+uint64_t stat_total(int which);
+void print_stats();
+uint64_t monotonic_ns();
+double monotonic_seconds();
+void telemetry_start(double interval, const char *socket_path);
 void reset();
 void init_memory();
 void load_program();
+uint32_t load_hex(const char *file, uint32_t base);
+void run_block();
+void select_core(int id);
+int machine_running();
+void machine_run(uint64_t budget);
+void machine_stop(int reason);
+void print_stop_reasons();
+uint32_t load_linked(uint32_t ea);
+uint32_t store_conditional(uint32_t ea, uint32_t value);
+void raise_exception(int code, uint32_t badvaddr);
+void service_events();
+void cp0_reset();
+uint32_t cp0_count();
+void cp0_assert_irq(int line);
+void cp0_clear_irq(int line);
+void cop0(const decoded_t *d);
+void mmu_flush();
+int mmu_translate_slow(uint32_t *addr, int acc);
+uint32_t mmu_peek(uint32_t va);
+void tlb_read();
+void tlb_write(int index);
+void tlb_probe();
+void print_tlb();
+void fpu_sync_in();
+void fpu_sync_out();
+uint32_t fpu_read_control(int reg);
+void fpu_write_control(int reg, uint32_t value);
+int mem_access_ok(uint32_t ea, uint32_t size, int store);
+void decode(uint32_t pc, uint32_t word, decoded_t *d);
+void execute(const decoded_t *d);
+void decode_flush();
+#ifdef MEM_TRACE
+uint32_t trace_access(uint32_t pa, int size, int write);
+void trace_report();
+void trace_reset();
+#endif
+void code_invalidate(uint32_t page);
+uint32_t isa_encode(int op, int rs, int rt, int rd, int sa, uint32_t imm);
+int isa_selftest();
+int valid_instruction(uint32_t word);
 void handle_instruction(); /*IMPLEMENT THIS*/
+void delay_configure(int slots, int loads);
 void initialize();
 void print_program(); /*IMPLEMENT THIS*/
 void print_instruction(uint32_t);
-void ADD(int rs, int rt, int rd);
-void ADDU(int rs, int rt, int rd);
-void ADDI(int rs, int rt, uint32_t address);
-void ADDUI(int rs, int rt, uint32_t address);
-void SUB(int rs, int rt, int rd);
-void SUBU(int rs, int rt, int rd);
-void MULT(int rs, int rt, int rd);
-void MULTU(int rs, int rt, int rd);
-void DIV(int rs, int rt, int rd);
-void DIVU(int rs, int rt, int rd);
-void AND(int rs, int rt, int rd);
-void ANDI(int rs, int rt, uint32_t address);
-void OR(int rs, int rt, int rd);
-void ORI(int rs, int rt, uint32_t address);
-void XOR(int rs, int rt, int rd);
-void XORI(int rs, int rt, uint32_t address);
-void NOR(int rs, int rt, int rd);
-void SLT(int rs, int rt, int rd);
-void SLTI(int rs, int rt, uint32_t address);
-void SLL(int rs, int rt, int shamt);
-void SRL(int rs, int rt, int rd);
-void SRA(int rs, int rt, int shamt);
-void J(uint32_t j_address);
-void JR(uint32_t j_address, int rs);
-void JAL(uint32_t j_address);
-void JALR(uint32_t j_address, int rs);
+int disassemble(uint32_t addr, uint32_t word, char *buf, size_t len);
+void print_listing(FILE *out, uint32_t start, uint32_t words, const uint64_t *cov);
+void cfg_build(uint32_t base, uint32_t words);
+int cfg_block_at(uint32_t addr);
+void cfg_write_dot(FILE *out);
+void cfg_write_json(FILE *out);
+int assemble(const char *file, asm_program_t *prog);
+void asm_free(asm_program_t *prog);
+int asm_write(const asm_program_t *prog, const char *file);
+uint32_t load_asm(const char *file);
+uint32_t load_image(const char *file);
+void decode_prefill(const decoded_t *records, uint32_t base, uint32_t words);
+uint32_t mmio_read(uint32_t pa, int size);
+void mmio_write(uint32_t pa, uint32_t value, int size);
+void device_register(device_t *dev);
+void device_irq(int line, int level);
+uint64_t device_time();
+void event_schedule(uint64_t delay, event_fn fn, void *arg);
+void event_cancel(event_fn fn, void *arg);
+void devices_init();
+void devices_reset();
+void devices_flush();
+void print_devices();
+void sym_clear();
+void sym_add(const char *name, uint32_t addr);
+int sym_load(const char *file);
+int sym_find(uint32_t addr);
+void prof_start();
+void prof_scan();
+void prof_report();
+int fuzz_one(const uint8_t *data, size_t size);
+int fuzz_file(const char *file);
+void cov_open();
+void cov_record(uint32_t pc, const decoded_t *d);
+void cov_loop(uint32_t pc, uint32_t words);
+void cov_save();
+int cov_merge(const char *out, char **files, int n);
+void print_coverage(const char *file);
+int timing_parse(const char *spec);
+void timing_init();
+void timing_reset();
+void timing_step(uint32_t pc, const decoded_t *d, uint32_t ea);
+void print_timing();
+int energy_parse(const char *spec);
+void energy_init();
+void energy_open();
+void energy_reset();
+void energy_step(uint32_t pc, const decoded_t *d, uint32_t ea);
+void print_energy();
+void pcache_open();
+void pcache_close();
+int aot_translate(const char *file);
+int aot_open(const char *file);
+void aot_check();
+int aot_enter();
@@ -0,0 +1,30 @@
+# Self-modifying code against the bulk fill loop: fill runs once over
+# buf (zeros, so the loop is recognized), then its sw is patched to
+# store 0x80 bytes further on and it runs again with 9. Expected:
+# 0x10010004 = 0, 0x10010084 = 9.
+	.text
+main:	la $s0, buf
+	li $s1, 0
+	jal fill
+	nop
+	la $t3, store
+	lw $t4, 0($t3)
+	ori $t4, $t4, 0x80	# sw $s1, 0x80($a0)
+	sw $t4, 0($t3)
+	li $s1, 9
+	jal fill
+	nop
+	li $v0, 10
+	syscall
+
+# 32 words of $s1 from $s0
+fill:	move $a0, $s0
+	addiu $a1, $s0, 128
+loop:
+store:	sw $s1, 0($a0)
+	addiu $a0, $a0, 4
+	bne $a0, $a1, loop
+	jr $ra
+
+	.data
+buf:	.space 512